@@ -0,0 +1,662 @@
+/*
+ * Throughput benchmarks for libambit internals
+ *
+ * Usage: ambitbench <benchmark> [options]
+ *
+ * Relies on internal libambit headers, so this has to be built against
+ * the libambit source tree.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#endif
+
+#include "libambit.h"
+#include "crc16.h"
+#include "sha256.h"
+#include "transport.h"
+
+typedef struct benchmark_s {
+    const char *name;
+    const char *description;
+    int (*run)(int argc, char *argv[]);
+} benchmark_t;
+
+static int bench_sha256(int argc, char *argv[]);
+static int bench_crc16(int argc, char *argv[]);
+static uint16_t crc16_reference(const uint8_t *buf, size_t len, uint16_t crc);
+static int crc16_check(void);
+static int bench_transport(int argc, char *argv[]);
+static int bench_sync(int argc, char *argv[]);
+static void sync_push_cb(void *userref, ambit_log_entry_t *log_entry);
+static int bench_uhid(int argc, char *argv[]);
+#ifdef __linux__
+static void *uhid_pump(void *param);
+#endif
+
+static double now(void);
+static void usage(void);
+
+static benchmark_t benchmarks[] = {
+    { "sha256", "SHA-256 throughput per block transform [size in KiB]", bench_sha256 },
+    { "crc16", "Packet CRC cost per implementation [payload bytes]", bench_crc16 },
+    { "transport", "Status request round trips per transport [transport...]", bench_transport },
+    { "sync", "Log read from every connected clock [rounds]", bench_sync },
+    { "uhid", "Log read over hidraw from a virtual uhid clock [rounds]", bench_uhid },
+    { NULL, NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    benchmark_t *bench;
+
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    for (bench = benchmarks; bench->name != NULL; bench++) {
+        if (strcmp(argv[1], bench->name) == 0) {
+            return bench->run(argc - 2, argv + 2);
+        }
+    }
+
+    usage();
+    return 1;
+}
+
+static int bench_sha256(int argc, char *argv[])
+{
+    static const struct {
+        sha256_impl_t impl;
+        const char *name;
+    } impls[] = {
+        { sha256_impl_generic, "generic" },
+        { sha256_impl_shani, "sha-ni" },
+    };
+    size_t size = 1024 * (argc > 0 ? atoi(argv[0]) : 64*1024);
+    uint8_t *data = malloc(size);
+    uint8_t hash[32], reference[32];
+    double start, elapsed;
+    int i, rounds;
+    size_t j;
+
+    if (data == NULL || size == 0) {
+        free(data);
+        return 1;
+    }
+    for (j=0; j<size; j++) {
+        data[j] = j * 31 + 7;
+    }
+
+    for (i=0; i<sizeof(impls)/sizeof(impls[0]); i++) {
+        if (sha256_select_impl(impls[i].impl) != 0) {
+            printf("%-8s not supported on this CPU\n", impls[i].name);
+            continue;
+        }
+
+        rounds = 0;
+        start = now();
+        do {
+            sha256(data, size, hash);
+            rounds++;
+            elapsed = now() - start;
+        } while (elapsed < 1.0);
+
+        if (i == 0) {
+            memcpy(reference, hash, sizeof(hash));
+        }
+        printf("%-8s %8.1f MiB/s%s\n", impls[i].name,
+               (double)size * rounds / elapsed / (1024 * 1024),
+               memcmp(reference, hash, sizeof(hash)) == 0 ? "" : " (HASH MISMATCH)");
+    }
+    sha256_select_impl(sha256_impl_auto);
+    printf("Default: %s\n", sha256_impl_name());
+
+    free(data);
+
+    return 0;
+}
+
+/*
+ * Times the CRC work done to frame one packet: header CRC over 4 bytes,
+ * then the payload CRC seeded with it. Default payload is a full 64 byte
+ * report (54 bytes after the header).
+ */
+static int bench_crc16(int argc, char *argv[])
+{
+    static const struct {
+        crc16_impl_t impl;
+        const char *name;
+    } impls[] = {
+        { crc16_impl_bytewise, "bytewise" },
+        { crc16_impl_slice8, "slice-by-8" },
+        { crc16_impl_clmul, "clmul" },
+    };
+    size_t len = (argc > 0 ? atoi(argv[0]) : 54);
+    uint8_t *packet = malloc(8 + len);
+    volatile uint16_t sink = 0;
+    uint16_t crc, reference = 0;
+    double start, elapsed;
+    int i, rounds, k;
+    size_t j;
+
+    if (packet == NULL) {
+        return 1;
+    }
+    for (j=0; j<8 + len; j++) {
+        packet[j] = j * 31 + 7;
+    }
+
+    if (crc16_check() != 0) {
+        free(packet);
+        return 1;
+    }
+
+    for (i=0; i<sizeof(impls)/sizeof(impls[0]); i++) {
+        if (crc16_select_impl(impls[i].impl) != 0) {
+            printf("%-10s not supported on this CPU\n", impls[i].name);
+            continue;
+        }
+
+        rounds = 0;
+        start = now();
+        do {
+            for (k=0; k<1000; k++) {
+                crc = crc16_ccitt_false(&packet[2], 4);
+                crc = crc16_ccitt_false_init(&packet[8], len, crc);
+                packet[8] ^= crc;
+                sink ^= crc;
+            }
+            rounds += 1000;
+            elapsed = now() - start;
+        } while (elapsed < 1.0);
+
+        // Rerun once on the untouched packet to compare results
+        for (j=0; j<8 + len; j++) {
+            packet[j] = j * 31 + 7;
+        }
+        crc = crc16_ccitt_false_init(&packet[8], len, crc16_ccitt_false(&packet[2], 4));
+        if (i == 0) {
+            reference = crc;
+        }
+        printf("%-10s %8.1f ns/packet%s\n", impls[i].name,
+               elapsed * 1e9 / rounds,
+               crc == reference ? "" : " (CRC MISMATCH)");
+    }
+    crc16_select_impl(crc16_impl_auto);
+    printf("Default: %s\n", crc16_impl_name());
+
+    free(packet);
+
+    return 0;
+}
+
+/*
+ * Plain bit at a time CRC-16/CCITT-FALSE, independent of the tables in
+ * crc16.c
+ */
+static uint16_t crc16_reference(const uint8_t *buf, size_t len, uint16_t crc)
+{
+    int bit;
+
+    while (len--) {
+        crc ^= *buf++ << 8;
+        for (bit=0; bit<8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/*
+ * Compare every implementation against crc16_reference(): all seeds for
+ * every single byte value, then every length and alignment up to a few
+ * packets of data with a sweep of seeds.
+ */
+static int crc16_check(void)
+{
+    static const struct {
+        crc16_impl_t impl;
+        const char *name;
+    } impls[] = {
+        { crc16_impl_bytewise, "bytewise" },
+        { crc16_impl_slice8, "slice-by-8" },
+        { crc16_impl_clmul, "clmul" },
+    };
+    static uint16_t single[0x10000][256];
+    static uint16_t sweep[256][256 + 1][8];
+    uint8_t data[8 + 256];
+    int i, offset, errors;
+    uint32_t seed, b;
+    size_t len;
+    uint8_t byte;
+
+    for (i=0; i<sizeof(data); i++) {
+        data[i] = (i * 167 + 13) ^ (i >> 3);
+    }
+    for (seed=0; seed<=0xffff; seed++) {
+        for (b=0; b<256; b++) {
+            byte = b;
+            single[seed][b] = crc16_reference(&byte, 1, seed);
+        }
+    }
+    for (seed=0; seed<=0xffff; seed+=0x0101) {
+        for (len=0; len<=256; len++) {
+            for (offset=0; offset<8; offset++) {
+                sweep[seed/0x0101][len][offset] = crc16_reference(&data[offset], len, seed);
+            }
+        }
+    }
+
+    for (i=0; i<sizeof(impls)/sizeof(impls[0]); i++) {
+        if (crc16_select_impl(impls[i].impl) != 0) {
+            continue;
+        }
+
+        errors = 0;
+        for (seed=0; seed<=0xffff; seed++) {
+            for (b=0; b<256; b++) {
+                byte = b;
+                if (crc16_ccitt_false_init(&byte, 1, seed) != single[seed][b]) {
+                    errors++;
+                }
+            }
+        }
+        for (seed=0; seed<=0xffff; seed+=0x0101) {
+            for (len=0; len<=256; len++) {
+                for (offset=0; offset<8; offset++) {
+                    if (crc16_ccitt_false_init(&data[offset], len, seed) != sweep[seed/0x0101][len][offset]) {
+                        errors++;
+                    }
+                }
+            }
+        }
+
+        if (errors > 0) {
+            printf("%-10s self check failed, %d mismatches\n", impls[i].name, errors);
+            crc16_select_impl(crc16_impl_auto);
+            return -1;
+        }
+    }
+    crc16_select_impl(crc16_impl_auto);
+    printf("Self check passed\n");
+
+    return 0;
+}
+
+typedef struct sync_stats_s {
+    int logs;
+    size_t samples;
+} sync_stats_t;
+
+/*
+ * Talks to the first Suunto device of each transport directly, bypassing
+ * the protocol layer. The request is a bare status command, which every
+ * clock (and the emulator) answers with a single report.
+ */
+static int bench_transport(int argc, char *argv[])
+{
+    const char **names = (argc > 0 ? (const char **)argv : libambit_transport_list());
+    int count = (argc > 0 ? argc : -1);
+    const ambit_transport_t *transport;
+    struct hid_device_info *devs, *current;
+    hid_device *dev;
+    uint8_t request[64], reply[64];
+    uint16_t crc;
+    double start, elapsed;
+    unsigned int dropped, late;
+    int i, rounds;
+
+    // Status request, see protocol.c for the layout
+    memset(request, 0, sizeof(request));
+    request[0] = 0x3f;
+    request[1] = 12 + 8;
+    request[2] = 0x5d;
+    request[3] = 12;
+    request[4] = 1;
+    request[8] = 0x03;
+    request[9] = 0x06;
+    request[10] = 5;
+    request[12] = 9;
+    crc = crc16_ccitt_false(&request[2], 4);
+    request[6] = crc & 0xff;
+    request[7] = crc >> 8;
+    crc = crc16_ccitt_false_init(&request[8], 12, crc);
+    request[20] = crc & 0xff;
+    request[21] = crc >> 8;
+
+    for (i=0; (count < 0 && names[i] != NULL) || i < count; i++) {
+        if ((transport = libambit_transport_find(names[i])) == NULL) {
+            printf("%-10s not built into libambit\n", names[i]);
+            continue;
+        }
+        if (transport->init() != 0) {
+            printf("%-10s failed to initialize\n", names[i]);
+            continue;
+        }
+
+        dev = NULL;
+        devs = transport->enumerate(0x1493, 0);
+        for (current = devs; current != NULL && dev == NULL; current = current->next) {
+            dev = transport->open_path(current->path);
+        }
+        transport->free_enumeration(devs);
+        if (dev == NULL) {
+            printf("%-10s no device\n", names[i]);
+            continue;
+        }
+        transport->set_nonblocking(dev, 0);
+
+        rounds = 0;
+        start = now();
+        do {
+            if (transport->write(dev, request, sizeof(request)) < 0 ||
+                transport->read_timeout(dev, reply, sizeof(reply), 1000) <= 0) {
+                break;
+            }
+            rounds++;
+            elapsed = now() - start;
+        } while (elapsed < 1.0);
+        elapsed = now() - start;
+        if (transport->input_stats == NULL || transport->input_stats(dev, &dropped, &late) != 0) {
+            dropped = late = 0;
+        }
+        transport->close(dev);
+
+        if (rounds == 0) {
+            printf("%-10s no reply\n", names[i]);
+            continue;
+        }
+        printf("%-10s %10.2f us/round trip", names[i], elapsed * 1e6 / rounds);
+        if (transport->input_stats != NULL) {
+            printf(", %u reports dropped, %u late", dropped, late);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
+
+/*
+ * Pair with the emulator transport (LIBAMBIT_TRANSPORT=emulator) to time
+ * the protocol and log parsing without hardware
+ */
+static int bench_sync(int argc, char *argv[])
+{
+    int rounds = (argc > 0 ? atoi(argv[0]) : 1);
+    ambit_device_info_t *devices, *device;
+    ambit_object_t *ambit_object;
+    sync_stats_t stats;
+    double start, elapsed;
+    int i, ret = 1;
+
+    devices = libambit_enumerate();
+    for (device = devices; device != NULL; device = device->next) {
+        if (device->access_status != 0 || !device->is_supported) {
+            printf("%s: not accessible or unsupported, skipping\n", device->path);
+            continue;
+        }
+        if ((ambit_object = libambit_new(device)) == NULL) {
+            printf("%s: failed to open\n", device->path);
+            continue;
+        }
+
+        for (i=0; i<rounds; i++) {
+            memset(&stats, 0, sizeof(stats));
+            start = now();
+            if (libambit_log_read(ambit_object, NULL, sync_push_cb, NULL, &stats) < 0) {
+                printf("%s: log read failed\n", device->path);
+                break;
+            }
+            elapsed = now() - start;
+            printf("%s (%s): %d logs, %zu samples in %.3f s (%.1f logs/s, %.0f samples/s)\n",
+                   device->path, device->serial, stats.logs, stats.samples, elapsed,
+                   stats.logs / elapsed, stats.samples / elapsed);
+            ret = 0;
+        }
+
+        libambit_close(ambit_object);
+    }
+    libambit_free_enumeration(devices);
+
+    if (ret != 0) {
+        printf("No clock synced\n");
+    }
+
+    return ret;
+}
+
+static void sync_push_cb(void *userref, ambit_log_entry_t *log_entry)
+{
+    sync_stats_t *stats = (sync_stats_t *)userref;
+
+    stats->logs++;
+    stats->samples += log_entry->samples_count;
+    libambit_log_entry_free(log_entry);
+}
+
+#ifdef __linux__
+/*
+ * Report descriptor of the clock: vendor defined, 63 byte input and
+ * output reports with report ID 0x3f (the first byte of every packet)
+ */
+static const uint8_t uhid_report_descriptor[] = {
+    0x06, 0x00, 0xff,                   /* Usage Page (Vendor 0xff00) */
+    0x09, 0x01,                         /* Usage (1) */
+    0xa1, 0x01,                         /* Collection (Application) */
+    0x85, 0x3f,                         /*   Report ID (0x3f) */
+    0x15, 0x00,                         /*   Logical Minimum (0) */
+    0x26, 0xff, 0x00,                   /*   Logical Maximum (255) */
+    0x75, 0x08,                         /*   Report Size (8) */
+    0x95, 0x3f,                         /*   Report Count (63) */
+    0x09, 0x01,                         /*   Usage (1) */
+    0x81, 0x02,                         /*   Input (Data, Var, Abs) */
+    0x09, 0x01,                         /*   Usage (1) */
+    0x91, 0x02,                         /*   Output (Data, Var, Abs) */
+    0xc0                                /* End Collection */
+};
+
+typedef struct uhid_bench_s {
+    int fd;
+    const ambit_transport_t *emulator;
+    hid_device *dev;
+    volatile int stop;
+    unsigned int commands;
+    size_t bytes;
+} uhid_bench_t;
+#endif
+
+/*
+ * Registers a virtual clock through /dev/uhid, answered by the emulator
+ * transport, and reads its logs through the unchanged hidraw transport.
+ * The kernel sees a Bluetooth device, as hid-linux.c skips USB devices
+ * without a USB parent. Needs write access to /dev/uhid.
+ */
+static int bench_uhid(int argc, char *argv[])
+{
+#ifdef __linux__
+    int rounds = (argc > 0 ? atoi(argv[0]) : 1);
+    uhid_bench_t bench;
+    struct hid_device_info *devs;
+    struct uhid_event ev;
+    pthread_t pump;
+    char serial[17];
+    ambit_device_info_t *devices = NULL, *device = NULL;
+    ambit_object_t *ambit_object;
+    sync_stats_t stats;
+    unsigned int commands;
+    size_t bytes;
+    double start, elapsed;
+    int i, ret = 1;
+
+    memset(&bench, 0, sizeof(bench));
+    if (libambit_transport_find("hidraw") == NULL) {
+        printf("hidraw transport not built into libambit\n");
+        return 1;
+    }
+    if ((bench.fd = open("/dev/uhid", O_RDWR | O_CLOEXEC)) < 0) {
+        printf("Failed to open /dev/uhid, is the uhid module loaded?\n");
+        return 1;
+    }
+
+    // The emulator plays the clock behind the virtual device
+    bench.emulator = libambit_transport_find("emulator");
+    if (bench.emulator->init() == 0 && (devs = bench.emulator->enumerate(0x1493, 0)) != NULL) {
+        memset(&ev, 0, sizeof(ev));
+        ev.type = UHID_CREATE2;
+        snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "Suunto Ambit (uhid)");
+        wcstombs(serial, devs->serial_number, sizeof(serial));
+        serial[sizeof(serial)-1] = 0;
+        snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "%s", serial);
+        ev.u.create2.rd_size = sizeof(uhid_report_descriptor);
+        memcpy(ev.u.create2.rd_data, uhid_report_descriptor, sizeof(uhid_report_descriptor));
+        ev.u.create2.bus = BUS_BLUETOOTH;
+        ev.u.create2.vendor = devs->vendor_id;
+        ev.u.create2.product = devs->product_id;
+        bench.dev = bench.emulator->open_path(devs->path);
+        bench.emulator->free_enumeration(devs);
+    }
+    if (bench.dev == NULL || write(bench.fd, &ev, sizeof(ev)) != sizeof(ev)) {
+        printf("Failed to create virtual clock\n");
+        if (bench.dev != NULL) {
+            bench.emulator->close(bench.dev);
+        }
+        close(bench.fd);
+        return 1;
+    }
+    pthread_create(&pump, NULL, uhid_pump, &bench);
+
+    // Give udev some time to announce the hidraw node
+    libambit_transport_set("hidraw");
+    for (i=0; i<50 && device == NULL; i++) {
+        libambit_free_enumeration(devices);
+        devices = libambit_enumerate();
+        for (device = devices; device != NULL; device = device->next) {
+            if (strcmp(device->serial, serial) == 0 && device->access_status == 0) {
+                break;
+            }
+        }
+        if (device == NULL) {
+            usleep(100000);
+        }
+    }
+
+    if (device == NULL) {
+        printf("Virtual clock %s not found through hidraw\n", serial);
+    }
+    else if ((ambit_object = libambit_new(device)) == NULL) {
+        printf("%s: failed to open\n", device->path);
+    }
+    else {
+        for (i=0; i<rounds; i++) {
+            memset(&stats, 0, sizeof(stats));
+            commands = bench.commands;
+            bytes = bench.bytes;
+            start = now();
+            if (libambit_log_read(ambit_object, NULL, sync_push_cb, NULL, &stats) < 0) {
+                printf("%s: log read failed\n", device->path);
+                break;
+            }
+            elapsed = now() - start;
+            commands = bench.commands - commands;
+            bytes = bench.bytes - bytes;
+            printf("%s (%s): %d logs, %u commands, %zu bytes in %.3f s (%.0f commands/s, %.1f KiB/s)\n",
+                   device->path, device->serial, stats.logs, commands, bytes, elapsed,
+                   commands / elapsed, bytes / elapsed / 1024);
+            ret = 0;
+        }
+        libambit_close(ambit_object);
+    }
+    libambit_free_enumeration(devices);
+
+    bench.stop = 1;
+    pthread_join(pump, NULL);
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    if (write(bench.fd, &ev, sizeof(ev)) != sizeof(ev)) {
+        printf("Failed to remove virtual clock\n");
+    }
+    close(bench.fd);
+    bench.emulator->close(bench.dev);
+
+    return ret;
+#else
+    printf("uhid is only available on Linux\n");
+
+    return 1;
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Hands output reports of the virtual device to the emulator and its
+ * replies back as input reports, counting traffic on the way
+ */
+static void *uhid_pump(void *param)
+{
+    uhid_bench_t *bench = (uhid_bench_t *)param;
+    struct pollfd pfd = { bench->fd, POLLIN, 0 };
+    struct uhid_event ev, reply;
+    int len;
+
+    while (!bench->stop) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        if (read(bench->fd, &ev, sizeof(ev)) <= 0) {
+            break;
+        }
+        if (ev.type != UHID_OUTPUT) {
+            continue;
+        }
+
+        bench->bytes += ev.u.output.size;
+        if (ev.u.output.size > 2 && ev.u.output.data[2] == 0x5d) {
+            bench->commands++;
+        }
+        bench->emulator->write(bench->dev, ev.u.output.data, ev.u.output.size);
+
+        memset(&reply, 0, sizeof(reply));
+        reply.type = UHID_INPUT2;
+        while ((len = bench->emulator->read_timeout(bench->dev, reply.u.input2.data, 64, 0)) > 0) {
+            reply.u.input2.size = len;
+            if (write(bench->fd, &reply, sizeof(reply)) != sizeof(reply)) {
+                break;
+            }
+            bench->bytes += len;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+    benchmark_t *bench;
+
+    printf("Usage: ambitbench <benchmark> [options]\n\n");
+    for (bench = benchmarks; bench->name != NULL; bench++) {
+        printf("  %-10s %s\n", bench->name, bench->description);
+    }
+}
@@ -0,0 +1,629 @@
+/*
+ * (C) Copyright 2014 Emil Ljungdahl
+ *
+ * This file is part of libambit.
+ *
+ * libambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "libambit.h"
+#include "libambit_int.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/timerfd.h>
+
+/*
+ * Local definitions
+ */
+#define OP_STACK_SIZE (256 * 1024)
+
+typedef struct async_op_s async_op_t;
+
+// Runs the blocking call, returns its result
+typedef int (*async_run_fn)(async_op_t *op);
+
+// Operations run on their own stack, in the thread calling
+// libambit_async_process(). Wherever the blocking call would wait for
+// the device, it saves its state and returns to the queue instead, see
+// libambit_async_wait(), to be resumed once the wait is over.
+struct async_op_s {
+    ambit_async_t *async;
+    ambit_async_completion_t completion;
+    ambit_async_cb cb;
+    void *userref;
+
+    async_run_fn run;
+    bool bulk;                          // Waits for earlier bulk ops on the object
+    bool cancelled;
+    bool abandoned;                     // Freed without completion callback
+    bool started;
+    bool running;                       // Its stack is in use right now
+    bool done;
+    uint64_t wake;                      // Monotonic ns it waits until
+    ucontext_t context;
+    ucontext_t caller;                  // Where it returns to when waiting
+    void *stack;
+
+    union {
+        ambit_personal_settings_t *settings;
+        struct tm date_time;
+        struct {
+            ambit_log_skip_cb skip_cb;
+            ambit_log_push_cb push_cb;
+            ambit_log_progress_cb progress_cb;
+        } log;
+        struct {
+            uint8_t *data;
+            size_t datalen;
+        } orbit;
+        struct {
+            ambit_sport_mode_device_settings_t *sport_modes;
+            ambit_app_rules_t *apps;
+        } sport;
+    } args;
+
+    async_op_t *next;
+};
+
+struct ambit_async_s {
+    int fd;                             // timerfd, expires when ops are due
+    async_op_t *ops;                    // submitted and not handed out yet,
+                                        // in submit order
+    int next_id;
+};
+
+/*
+ * Static functions
+ */
+static int submit(ambit_async_t *async, async_op_t *op);
+static async_op_t *op_new(ambit_object_t *object, async_run_fn run, bool bulk, ambit_async_cb cb, void *userref);
+static void op_free(async_op_t *op);
+static bool op_may_start(async_op_t *op);
+static void op_resume(async_op_t *op);
+static void op_main(void);
+static void op_finish(async_op_t *op);
+static void timer_update(ambit_async_t *async);
+static uint64_t now(void);
+
+static int run_device_status_get(async_op_t *op);
+static int run_personal_settings_get(async_op_t *op);
+static int run_sync_display_show(async_op_t *op);
+static int run_sync_display_clear(async_op_t *op);
+static int run_date_time_set(async_op_t *op);
+static int run_log_read(async_op_t *op);
+static int run_gps_orbit_write(async_op_t *op);
+static int run_navigation_read(async_op_t *op);
+static int run_navigation_write(async_op_t *op);
+static int run_sport_mode_write(async_op_t *op);
+static int run_app_data_write(async_op_t *op);
+
+/*
+ * Static variables
+ */
+// Operation running on the calling thread, for libambit_async_wait()
+static __thread async_op_t *current_op = NULL;
+
+/*
+ * Public functions
+ */
+ambit_async_t * libambit_async_new(void)
+{
+    ambit_async_t *async = calloc(1, sizeof(*async));
+
+    if (async == NULL) {
+        return NULL;
+    }
+
+    async->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (async->fd < 0) {
+        LOG_ERROR("Failed to create timerfd (%s)", strerror(errno));
+        free(async);
+        return NULL;
+    }
+    async->next_id = 1;
+
+    return async;
+}
+
+void libambit_async_free(ambit_async_t *async)
+{
+    async_op_t *op;
+
+    if (async == NULL) {
+        return;
+    }
+
+    while ((op = async->ops) != NULL) {
+        async->ops = op->next;
+        op_finish(op);
+        op_free(op);
+    }
+
+    close(async->fd);
+    free(async);
+}
+
+int libambit_async_get_fd(ambit_async_t *async)
+{
+    return async != NULL ? async->fd : -1;
+}
+
+int libambit_async_process(ambit_async_t *async)
+{
+    async_op_t *op, **prev;
+    uint64_t count, due;
+    int ret = 0;
+
+    if (async == NULL) {
+        return -1;
+    }
+
+    // Reset the timer first, it is set again below
+    if (read(async->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+
+    // Earlier ops in the list finish first, so later ones on the same
+    // object may start in this very pass
+    due = now();
+    for (op = async->ops; op != NULL; op = op->next) {
+        if (!op->done && !op->running && op->wake <= due && op_may_start(op)) {
+            op_resume(op);
+        }
+    }
+
+    // Completion callbacks may submit, cancel or abandon operations, so
+    // the list is searched again after each
+    for (;;) {
+        for (prev = &async->ops; (op = *prev) != NULL && !op->done; prev = &op->next);
+        if (op == NULL) {
+            break;
+        }
+        *prev = op->next;
+        if (op->cb != NULL && !op->abandoned) {
+            op->cb(op->userref, &op->completion);
+            ret++;
+        }
+        op_free(op);
+    }
+
+    timer_update(async);
+
+    return ret;
+}
+
+int libambit_async_cancel(ambit_async_t *async, int id)
+{
+    async_op_t *op;
+
+    if (async == NULL) {
+        return -1;
+    }
+
+    for (op = async->ops; op != NULL; op = op->next) {
+        if (op->completion.id == id) {
+            if (op->done) {
+                break;
+            }
+            // Wake it up, so that it fails at once
+            op->cancelled = true;
+            op->wake = 0;
+            timer_update(async);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void libambit_async_abandon(ambit_async_t *async, ambit_object_t *object)
+{
+    async_op_t *op, **prev;
+
+    if (async == NULL) {
+        return;
+    }
+
+    prev = &async->ops;
+    while ((op = *prev) != NULL) {
+        if (op->completion.object != object) {
+            prev = &op->next;
+        }
+        else if (op->running) {
+            // Called from one of its own log callbacks, it is freed by
+            // libambit_async_process() once it has unwound
+            op->cancelled = true;
+            op->abandoned = true;
+            prev = &op->next;
+        }
+        else {
+            *prev = op->next;
+            op_finish(op);
+            op_free(op);
+        }
+    }
+
+    timer_update(async);
+}
+
+int libambit_async_device_status_get(ambit_async_t *async, ambit_object_t *object, ambit_async_cb cb, void *userref)
+{
+    // Not bulk, so it gets in between the commands of a running operation
+    return submit(async, op_new(object, run_device_status_get, false, cb, userref));
+}
+
+int libambit_async_personal_settings_get(ambit_async_t *async, ambit_object_t *object, ambit_personal_settings_t *settings, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_personal_settings_get, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.settings = settings;
+    }
+
+    return submit(async, op);
+}
+
+int libambit_async_sync_display_show(ambit_async_t *async, ambit_object_t *object, ambit_async_cb cb, void *userref)
+{
+    return submit(async, op_new(object, run_sync_display_show, true, cb, userref));
+}
+
+int libambit_async_sync_display_clear(ambit_async_t *async, ambit_object_t *object, ambit_async_cb cb, void *userref)
+{
+    return submit(async, op_new(object, run_sync_display_clear, true, cb, userref));
+}
+
+int libambit_async_date_time_set(ambit_async_t *async, ambit_object_t *object, const struct tm *date_time, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_date_time_set, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.date_time = *date_time;
+    }
+
+    return submit(async, op);
+}
+
+int libambit_async_log_read(ambit_async_t *async, ambit_object_t *object, ambit_log_skip_cb skip_cb, ambit_log_push_cb push_cb, ambit_log_progress_cb progress_cb, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_log_read, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.log.skip_cb = skip_cb;
+        op->args.log.push_cb = push_cb;
+        op->args.log.progress_cb = progress_cb;
+    }
+
+    return submit(async, op);
+}
+
+int libambit_async_gps_orbit_write(ambit_async_t *async, ambit_object_t *object, const uint8_t *data, size_t datalen, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_gps_orbit_write, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.orbit.data = malloc(datalen);
+        if (op->args.orbit.data == NULL) {
+            op_free(op);
+            return -1;
+        }
+        memcpy(op->args.orbit.data, data, datalen);
+        op->args.orbit.datalen = datalen;
+    }
+
+    return submit(async, op);
+}
+
+int libambit_async_navigation_read(ambit_async_t *async, ambit_object_t *object, ambit_personal_settings_t *settings, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_navigation_read, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.settings = settings;
+    }
+
+    return submit(async, op);
+}
+
+int libambit_async_navigation_write(ambit_async_t *async, ambit_object_t *object, ambit_personal_settings_t *settings, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_navigation_write, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.settings = settings;
+    }
+
+    return submit(async, op);
+}
+
+int libambit_async_sport_mode_write(ambit_async_t *async, ambit_object_t *object, ambit_sport_mode_device_settings_t *sport_modes, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_sport_mode_write, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.sport.sport_modes = sport_modes;
+    }
+
+    return submit(async, op);
+}
+
+int libambit_async_app_data_write(ambit_async_t *async, ambit_object_t *object, ambit_sport_mode_device_settings_t *sport_modes, ambit_app_rules_t *apps, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op = op_new(object, run_app_data_write, true, cb, userref);
+
+    if (op != NULL) {
+        op->args.sport.sport_modes = sport_modes;
+        op->args.sport.apps = apps;
+    }
+
+    return submit(async, op);
+}
+
+bool libambit_async_cancelled(void)
+{
+    return current_op != NULL && current_op->cancelled;
+}
+
+bool libambit_async_running(void)
+{
+    return current_op != NULL;
+}
+
+int libambit_async_wait(unsigned int timeout)
+{
+    async_op_t *op = current_op;
+
+    if (op == NULL || op->cancelled) {
+        return -1;
+    }
+
+    op->wake = now() + (uint64_t)timeout * 1000000;
+    swapcontext(&op->context, &op->caller);
+
+    return op->cancelled ? -1 : 0;
+}
+
+/*
+ * Static functions
+ */
+static int submit(ambit_async_t *async, async_op_t *op)
+{
+    async_op_t **last;
+    int id;
+
+    if (op == NULL) {
+        return -1;
+    }
+    if (async == NULL) {
+        op_free(op);
+        return -1;
+    }
+
+    op->async = async;
+    id = async->next_id;
+    async->next_id = (async->next_id < 0x7fffffff ? async->next_id + 1 : 1);
+    op->completion.id = id;
+
+    for (last = &async->ops; *last != NULL; last = &(*last)->next);
+    *last = op;
+
+    // Started by the next libambit_async_process()
+    timer_update(async);
+
+    return id;
+}
+
+static async_op_t *op_new(ambit_object_t *object, async_run_fn run, bool bulk, ambit_async_cb cb, void *userref)
+{
+    async_op_t *op;
+
+    if (object == NULL) {
+        return NULL;
+    }
+
+    op = calloc(1, sizeof(*op));
+    if (op != NULL) {
+        op->completion.object = object;
+        op->completion.result = -1;
+        op->run = run;
+        op->bulk = bulk;
+        op->cb = cb;
+        op->userref = userref;
+    }
+
+    return op;
+}
+
+static void op_free(async_op_t *op)
+{
+    if (op->run == run_gps_orbit_write) {
+        free(op->args.orbit.data);
+    }
+    free(op->stack);
+    free(op);
+}
+
+static bool op_may_start(async_op_t *op)
+{
+    async_op_t *earlier;
+
+    if (op->started || !op->bulk) {
+        return true;
+    }
+
+    // Bulk operations on an object run one at a time, in submit order
+    for (earlier = op->async->ops; earlier != op; earlier = earlier->next) {
+        if (earlier->bulk && !earlier->done && earlier->completion.object == op->completion.object) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void op_resume(async_op_t *op)
+{
+    async_op_t *resumer = current_op;
+
+    if (!op->started) {
+        op->started = true;
+        if (op->cancelled) {
+            op->completion.cancelled = true;
+            op->done = true;
+            return;
+        }
+        op->stack = malloc(OP_STACK_SIZE);
+        if (op->stack == NULL || getcontext(&op->context) != 0) {
+            LOG_ERROR("Failed to start async operation");
+            op->done = true;
+            return;
+        }
+        op->context.uc_stack.ss_sp = op->stack;
+        op->context.uc_stack.ss_size = OP_STACK_SIZE;
+        op->context.uc_link = &op->caller;
+        makecontext(&op->context, op_main, 0);
+    }
+
+    // Runs until it waits or returns. An operation resumed from the log
+    // callback of another one hands the thread back to that one after.
+    op->wake = 0;
+    op->running = true;
+    current_op = op;
+    swapcontext(&op->caller, &op->context);
+    current_op = resumer;
+    op->running = false;
+}
+
+static void op_main(void)
+{
+    async_op_t *op = current_op;
+
+    if (!op->cancelled) {
+        op->completion.result = op->run(op);
+    }
+    op->completion.cancelled = op->cancelled;
+    op->done = true;
+}
+
+static void op_finish(async_op_t *op)
+{
+    // Waits of a cancelled operation fail without waiting, and so do its
+    // commands to the clock, so this unwinds it right away
+    op->cancelled = true;
+    op->abandoned = true;
+    while (!op->done) {
+        op_resume(op);
+    }
+}
+
+static void timer_update(ambit_async_t *async)
+{
+    struct itimerspec timer;
+    async_op_t *op;
+    uint64_t wake = UINT64_MAX;
+
+    for (op = async->ops; op != NULL; op = op->next) {
+        if (op->done) {
+            wake = 0;
+        }
+        else if (!op->running && op->wake < wake && op_may_start(op)) {
+            wake = op->wake;
+        }
+    }
+
+    // All zero would disarm the timer, so due at once is 1 ns
+    memset(&timer, 0, sizeof(timer));
+    if (wake != UINT64_MAX) {
+        wake = (wake > 0 ? wake : 1);
+        timer.it_value.tv_sec = wake / 1000000000;
+        timer.it_value.tv_nsec = wake % 1000000000;
+    }
+    if (timerfd_settime(async->fd, TFD_TIMER_ABSTIME, &timer, NULL) != 0) {
+        LOG_WARNING("Failed to set async timer (%s)", strerror(errno));
+    }
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int run_device_status_get(async_op_t *op)
+{
+    return libambit_device_status_get(op->completion.object, &op->completion.status);
+}
+
+static int run_personal_settings_get(async_op_t *op)
+{
+    return libambit_personal_settings_get(op->completion.object, op->args.settings);
+}
+
+static int run_sync_display_show(async_op_t *op)
+{
+    libambit_sync_display_show(op->completion.object);
+    return 0;
+}
+
+static int run_sync_display_clear(async_op_t *op)
+{
+    libambit_sync_display_clear(op->completion.object);
+    return 0;
+}
+
+static int run_date_time_set(async_op_t *op)
+{
+    return libambit_date_time_set(op->completion.object, &op->args.date_time);
+}
+
+static int run_log_read(async_op_t *op)
+{
+    return libambit_log_read(op->completion.object, op->args.log.skip_cb, op->args.log.push_cb, op->args.log.progress_cb, op->userref);
+}
+
+static int run_gps_orbit_write(async_op_t *op)
+{
+    return libambit_gps_orbit_write(op->completion.object, op->args.orbit.data, op->args.orbit.datalen);
+}
+
+static int run_navigation_read(async_op_t *op)
+{
+    return libambit_navigation_read(op->completion.object, op->args.settings);
+}
+
+static int run_navigation_write(async_op_t *op)
+{
+    return libambit_navigation_write(op->completion.object, op->args.settings);
+}
+
+static int run_sport_mode_write(async_op_t *op)
+{
+    return libambit_sport_mode_write(op->completion.object, op->args.sport.sport_modes);
+}
+
+static int run_app_data_write(async_op_t *op)
+{
+    return libambit_app_data_write(op->completion.object, op->args.sport.sport_modes, op->args.sport.apps);
+}
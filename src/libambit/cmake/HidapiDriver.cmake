@@ -1,30 +1,79 @@
-# - Resolve what hidapi driver to use
+# - Resolve what hidapi drivers to build
+# Every driver whose dependencies are found is built into libambit, with
+# its API prefixed by HIDAPI_NAMESPACE, and the one to use is picked at
+# runtime (see transport.c). replay, emulator and loopback are always
+# built.
 # This module is affected by the following defines
-#  HIDAPI_DRIVER (possible values: usbraw, libusb, pcapsimulate)
+#  HIDAPI_DRIVER (possible values: usbraw, libusb, pcapsimulate, replay,
+#                 emulator, loopback) makes that driver required and the default,
+#                 which can still be overridden at runtime
 #
 # This module defines
 #  HIDAPI_INCLUDE_DIR
 #  HIDAPI_SOURCE_FILES
 #  HIDAPI_LIBS
+#  HIDAPI_DEFINITIONS
 
 if (NOT HIDAPI_RESOLVED)
+    set (HIDAPI_INCLUDE_DIR "hidapi")
+    set (HIDAPI_SOURCE_FILES "hidapi/hid-replay.c" "hidapi/hid-emulator.c" "hidapi/hid-loopback.c")
+    set (HIDAPI_LIBS "")
+    set (HIDAPI_DEFINITIONS "")
+    set_source_files_properties(hidapi/hid-replay.c PROPERTIES COMPILE_DEFINITIONS HIDAPI_NAMESPACE=replay)
+    set_source_files_properties(hidapi/hid-emulator.c PROPERTIES COMPILE_DEFINITIONS HIDAPI_NAMESPACE=emulator)
+    set_source_files_properties(hidapi/hid-loopback.c PROPERTIES COMPILE_DEFINITIONS HIDAPI_NAMESPACE=loopback)
+
+    # hidraw, the default unless some other driver is asked for
+    if (NOT HIDAPI_DRIVER OR HIDAPI_DRIVER STREQUAL "usbraw")
+        find_package(UDev REQUIRED)
+    else ()
+        find_package(UDev QUIET)
+    endif ()
+    if (UDEV_FOUND)
+        list (APPEND HIDAPI_INCLUDE_DIR ${UDEV_INCLUDE_DIR})
+        list (APPEND HIDAPI_SOURCE_FILES "hidapi/hid-linux.c")
+        list (APPEND HIDAPI_LIBS ${UDEV_LIBS})
+        list (APPEND HIDAPI_DEFINITIONS -DLIBAMBIT_TRANSPORT_HIDRAW -DLIBAMBIT_HOTPLUG_UDEV)
+        set_source_files_properties(hidapi/hid-linux.c PROPERTIES COMPILE_DEFINITIONS HIDAPI_NAMESPACE=hidraw)
+    endif ()
+
     if (HIDAPI_DRIVER STREQUAL "libusb")
         find_package(libusb REQUIRED)
-        set (HIDAPI_INCLUDE_DIR "hidapi" ${LIBUSB_INCLUDE_DIR})
-        set (HIDAPI_SOURCE_FILES "hidapi/hid-libusb.c")
-        set (HIDAPI_LIBS ${LIBUSB_LIBRARIES})
-    elseif (HIDAPI_DRIVER STREQUAL "pcapsimulate")
+    else ()
+        find_package(libusb QUIET)
+    endif ()
+    if (LIBUSB_FOUND)
+        list (APPEND HIDAPI_INCLUDE_DIR ${LIBUSB_INCLUDE_DIR})
+        list (APPEND HIDAPI_SOURCE_FILES "hidapi/hid-libusb.c")
+        list (APPEND HIDAPI_LIBS ${LIBUSB_LIBRARIES})
+        list (APPEND HIDAPI_DEFINITIONS -DLIBAMBIT_TRANSPORT_LIBUSB)
+        set_source_files_properties(hidapi/hid-libusb.c PROPERTIES COMPILE_DEFINITIONS HIDAPI_NAMESPACE=libusb)
+    endif ()
+
+    # FindPCAP fails hard when libpcap is missing, so only look for it
+    # when asked to or when the library is there
+    if (NOT HIDAPI_DRIVER STREQUAL "pcapsimulate")
+        find_library(HIDAPI_PCAP_PROBE pcap)
+        mark_as_advanced(HIDAPI_PCAP_PROBE)
+    endif ()
+    if (HIDAPI_DRIVER STREQUAL "pcapsimulate" OR HIDAPI_PCAP_PROBE)
         find_package(PCAP REQUIRED)
-        set (HIDAPI_INCLUDE_DIR "hidapi" ${PCAP_INCLUDE_DIR})
-        set (HIDAPI_SOURCE_FILES "hidapi/hid-pcapsimulate.c")
-        set (HIDAPI_LIBS ${PCAP_LIBRARY})
-    else (HIDAPI_DRIVER STREQUAL "libusb")
-        find_package(UDev REQUIRED)
-        set (HIDAPI_INCLUDE_DIR "hidapi" ${UDEV_INCLUDE_DIR})
-        set (HIDAPI_SOURCE_FILES "hidapi/hid-linux.c")
-        set (HIDAPI_LIBS ${UDEV_LIBS})
-    endif (HIDAPI_DRIVER STREQUAL "libusb")
+        list (APPEND HIDAPI_INCLUDE_DIR ${PCAP_INCLUDE_DIR})
+        list (APPEND HIDAPI_SOURCE_FILES "hidapi/hid-pcapsimulate.c")
+        list (APPEND HIDAPI_LIBS ${PCAP_LIBRARY})
+        list (APPEND HIDAPI_DEFINITIONS -DLIBAMBIT_TRANSPORT_PCAP)
+        set_source_files_properties(hidapi/hid-pcapsimulate.c PROPERTIES COMPILE_DEFINITIONS HIDAPI_NAMESPACE=pcap)
+    endif ()
+
+    # Build time default, transport names differ from the driver names
+    if (HIDAPI_DRIVER STREQUAL "usbraw")
+        list (APPEND HIDAPI_DEFINITIONS -DLIBAMBIT_TRANSPORT_DEFAULT="hidraw")
+    elseif (HIDAPI_DRIVER STREQUAL "pcapsimulate")
+        list (APPEND HIDAPI_DEFINITIONS -DLIBAMBIT_TRANSPORT_DEFAULT="pcap")
+    elseif (HIDAPI_DRIVER)
+        list (APPEND HIDAPI_DEFINITIONS -DLIBAMBIT_TRANSPORT_DEFAULT="${HIDAPI_DRIVER}")
+    endif ()
 
-    mark_as_advanced(HIDAPI_INCLUDE_DIR HIDAPI_SOURCE_FILES HIDAPI_LIBS)
+    mark_as_advanced(HIDAPI_INCLUDE_DIR HIDAPI_SOURCE_FILES HIDAPI_LIBS HIDAPI_DEFINITIONS)
     set (HIDAPI_RESOLVED TRUE)
 endif (NOT HIDAPI_RESOLVED)
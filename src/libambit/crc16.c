@@ -18,9 +18,18 @@
 /*                                                               */
 /*****************************************************************/
 
+#include <pthread.h>
+#include <string.h>
+
 #include "crc16.h"
 
-static uint16_t crctable[256] =
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC16_HAVE_CLMUL 1
+#endif
+
+static const uint16_t crctable[256] =
 {
  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
@@ -63,15 +72,221 @@ static uint16_t crctable[256] =
 /*                   End of CRC Lookup Table                     */
 /*****************************************************************/
 
+/*
+ * Local definitions
+ */
+typedef uint16_t (*crc16_fn)(const unsigned char *buf, size_t buflen, uint16_t crc);
+
+// Folding constants for 128 bit blocks, x^192 mod P and x^128 mod P
+#define CLMUL_K_192  0x650b
+#define CLMUL_K_128  0xaefc
+// Below this slice-by-8 is faster, which covers every single packet
+#define CLMUL_MIN_LEN 96
+
+/*
+ * Static functions
+ */
+static uint16_t crc16_bytewise(const unsigned char *buf, size_t buflen, uint16_t crc);
+static uint16_t crc16_slice8(const unsigned char *buf, size_t buflen, uint16_t crc);
+#ifdef CRC16_HAVE_CLMUL
+static uint16_t crc16_clmul(const unsigned char *buf, size_t buflen, uint16_t crc);
+static int cpu_has_clmul(void);
+#endif
+static uint16_t crc16_auto(const unsigned char *buf, size_t buflen, uint16_t crc);
+static void crc16_init(void);
+
+/*
+ * Static variables
+ */
+// crctable_slice[k][x] is the CRC of byte x followed by k zero bytes,
+// crctable_slice[0] is a copy of crctable
+static uint16_t crctable_slice[8][256];
+static int have_clmul = 0;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Selected implementation, only read and written atomically as every
+// sync thread computes CRCs
+static crc16_fn impl_fn = crc16_auto;
+static crc16_impl_t impl_id = crc16_impl_auto;
+
+/*
+ * Public functions
+ */
 uint16_t crc16_ccitt_false(unsigned char *buf, size_t buflen)
 {
     return crc16_ccitt_false_init(buf, buflen, CRC16_CCITT_FALSE_INIT);
 }
 
 uint16_t crc16_ccitt_false_init(unsigned char *buf, size_t buflen, uint16_t crc)
+{
+    crc16_fn fn;
+
+    pthread_once(&init_once, crc16_init);
+    fn = __atomic_load_n(&impl_fn, __ATOMIC_ACQUIRE);
+
+    return fn(buf, buflen, crc) ^ CRC16_CCITT_FALSE_XOROT;
+}
+
+int crc16_select_impl(crc16_impl_t impl)
+{
+    crc16_fn fn;
+
+    pthread_once(&init_once, crc16_init);
+
+    switch (impl) {
+      case crc16_impl_auto:
+        fn = crc16_auto;
+        break;
+      case crc16_impl_bytewise:
+        fn = crc16_bytewise;
+        break;
+      case crc16_impl_slice8:
+        fn = crc16_slice8;
+        break;
+      case crc16_impl_clmul:
+#ifdef CRC16_HAVE_CLMUL
+        if (have_clmul) {
+            fn = crc16_clmul;
+            break;
+        }
+#endif
+        return -1;
+      default:
+        return -1;
+    }
+
+    __atomic_store_n(&impl_id, impl, __ATOMIC_RELAXED);
+    __atomic_store_n(&impl_fn, fn, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+const char *crc16_impl_name(void)
+{
+    pthread_once(&init_once, crc16_init);
+
+    switch (__atomic_load_n(&impl_id, __ATOMIC_RELAXED)) {
+      case crc16_impl_auto:
+        return have_clmul ? "slice-by-8, clmul for long input" : "slice-by-8";
+      case crc16_impl_clmul:
+        return "clmul";
+      case crc16_impl_slice8:
+        return "slice-by-8";
+      case crc16_impl_bytewise:
+      default:
+        return "bytewise";
+    }
+}
+
+/**
+ * Default implementation. Single packets are short enough that clmul only
+ * adds a call before falling back to slice-by-8, so it is used directly
+ * for them, clmul only for long buffers on CPUs that support it.
+ */
+static uint16_t crc16_auto(const unsigned char *buf, size_t buflen, uint16_t crc)
+{
+#ifdef CRC16_HAVE_CLMUL
+    if (buflen >= CLMUL_MIN_LEN && have_clmul) {
+        return crc16_clmul(buf, buflen, crc);
+    }
+#endif
+
+    return crc16_slice8(buf, buflen, crc);
+}
+
+static void crc16_init(void)
+{
+    int i, k;
+
+    for (i=0; i<256; i++) {
+        crctable_slice[0][i] = crctable[i];
+    }
+    for (k=1; k<8; k++) {
+        for (i=0; i<256; i++) {
+            crctable_slice[k][i] = crctable[crctable_slice[k-1][i] >> 8] ^ (crctable_slice[k-1][i] << 8);
+        }
+    }
+
+#ifdef CRC16_HAVE_CLMUL
+    have_clmul = cpu_has_clmul();
+#endif
+}
+
+static uint16_t crc16_bytewise(const unsigned char *buf, size_t buflen, uint16_t crc)
 {
     while (buflen--) {
        crc = crctable[((crc>>8) ^ *buf++) & 0xFFL] ^ (crc << 8);
     }
-    return crc ^ CRC16_CCITT_FALSE_XOROT;
+    return crc;
+}
+
+static uint16_t crc16_slice8(const unsigned char *buf, size_t buflen, uint16_t crc)
+{
+    while (buflen >= 8) {
+        crc = crctable_slice[7][(crc >> 8) ^ buf[0]] ^
+              crctable_slice[6][(crc & 0xff) ^ buf[1]] ^
+              crctable_slice[5][buf[2]] ^
+              crctable_slice[4][buf[3]] ^
+              crctable_slice[3][buf[4]] ^
+              crctable_slice[2][buf[5]] ^
+              crctable_slice[1][buf[6]] ^
+              crctable_slice[0][buf[7]];
+        buf += 8;
+        buflen -= 8;
+    }
+
+    return crc16_bytewise(buf, buflen, crc);
+}
+
+#ifdef CRC16_HAVE_CLMUL
+static int cpu_has_clmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    // SSSE3 is needed for the byte reversal
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+/**
+ * Fold 16 byte blocks with carry-less multiplies, then finish the last
+ * folded block and any tail bytes with slice-by-8. The initial value is
+ * xor:ed into the first two message bytes, so folding starts from zero.
+ * Short input goes straight to slice-by-8.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc16_clmul(const unsigned char *buf, size_t buflen, uint16_t crc)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k = _mm_set_epi64x(CLMUL_K_128, CLMUL_K_192);
+    unsigned char block[16];
+    __m128i x;
+
+    if (buflen < CLMUL_MIN_LEN) {
+        return crc16_slice8(buf, buflen, crc);
+    }
+
+    memcpy(block, buf, sizeof(block));
+    block[0] ^= crc >> 8;
+    block[1] ^= crc & 0xff;
+    x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)block), bswap);
+    buf += 16;
+    buflen -= 16;
+
+    while (buflen >= 16) {
+        x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x01),
+                                        _mm_clmulepi64_si128(x, k, 0x10)),
+                          _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buf), bswap));
+        buf += 16;
+        buflen -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *)block, _mm_shuffle_epi8(x, bswap));
+    crc = crc16_slice8(block, sizeof(block), 0);
+
+    return crc16_slice8(buf, buflen, crc);
 }
+#endif
@@ -25,7 +25,26 @@
 #include <stddef.h>
 #include <stdint.h>
 
+typedef enum crc16_impl_e {
+    crc16_impl_auto,                    /* Slice-by-8, clmul for long input if supported */
+    crc16_impl_bytewise,                /* Reference, one table lookup per byte */
+    crc16_impl_slice8,
+    crc16_impl_clmul                    /* x86 carry-less multiply, slice-by-8 for short input */
+} crc16_impl_t;
+
 uint16_t crc16_ccitt_false(unsigned char *buf, size_t buflen);
 uint16_t crc16_ccitt_false_init(unsigned char *buf, size_t buflen, uint16_t crc);
 
+/**
+ * Force a specific implementation (mainly for benchmarks)
+ * \param impl Implementation to use
+ * \return 0 on success, -1 if not supported on this CPU
+ */
+int crc16_select_impl(crc16_impl_t impl);
+
+/**
+ * Get name of the implementation currently in use
+ */
+const char *crc16_impl_name(void);
+
 #endif /* __CRC16_H__ */
@@ -123,6 +123,7 @@ static int personal_settings_get(ambit_object_t *object, ambit_personal_settings
 static int log_read(ambit_object_t *object, ambit_log_skip_cb skip_cb, ambit_log_push_cb push_cb, ambit_log_progress_cb progress_cb, void *userref)
 {
     int entries_read = 0;
+    int entries_failed = 0;
 
     uint8_t *reply_data = NULL;
     size_t replylen = 0;
@@ -243,6 +244,9 @@ static int log_read(ambit_object_t *object, ambit_log_skip_cb skip_cb, ambit_log
                     }
                     entries_read++;
                 }
+                else {
+                    entries_failed++;
+                }
             }
             else {
                 LOG_INFO("Log %d of %d already exists, skip reading data", log_entries_walked + 1, log_entries_total);
@@ -252,6 +256,11 @@ static int log_read(ambit_object_t *object, ambit_log_skip_cb skip_cb, ambit_log
                 progress_cb(userref, log_entries_total, log_entries_walked, 100*log_entries_walked/log_entries_total);
             }
         }
+
+        // A failed or cancelled read keeps what was downloaded for next time
+        if (log_entries_walked == log_entries_total && entries_failed == 0) {
+            libambit_pmem20_log_deinit(&object->driver_data->pmem20);
+        }
     }
 
     LOG_INFO("%d entries read", entries_read);
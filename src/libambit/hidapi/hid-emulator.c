@@ -0,0 +1,1079 @@
+/*******************************************************
+ HIDAPI in-process emulator of an Ambit device
+
+ Answers the Ambit protocol from a synthetic memory image instead of
+ talking to a real clock, so sync code can be exercised and timed
+ without hardware. Behaviour is set by environment variables:
+
+   HIDAPI_EMULATOR_MODEL       ambit2 (PMEM20 logs, default) or ambit3
+                               (SBEM0102 log headers and memory map)
+   HIDAPI_EMULATOR_DEVICES     number of clocks to enumerate (default 1)
+   HIDAPI_EMULATOR_LOGS        number of logs on each clock (default 10)
+   HIDAPI_EMULATOR_SAMPLES     samples in each log (default 3600)
+   HIDAPI_EMULATOR_MIX         periodic:gps:ibi sample weights
+                               (default 4:1:1)
+   HIDAPI_EMULATOR_LATENCY_US  delay for every 64 byte report (default 0)
+********************************************************/
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "hidapi.h"
+
+/* Local definitions */
+#define EMULATOR_PATH_PREFIX        "emulator:"
+
+#define EMULATOR_LOG_START          0x000f4240
+#define EMULATOR_LOG_SIZE           0x0029f630 /* Fixed by the Ambit2 driver */
+#define EMULATOR_LOG_ENTRY_OFFSET   0x00000012
+#define EMULATOR_LOG_HEADER_LEN     256
+#define EMULATOR_CHUNK_SIZE         0x0400
+
+#define EMULATOR_GPS_SATELLITES     4
+#define EMULATOR_IBI_VALUES         4
+
+typedef struct emulator_model_s {
+    const char *name;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    const char *model;
+    const char *manufacturer;
+    const char *product;
+    uint8_t fw_version[4];
+    uint8_t hw_version[4];
+    bool sbem0102;                      /* Ambit3 style log headers */
+} emulator_model_t;
+
+typedef struct emulator_log_s {
+    uint32_t address;
+    uint32_t end_address;
+    uint32_t samples;
+    struct tm start;
+} emulator_log_t;
+
+struct hid_device_ {
+    const emulator_model_t *model;
+    int index;
+
+    /* Synthetic PMEM20 log area, built on first use */
+    uint8_t *mem;
+    uint32_t mem_start;
+    uint32_t mem_size;
+    emulator_log_t *logs;
+    int log_count;
+    int head_cursor;
+
+    uint32_t lock;
+
+    /* Request being reassembled from written reports */
+    uint8_t *request;
+    size_t request_len;
+    size_t request_received;
+    uint16_t request_command;
+    uint16_t request_sequence;
+
+    /* Reply being handed out as read reports */
+    uint8_t *reply;
+    size_t reply_len;
+    uint16_t reply_command;
+    uint16_t reply_sequence;
+    uint16_t reply_parts;
+    uint16_t reply_next_part;
+};
+
+typedef struct emulator_config_s {
+    const emulator_model_t *model;
+    int devices;
+    int logs;
+    int samples;
+    unsigned int mix_periodic;
+    unsigned int mix_gps;
+    unsigned int mix_ibi;
+    useconds_t latency_us;
+} emulator_config_t;
+
+// crc16.c
+uint16_t crc16_ccitt_false(unsigned char *buf, size_t buflen);
+uint16_t crc16_ccitt_false_init(unsigned char *buf, size_t buflen, uint16_t crc);
+
+/* Static functions */
+static const emulator_config_t *config_get(void);
+static int path_to_index(const char *path);
+static void serial_string(int index, char serial[17]);
+
+static int image_build(hid_device *dev);
+static size_t log_build(hid_device *dev, uint8_t *buf, int index, uint32_t next, uint32_t prev);
+static size_t log_header_build(hid_device *dev, uint8_t *buf, const emulator_log_t *log);
+static size_t sbem0102_log_header_build(uint8_t *buf, const emulator_log_t *log);
+static void log_start_time(int index, struct tm *tm);
+
+static void request_dispatch(hid_device *dev);
+static void reply_set(hid_device *dev, const uint8_t *data, size_t datalen);
+static void reply_set_sbem0102(hid_device *dev, const uint8_t *head, const uint8_t *data, size_t datalen);
+static size_t sbem0102_put(uint8_t *buf, size_t offset, uint8_t id, const uint8_t *data, uint32_t datalen);
+static void finalize_packet(uint8_t *data, uint8_t payload_len);
+
+static void put8(uint8_t *buf, size_t *offset, uint8_t value);
+static void put16(uint8_t *buf, size_t *offset, uint16_t value);
+static void put32(uint8_t *buf, size_t *offset, uint32_t value);
+static void putmem(uint8_t *buf, size_t *offset, const void *data, size_t len);
+
+static hid_device *new_hid_device(void);
+static wchar_t *utf8_to_wchar_t(const char *utf8);
+
+
+/* Static data */
+static const emulator_model_t emulator_models[] = {
+    { "ambit2", 0x1493, 0x0019, "Duck", "Suunto", "Ambit", { 0x02, 0x00, 0x04, 0x00 }, { 0x3d, 0x00, 0x00, 0x00 }, false },
+    { "ambit3", 0x1493, 0x001b, "Emu", "Suunto", "Ambit", { 0x02, 0x04, 0x59, 0x00 }, { 0x5c, 0x00, 0x00, 0x00 }, true }
+};
+
+/* Periodic sample layout, as {type, offset, length} relative to the
+   sample type byte. The last 4 bytes of every periodic sample is time */
+static const uint16_t periodic_spec[][3] = {
+    { 0x03,  0, 4 },                    /* distance */
+    { 0x04,  4, 2 },                    /* speed */
+    { 0x05,  6, 1 },                    /* hr */
+    { 0x0c,  7, 2 },                    /* altitude */
+    { 0x0e,  9, 2 },                    /* energy */
+    { 0x0f, 11, 2 }                     /* temperature */
+};
+#define PERIODIC_VALUES_LEN 13
+
+/* Ambit3 fw 2.4 SBEM0102 data ids */
+#define SBEM0102_ID_MEMORY_MAP_ENTRY    0x4a
+#define SBEM0102_ID_LOG_COUNT           0x59
+#define SBEM0102_ID_LOG_NOTSYNCED       0x5a
+#define SBEM0102_ID_LOG_HEADERS         0x8a
+#define SBEM0102_LOG_HEADER_TAIL_LEN    0x1c
+
+static emulator_config_t config;
+static bool config_read = false;
+
+int HID_API_EXPORT hid_init(void)
+{
+    config_get();
+
+    return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+    return 0;
+}
+
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    struct hid_device_info *root = NULL; /* return object */
+    struct hid_device_info *tmp;
+    const emulator_config_t *conf = config_get();
+    char path[32];
+    char serial[17];
+    int i;
+
+    for (i=conf->devices-1; i>=0; i--) {
+        if ((vendor_id != 0 && vendor_id != conf->model->vendor_id) ||
+            (product_id != 0 && product_id != conf->model->product_id)) {
+            continue;
+        }
+
+        tmp = malloc(sizeof(struct hid_device_info));
+        if (tmp == NULL) {
+            break;
+        }
+
+        snprintf(path, sizeof(path), EMULATOR_PATH_PREFIX "%d", i);
+        serial_string(i, serial);
+
+        tmp->next = root;
+        tmp->path = strdup(path);
+        tmp->vendor_id = conf->model->vendor_id;
+        tmp->product_id = conf->model->product_id;
+        tmp->serial_number = utf8_to_wchar_t(serial);
+        tmp->release_number = 0x0;
+        tmp->interface_number = -1;
+        tmp->manufacturer_string = utf8_to_wchar_t(conf->model->manufacturer);
+        tmp->product_string = utf8_to_wchar_t(conf->model->product);
+
+        root = tmp;
+    }
+
+    return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+    struct hid_device_info *d = devs;
+    while (d) {
+        struct hid_device_info *next = d->next;
+        free(d->path);
+        free(d->serial_number);
+        free(d->manufacturer_string);
+        free(d->product_string);
+        free(d);
+        d = next;
+    }
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+    return hid_open_path(EMULATOR_PATH_PREFIX "0");
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+    hid_device *dev = NULL;
+    int index = path_to_index(path);
+
+    if (index >= 0) {
+        dev = new_hid_device();
+        if (dev != NULL) {
+            dev->model = config_get()->model;
+            dev->index = index;
+        }
+    }
+
+    return dev;
+}
+
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+    uint8_t payload_len;
+    uint16_t parts;
+    uint32_t request_len;
+
+    if (length < 64 || data[0] != 0x3f) {
+        return -1;
+    }
+
+    if (config_get()->latency_us > 0) {
+        usleep(config_get()->latency_us);
+    }
+
+    payload_len = data[3];
+
+    if (data[2] == 0x5d) {
+        // First part of a new request, previous leftovers are lost
+        free(dev->request);
+        dev->request = NULL;
+        dev->request_received = 0;
+
+        parts = le16toh(*(uint16_t*)(data + 4));
+        request_len = le32toh(*(uint32_t*)(data + 16));
+        dev->request_command = be16toh(*(uint16_t*)(data + 8));
+        dev->request_sequence = le16toh(*(uint16_t*)(data + 14));
+        dev->request_len = request_len;
+        if (request_len > 0) {
+            dev->request = malloc(request_len);
+            if (dev->request == NULL) {
+                return -1;
+            }
+        }
+
+        if (request_len > 0 && payload_len >= 12 && payload_len - 12 <= request_len) {
+            memcpy(dev->request, data + 20, payload_len - 12);
+            dev->request_received = payload_len - 12;
+        }
+
+        if (parts <= 1) {
+            request_dispatch(dev);
+        }
+    }
+    else if (data[2] == 0x5e) {
+        if (dev->request_received + payload_len <= dev->request_len) {
+            memcpy(dev->request + dev->request_received, data + 8, payload_len);
+            dev->request_received += payload_len;
+        }
+
+        if (dev->request_received >= dev->request_len) {
+            request_dispatch(dev);
+        }
+    }
+
+    return length;
+}
+
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+    uint8_t buf[64];
+    size_t offset, packet_payload_len;
+
+    if (dev->reply_next_part >= dev->reply_parts) {
+        // Nothing to say, behave as a silent device
+        return 0;
+    }
+
+    if (config_get()->latency_us > 0) {
+        usleep(config_get()->latency_us);
+    }
+
+    memset(buf, 0, sizeof(buf));
+    if (dev->reply_next_part == 0) {
+        packet_payload_len = dev->reply_len < 42 ? dev->reply_len : 42;
+        buf[2] = 0x5d;
+        *(uint16_t*)(buf + 4) = htole16(dev->reply_parts);
+        *(uint16_t*)(buf + 8) = htobe16(dev->reply_command);
+        *(uint16_t*)(buf + 10) = htole16(0x0a);
+        *(uint16_t*)(buf + 12) = htole16(0x09);
+        *(uint16_t*)(buf + 14) = htole16(dev->reply_sequence);
+        *(uint32_t*)(buf + 16) = htole32(dev->reply_len);
+        memcpy(buf + 20, dev->reply, packet_payload_len);
+        finalize_packet(buf, packet_payload_len + 12);
+    }
+    else {
+        offset = 42 + (dev->reply_next_part - 1)*54;
+        packet_payload_len = dev->reply_len - offset < 54 ? dev->reply_len - offset : 54;
+        buf[2] = 0x5e;
+        *(uint16_t*)(buf + 4) = htole16(dev->reply_next_part);
+        memcpy(buf + 8, dev->reply + offset, packet_payload_len);
+        finalize_packet(buf, packet_payload_len);
+    }
+    dev->reply_next_part++;
+
+    // Fix length
+    if (length > 64)
+        length = 64;
+    if (data != NULL) {
+        memcpy(data, buf, length);
+    }
+
+    return length;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+    return hid_read_timeout(dev, data, length, 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+    return 0; /* Success */
+}
+
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+    return 0;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+    return 0;
+}
+
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+    if (!dev)
+        return;
+
+    free(dev->mem);
+    free(dev->logs);
+    free(dev->request);
+    free(dev->reply);
+    free(dev);
+}
+
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+    return NULL;
+}
+
+static const emulator_config_t *config_get(void)
+{
+    const char *value;
+    int i;
+
+    if (config_read) {
+        return &config;
+    }
+
+    config.model = &emulator_models[0];
+    config.devices = 1;
+    config.logs = 10;
+    config.samples = 3600;
+    config.mix_periodic = 4;
+    config.mix_gps = 1;
+    config.mix_ibi = 1;
+    config.latency_us = 0;
+
+    if ((value = getenv("HIDAPI_EMULATOR_MODEL")) != NULL) {
+        for (i=0; i<sizeof(emulator_models)/sizeof(emulator_models[0]); i++) {
+            if (strcmp(emulator_models[i].name, value) == 0) {
+                config.model = &emulator_models[i];
+            }
+        }
+    }
+    if ((value = getenv("HIDAPI_EMULATOR_DEVICES")) != NULL && atoi(value) >= 0) {
+        config.devices = atoi(value);
+    }
+    if ((value = getenv("HIDAPI_EMULATOR_LOGS")) != NULL && atoi(value) >= 0) {
+        config.logs = atoi(value);
+    }
+    if ((value = getenv("HIDAPI_EMULATOR_SAMPLES")) != NULL && atoi(value) >= 0) {
+        config.samples = atoi(value);
+    }
+    if ((value = getenv("HIDAPI_EMULATOR_MIX")) != NULL) {
+        if (sscanf(value, "%u:%u:%u", &config.mix_periodic, &config.mix_gps, &config.mix_ibi) != 3 ||
+            config.mix_periodic + config.mix_gps + config.mix_ibi == 0) {
+            printf("Error: Bad HIDAPI_EMULATOR_MIX \"%s\", using 4:1:1\n", value);
+            config.mix_periodic = 4;
+            config.mix_gps = 1;
+            config.mix_ibi = 1;
+        }
+    }
+    if ((value = getenv("HIDAPI_EMULATOR_LATENCY_US")) != NULL && atoi(value) >= 0) {
+        config.latency_us = atoi(value);
+    }
+
+    config_read = true;
+
+    return &config;
+}
+
+static int path_to_index(const char *path)
+{
+    int index;
+
+    if (path == NULL || strncmp(path, EMULATOR_PATH_PREFIX, strlen(EMULATOR_PATH_PREFIX)) != 0) {
+        return -1;
+    }
+
+    index = atoi(path + strlen(EMULATOR_PATH_PREFIX));
+    if (index < 0 || index >= config_get()->devices) {
+        return -1;
+    }
+
+    return index;
+}
+
+static void serial_string(int index, char serial[17])
+{
+    snprintf(serial, 17, "EMU%013d", index);
+}
+
+/**
+ * Lay out all logs in a PMEM20 log area, the same way the clock does:
+ * area header followed by linked "PMEM" entries
+ */
+static int image_build(hid_device *dev)
+{
+    const emulator_config_t *conf = config_get();
+    uint32_t address, next;
+    size_t total = EMULATOR_LOG_ENTRY_OFFSET, entry_len;
+    size_t offset;
+    int i, count;
+
+    if (dev->mem != NULL) {
+        return 0;
+    }
+
+    // Size up all entries, Ambit2 has a fixed area where the logs must fit
+    for (count=0; count<conf->logs; count++) {
+        entry_len = log_build(dev, NULL, count, 0, 0);
+        if (!dev->model->sbem0102 && total + entry_len > EMULATOR_LOG_SIZE) {
+            printf("Error: Only %d emulated logs fit in the log area\n", count);
+            break;
+        }
+        total += entry_len;
+    }
+
+    dev->mem_start = EMULATOR_LOG_START;
+    if (dev->model->sbem0102) {
+        dev->mem_size = ((total + EMULATOR_CHUNK_SIZE - 1)/EMULATOR_CHUNK_SIZE)*EMULATOR_CHUNK_SIZE;
+    }
+    else {
+        dev->mem_size = EMULATOR_LOG_SIZE;
+    }
+
+    dev->mem = calloc(1, dev->mem_size);
+    dev->logs = calloc(count > 0 ? count : 1, sizeof(emulator_log_t));
+    if (dev->mem == NULL || dev->logs == NULL) {
+        free(dev->mem);
+        free(dev->logs);
+        dev->mem = NULL;
+        dev->logs = NULL;
+        return -1;
+    }
+    dev->log_count = count;
+
+    address = dev->mem_start + EMULATOR_LOG_ENTRY_OFFSET;
+    for (i=0; i<count; i++) {
+        entry_len = log_build(dev, NULL, i, 0, 0);
+        // Last entry points to itself
+        next = (i == count - 1) ? address : address + entry_len;
+        log_build(dev, dev->mem + (address - dev->mem_start), i, next,
+                  i == 0 ? address : dev->logs[i-1].address);
+        dev->logs[i].address = address;
+        dev->logs[i].end_address = address + entry_len;
+        dev->logs[i].samples = conf->samples;
+        log_start_time(i, &dev->logs[i].start);
+        address += entry_len;
+    }
+
+    offset = 0;
+    put32(dev->mem, &offset, count > 0 ? dev->logs[count-1].address : dev->mem_start);
+    put32(dev->mem, &offset, count > 0 ? dev->logs[0].address : dev->mem_start);
+    put32(dev->mem, &offset, count);
+    put32(dev->mem, &offset, address);
+
+    return 0;
+}
+
+/**
+ * Write one "PMEM" log entry (or just size it up if buf is NULL)
+ * \return Length of entry
+ */
+static size_t log_build(hid_device *dev, uint8_t *buf, int index, uint32_t next, uint32_t prev)
+{
+    const emulator_config_t *conf = config_get();
+    unsigned int mix_total = conf->mix_periodic + conf->mix_gps + conf->mix_ibi;
+    emulator_log_t log;
+    size_t offset = 0;
+    uint32_t periodic_time = 0, gps_count = 0;
+    unsigned int slot;
+    int i, j;
+
+    memset(&log, 0, sizeof(log));
+    log.samples = conf->samples;
+    log_start_time(index, &log.start);
+
+    putmem(buf, &offset, "PMEM", 4);
+    put32(buf, &offset, next);
+    put32(buf, &offset, prev);
+
+    // Periodic sample specification
+    put16(buf, &offset, 3 + sizeof(periodic_spec));
+    put8(buf, &offset, 0);
+    put16(buf, &offset, sizeof(periodic_spec)/sizeof(periodic_spec[0]));
+    for (i=0; i<sizeof(periodic_spec)/sizeof(periodic_spec[0]); i++) {
+        put16(buf, &offset, periodic_spec[i][0]);
+        put16(buf, &offset, periodic_spec[i][1]);
+        put16(buf, &offset, periodic_spec[i][2]);
+    }
+
+    put16(buf, &offset, EMULATOR_LOG_HEADER_LEN);
+    offset += log_header_build(dev, buf != NULL ? buf + offset : NULL, &log);
+
+    for (i=0; i<log.samples; i++) {
+        slot = (i + index) % mix_total;
+        if (i == 0 || slot < conf->mix_periodic) {
+            put16(buf, &offset, 1 + PERIODIC_VALUES_LEN + 4);
+            put8(buf, &offset, 0x02);
+            put32(buf, &offset, periodic_time * 3);         /* distance */
+            put16(buf, &offset, 300 + i % 50);              /* speed */
+            put8(buf, &offset, 120 + i % 40);               /* hr */
+            put16(buf, &offset, 100 + i % 20);              /* altitude */
+            put16(buf, &offset, 80);                        /* energy */
+            put16(buf, &offset, 200);                       /* temperature */
+            put32(buf, &offset, periodic_time * 1000);
+            periodic_time++;
+        }
+        else if (slot < conf->mix_periodic + conf->mix_gps) {
+            if (gps_count++ == 0) {
+                put16(buf, &offset, 40 + 4*EMULATOR_GPS_SATELLITES);
+                put8(buf, &offset, 0x03);
+                put32(buf, &offset, 500);
+                put8(buf, &offset, 0x0f);
+                put16(buf, &offset, 0);                     /* navvalid */
+                put16(buf, &offset, 0x0c);                  /* navtype */
+                put16(buf, &offset, 1900 + log.start.tm_year);
+                put8(buf, &offset, log.start.tm_mon + 1);
+                put8(buf, &offset, log.start.tm_mday);
+                put8(buf, &offset, log.start.tm_hour);
+                put8(buf, &offset, log.start.tm_min);
+                put16(buf, &offset, log.start.tm_sec*1000);
+                put32(buf, &offset, 600000000);             /* latitude */
+                put32(buf, &offset, 180000000);             /* longitude */
+                put32(buf, &offset, 10000);                 /* altitude */
+                put16(buf, &offset, 300);
+                put16(buf, &offset, 9000);
+                put32(buf, &offset, 500);                   /* ehpe */
+                put8(buf, &offset, EMULATOR_GPS_SATELLITES);
+                put8(buf, &offset, 10);                     /* hdop */
+                for (j=0; j<EMULATOR_GPS_SATELLITES; j++) {
+                    put8(buf, &offset, j + 1);
+                    put8(buf, &offset, 0x07);
+                    put8(buf, &offset, 0);
+                    put8(buf, &offset, 40);
+                }
+            }
+            else {
+                put16(buf, &offset, 14);
+                put8(buf, &offset, 0x03);
+                put32(buf, &offset, 500);
+                put8(buf, &offset, 0x10);
+                put16(buf, &offset, gps_count);             /* latitude delta */
+                put16(buf, &offset, gps_count);             /* longitude delta */
+                put16(buf, &offset, periodic_time);
+                put8(buf, &offset, 5);                      /* ehpe */
+                put8(buf, &offset, EMULATOR_GPS_SATELLITES);
+            }
+        }
+        else {
+            put16(buf, &offset, 6 + 2*EMULATOR_IBI_VALUES);
+            put8(buf, &offset, 0x03);
+            put32(buf, &offset, 250);
+            put8(buf, &offset, 0x06);
+            for (j=0; j<EMULATOR_IBI_VALUES; j++) {
+                put16(buf, &offset, 480 + (i + j) % 60);
+            }
+        }
+    }
+
+    return offset;
+}
+
+/**
+ * Write a PMEM20 log header (or just size it up if buf is NULL)
+ * \return Length of header
+ */
+static size_t log_header_build(hid_device *dev, uint8_t *buf, const emulator_log_t *log)
+{
+    size_t offset = 0;
+    char name[16];
+
+    if (buf == NULL) {
+        return EMULATOR_LOG_HEADER_LEN;
+    }
+
+    memset(buf, 0, EMULATOR_LOG_HEADER_LEN);
+    memset(name, 0, sizeof(name));
+    strncpy(name, "Emulated", sizeof(name));
+
+    put8(buf, &offset, 0);
+    put16(buf, &offset, 1900 + log->start.tm_year);
+    put8(buf, &offset, log->start.tm_mon + 1);
+    put8(buf, &offset, log->start.tm_mday);
+    put8(buf, &offset, log->start.tm_hour);
+    put8(buf, &offset, log->start.tm_min);
+    put8(buf, &offset, log->start.tm_sec);
+    offset += 5;
+    put32(buf, &offset, log->samples * 10);             /* duration, 0.1 s */
+    put16(buf, &offset, 120);                           /* ascent */
+    put16(buf, &offset, 110);                           /* descent */
+    put32(buf, &offset, 600);
+    put32(buf, &offset, 550);
+    put16(buf, &offset, 600);                           /* recovery time */
+    put16(buf, &offset, 1000);                          /* speed avg */
+    put16(buf, &offset, 1500);                          /* speed max */
+    put16(buf, &offset, 120);                           /* altitude max */
+    put16(buf, &offset, 100);                           /* altitude min */
+    put8(buf, &offset, 140);                            /* hr avg */
+    put8(buf, &offset, 160);                            /* hr max */
+    put8(buf, &offset, 30);                             /* peak training effect */
+    put8(buf, &offset, 3);                              /* activity type */
+    putmem(buf, &offset, name, sizeof(name));
+    put8(buf, &offset, 120);                            /* hr min */
+    put8(buf, &offset, 0);
+    if (dev->model->sbem0102) {
+        offset += 46;
+        put8(buf, &offset, 120);
+        offset += 1;
+    }
+    put16(buf, &offset, 200);                           /* temperature max */
+    put16(buf, &offset, 180);                           /* temperature min */
+    put32(buf, &offset, log->samples * 3);              /* distance */
+    put32(buf, &offset, log->samples);
+    put16(buf, &offset, 500);                           /* energy */
+    put8(buf, &offset, 90);                             /* cadence max */
+    put8(buf, &offset, 80);                             /* cadence avg */
+
+    return EMULATOR_LOG_HEADER_LEN;
+}
+
+/**
+ * Write an Ambit3 fw 2.4 log header, as found in the SBEM0102 reply of
+ * ambit_command_ambit3_log_headers
+ * \return Length of header
+ */
+static size_t sbem0102_log_header_build(uint8_t *buf, const emulator_log_t *log)
+{
+    size_t offset = 0;
+    char date[32];
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &log->start);
+
+    putmem(buf, &offset, date, strlen(date) + 1);
+    put8(buf, &offset, 0);                              /* synced */
+    put32(buf, &offset, log->address);
+    put32(buf, &offset, log->end_address);
+    put32(buf, &offset, 0);
+    put32(buf, &offset, 0);
+    put8(buf, &offset, 120);                            /* hr min */
+    put8(buf, &offset, 140);                            /* hr avg */
+    put8(buf, &offset, 160);                            /* hr max */
+    put32(buf, &offset, 0);
+    put32(buf, &offset, 0);
+    put16(buf, &offset, 0);                             /* temperature */
+    put32(buf, &offset, 0);
+    put32(buf, &offset, 0);
+    put16(buf, &offset, 100);                           /* altitude min */
+    put16(buf, &offset, 120);                           /* altitude max */
+    put32(buf, &offset, 0);
+    put32(buf, &offset, 0);
+    put8(buf, &offset, 80);                             /* cadence avg */
+    put8(buf, &offset, 90);                             /* cadence max */
+    put32(buf, &offset, 0);
+    put16(buf, &offset, 1000);                          /* speed avg */
+    put16(buf, &offset, 1500);                          /* speed max */
+    put32(buf, &offset, 0);
+    put32(buf, &offset, 0);
+    put32(buf, &offset, log->samples * 10);             /* duration, 0.1 s */
+    put16(buf, &offset, 120);                           /* ascent */
+    put16(buf, &offset, 110);                           /* descent */
+    put32(buf, &offset, 600);
+    put32(buf, &offset, 550);
+    put16(buf, &offset, 10);                            /* recovery time */
+    put8(buf, &offset, 30);                             /* peak training effect */
+    putmem(buf, &offset, "Emulated", 9);
+    put32(buf, &offset, log->samples * 3);              /* distance */
+    put16(buf, &offset, 500);                           /* energy */
+    if (buf != NULL) {
+        memset(buf + offset, 0, SBEM0102_LOG_HEADER_TAIL_LEN);
+    }
+    offset += SBEM0102_LOG_HEADER_TAIL_LEN;
+
+    return offset;
+}
+
+static void log_start_time(int index, struct tm *tm)
+{
+    // One log per day, backwards from a fixed date so runs are repeatable
+    time_t start = 1420099200 - (time_t)index*24*60*60; /* 2015-01-01 08:00 UTC */
+
+    gmtime_r(&start, tm);
+}
+
+static void request_dispatch(hid_device *dev)
+{
+    uint8_t reply[8 + EMULATOR_LOG_HEADER_LEN];
+    uint8_t *data = dev->request;
+    size_t datalen = dev->request_len;
+    size_t offset = 0;
+    uint32_t address, length;
+    char serial[17];
+    int i;
+
+    free(dev->reply);
+    dev->reply = NULL;
+    dev->reply_len = 0;
+    dev->reply_parts = 0;
+    dev->reply_next_part = 0;
+    dev->reply_command = dev->request_command;
+    dev->reply_sequence = dev->request_sequence;
+
+    memset(reply, 0, sizeof(reply));
+
+    switch (dev->request_command) {
+      case 0x0000: /* device info */
+        // Real clocks answer this one as 0x0002
+        dev->reply_command = 0x0002;
+        serial_string(dev->index, serial);
+        strncpy((char*)reply, dev->model->model, 16);
+        memcpy(reply + 16, serial, 16);
+        memcpy(reply + 32, dev->model->fw_version, 4);
+        memcpy(reply + 36, dev->model->hw_version, 4);
+        reply_set(dev, reply, 40);
+        break;
+      case 0x0b1e: /* compact serial */
+        snprintf((char*)reply + 9, 11, "EMU%07d", dev->index);
+        reply_set(dev, reply, 20);
+        break;
+      case 0x0306: /* status */
+        reply[1] = 80;
+        reply_set(dev, reply, 4);
+        break;
+      case 0x0b00: /* personal settings */
+        offset = 0x30;
+        put16(reply, &offset, 7000);                    /* weight */
+        put16(reply, &offset, 1980);                    /* birthyear */
+        put8(reply, &offset, 190);                      /* max hr */
+        put8(reply, &offset, 50);                       /* rest hr */
+        reply_set(dev, reply, 0xc0);
+        break;
+      case 0x0b19: /* lock check */
+        offset = 0;
+        put32(reply, &offset, dev->lock);
+        reply_set(dev, reply, 4);
+        break;
+      case 0x0b1a: /* lock set */
+        if (datalen >= 1) {
+            dev->lock = data[0];
+        }
+        reply_set(dev, reply, 4);
+        break;
+      case 0x0b06: /* log count */
+        image_build(dev);
+        offset = 2;
+        put16(reply, &offset, dev->log_count);
+        reply_set(dev, reply, 4);
+        break;
+      case 0x0b07: /* log head first */
+        image_build(dev);
+        dev->head_cursor = -1;
+        offset = 0;
+        put32(reply, &offset, dev->log_count > 0 ? 0x400 : 0);
+        reply_set(dev, reply, 4);
+        break;
+      case 0x0b0a: /* log head step */
+        dev->head_cursor++;
+        reply_set(dev, reply, 4);
+        break;
+      case 0x0b0b: /* log head */
+        if (dev->mem != NULL && dev->head_cursor >= 0 && dev->head_cursor < dev->log_count) {
+            // Header follows "PMEM", next, prev and the periodic spec
+            memcpy(reply + 8, dev->mem + (dev->logs[dev->head_cursor].address - dev->mem_start) + 12 +
+                   2 + 3 + sizeof(periodic_spec) + 2, EMULATOR_LOG_HEADER_LEN);
+            reply_set(dev, reply, 8 + EMULATOR_LOG_HEADER_LEN);
+        }
+        else {
+            reply_set(dev, reply, 8);
+        }
+        break;
+      case 0x0b08: /* log head peek */
+        offset = 0;
+        put32(reply, &offset, dev->head_cursor + 1 < dev->log_count ? 0x400 : 0);
+        reply_set(dev, reply, 4);
+        break;
+      case 0x0b17: /* log read */
+        if (datalen >= 8 && image_build(dev) == 0) {
+            address = le32toh(*(uint32_t*)data);
+            length = le32toh(*(uint32_t*)(data + 4));
+            dev->reply = calloc(1, length + 8);
+            if (dev->reply != NULL) {
+                memcpy(dev->reply, data, 8);
+                if (address >= dev->mem_start && address < dev->mem_start + dev->mem_size) {
+                    memcpy(dev->reply + 8, dev->mem + (address - dev->mem_start),
+                           address + length <= dev->mem_start + dev->mem_size ? length : dev->mem_start + dev->mem_size - address);
+                }
+                reply_set(dev, NULL, length + 8);
+            }
+        }
+        break;
+      case 0x0b15: /* gps orbit head */
+        reply_set(dev, reply, 9);
+        break;
+      case 0x0b21: /* ambit3 memory map */
+        image_build(dev);
+        offset = 0;
+        putmem(reply, &offset, "ExerciseLog", 12);
+        for (i=0; i<32; i++) {
+            putmem(reply, &offset, "00", 2);
+        }
+        put8(reply, &offset, 0);
+        put32(reply, &offset, dev->mem_start);
+        put32(reply, &offset, dev->mem_size);
+        offset = sbem0102_put(reply + 128, 0, SBEM0102_ID_MEMORY_MAP_ENTRY, reply, offset);
+        reply_set_sbem0102(dev, NULL, reply + 128, offset);
+        break;
+      case 0x1100: /* ambit3 settings */
+        {
+            static const uint8_t units_mode[] = { 0x00 };
+            static const uint8_t weight[] = { 0x58, 0x1b };
+            static const uint8_t max_hr[] = { 190 };
+
+            offset = sbem0102_put(reply, 0, 0x08, units_mode, sizeof(units_mode));
+            offset = sbem0102_put(reply, offset, 0x1a, weight, sizeof(weight));
+            offset = sbem0102_put(reply, offset, 0x1b, max_hr, sizeof(max_hr));
+            reply_set_sbem0102(dev, NULL, reply, offset);
+        }
+        break;
+      case 0x1200: /* ambit3 log headers */
+        if (image_build(dev) == 0) {
+            uint8_t *headers;
+            size_t headers_len = 0;
+
+            for (i=0; i<dev->log_count; i++) {
+                headers_len += sbem0102_log_header_build(NULL, &dev->logs[i]);
+            }
+            headers = malloc(32 + headers_len + 6);
+            if (headers != NULL) {
+                offset = 0;
+                put16(reply, &offset, dev->log_count);
+                offset = sbem0102_put(headers, 0, SBEM0102_ID_LOG_COUNT, reply, 2);
+                offset = sbem0102_put(headers, offset, SBEM0102_ID_LOG_NOTSYNCED, reply, 2);
+                offset = sbem0102_put(headers, offset, SBEM0102_ID_LOG_HEADERS, NULL, headers_len);
+                offset -= headers_len;
+                for (i=0; i<dev->log_count; i++) {
+                    offset +=  sbem0102_log_header_build(headers + offset, &dev->logs[i]);
+                }
+                reply_set_sbem0102(dev, datalen >= 4 ? data : NULL, headers, offset);
+                free(headers);
+            }
+        }
+        break;
+      default:
+        // Writes and unknown commands are just accepted
+        reply_set(dev, reply, 4);
+        break;
+    }
+}
+
+/**
+ * Set reply to hand out on next reads. If data is NULL, dev->reply is
+ * already filled in
+ */
+static void reply_set(hid_device *dev, const uint8_t *data, size_t datalen)
+{
+    if (data != NULL) {
+        dev->reply = malloc(datalen > 0 ? datalen : 1);
+        if (dev->reply == NULL) {
+            return;
+        }
+        memcpy(dev->reply, data, datalen);
+    }
+
+    dev->reply_len = datalen;
+    dev->reply_parts = 1;
+    if (datalen > 42) {
+        dev->reply_parts = 2 + (datalen - 42 - 1)/54;
+    }
+    dev->reply_next_part = 0;
+}
+
+static void reply_set_sbem0102(hid_device *dev, const uint8_t *head, const uint8_t *data, size_t datalen)
+{
+    static const uint8_t header[] = { 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 'S', 'B', 'E', 'M', '0', '1', '0', '2' };
+
+    dev->reply = malloc(sizeof(header) + datalen);
+    if (dev->reply == NULL) {
+        return;
+    }
+
+    memcpy(dev->reply, header, sizeof(header));
+    if (head != NULL) {
+        memcpy(dev->reply, head, 4);
+    }
+    // Always complete in one reply
+    dev->reply[4] = 0x01;
+    memcpy(dev->reply + sizeof(header), data, datalen);
+
+    reply_set(dev, NULL, sizeof(header) + datalen);
+}
+
+/**
+ * Append SBEM0102 data object. If data is NULL only the object header
+ * is written and the data is expected to be filled in by the caller
+ * \return Offset after object
+ */
+static size_t sbem0102_put(uint8_t *buf, size_t offset, uint8_t id, const uint8_t *data, uint32_t datalen)
+{
+    put8(buf, &offset, id);
+    if (datalen > 254) {
+        put8(buf, &offset, 0xff);
+        put32(buf, &offset, datalen);
+    }
+    else {
+        put8(buf, &offset, datalen);
+    }
+    if (data != NULL) {
+        putmem(buf, &offset, data, datalen);
+    }
+    else {
+        offset += datalen;
+    }
+
+    return offset;
+}
+
+static void finalize_packet(uint8_t *data, uint8_t payload_len)
+{
+    uint16_t *payload_crc, tmpcrc;
+
+    data[0] = 0x3f;
+    data[1] = payload_len + 8;
+    data[3] = payload_len;
+    tmpcrc = crc16_ccitt_false(&data[2], 4);
+    *(uint16_t*)(data + 6) = htole16(tmpcrc);
+    payload_crc = (uint16_t *)&data[data[1]];
+    *payload_crc = htole16(crc16_ccitt_false_init(&data[8], payload_len, tmpcrc));
+}
+
+static void put8(uint8_t *buf, size_t *offset, uint8_t value)
+{
+    if (buf != NULL) {
+        buf[*offset] = value;
+    }
+    *offset += 1;
+}
+
+static void put16(uint8_t *buf, size_t *offset, uint16_t value)
+{
+    if (buf != NULL) {
+        buf[*offset] = value & 0xff;
+        buf[*offset + 1] = value >> 8;
+    }
+    *offset += 2;
+}
+
+static void put32(uint8_t *buf, size_t *offset, uint32_t value)
+{
+    put16(buf, offset, value & 0xffff);
+    put16(buf, offset, value >> 16);
+}
+
+static void putmem(uint8_t *buf, size_t *offset, const void *data, size_t len)
+{
+    if (buf != NULL) {
+        memcpy(buf + *offset, data, len);
+    }
+    *offset += len;
+}
+
+static hid_device *new_hid_device(void)
+{
+    hid_device *dev = calloc(1, sizeof(hid_device));
+
+    return dev;
+}
+
+/* The caller must free the returned string with free(). */
+static wchar_t *utf8_to_wchar_t(const char *utf8)
+{
+    wchar_t *ret = NULL;
+
+    if (utf8) {
+        size_t wlen = mbstowcs(NULL, utf8, 0);
+        if ((size_t) -1 == wlen) {
+            return wcsdup(L"");
+        }
+        ret = calloc(wlen+1, sizeof(wchar_t));
+        mbstowcs(ret, utf8, wlen+1);
+        ret[wlen] = 0x0000;
+    }
+
+    return ret;
+}
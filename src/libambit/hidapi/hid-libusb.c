@@ -42,6 +42,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <wchar.h>
+#include <time.h>
 
 /* GNU / LibUSB */
 #include "libusb.h"
@@ -71,11 +72,29 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
-struct input_report {
-	uint8_t *data;
-	size_t len;
-	struct input_report *next;
+/* Number of interrupt IN transfers kept submitted, so that the endpoint
+   is polled again while earlier reports are still being handed over.
+   Can be changed with HIDAPI_LIBUSB_TRANSFERS. */
+#define INPUT_TRANSFERS_DEFAULT 4
+#define INPUT_TRANSFERS_MAX 32
+
+/* Received reports waiting to be read. A power of two, reports arriving
+   with the ring full are dropped. */
+#define INPUT_RING_SIZE 64
+
+/* Reports waiting longer than this before being read are counted late */
+#define INPUT_LATE_MS 100
+
+/* Single producer, single consumer ring of input reports. Only the
+   thread handling libusb events pushes (libusb runs one event handler at
+   a time) and only the reader pops. */
+struct input_ring {
+	uint8_t *data; /* INPUT_RING_SIZE reports of report_size bytes */
+	size_t report_size;
+	size_t len[INPUT_RING_SIZE];
+	uint64_t time_ms[INPUT_RING_SIZE];
+	unsigned int head; /* Written by producer only */
+	unsigned int tail; /* Written by consumer only */
 };
 
 
@@ -101,21 +120,29 @@ struct hid_device_ {
 
 	/* Read thread objects */
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* Only for waking up a waiting reader */
 	pthread_cond_t condition;
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
 	int cancelled;
-	struct libusb_transfer *transfer;
+	struct libusb_transfer *transfers[INPUT_TRANSFERS_MAX];
+	int num_transfers;
+	int active_transfers;
+	int reader_waiting;
+
+	/* Received input reports. */
+	struct input_ring input_ring;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Stats */
+	unsigned int reports_dropped;
+	unsigned int reports_late;
 };
 
 static libusb_context *usb_context = NULL;
 
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static void ring_push(hid_device *dev, const uint8_t *data, size_t length);
+static int ring_pop(hid_device *dev, unsigned char *data, size_t length);
 
 static hid_device *new_hid_device(void)
 {
@@ -136,6 +163,8 @@ static void free_hid_device(hid_device *dev)
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	free(dev->input_ring.data);
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -642,54 +671,36 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const
 	return handle;
 }
 
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Transfer will not be resubmitted. Once all are done, the read thread
+   can stop. */
+static void transfer_ended(hid_device *dev)
+{
+	dev->shutdown_thread = 1;
+	if (__atomic_sub_fetch(&dev->active_transfers, 1, __ATOMIC_SEQ_CST) == 0)
+		dev->cancelled = 1;
+}
+
 static void read_callback(struct libusb_transfer *transfer)
 {
 	hid_device *dev = transfer->user_data;
 	int res;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
-
-		pthread_mutex_lock(&dev->mutex);
-
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
-		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}
-		}
-		pthread_mutex_unlock(&dev->mutex);
+		ring_push(dev, transfer->buffer, transfer->actual_length);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		transfer_ended(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		transfer_ended(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
@@ -699,12 +710,18 @@ static void read_callback(struct libusb_transfer *transfer)
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
 
-	/* Re-submit the transfer object. */
+	if (dev->shutdown_thread) {
+		/* Some other transfer ended, let this one go too */
+		transfer_ended(dev);
+		return;
+	}
+
+	/* Re-submit the transfer object. The other transfers keep the
+	   endpoint busy meanwhile. */
 	res = libusb_submit_transfer(transfer);
 	if (res != 0) {
 		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		transfer_ended(dev);
 	}
 }
 
@@ -712,24 +729,28 @@ static void read_callback(struct libusb_transfer *transfer)
 static void *read_thread(void *param)
 {
 	hid_device *dev = param;
-	unsigned char *buf;
 	const size_t length = dev->input_ep_max_packet_size;
+	int i;
 
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+	/* Set up and submit the transfer objects. Further submissions are
+	   made from inside read_callback() */
+	for (i = 0; i < dev->num_transfers; i++) {
+		dev->transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_interrupt_transfer(dev->transfers[i],
+			dev->device_handle,
+			dev->input_endpoint,
+			malloc(length),
+			length,
+			read_callback,
+			dev,
+			5000/*timeout*/);
+
+		/* Counted before submitting, another thread handling libusb
+		   events may complete the transfer right away */
+		__atomic_add_fetch(&dev->active_transfers, 1, __ATOMIC_SEQ_CST);
+		if (libusb_submit_transfer(dev->transfers[i]) != 0)
+			transfer_ended(dev);
+	}
 
 	/* Notify the main thread that the read thread is up and running. */
 	pthread_barrier_wait(&dev->barrier);
@@ -752,9 +773,10 @@ static void *read_thread(void *param)
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
+	/* Cancel any transfers that may be pending. This call will fail
+	   for transfers that are not pending, but that's OK. */
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
 
 	while (!dev->cancelled)
 		libusb_handle_events_completed(usb_context, &dev->cancelled);
@@ -768,13 +790,13 @@ static void *read_thread(void *param)
 	pthread_cond_broadcast(&dev->condition);
 	pthread_mutex_unlock(&dev->mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+	/* The transfer buffers and objects are cleaned up in hid_close().
+	   They are not cleaned up here because this thread could end
+	   either due to a disconnect or due to a user call to hid_close().
+	   In both cases the objects can be safely cleaned up after the
+	   call to pthread_join() (in hid_close()), but since hid_close()
+	   calls libusb_cancel_transfer(), on these objects, they can not
+	   be cleaned up here. */
 
 	return NULL;
 }
@@ -885,6 +907,26 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
+						/* Set up the input queue */
+						dev->num_transfers = INPUT_TRANSFERS_DEFAULT;
+						if (getenv("HIDAPI_LIBUSB_TRANSFERS") != NULL) {
+							dev->num_transfers = atoi(getenv("HIDAPI_LIBUSB_TRANSFERS"));
+							if (dev->num_transfers < 1)
+								dev->num_transfers = 1;
+							if (dev->num_transfers > INPUT_TRANSFERS_MAX)
+								dev->num_transfers = INPUT_TRANSFERS_MAX;
+						}
+						dev->input_ring.report_size = dev->input_ep_max_packet_size;
+						dev->input_ring.data = malloc(INPUT_RING_SIZE * dev->input_ring.report_size);
+						if (dev->input_ring.data == NULL) {
+							LOG("can't allocate input report ring\n");
+							free(dev_path);
+							libusb_release_interface(dev->device_handle, dev->interface);
+							libusb_close(dev->device_handle);
+							good_open = 0;
+							break;
+						}
+
 						pthread_create(&dev->thread, NULL, read_thread, dev);
 
 						/* Wait here for the read thread to be initialized. */
@@ -963,70 +1005,91 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
-/* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+/* Add a report to the input ring. Called from read_callback() only, the
+   single producer. */
+static void ring_push(hid_device *dev, const uint8_t *data, size_t length)
+{
+	struct input_ring *ring = &dev->input_ring;
+	unsigned int head = ring->head;
+	unsigned int slot = head & (INPUT_RING_SIZE - 1);
+
+	/* Never block the event thread, a full ring means the reader is
+	   not keeping up. */
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= INPUT_RING_SIZE) {
+		dev->reports_dropped++;
+		return;
+	}
+
+	if (length > ring->report_size)
+		length = ring->report_size;
+	memcpy(ring->data + slot * ring->report_size, data, length);
+	ring->len[slot] = length;
+	ring->time_ms[slot] = now_ms();
+
+	/* Publish the report, then wake the reader if it went to sleep.
+	   Sequentially consistent to pair with the store of reader_waiting
+	   in hid_read_timeout(), so the wakeup can not get lost. */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&dev->reader_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&dev->mutex);
+		pthread_cond_signal(&dev->condition);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+}
+
+/* Take the oldest report off the input ring, the single consumer.
+   Returns the number of bytes copied, or -1 if the ring is empty. */
+static int ring_pop(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
+	struct input_ring *ring = &dev->input_ring;
+	unsigned int tail = ring->tail;
+	unsigned int slot = tail & (INPUT_RING_SIZE - 1);
+	size_t len;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail)
+		return -1;
+
+	len = (length < ring->len[slot])? length: ring->len[slot];
 	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+		memcpy(data, ring->data + slot * ring->report_size, len);
+	if (now_ms() - ring->time_ms[slot] > INPUT_LATE_MS)
+		dev->reports_late++;
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
 	return len;
 }
 
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = param;
+	__atomic_store_n(&dev->reader_waiting, 0, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&dev->mutex);
 }
 
 
 int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
 {
-	int bytes_read = -1;
-
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
-
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
+	int bytes_read;
+	int res = 0;
+	struct timespec ts;
 
 	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	if ((bytes_read = ring_pop(dev, data, length)) >= 0)
+		return bytes_read;
 
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
 
-	if (milliseconds == -1) {
-		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			pthread_cond_wait(&dev->condition, &dev->mutex);
-		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
+	if (milliseconds == 0) {
+		/* Purely non-blocking */
+		return 0;
 	}
-	else if (milliseconds > 0) {
-		/* Non-blocking, but called with timeout. */
-		int res;
-		struct timespec ts;
+
+	if (milliseconds > 0) {
 		clock_gettime(CLOCK_REALTIME, &ts);
 		ts.tv_sec += milliseconds / 1000;
 		ts.tv_nsec += (milliseconds % 1000) * 1000000;
@@ -1034,40 +1097,32 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_sec++;
 			ts.tv_nsec -= 1000000000L;
 		}
+	}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	/* Tell ring_push() to wake us up, then look again, as a report
+	   might have been pushed in between. */
+	__atomic_store_n(&dev->reader_waiting, 1, __ATOMIC_SEQ_CST);
+	while ((bytes_read = ring_pop(dev, data, length)) < 0 &&
+	       !dev->shutdown_thread && res == 0) {
+		if (milliseconds == -1)
+			res = pthread_cond_wait(&dev->condition, &dev->mutex);
+		else
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
 
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
-				/* Timed out. */
-				bytes_read = 0;
-				break;
-			}
-			else {
-				/* Error. */
-				bytes_read = -1;
-				break;
-			}
-		}
+		/* Spurious wake ups and the read thread shutting down
+		   just run the loop again. */
 	}
-	else {
-		/* Purely non-blocking */
+
+	pthread_cleanup_pop(1);
+
+	if (bytes_read < 0 && res == ETIMEDOUT) {
+		/* Timed out. */
 		bytes_read = 0;
 	}
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
-
 	return bytes_read;
 }
 
@@ -1145,21 +1200,39 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 }
 
 
+int HID_API_EXPORT hid_get_input_stats(hid_device *dev, unsigned int *dropped, unsigned int *late)
+{
+	/* Counted on the event and reader threads, a snapshot will do. */
+	*dropped = __atomic_load_n(&dev->reports_dropped, __ATOMIC_RELAXED);
+	*late = __atomic_load_n(&dev->reports_late, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	int i;
+
 	if (!dev)
 		return;
 
 	/* Cause read_thread() to stop. */
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
 
 	/* Wait for read_thread() to end. */
 	pthread_join(dev->thread, NULL);
 
 	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	for (i = 0; i < dev->num_transfers; i++) {
+		free(dev->transfers[i]->buffer);
+		libusb_free_transfer(dev->transfers[i]);
+	}
+
+	if (dev->reports_dropped > 0 || dev->reports_late > 0)
+		LOG("%u input reports dropped, %u read late\n",
+		    dev->reports_dropped, dev->reports_late);
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1167,13 +1240,6 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-
 	free_hid_device(dev);
 }
 
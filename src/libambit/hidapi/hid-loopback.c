@@ -0,0 +1,212 @@
+/*******************************************************
+ HIDAPI in-memory loopback
+
+ Every report written to a device is queued and handed back by the
+ next read, untouched. There is no clock behind it, so the device uses
+ a product id libambit does not know and is skipped by
+ libambit_enumerate(). It is meant for timing the transport layer
+ itself, e.g. with "ambitbench transport".
+********************************************************/
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hidapi.h"
+
+/* Local definitions */
+#define LOOPBACK_PATH               "loopback:0"
+#define LOOPBACK_VENDOR_ID          0x1493
+#define LOOPBACK_PRODUCT_ID         0x0000
+#define LOOPBACK_REPORT_SIZE        64
+#define LOOPBACK_QUEUE_LEN          64 /* reports, power of two */
+
+struct hid_device_ {
+    uint8_t queue[LOOPBACK_QUEUE_LEN][LOOPBACK_REPORT_SIZE];
+    size_t queue_len[LOOPBACK_QUEUE_LEN];
+    unsigned int head;
+    unsigned int tail;
+};
+
+/* Static functions */
+static wchar_t *utf8_to_wchar_t(const char *utf8);
+
+
+int HID_API_EXPORT hid_init(void)
+{
+    return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+    return 0;
+}
+
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    struct hid_device_info *root = NULL; /* return object */
+
+    if ((vendor_id != 0 && vendor_id != LOOPBACK_VENDOR_ID) ||
+        (product_id != 0 && product_id != LOOPBACK_PRODUCT_ID)) {
+        return NULL;
+    }
+
+    root = malloc(sizeof(struct hid_device_info));
+    if (root != NULL) {
+        root->next = NULL;
+        root->path = strdup(LOOPBACK_PATH);
+        root->vendor_id = LOOPBACK_VENDOR_ID;
+        root->product_id = LOOPBACK_PRODUCT_ID;
+        root->serial_number = utf8_to_wchar_t("LOOPBACK");
+        root->release_number = 0x0;
+        root->interface_number = -1;
+        root->manufacturer_string = utf8_to_wchar_t("libambit");
+        root->product_string = utf8_to_wchar_t("Loopback");
+    }
+
+    return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+    struct hid_device_info *d = devs;
+    while (d) {
+        struct hid_device_info *next = d->next;
+        free(d->path);
+        free(d->serial_number);
+        free(d->manufacturer_string);
+        free(d->product_string);
+        free(d);
+        d = next;
+    }
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+    return hid_open_path(LOOPBACK_PATH);
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+    if (path == NULL || strcmp(path, LOOPBACK_PATH) != 0) {
+        return NULL;
+    }
+
+    return calloc(1, sizeof(hid_device));
+}
+
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+    unsigned int slot;
+
+    if (dev->head - dev->tail >= LOOPBACK_QUEUE_LEN) {
+        // Nobody is reading, drop like a full interrupt endpoint would
+        return -1;
+    }
+
+    if (length > LOOPBACK_REPORT_SIZE) {
+        length = LOOPBACK_REPORT_SIZE;
+    }
+    slot = dev->head++ & (LOOPBACK_QUEUE_LEN - 1);
+    memcpy(dev->queue[slot], data, length);
+    dev->queue_len[slot] = length;
+
+    return length;
+}
+
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+    unsigned int slot;
+
+    if (dev->tail == dev->head) {
+        // Nothing will arrive later either, so never block
+        return 0;
+    }
+
+    slot = dev->tail++ & (LOOPBACK_QUEUE_LEN - 1);
+    if (length > dev->queue_len[slot]) {
+        length = dev->queue_len[slot];
+    }
+    if (data != NULL) {
+        memcpy(data, dev->queue[slot], length);
+    }
+
+    return length;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+    return hid_read_timeout(dev, data, length, 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+    return 0; /* Success */
+}
+
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+    return 0;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+    return 0;
+}
+
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+    free(dev);
+}
+
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+    return NULL;
+}
+
+/* The caller must free the returned string with free(). */
+static wchar_t *utf8_to_wchar_t(const char *utf8)
+{
+    wchar_t *ret = NULL;
+
+    if (utf8) {
+        size_t wlen = mbstowcs(NULL, utf8, 0);
+        if ((size_t) -1 == wlen) {
+            return wcsdup(L"");
+        }
+        ret = calloc(wlen+1, sizeof(wchar_t));
+        mbstowcs(ret, utf8, wlen+1);
+        ret[wlen] = 0x0000;
+    }
+
+    return ret;
+}
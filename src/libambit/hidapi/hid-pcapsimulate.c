@@ -3,6 +3,13 @@
 
  Set PCAP-file to parse by setting environment variable
  HIDAPI_PCAPSIMULATE_FILENAME to the file path
+
+ The capture is loaded once. Classic pcap files are memory mapped,
+ other formats (pcapng) are read through libpcap into memory. All
+ first parts of messages are indexed by (command, direction, payload
+ hash), and every key keeps its own cursor, so a request is answered
+ by the next recorded exchange of the same kind without scanning the
+ capture.
 ********************************************************/
 
 /* C */
@@ -10,14 +17,42 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pcap/pcap.h>
 
 #include "hidapi.h"
 
 /* Local definitions */
+#define NO_PACKET ((size_t)-1)
+
+typedef struct capture_key_s {
+    uint16_t command;
+    uint8_t recv_not_send;
+    uint8_t match_data;                 /* data_hash is valid */
+    uint32_t data_hash;
+    uint32_t first;                     /* into capture.key_pkts */
+    uint32_t count;                     /* 0 for free slot */
+} capture_key_t;
+
+typedef struct capture_s {
+    void *map;
+    size_t map_len;
+    u_char *copy;                       /* reports read through libpcap */
+    const u_char **pkts;                /* 64 byte reports, in capture order */
+    size_t pkt_count;
+    size_t *next_reply;                 /* first receive part after each packet */
+    capture_key_t *keys;                /* open addressing hash table */
+    size_t key_slots;
+    uint32_t *key_pkts;                 /* packet indices, grouped by key */
+} capture_t;
+
 struct hid_device_ {
-    pcap_t *pcap;
-    char errbuf[PCAP_ERRBUF_SIZE];
+    uint32_t *key_cursors;              /* one per capture key slot */
+    size_t read_pos;
     uint16_t last_write_command;
     uint16_t last_sequence_number;
     uint8_t reading_parts;
@@ -31,15 +66,40 @@ typedef struct device_id_mappings_s {
     char *product;
 } device_id_mappings_t;
 
+typedef struct __attribute__((__packed__)) pcap_file_header_s {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_header_t;
+
+typedef struct __attribute__((__packed__)) pcap_record_header_s {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_header_t;
+
 // crc16.c
 uint16_t crc16_ccitt_false(unsigned char *buf, size_t buflen);
 uint16_t crc16_ccitt_false_init(unsigned char *buf, size_t buflen, uint16_t crc);
 
 /* Static functions */
-static pcap_t *pcap_file_reopen(pcap_t *old_pcap, char *errbuf);
-static const u_char *pcap_file_get_next(pcap_t *pcap);
-static const u_char *pcap_file_find_next_pkt(pcap_t *pcap, uint16_t command, uint8_t recv_not_send, const u_char *data);
-static uint16_t pcap_file_find_next_pkt_reass(pcap_t *pcap, uint16_t command, uint8_t recv_not_send, const u_char *data, u_char **buf);
+static int capture_load(capture_t *capture);
+static void capture_free(capture_t *capture);
+static int capture_load_mmap(capture_t *capture, const char *filename);
+static int capture_load_pcap(capture_t *capture, const char *filename);
+static int capture_add_pkt(capture_t *capture, const u_char *pktdata, size_t len, size_t *allocated);
+static int capture_index(capture_t *capture);
+static capture_key_t *capture_key_find(capture_t *capture, uint16_t command, uint8_t recv_not_send, uint8_t match_data, uint32_t data_hash, bool create);
+static size_t capture_find_pkt(capture_t *capture, hid_device *dev, uint16_t command, uint8_t recv_not_send, const u_char *data, size_t datalen);
+static uint16_t capture_find_pkt_reass(capture_t *capture, uint16_t command, uint8_t recv_not_send, u_char **buf);
+static uint32_t data_hash(const u_char *data, size_t len);
+static uint16_t pkt_command(const u_char *pkt);
+static uint8_t pkt_recv_not_send(const u_char *pkt);
 
 static hid_device *new_hid_device(void);
 static wchar_t *utf8_to_wchar_t(const char *utf8);
@@ -56,25 +116,27 @@ static device_id_mappings_t device_id_mapping[] = {
 };
 static const device_id_mappings_t *detected_device = NULL;
 static char *detected_device_serial = NULL;
+static capture_t capture;
+static bool capture_loaded = false;
 
 int HID_API_EXPORT hid_init(void)
 {
-    pcap_t *pcap;
-    char errbuf[PCAP_ERRBUF_SIZE];
     u_char *pktbuf;
     uint16_t pktbuf_len;
     char *model_string;
     char *serial_string;
     int i;
 
-    if (detected_device == NULL) {
-        pcap = pcap_file_reopen(NULL, errbuf);
-        if (pcap == NULL) {
+    if (!capture_loaded) {
+        if (capture_load(&capture) != 0) {
             return -1;
         }
+        capture_loaded = true;
+    }
 
+    if (detected_device == NULL) {
         // Try to find device info in PCAP file
-        pktbuf_len = pcap_file_find_next_pkt_reass(pcap, 0x0002, 1, NULL, &pktbuf);
+        pktbuf_len = capture_find_pkt_reass(&capture, 0x0002, 1, &pktbuf);
 
         if (pktbuf_len > 0) {
             model_string = (char*)pktbuf;
@@ -84,10 +146,11 @@ int HID_API_EXPORT hid_init(void)
             for (i=0; i<sizeof(device_id_mapping)/sizeof(device_id_mapping[0]); i++) {
                 if (strncmp(device_id_mapping[i].model, model_string, 16) == 0) {
                     detected_device = &device_id_mapping[i];
-                    detected_device_serial = malloc(17);
+                    detected_device_serial = calloc(1, 17);
                     strncpy(detected_device_serial, serial_string, 16);
                 }
             }
+            free(pktbuf);
         }
     }
 
@@ -96,6 +159,14 @@ int HID_API_EXPORT hid_init(void)
 
 int HID_API_EXPORT hid_exit(void)
 {
+    if (capture_loaded) {
+        capture_free(&capture);
+        capture_loaded = false;
+    }
+    free(detected_device_serial);
+    detected_device_serial = NULL;
+    detected_device = NULL;
+
     return 0;
 }
 
@@ -158,10 +229,15 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
     if (detected_device != NULL) {
         dev = new_hid_device();
-        dev->pcap = pcap_file_reopen(NULL, dev->errbuf);
-        if (dev->pcap == NULL) {
+        if (dev == NULL) {
             return NULL;
         }
+        dev->key_cursors = calloc(capture.key_slots, sizeof(uint32_t));
+        if (dev->key_cursors == NULL) {
+            free(dev);
+            return NULL;
+        }
+        dev->read_pos = NO_PACKET;
     }
 
     return dev;
@@ -170,7 +246,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
-    const u_char *pkt;
+    size_t pkt = NO_PACKET;
     uint16_t command;
     uint8_t pkt_part;
     uint8_t len;
@@ -182,32 +258,25 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 
     // If this is a contineous write, we have to assume this is just fine, do
     // nothing
-    if (pkt_part == 0x5d) {
-        // First try, search to end
-        pkt = pcap_file_find_next_pkt(dev->pcap, command, 0, len != 20 ? data + 20 : NULL);
-        if (pkt != NULL) {
-        }
-        // Second try, read from top
-        if (pkt == NULL) {
-            dev->pcap = pcap_file_reopen(dev->pcap, dev->errbuf);
-            pkt = pcap_file_find_next_pkt(dev->pcap, command, 0, len != 20 ? data + 20 : NULL);
-        }
-        if (pkt != NULL) {
-        }
-        // Third try, do not care about data
-        if (pkt == NULL) {
-            dev->pcap = pcap_file_reopen(dev->pcap, dev->errbuf);
-            pkt = pcap_file_find_next_pkt(dev->pcap, command, 0, NULL);
-        }
-        if (pkt != NULL) {
-        }
+    if (pkt_part != 0x5d) {
+        return length;
+    }
 
-        dev->last_write_command = command;
-        dev->last_sequence_number = le16toh(*(uint16_t*)(data + 14));
-        dev->reading_parts = 0;
+    // First try, same data
+    if (len > 20) {
+        pkt = capture_find_pkt(&capture, dev, command, 0, data + 20, len - 20);
+    }
+    // Second try, do not care about data
+    if (pkt == NO_PACKET) {
+        pkt = capture_find_pkt(&capture, dev, command, 0, NULL, 0);
     }
-    
-    return pkt != NULL ? 0 : -1;
+
+    dev->last_write_command = command;
+    dev->last_sequence_number = le16toh(*(uint16_t*)(data + 14));
+    dev->reading_parts = 0;
+    dev->read_pos = (pkt != NO_PACKET) ? capture.next_reply[pkt] : NO_PACKET;
+
+    return pkt != NO_PACKET ? length : -1;
 }
 
 
@@ -218,36 +287,31 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
     uint16_t *payload_crc, tmpcrc;
 
     // If we have already started to read parts, we should just continue with
-    // next valid packet, else we need to resolve first packet
-    if (dev->reading_parts) {
-        pkt = pcap_file_get_next(dev->pcap);
-    }
-    else {
-        // Search for next receive packet
-        pkt = pcap_file_find_next_pkt(dev->pcap, 0xffff, 1, NULL);
-    }
-
-    if (pkt != NULL) {
-        if (dev->reading_parts == 0) {
-            // If we found firstpacket, we need to rewrite sequence number and crc
-            memcpy(tmpbuf, pkt, 64);
-            *(uint16_t*)(tmpbuf + 14) = htole16(dev->last_sequence_number);
-            tmpcrc = crc16_ccitt_false(&tmpbuf[2], 4);
-            *(uint16_t*)(tmpbuf + 6) = htole16(tmpcrc);
-            payload_crc = (uint16_t *)&tmpbuf[tmpbuf[1]];
-            *payload_crc = htole16(crc16_ccitt_false_init(&tmpbuf[8], tmpbuf[3], tmpcrc));
-            pkt = tmpbuf;
-        }
-        dev->reading_parts = 1;
-        // Fix length
-        if (length > 64)
-            length = 64;
-        if (data != NULL) {
-            memcpy(data, pkt, length);
-        }
-        return length;
+    // next packet, the reply to last write was resolved in hid_write
+    if (dev->read_pos == NO_PACKET || dev->read_pos >= capture.pkt_count) {
+        return -1;
     }
-    return -1;
+
+    pkt = capture.pkts[dev->read_pos++];
+
+    if (dev->reading_parts == 0) {
+        // If we found firstpacket, we need to rewrite sequence number and crc
+        memcpy(tmpbuf, pkt, 64);
+        *(uint16_t*)(tmpbuf + 14) = htole16(dev->last_sequence_number);
+        tmpcrc = crc16_ccitt_false(&tmpbuf[2], 4);
+        *(uint16_t*)(tmpbuf + 6) = htole16(tmpcrc);
+        payload_crc = (uint16_t *)&tmpbuf[tmpbuf[1]];
+        *payload_crc = htole16(crc16_ccitt_false_init(&tmpbuf[8], tmpbuf[3], tmpcrc));
+        pkt = tmpbuf;
+    }
+    dev->reading_parts = 1;
+    // Fix length
+    if (length > 64)
+        length = 64;
+    if (data != NULL) {
+        memcpy(data, pkt, length);
+    }
+    return length;
 }
 
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
@@ -277,7 +341,8 @@ void HID_API_EXPORT hid_close(hid_device *dev)
     if (!dev)
         return;
 
-    pcap_close(dev->pcap);
+    free(dev->key_cursors);
+    free(dev);
 }
 
 
@@ -307,89 +372,326 @@ HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
     return NULL;
 }
 
-static pcap_t *pcap_file_reopen(pcap_t *old_pcap, char *errbuf)
+static int capture_load(capture_t *capture)
 {
     char *pcap_file;
-    pcap_t *pcap = NULL;
+    int ret = -1;
 
-    if (old_pcap != NULL) {
-        pcap_close(old_pcap);
-    }
+    memset(capture, 0, sizeof(capture_t));
 
     pcap_file = getenv("HIDAPI_PCAPSIMULATE_FILENAME");
-    if (pcap_file != NULL) {
-        pcap = pcap_open_offline(pcap_file, errbuf);
-        if (pcap == NULL) {
-            printf("Error: Failed to open pcap file %s\n", pcap_file);
-        }
-    }
-    else {
+    if (pcap_file == NULL) {
         printf("Error: No HIDAPI_PCAPSIMULATE_FILENAME variable defined\n");
+        return -1;
     }
 
-    return pcap;
+    ret = capture_load_mmap(capture, pcap_file);
+    if (ret > 0) {
+        // Not a classic pcap file, let libpcap have a go
+        ret = capture_load_pcap(capture, pcap_file);
+    }
+
+    if (ret == 0) {
+        ret = capture_index(capture);
+    }
+
+    if (ret != 0) {
+        printf("Error: Failed to open pcap file %s\n", pcap_file);
+        capture_free(capture);
+    }
+
+    return ret;
+}
+
+static void capture_free(capture_t *capture)
+{
+    if (capture->map != NULL) {
+        munmap(capture->map, capture->map_len);
+    }
+    free(capture->copy);
+    free(capture->pkts);
+    free(capture->next_reply);
+    free(capture->keys);
+    free(capture->key_pkts);
+    memset(capture, 0, sizeof(capture_t));
 }
 
-static const u_char *pcap_file_get_next(pcap_t *pcap)
+/**
+ * Map a classic pcap file and collect its reports in place
+ * \return 0 on success, 1 if not a classic pcap file, else -1
+ */
+static int capture_load_mmap(capture_t *capture, const char *filename)
 {
-    struct pcap_pkthdr h;
-    const u_char *pktdata;
-    size_t data_offset;
+    const pcap_file_header_t *file_header;
+    pcap_record_header_t record;
+    const u_char *ptr, *end;
+    size_t allocated = 0;
+    bool swapped;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(pcap_file_header_t)) {
+        close(fd);
+        return -1;
+    }
 
-    do {
-        pktdata = pcap_next(pcap, &h);
-        if (h.len == 128 || h.len == 91) { // Linux USB vs USBPcap
-            data_offset = h.len - 64;
-            if (pktdata[data_offset] == 0x3f) { // Sanity check, first byte
-                return pktdata + data_offset;
-            }
+    capture->map_len = st.st_size;
+    capture->map = mmap(NULL, capture->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (capture->map == MAP_FAILED) {
+        capture->map = NULL;
+        return -1;
+    }
+    madvise(capture->map, capture->map_len, MADV_WILLNEED);
+
+    file_header = (const pcap_file_header_t *)capture->map;
+    switch (file_header->magic) {
+      case 0xa1b2c3d4:                  /* usec */
+      case 0xa1b23c4d:                  /* nsec */
+        swapped = false;
+        break;
+      case 0xd4c3b2a1:
+      case 0x4d3cb2a1:
+        swapped = true;
+        break;
+      default:
+        munmap(capture->map, capture->map_len);
+        capture->map = NULL;
+        return 1;
+    }
+
+    ptr = (const u_char *)capture->map + sizeof(pcap_file_header_t);
+    end = (const u_char *)capture->map + capture->map_len;
+    while (ptr + sizeof(pcap_record_header_t) <= end) {
+        memcpy(&record, ptr, sizeof(record));
+        if (swapped) {
+            record.incl_len = __builtin_bswap32(record.incl_len);
         }
-    } while(pktdata != NULL);
+        ptr += sizeof(pcap_record_header_t);
+        if (ptr + record.incl_len > end) {
+            break;
+        }
+        if (capture_add_pkt(capture, ptr, record.incl_len, &allocated) != 0) {
+            return -1;
+        }
+        ptr += record.incl_len;
+    }
 
-    return NULL;
+    return 0;
 }
 
-static const u_char *pcap_file_find_next_pkt(pcap_t *pcap, uint16_t command, uint8_t recv_not_send, const u_char *data)
+static int capture_load_pcap(capture_t *capture, const char *filename)
 {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr *h;
     const u_char *pktdata;
+    size_t allocated = 0, copied = 0, copy_allocated = 0;
+    u_char *tmp;
+    pcap_t *pcap;
+    size_t i;
+
+    pcap = pcap_open_offline(filename, errbuf);
+    if (pcap == NULL) {
+        return -1;
+    }
 
-    do {
-        pktdata = pcap_file_get_next(pcap);
-        if (pktdata != NULL) {
-            uint8_t len = pktdata[1];
-            uint8_t pkttype = pktdata[2];
-            uint16_t pktcommand = be16toh(*(uint16_t*)(pktdata + 8));
-            uint8_t send_recv = (pktdata[10] & 0x03) >> 1;
-            if (pkttype == 0x5d &&
-                (command == 0xffff || pktcommand == command) &&
-                send_recv == recv_not_send) {
-                if (data != NULL) {
-                    // Compare data as well
-                    if (memcmp(data, pktdata + 20, len - 20) == 0) {
-                        break;
-                    }
+    // Keep reports in one buffer, pointers are fixed up once it stops moving
+    while (pcap_next_ex(pcap, &h, &pktdata) == 1) {
+        if (capture_add_pkt(capture, pktdata, h->caplen, &allocated) != 0) {
+            pcap_close(pcap);
+            return -1;
+        }
+        if (capture->pkt_count > copied) {
+            if (copied == copy_allocated) {
+                copy_allocated = copy_allocated ? 2*copy_allocated : 1024;
+                tmp = realloc(capture->copy, 64*copy_allocated);
+                if (tmp == NULL) {
+                    pcap_close(pcap);
+                    return -1;
                 }
-                else {
-                    break;
+                capture->copy = tmp;
+            }
+            memcpy(capture->copy + 64*copied, capture->pkts[copied], 64);
+            copied++;
+        }
+    }
+    pcap_close(pcap);
+
+    for (i=0; i<capture->pkt_count; i++) {
+        capture->pkts[i] = capture->copy + 64*i;
+    }
+
+    return 0;
+}
+
+static int capture_add_pkt(capture_t *capture, const u_char *pktdata, size_t len, size_t *allocated)
+{
+    const u_char **tmp;
+    size_t data_offset;
+
+    if (len == 128 || len == 91) { // Linux USB vs USBPcap
+        data_offset = len - 64;
+        if (pktdata[data_offset] == 0x3f) { // Sanity check, first byte
+            if (capture->pkt_count == *allocated) {
+                *allocated = *allocated ? 2*(*allocated) : 1024;
+                tmp = realloc(capture->pkts, *allocated * sizeof(const u_char *));
+                if (tmp == NULL) {
+                    return -1;
                 }
+                capture->pkts = tmp;
             }
+            capture->pkts[capture->pkt_count++] = pktdata + data_offset;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Build reply lookup and key index over the collected reports
+ */
+static int capture_index(capture_t *capture)
+{
+    capture_key_t *key;
+    size_t next = NO_PACKET, first = 0, i;
+    const u_char *pkt;
+    uint32_t *fill;
+
+    capture->next_reply = malloc((capture->pkt_count + 1) * sizeof(size_t));
+    // Load factor below 0.5 even if every packet got a key of its own
+    for (capture->key_slots = 64; capture->key_slots < 4*capture->pkt_count; capture->key_slots *= 2);
+    capture->keys = calloc(capture->key_slots, sizeof(capture_key_t));
+    capture->key_pkts = malloc((2*capture->pkt_count + 1) * sizeof(uint32_t));
+    fill = calloc(capture->key_slots, sizeof(uint32_t));
+    if (capture->next_reply == NULL || capture->keys == NULL || capture->key_pkts == NULL || fill == NULL) {
+        free(fill);
+        return -1;
+    }
+
+    for (i=capture->pkt_count; i-- > 0; ) {
+        capture->next_reply[i] = next;
+        pkt = capture->pkts[i];
+        if (pkt[2] == 0x5d && pkt_recv_not_send(pkt) == 1) {
+            next = i;
+        }
+    }
+
+    // Count packets per key, every first part goes under its exact key and
+    // under the "any data" key of its command
+    for (i=0; i<capture->pkt_count; i++) {
+        pkt = capture->pkts[i];
+        if (pkt[2] != 0x5d) {
+            continue;
+        }
+        if (pkt[1] > 20) {
+            capture_key_find(capture, pkt_command(pkt), pkt_recv_not_send(pkt), 1, data_hash(pkt + 20, pkt[1] - 20), true)->count++;
+        }
+        capture_key_find(capture, pkt_command(pkt), pkt_recv_not_send(pkt), 0, 0, true)->count++;
+    }
+
+    for (i=0; i<capture->key_slots; i++) {
+        capture->keys[i].first = first;
+        first += capture->keys[i].count;
+    }
+
+    for (i=0; i<capture->pkt_count; i++) {
+        pkt = capture->pkts[i];
+        if (pkt[2] != 0x5d) {
+            continue;
+        }
+        if (pkt[1] > 20) {
+            key = capture_key_find(capture, pkt_command(pkt), pkt_recv_not_send(pkt), 1, data_hash(pkt + 20, pkt[1] - 20), false);
+            capture->key_pkts[key->first + fill[key - capture->keys]++] = i;
+        }
+        key = capture_key_find(capture, pkt_command(pkt), pkt_recv_not_send(pkt), 0, 0, false);
+        capture->key_pkts[key->first + fill[key - capture->keys]++] = i;
+    }
+
+    free(fill);
+
+    return 0;
+}
+
+static capture_key_t *capture_key_find(capture_t *capture, uint16_t command, uint8_t recv_not_send, uint8_t match_data, uint32_t data_hash, bool create)
+{
+    size_t mask = capture->key_slots - 1;
+    size_t slot = ((command * 0x9e3779b1u) ^ data_hash ^ (recv_not_send << 16) ^ (match_data << 17)) & mask;
+    capture_key_t *key;
+
+    for (;;) {
+        key = &capture->keys[slot];
+        if (key->count == 0 && !create) {
+            return NULL;
+        }
+        if (key->count == 0 ||
+            (key->command == command && key->recv_not_send == recv_not_send &&
+             key->match_data == match_data && key->data_hash == data_hash)) {
+            break;
         }
-    } while(pktdata != NULL);
+        slot = (slot + 1) & mask;
+    }
+
+    if (key->count == 0) {
+        key->command = command;
+        key->recv_not_send = recv_not_send;
+        key->match_data = match_data;
+        key->data_hash = data_hash;
+    }
 
-    return pktdata;
+    return key;
 }
 
-static uint16_t pcap_file_find_next_pkt_reass(pcap_t *pcap, uint16_t command, uint8_t recv_not_send, const u_char *data, u_char **buf)
+/**
+ * Next recorded packet of a kind. Cursors wrap, so the replay starts over
+ * from the top when a key runs out
+ */
+static size_t capture_find_pkt(capture_t *capture, hid_device *dev, uint16_t command, uint8_t recv_not_send, const u_char *data, size_t datalen)
 {
+    capture_key_t *key;
+    uint32_t *cursor;
+    size_t pkt, tries;
+
+    if (capture->key_slots == 0) {
+        return NO_PACKET;
+    }
+
+    key = capture_key_find(capture, command, recv_not_send, data != NULL, data != NULL ? data_hash(data, datalen) : 0, false);
+    if (key == NULL) {
+        return NO_PACKET;
+    }
+
+    cursor = &dev->key_cursors[key - capture->keys];
+    for (tries=0; tries<key->count; tries++) {
+        pkt = capture->key_pkts[key->first + *cursor];
+        *cursor = (*cursor + 1) % key->count;
+        // Rule out hash collisions
+        if (data == NULL || memcmp(data, capture->pkts[pkt] + 20, datalen) == 0) {
+            return pkt;
+        }
+    }
+
+    return NO_PACKET;
+}
+
+static uint16_t capture_find_pkt_reass(capture_t *capture, uint16_t command, uint8_t recv_not_send, u_char **buf)
+{
+    capture_key_t *key;
     const u_char *pkt;
     u_char *retbuf = NULL;
     uint16_t retlen = 0;
     uint16_t msg_parts, msg_part;
     uint16_t pkts_captured = 1;
+    size_t pkt_index;
 
-    pkt = pcap_file_find_next_pkt(pcap, command, recv_not_send, data);
+    key = capture_key_find(capture, command, recv_not_send, 0, 0, false);
+
+    if (key != NULL) {
+        pkt_index = capture->key_pkts[key->first];
+        pkt = capture->pkts[pkt_index];
 
-    if (pkt != NULL) {
         // Check how many packets this entry should consist of
         msg_parts = le16toh(*(uint16_t*)(pkt + 4));
         retlen = le32toh(*(uint32_t*)(pkt + 16));
@@ -398,15 +700,17 @@ static uint16_t pcap_file_find_next_pkt_reass(pcap_t *pcap, uint16_t command, ui
         if (retbuf != NULL) {
             memcpy(retbuf, pkt + 20, 44);
             while (msg_parts > pkts_captured) {
-                pkt = pcap_file_get_next(pcap);
-                if (pkt == NULL) {
+                if (++pkt_index >= capture->pkt_count) {
                     free(retbuf);
                     retbuf = NULL;
                     retlen = 0;
                     break;
                 }
+                pkt = capture->pkts[pkt_index];
                 msg_part = le16toh(*(uint16_t*)(pkt + 4));
-                memcpy(retbuf + 44 + 56*(msg_part-1), pkt + 8, 56);
+                if (msg_part >= 1 && msg_part < msg_parts) {
+                    memcpy(retbuf + 44 + 56*(msg_part-1), pkt + 8, 56);
+                }
                 pkts_captured++;
             }
         }
@@ -416,6 +720,30 @@ static uint16_t pcap_file_find_next_pkt_reass(pcap_t *pcap, uint16_t command, ui
     return retlen;
 }
 
+/* FNV-1a */
+static uint32_t data_hash(const u_char *data, size_t len)
+{
+    uint32_t hash = 0x811c9dc5;
+    size_t i;
+
+    for (i=0; i<len; i++) {
+        hash ^= data[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static uint16_t pkt_command(const u_char *pkt)
+{
+    return be16toh(*(uint16_t*)(pkt + 8));
+}
+
+static uint8_t pkt_recv_not_send(const u_char *pkt)
+{
+    return (pkt[10] & 0x03) >> 1;
+}
+
 static hid_device *new_hid_device(void)
 {
     hid_device *dev = calloc(1, sizeof(hid_device));
@@ -0,0 +1,715 @@
+/*******************************************************
+ HIDAPI replay of a recorded session
+
+ Plays back a file written by libambit with LIBAMBIT_RECORD set (see
+ record.h for the format) as if the recorded clock was connected.
+ Behaviour is set by environment variables:
+
+   HIDAPI_REPLAY_FILENAME  recording to play back
+   HIDAPI_REPLAY_SPEED     original (default) hands out each reply the
+                           time after the request that the clock took
+                           when recording, max hands it out at once
+
+ Requests are matched to the next recorded request with the same
+ command, preferring one with the same payload, so a sync that skips
+ some logs still gets the right replies. When a device is closed, the
+ time spent per command, recorded and replayed, is printed to stderr.
+********************************************************/
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hidapi.h"
+#include "../record.h"
+
+/* Local definitions */
+#define NO_RECORD ((uint32_t)-1)
+#define COMMANDS  0x10000
+
+typedef struct replay_record_s {
+    uint8_t type;
+    uint8_t len;                        /* of report */
+    uint64_t time_us;                   /* since start of recording */
+    const uint8_t *data;                /* report, or payload */
+    uint32_t next_same;                 /* next write of the same command */
+} replay_record_t;
+
+typedef struct replay_s {
+    void *map;
+    size_t map_len;
+    replay_record_t *records;
+    size_t record_count;
+    uint32_t *first_write;              /* per command */
+    struct hid_device_info *devices;
+    bool original_speed;
+} replay_t;
+
+typedef struct replay_stats_s {
+    uint16_t command;
+    uint32_t count;
+    uint64_t recorded_us;
+    uint64_t replayed_us;
+} replay_stats_t;
+
+struct hid_device_ {
+    uint32_t *cursors;                  /* per command, next write to use */
+    uint32_t read_pos;                  /* next reply record */
+    uint16_t last_sequence_number;
+    bool nonblocking;
+
+    /* Request in progress */
+    bool phase_active;
+    uint16_t phase_command;
+    uint64_t phase_start_us;
+    uint64_t phase_end_us;
+    uint64_t phase_rec_start_us;
+    uint64_t phase_rec_end_us;
+
+    replay_stats_t *stats;
+    size_t stats_count;
+    size_t stats_allocated;
+};
+
+// crc16.c
+uint16_t crc16_ccitt_false(unsigned char *buf, size_t buflen);
+uint16_t crc16_ccitt_false_init(unsigned char *buf, size_t buflen, uint16_t crc);
+
+/* Static functions */
+static int replay_load(replay_t *replay);
+static void replay_free(replay_t *replay);
+static int replay_parse(replay_t *replay, const uint8_t *ptr, const uint8_t *end);
+static int replay_add_device(replay_t *replay, const uint8_t **ptr, const uint8_t *end);
+static uint32_t replay_find_write(hid_device *dev, uint16_t command, const uint8_t *data, size_t datalen);
+static void replay_phase_end(hid_device *dev);
+static void replay_print_stats(hid_device *dev);
+static int read_varint(const uint8_t **ptr, const uint8_t *end, uint64_t *value);
+static char *read_string(const uint8_t **ptr, const uint8_t *end);
+static uint64_t now_us(void);
+
+static wchar_t *utf8_to_wchar_t(const char *utf8);
+
+
+/* Static data */
+static replay_t replay;
+static bool replay_loaded = false;
+
+int HID_API_EXPORT hid_init(void)
+{
+    if (!replay_loaded) {
+        if (replay_load(&replay) != 0) {
+            return -1;
+        }
+        replay_loaded = true;
+    }
+
+    return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+    if (replay_loaded) {
+        replay_free(&replay);
+        replay_loaded = false;
+    }
+
+    return 0;
+}
+
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    struct hid_device_info *root = NULL; /* return object */
+    struct hid_device_info *cur_dev = NULL;
+    struct hid_device_info *recorded, *tmp;
+
+    if (hid_init() != 0) {
+        return NULL;
+    }
+
+    for (recorded = replay.devices; recorded != NULL; recorded = recorded->next) {
+        if ((vendor_id != 0 && vendor_id != recorded->vendor_id) ||
+            (product_id != 0 && product_id != recorded->product_id)) {
+            continue;
+        }
+
+        tmp = malloc(sizeof(struct hid_device_info));
+        if (tmp == NULL) {
+            break;
+        }
+        memcpy(tmp, recorded, sizeof(struct hid_device_info));
+        tmp->next = NULL;
+        tmp->path = strdup(recorded->path);
+        tmp->serial_number = wcsdup(recorded->serial_number);
+        tmp->manufacturer_string = wcsdup(recorded->manufacturer_string);
+        tmp->product_string = wcsdup(recorded->product_string);
+
+        if (cur_dev) {
+            cur_dev->next = tmp;
+        }
+        else {
+            root = tmp;
+        }
+        cur_dev = tmp;
+    }
+
+    return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+    struct hid_device_info *d = devs;
+    while (d) {
+        struct hid_device_info *next = d->next;
+        free(d->path);
+        free(d->serial_number);
+        free(d->manufacturer_string);
+        free(d->product_string);
+        free(d);
+        d = next;
+    }
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+    return hid_open_path(NULL);
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+    hid_device *dev = NULL;
+
+    if (hid_init() != 0 || replay.devices == NULL) {
+        return NULL;
+    }
+
+    dev = calloc(1, sizeof(hid_device));
+    if (dev == NULL) {
+        return NULL;
+    }
+    dev->cursors = calloc(COMMANDS, sizeof(uint32_t));
+    if (dev->cursors == NULL) {
+        free(dev);
+        return NULL;
+    }
+    dev->read_pos = NO_RECORD;
+
+    return dev;
+}
+
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+    uint16_t command;
+    uint32_t rec;
+    size_t datalen = 0;
+
+    // Later parts of a message go with the first one
+    if (length < 20 || data[2] != 0x5d) {
+        return length;
+    }
+
+    command = be16toh(*(uint16_t*)(data + 8));
+    if (data[3] > 12 && data[3] - 12 <= length - 20) {
+        datalen = data[3] - 12;
+    }
+
+    replay_phase_end(dev);
+
+    rec = replay_find_write(dev, command, data + 20, datalen);
+    if (rec == NO_RECORD) {
+        dev->read_pos = NO_RECORD;
+        return -1;
+    }
+
+    dev->read_pos = rec + 1;
+    dev->last_sequence_number = le16toh(*(uint16_t*)(data + 14));
+    dev->phase_active = true;
+    dev->phase_command = command;
+    dev->phase_start_us = dev->phase_end_us = now_us();
+    dev->phase_rec_start_us = dev->phase_rec_end_us = replay.records[rec].time_us;
+
+    return length;
+}
+
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+    const replay_record_t *rec;
+    uint8_t tmpbuf[64];
+    uint16_t *payload_crc, tmpcrc;
+    uint64_t due, now;
+
+    if (dev->read_pos == NO_RECORD || dev->read_pos >= replay.record_count) {
+        return -1;
+    }
+    rec = &replay.records[dev->read_pos];
+    if (rec->type != RECORD_READ && rec->type != RECORD_READ_ERROR) {
+        // The clock sent no more than this
+        return -1;
+    }
+
+    if (replay.original_speed) {
+        due = dev->phase_start_us + (rec->time_us - dev->phase_rec_start_us);
+        now = now_us();
+        // Also non blocking reads wait, the recorded delay already holds
+        // the polling of the recording host
+        if (now < due) {
+            if (milliseconds > 0 && due - now > (uint64_t)milliseconds * 1000) {
+                usleep(milliseconds * 1000);
+                return 0;
+            }
+            usleep(due - now);
+        }
+    }
+
+    dev->read_pos++;
+    dev->phase_end_us = now_us();
+    dev->phase_rec_end_us = rec->time_us;
+
+    if (rec->type == RECORD_READ_ERROR) {
+        return -1;
+    }
+
+    memset(tmpbuf, 0, sizeof(tmpbuf));
+    memcpy(tmpbuf, rec->data, rec->len < 64 ? rec->len : 64);
+    if (tmpbuf[2] == 0x5d && tmpbuf[1] <= 62) {
+        // First part, answer the sequence number actually asked for
+        *(uint16_t*)(tmpbuf + 14) = htole16(dev->last_sequence_number);
+        tmpcrc = crc16_ccitt_false(&tmpbuf[2], 4);
+        *(uint16_t*)(tmpbuf + 6) = htole16(tmpcrc);
+        payload_crc = (uint16_t *)&tmpbuf[tmpbuf[1]];
+        *payload_crc = htole16(crc16_ccitt_false_init(&tmpbuf[8], tmpbuf[3], tmpcrc));
+    }
+
+    // Fix length
+    if (length > 64)
+        length = 64;
+    if (data != NULL) {
+        memcpy(data, tmpbuf, length);
+    }
+    return length;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+    return hid_read_timeout(dev, data, length, dev->nonblocking ? 0 : -1);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+    dev->nonblocking = nonblock;
+
+    return 0; /* Success */
+}
+
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+    return 0;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+    return 0;
+}
+
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+    if (!dev)
+        return;
+
+    replay_phase_end(dev);
+    replay_print_stats(dev);
+
+    free(dev->stats);
+    free(dev->cursors);
+    free(dev);
+}
+
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
+{
+    return -1;
+}
+
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+    return NULL;
+}
+
+static int replay_load(replay_t *replay)
+{
+    const char *filename, *speed;
+    const uint8_t *ptr;
+    struct stat st;
+    int fd;
+
+    memset(replay, 0, sizeof(replay_t));
+
+    // Quietly unavailable, the transport may just be probed
+    filename = getenv("HIDAPI_REPLAY_FILENAME");
+    if (filename == NULL) {
+        return -1;
+    }
+    speed = getenv("HIDAPI_REPLAY_SPEED");
+    replay->original_speed = speed == NULL || strcmp(speed, "max") != 0;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        printf("Error: Failed to open replay file %s\n", filename);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < RECORD_MAGIC_LEN + 1) {
+        printf("Error: Replay file %s is too short\n", filename);
+        close(fd);
+        return -1;
+    }
+    replay->map_len = st.st_size;
+    replay->map = mmap(NULL, replay->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (replay->map == MAP_FAILED) {
+        replay->map = NULL;
+        return -1;
+    }
+
+    ptr = replay->map;
+    if (memcmp(ptr, RECORD_MAGIC, RECORD_MAGIC_LEN) != 0 || ptr[RECORD_MAGIC_LEN] != RECORD_VERSION) {
+        printf("Error: %s is not a version %d recording\n", filename, RECORD_VERSION);
+        replay_free(replay);
+        return -1;
+    }
+
+    if (replay_parse(replay, ptr + RECORD_MAGIC_LEN + 1, ptr + replay->map_len) != 0) {
+        printf("Error: Failed to parse replay file %s\n", filename);
+        replay_free(replay);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void replay_free(replay_t *replay)
+{
+    if (replay->map != NULL) {
+        munmap(replay->map, replay->map_len);
+    }
+    free(replay->records);
+    free(replay->first_write);
+    hid_free_enumeration(replay->devices);
+    memset(replay, 0, sizeof(replay_t));
+}
+
+/**
+ * Collect records and chain the writes of each command. A truncated last
+ * record, e.g. from a crash while recording, is dropped.
+ */
+static int replay_parse(replay_t *replay, const uint8_t *ptr, const uint8_t *end)
+{
+    replay_record_t *rec, *tmp;
+    uint32_t *last_write;
+    size_t allocated = 0;
+    uint64_t delta, time_us = 0;
+    uint16_t command;
+    uint32_t i;
+    char *path;
+
+    replay->first_write = malloc(COMMANDS * sizeof(uint32_t));
+    last_write = malloc(COMMANDS * sizeof(uint32_t));
+    if (replay->first_write == NULL || last_write == NULL) {
+        free(last_write);
+        return -1;
+    }
+    memset(replay->first_write, 0xff, COMMANDS * sizeof(uint32_t));
+    memset(last_write, 0xff, COMMANDS * sizeof(uint32_t));
+
+    while (ptr < end) {
+        if (replay->record_count == allocated) {
+            allocated = allocated ? 2*allocated : 4096;
+            tmp = realloc(replay->records, allocated * sizeof(replay_record_t));
+            if (tmp == NULL) {
+                free(last_write);
+                return -1;
+            }
+            replay->records = tmp;
+        }
+        rec = &replay->records[replay->record_count];
+        memset(rec, 0, sizeof(replay_record_t));
+        rec->next_same = NO_RECORD;
+
+        rec->type = *ptr++;
+        if (read_varint(&ptr, end, &delta) != 0) {
+            break;
+        }
+        time_us += delta;
+        rec->time_us = time_us;
+
+        if (rec->type == RECORD_WRITE || rec->type == RECORD_READ) {
+            if (ptr >= end || ptr + 1 + *ptr > end) {
+                break;
+            }
+            rec->len = *ptr++;
+            rec->data = ptr;
+            ptr += rec->len;
+        }
+        else if (rec->type == RECORD_DEVICE) {
+            if (replay_add_device(replay, &ptr, end) != 0) {
+                break;
+            }
+            continue;
+        }
+        else if (rec->type == RECORD_OPEN) {
+            if ((path = read_string(&ptr, end)) == NULL) {
+                break;
+            }
+            free(path);
+            continue;
+        }
+        else if (rec->type != RECORD_CLOSE && rec->type != RECORD_READ_ERROR) {
+            free(last_write);
+            return -1;
+        }
+
+        // First parts of requests are chained per command
+        if (rec->type == RECORD_WRITE && rec->len >= 20 && rec->data[2] == 0x5d) {
+            i = replay->record_count;
+            command = be16toh(*(uint16_t*)(rec->data + 8));
+            if (last_write[command] == NO_RECORD) {
+                replay->first_write[command] = i;
+            }
+            else {
+                replay->records[last_write[command]].next_same = i;
+            }
+            last_write[command] = i;
+        }
+        replay->record_count++;
+    }
+
+    free(last_write);
+
+    return 0;
+}
+
+/**
+ * Add device to the enumeration, unless its path is already there
+ */
+static int replay_add_device(replay_t *replay, const uint8_t **ptr, const uint8_t *end)
+{
+    struct hid_device_info *dev, **last;
+    char *strings[4];
+    int i;
+
+    if (*ptr + 6 > end) {
+        return -1;
+    }
+    dev = calloc(1, sizeof(struct hid_device_info));
+    if (dev == NULL) {
+        return -1;
+    }
+    dev->vendor_id = (*ptr)[0] | ((*ptr)[1] << 8);
+    dev->product_id = (*ptr)[2] | ((*ptr)[3] << 8);
+    dev->release_number = (*ptr)[4] | ((*ptr)[5] << 8);
+    dev->interface_number = -1;
+    *ptr += 6;
+
+    for (i=0; i<4; i++) {
+        if ((strings[i] = read_string(ptr, end)) == NULL) {
+            while (i-- > 0) {
+                free(strings[i]);
+            }
+            free(dev);
+            return -1;
+        }
+    }
+    dev->path = strings[0];
+    dev->serial_number = utf8_to_wchar_t(strings[1]);
+    dev->manufacturer_string = utf8_to_wchar_t(strings[2]);
+    dev->product_string = utf8_to_wchar_t(strings[3]);
+    for (i=1; i<4; i++) {
+        free(strings[i]);
+    }
+
+    for (last = &replay->devices; *last != NULL; last = &(*last)->next) {
+        if (strcmp((*last)->path, dev->path) == 0) {
+            hid_free_enumeration(dev);
+            return 0;
+        }
+    }
+    *last = dev;
+
+    return 0;
+}
+
+/**
+ * Find the recorded request to answer from. Starts at the command's
+ * cursor and takes the first one with the same payload, else the one at
+ * the cursor. Wraps around when the recording runs out, so that status
+ * polls keep getting answers.
+ */
+static uint32_t replay_find_write(hid_device *dev, uint16_t command, const uint8_t *data, size_t datalen)
+{
+    const replay_record_t *rec;
+    uint32_t start, i;
+
+    start = dev->cursors[command] != 0 ? dev->cursors[command] - 1 : replay.first_write[command];
+    if (start == NO_RECORD) {
+        return NO_RECORD;
+    }
+
+    for (i = start; i != NO_RECORD; i = rec->next_same) {
+        rec = &replay.records[i];
+        if (rec->len >= 20 && (size_t)rec->data[3] == datalen + 12 &&
+            rec->len >= 20 + datalen && memcmp(rec->data + 20, data, datalen) == 0) {
+            break;
+        }
+    }
+    if (i == NO_RECORD) {
+        i = start;
+    }
+
+    dev->cursors[command] = replay.records[i].next_same != NO_RECORD ? replay.records[i].next_same + 1 : 0;
+
+    return i;
+}
+
+static void replay_phase_end(hid_device *dev)
+{
+    replay_stats_t *stats = NULL, *tmp;
+    size_t i;
+
+    if (!dev->phase_active) {
+        return;
+    }
+    dev->phase_active = false;
+
+    for (i=0; i<dev->stats_count; i++) {
+        if (dev->stats[i].command == dev->phase_command) {
+            stats = &dev->stats[i];
+            break;
+        }
+    }
+    if (stats == NULL) {
+        if (dev->stats_count == dev->stats_allocated) {
+            dev->stats_allocated = dev->stats_allocated ? 2*dev->stats_allocated : 16;
+            tmp = realloc(dev->stats, dev->stats_allocated * sizeof(replay_stats_t));
+            if (tmp == NULL) {
+                return;
+            }
+            dev->stats = tmp;
+        }
+        stats = &dev->stats[dev->stats_count++];
+        memset(stats, 0, sizeof(replay_stats_t));
+        stats->command = dev->phase_command;
+    }
+
+    stats->count++;
+    stats->recorded_us += dev->phase_rec_end_us - dev->phase_rec_start_us;
+    stats->replayed_us += dev->phase_end_us - dev->phase_start_us;
+}
+
+static void replay_print_stats(hid_device *dev)
+{
+    uint64_t recorded_us = 0, replayed_us = 0;
+    uint32_t count = 0;
+    size_t i;
+
+    if (dev->stats_count == 0) {
+        return;
+    }
+
+    fprintf(stderr, "replay: command    count  recorded ms  replayed ms\n");
+    for (i=0; i<dev->stats_count; i++) {
+        fprintf(stderr, "replay:  0x%04x %8u %12.1f %12.1f\n", dev->stats[i].command, dev->stats[i].count,
+                dev->stats[i].recorded_us / 1000.0, dev->stats[i].replayed_us / 1000.0);
+        count += dev->stats[i].count;
+        recorded_us += dev->stats[i].recorded_us;
+        replayed_us += dev->stats[i].replayed_us;
+    }
+    fprintf(stderr, "replay:  total  %8u %12.1f %12.1f\n", count, recorded_us / 1000.0, replayed_us / 1000.0);
+}
+
+static int read_varint(const uint8_t **ptr, const uint8_t *end, uint64_t *value)
+{
+    int shift = 0;
+
+    *value = 0;
+    while (*ptr < end && shift < 64) {
+        *value |= (uint64_t)(**ptr & 0x7f) << shift;
+        if ((*(*ptr)++ & 0x80) == 0) {
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+/* The caller must free the returned string with free(). */
+static char *read_string(const uint8_t **ptr, const uint8_t *end)
+{
+    uint64_t len;
+    char *str;
+
+    if (read_varint(ptr, end, &len) != 0 || len > (uint64_t)(end - *ptr)) {
+        return NULL;
+    }
+    if ((str = malloc(len + 1)) != NULL) {
+        memcpy(str, *ptr, len);
+        str[len] = '\0';
+    }
+    *ptr += len;
+
+    return str;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The caller must free the returned string with free(). */
+static wchar_t *utf8_to_wchar_t(const char *utf8)
+{
+    wchar_t *ret = NULL;
+
+    if (utf8) {
+        size_t wlen = mbstowcs(NULL, utf8, 0);
+        if ((size_t) -1 == wlen) {
+            return wcsdup(L"");
+        }
+        ret = calloc(wlen+1, sizeof(wchar_t));
+        mbstowcs(ret, utf8, wlen+1);
+        ret[wlen] = 0x0000;
+    }
+
+    return ret;
+}
@@ -39,6 +39,33 @@
 
 #define HID_API_EXPORT_CALL HID_API_EXPORT HID_API_CALL /**< API export and call macro*/
 
+/* libambit links several backends into one library. Each one is built
+   with HIDAPI_NAMESPACE set, which prefixes the API below so that they
+   do not clash, e.g. hid_write becomes hidraw_hid_write. */
+#ifdef HIDAPI_NAMESPACE
+#define HIDAPI_NAME_(ns, name) ns##_##name
+#define HIDAPI_NAME(ns, name) HIDAPI_NAME_(ns, name)
+#define hid_init                     HIDAPI_NAME(HIDAPI_NAMESPACE, hid_init)
+#define hid_exit                     HIDAPI_NAME(HIDAPI_NAMESPACE, hid_exit)
+#define hid_enumerate                HIDAPI_NAME(HIDAPI_NAMESPACE, hid_enumerate)
+#define hid_free_enumeration         HIDAPI_NAME(HIDAPI_NAMESPACE, hid_free_enumeration)
+#define hid_open                     HIDAPI_NAME(HIDAPI_NAMESPACE, hid_open)
+#define hid_open_path                HIDAPI_NAME(HIDAPI_NAMESPACE, hid_open_path)
+#define hid_write                    HIDAPI_NAME(HIDAPI_NAMESPACE, hid_write)
+#define hid_read_timeout             HIDAPI_NAME(HIDAPI_NAMESPACE, hid_read_timeout)
+#define hid_read                     HIDAPI_NAME(HIDAPI_NAMESPACE, hid_read)
+#define hid_set_nonblocking          HIDAPI_NAME(HIDAPI_NAMESPACE, hid_set_nonblocking)
+#define hid_send_feature_report      HIDAPI_NAME(HIDAPI_NAMESPACE, hid_send_feature_report)
+#define hid_get_feature_report       HIDAPI_NAME(HIDAPI_NAMESPACE, hid_get_feature_report)
+#define hid_close                    HIDAPI_NAME(HIDAPI_NAMESPACE, hid_close)
+#define hid_get_manufacturer_string  HIDAPI_NAME(HIDAPI_NAMESPACE, hid_get_manufacturer_string)
+#define hid_get_product_string       HIDAPI_NAME(HIDAPI_NAMESPACE, hid_get_product_string)
+#define hid_get_serial_number_string HIDAPI_NAME(HIDAPI_NAMESPACE, hid_get_serial_number_string)
+#define hid_get_indexed_string       HIDAPI_NAME(HIDAPI_NAMESPACE, hid_get_indexed_string)
+#define hid_error                    HIDAPI_NAME(HIDAPI_NAMESPACE, hid_error)
+#define hid_get_input_stats          HIDAPI_NAME(HIDAPI_NAMESPACE, hid_get_input_stats)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -379,6 +406,21 @@ extern "C" {
 		*/
 		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
 
+		/** @brief Get the input report counters of a device.
+
+			Only backends that queue input reports themselves keep
+			these, libusb does in libambit.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param dropped Reports lost as the queue was full.
+			@param late Reports that waited too long to be read.
+
+			@returns
+				0 on success and -1 if the backend does not count them.
+		*/
+		int HID_API_EXPORT_CALL hid_get_input_stats(hid_device *device, unsigned int *dropped, unsigned int *late);
+
 #ifdef __cplusplus
 }
 #endif
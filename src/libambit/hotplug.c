@@ -0,0 +1,506 @@
+/*
+ * (C) Copyright 2014 Emil Ljungdahl
+ *
+ * This file is part of libambit.
+ *
+ * libambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "libambit.h"
+#include "libambit_int.h"
+#include "device_support.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+#include <libudev.h>
+#endif
+
+/*
+ * Local definitions
+ */
+typedef struct hotplug_entry_s {
+    ambit_device_info_t *info;
+    char *hid_serial;                   /* key for reconnecting clocks */
+    bool present;
+    struct hotplug_entry_s *next;
+} hotplug_entry_t;
+
+struct ambit_hotplug_s {
+    ambit_hotplug_cb cb;
+    void *userref;
+    const ambit_transport_t *transport;
+
+    pthread_mutex_t mutex;              /* protects entries */
+    hotplug_entry_t *entries;
+
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+    struct udev *udev;
+    struct udev_monitor *monitor;
+#endif
+};
+
+/*
+ * Static functions
+ */
+static int scan(ambit_hotplug_t *hotplug);
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+static int probe(ambit_hotplug_t *hotplug, struct udev_device *raw_dev);
+static wchar_t *wcs_from_utf8(const char *src);
+#endif
+static int device_arrived(ambit_hotplug_t *hotplug, const struct hid_device_info *dev);
+static int device_left(ambit_hotplug_t *hotplug, const char *path);
+static void notify(ambit_hotplug_t *hotplug, ambit_hotplug_event_t event, ambit_device_info_t *info);
+static hotplug_entry_t *entry_find_present(ambit_hotplug_t *hotplug, const char *path);
+static hotplug_entry_t *entry_find_gone(ambit_hotplug_t *hotplug, uint16_t vid, uint16_t pid, const char *hid_serial);
+static ambit_device_info_t *device_info_dup(const ambit_device_info_t *info);
+
+/*
+ * Public functions
+ */
+ambit_hotplug_t * libambit_hotplug_new(ambit_hotplug_cb cb, void *userref)
+{
+    ambit_hotplug_t *hotplug = calloc(1, sizeof(*hotplug));
+
+    if (hotplug == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&hotplug->mutex, NULL);
+    hotplug->transport = libambit_transport();
+
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+    // Set up the monitor before the initial scan, so that nothing
+    // arriving in between goes unnoticed. Only hidraw paths match what
+    // udev reports, other transports are polled.
+    if (hotplug->transport->udev_hotplug) {
+        hotplug->udev = udev_new();
+    }
+    if (hotplug->udev != NULL) {
+        hotplug->monitor = udev_monitor_new_from_netlink(hotplug->udev, "udev");
+        if (hotplug->monitor != NULL) {
+            udev_monitor_filter_add_match_subsystem_devtype(hotplug->monitor, "hidraw", NULL);
+            if (udev_monitor_enable_receiving(hotplug->monitor) != 0) {
+                udev_monitor_unref(hotplug->monitor);
+                hotplug->monitor = NULL;
+            }
+        }
+        if (hotplug->monitor == NULL) {
+            LOG_WARNING("Failed to set up udev monitor, falling back to polling");
+        }
+    }
+#endif
+
+    scan(hotplug);
+
+    // Clocks found by the initial scan are not reported through cb
+    hotplug->cb = cb;
+    hotplug->userref = userref;
+
+    return hotplug;
+}
+
+int libambit_hotplug_get_fd(ambit_hotplug_t *hotplug)
+{
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+    if (hotplug != NULL && hotplug->monitor != NULL) {
+        return udev_monitor_get_fd(hotplug->monitor);
+    }
+#endif
+    return -1;
+}
+
+int libambit_hotplug_process(ambit_hotplug_t *hotplug)
+{
+    int ret = -1;
+
+    if (hotplug == NULL) {
+        return -1;
+    }
+
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+    if (hotplug->monitor != NULL) {
+        struct udev_device *dev;
+        const char *action;
+        const char *devnode;
+
+        ret = 0;
+        while ((dev = udev_monitor_receive_device(hotplug->monitor)) != NULL) {
+            action = udev_device_get_action(dev);
+            devnode = udev_device_get_devnode(dev);
+            if (action != NULL && devnode != NULL) {
+                if (strcmp(action, "add") == 0) {
+                    ret += probe(hotplug, dev);
+                }
+                else if (strcmp(action, "remove") == 0) {
+                    ret += device_left(hotplug, devnode);
+                }
+            }
+            udev_device_unref(dev);
+        }
+
+        return ret;
+    }
+#endif
+
+    ret = scan(hotplug);
+
+    return ret;
+}
+
+ambit_device_info_t * libambit_hotplug_enumerate(ambit_hotplug_t *hotplug)
+{
+    ambit_device_info_t *devices = NULL;
+    ambit_device_info_t **tail = &devices;
+    hotplug_entry_t *entry;
+
+    if (hotplug == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&hotplug->mutex);
+    for (entry = hotplug->entries; entry != NULL; entry = entry->next) {
+        if (entry->present && (*tail = device_info_dup(entry->info)) != NULL) {
+            tail = &(*tail)->next;
+        }
+    }
+    pthread_mutex_unlock(&hotplug->mutex);
+
+    return devices;
+}
+
+void libambit_hotplug_free(ambit_hotplug_t *hotplug)
+{
+    hotplug_entry_t *entry, *next;
+
+    if (hotplug == NULL) {
+        return;
+    }
+
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+    if (hotplug->monitor != NULL) {
+        udev_monitor_unref(hotplug->monitor);
+    }
+    if (hotplug->udev != NULL) {
+        udev_unref(hotplug->udev);
+    }
+#endif
+
+    for (entry = hotplug->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        libambit_free_enumeration(entry->info);
+        free(entry->hid_serial);
+        free(entry);
+    }
+
+    pthread_mutex_destroy(&hotplug->mutex);
+    free(hotplug);
+}
+
+/*
+ * Static functions
+ */
+
+/**
+ * Check all HID devices for new clocks and clocks that have left
+ * \return Number of changes
+ */
+static int scan(ambit_hotplug_t *hotplug)
+{
+    int ret = 0;
+    struct hid_device_info *devs = hotplug->transport->enumerate(0, 0);
+    struct hid_device_info *current;
+    hotplug_entry_t *entry;
+    char *gone;
+
+    for (current = devs; current != NULL; current = current->next) {
+        if (current->path != NULL) {
+            ret += device_arrived(hotplug, current);
+        }
+    }
+
+    do {
+        gone = NULL;
+        pthread_mutex_lock(&hotplug->mutex);
+        for (entry = hotplug->entries; entry != NULL && gone == NULL; entry = entry->next) {
+            if (entry->present) {
+                for (current = devs; current != NULL; current = current->next) {
+                    if (current->path != NULL && strcmp(current->path, entry->info->path) == 0) {
+                        break;
+                    }
+                }
+                if (current == NULL) {
+                    gone = strdup(entry->info->path);
+                }
+            }
+        }
+        pthread_mutex_unlock(&hotplug->mutex);
+
+        if (gone != NULL) {
+            ret += device_left(hotplug, gone);
+            free(gone);
+        }
+    } while (gone != NULL);
+
+    hotplug->transport->free_enumeration(devs);
+
+    return ret;
+}
+
+#ifdef LIBAMBIT_HOTPLUG_UDEV
+/**
+ * Check the hidraw device of an udev "add" event. What the enumeration
+ * would find out is taken from udev instead, so no other device is
+ * looked at.
+ * \return 1 if a clock was added, else 0
+ */
+static int probe(ambit_hotplug_t *hotplug, struct udev_device *raw_dev)
+{
+    struct udev_device *hid_dev, *usb_dev;
+    struct hid_device_info dev;
+    const char *hid_id;
+    unsigned int bus, vid, pid;
+    int ret;
+
+    hid_dev = udev_device_get_parent_with_subsystem_devtype(raw_dev, "hid", NULL);
+    if (hid_dev == NULL) {
+        return 0;
+    }
+    // HID_ID=<bus>:<vendor id>:<product id>, all in hex
+    hid_id = udev_device_get_property_value(hid_dev, "HID_ID");
+    if (hid_id == NULL || sscanf(hid_id, "%x:%x:%x", &bus, &vid, &pid) != 3 ||
+        !libambit_device_support_known(vid, pid)) {
+        return 0;
+    }
+
+    memset(&dev, 0, sizeof(dev));
+    dev.path = (char *) udev_device_get_devnode(raw_dev);
+    dev.vendor_id = vid;
+    dev.product_id = pid;
+    dev.interface_number = -1;
+    dev.serial_number = wcs_from_utf8(udev_device_get_property_value(hid_dev, "HID_UNIQ"));
+    usb_dev = udev_device_get_parent_with_subsystem_devtype(raw_dev, "usb", "usb_device");
+    if (usb_dev != NULL) {
+        dev.manufacturer_string = wcs_from_utf8(udev_device_get_sysattr_value(usb_dev, "manufacturer"));
+        dev.product_string = wcs_from_utf8(udev_device_get_sysattr_value(usb_dev, "product"));
+    }
+
+    ret = 0;
+    if (dev.path != NULL && dev.serial_number != NULL) {
+        ret = device_arrived(hotplug, &dev);
+    }
+
+    free(dev.serial_number);
+    free(dev.manufacturer_string);
+    free(dev.product_string);
+
+    return ret;
+}
+
+/**
+ * Widen an udev string, NULL gives an empty string like hidapi does
+ */
+static wchar_t *wcs_from_utf8(const char *src)
+{
+    wchar_t *dst;
+    size_t len;
+
+    if (src == NULL) {
+        src = "";
+    }
+    len = mbstowcs(NULL, src, 0);
+    if (len == (size_t) -1) {
+        return NULL;
+    }
+    dst = calloc(len + 1, sizeof(wchar_t));
+    if (dst != NULL) {
+        mbstowcs(dst, src, len + 1);
+    }
+
+    return dst;
+}
+#endif
+
+/**
+ * Add clock to cache. Only clocks that have not been seen before (or
+ * could not be queried last time) get queried for device info.
+ * \return 1 if a clock was added, else 0
+ */
+static int device_arrived(ambit_hotplug_t *hotplug, const struct hid_device_info *dev)
+{
+    hotplug_entry_t *entry;
+    ambit_device_info_t *info;
+    ambit_device_info_t *copy = NULL;
+    char *hid_serial;
+    char *path;
+
+    if (!libambit_device_support_known(dev->vendor_id, dev->product_id)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&hotplug->mutex);
+    entry = entry_find_present(hotplug, dev->path);
+    pthread_mutex_unlock(&hotplug->mutex);
+    if (entry != NULL) {
+        return 0;
+    }
+
+    hid_serial = utf8wcsconv(dev->serial_number);
+
+    // Reconnected clock, reuse what we already know about it
+    pthread_mutex_lock(&hotplug->mutex);
+    entry = entry_find_gone(hotplug, dev->vendor_id, dev->product_id, hid_serial);
+    if (entry != NULL && entry->info->access_status == 0 && entry->info->model != NULL &&
+        (path = strdup(dev->path)) != NULL) {
+        LOG_INFO("Reusing device info for %s (serial: %s)", dev->path, entry->info->serial);
+        free((char *) entry->info->path);
+        entry->info->path = path;
+        entry->present = true;
+        copy = device_info_dup(entry->info);
+    }
+    pthread_mutex_unlock(&hotplug->mutex);
+
+    if (copy != NULL) {
+        free(hid_serial);
+        notify(hotplug, ambit_hotplug_event_arrived, copy);
+        return 1;
+    }
+
+    // Not seen before, query the clock without holding the lock
+    info = libambit_device_info_new(hotplug->transport, dev);
+    if (info == NULL) {
+        free(hid_serial);
+        return 0;
+    }
+
+    pthread_mutex_lock(&hotplug->mutex);
+    entry = entry_find_gone(hotplug, dev->vendor_id, dev->product_id, hid_serial);
+    if (entry != NULL) {
+        libambit_free_enumeration(entry->info);
+        free(hid_serial);
+    }
+    else if ((entry = calloc(1, sizeof(*entry))) != NULL) {
+        entry->hid_serial = hid_serial;
+        entry->next = hotplug->entries;
+        hotplug->entries = entry;
+    }
+    else {
+        pthread_mutex_unlock(&hotplug->mutex);
+        libambit_free_enumeration(info);
+        free(hid_serial);
+        return 0;
+    }
+    entry->info = info;
+    entry->present = true;
+    copy = device_info_dup(info);
+    pthread_mutex_unlock(&hotplug->mutex);
+
+    notify(hotplug, ambit_hotplug_event_arrived, copy);
+
+    return 1;
+}
+
+/**
+ * Mark clock at path as gone, the entry is kept for reconnects
+ * \return 1 if a clock left, else 0
+ */
+static int device_left(ambit_hotplug_t *hotplug, const char *path)
+{
+    hotplug_entry_t *entry;
+    ambit_device_info_t *copy = NULL;
+
+    pthread_mutex_lock(&hotplug->mutex);
+    entry = entry_find_present(hotplug, path);
+    if (entry != NULL) {
+        entry->present = false;
+        copy = device_info_dup(entry->info);
+    }
+    pthread_mutex_unlock(&hotplug->mutex);
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    notify(hotplug, ambit_hotplug_event_left, copy);
+
+    return 1;
+}
+
+/**
+ * Call user callback, outside of the lock, and release info
+ */
+static void notify(ambit_hotplug_t *hotplug, ambit_hotplug_event_t event, ambit_device_info_t *info)
+{
+    if (info != NULL) {
+        if (hotplug->cb != NULL) {
+            hotplug->cb(hotplug->userref, event, info);
+        }
+        libambit_free_enumeration(info);
+    }
+}
+
+static hotplug_entry_t *entry_find_present(ambit_hotplug_t *hotplug, const char *path)
+{
+    hotplug_entry_t *entry;
+
+    for (entry = hotplug->entries; entry != NULL; entry = entry->next) {
+        if (entry->present && strcmp(entry->info->path, path) == 0) {
+            break;
+        }
+    }
+
+    return entry;
+}
+
+static hotplug_entry_t *entry_find_gone(ambit_hotplug_t *hotplug, uint16_t vid, uint16_t pid, const char *hid_serial)
+{
+    hotplug_entry_t *entry;
+
+    if (hid_serial == NULL) {
+        return NULL;
+    }
+
+    for (entry = hotplug->entries; entry != NULL; entry = entry->next) {
+        if (!entry->present && entry->info->vendor_id == vid && entry->info->product_id == pid &&
+            entry->hid_serial != NULL && strcmp(entry->hid_serial, hid_serial) == 0) {
+            break;
+        }
+    }
+
+    return entry;
+}
+
+static ambit_device_info_t *device_info_dup(const ambit_device_info_t *info)
+{
+    ambit_device_info_t *copy = malloc(sizeof(*copy));
+
+    if (copy != NULL) {
+        memcpy(copy, info, sizeof(*copy));
+        copy->name = info->name != NULL ? strdup(info->name) : NULL;
+        copy->model = info->model != NULL ? strdup(info->model) : NULL;
+        copy->serial = info->serial != NULL ? strdup(info->serial) : NULL;
+        copy->path = strdup(info->path);
+        copy->next = NULL;
+    }
+
+    return copy;
+}
@@ -47,7 +47,6 @@
  * Static functions
  */
 static int device_info_get(ambit_object_t *object, ambit_device_info_t *info);
-static ambit_device_info_t * ambit_device_info_new(const struct hid_device_info *dev);
 
 /*
  * Public functions
@@ -56,7 +55,8 @@ ambit_device_info_t * libambit_enumerate(void)
 {
     ambit_device_info_t *devices = NULL;
 
-    struct hid_device_info *devs = hid_enumerate(0, 0);
+    const ambit_transport_t *transport = libambit_transport();
+    struct hid_device_info *devs = transport->enumerate(0, 0);
     struct hid_device_info *current;
 
     if (!devs) {
@@ -66,19 +66,15 @@ ambit_device_info_t * libambit_enumerate(void)
 
     current = devs;
     while (current) {
-        ambit_device_info_t *tmp = ambit_device_info_new(current);
+        ambit_device_info_t *tmp = libambit_device_info_new(transport, current);
 
         if (tmp) {
-            if (devices) {
-                tmp->next = devices;
-            }
-            else {
-                devices = tmp;
-            }
+            tmp->next = devices;
+            devices = tmp;
         }
         current = current->next;
     }
-    hid_free_enumeration(devs);
+    transport->free_enumeration(devs);
 
     return devices;
 }
@@ -116,13 +112,15 @@ ambit_object_t * libambit_new(const ambit_device_info_t *device)
         if (known_device != NULL) {
             object = calloc(1, sizeof(*object));
             if (object) {
-                object->handle = hid_open_path(path);
+                libambit_protocol_sched_init(object);
+                object->transport = libambit_transport();
+                object->handle = object->transport->open_path(path);
                 memcpy(&object->device_info, device, sizeof(*device));
                 object->device_info.path = path;
                 object->driver = known_device->driver;
 
                 if (object->handle) {
-                    hid_set_nonblocking(object->handle, true);
+                    object->transport->set_nonblocking(object->handle, true);
                 }
 
                 // Initialize driver
@@ -175,14 +173,30 @@ void libambit_close(ambit_object_t *object)
             }
         }
         if (object->handle != NULL) {
-            hid_close(object->handle);
+            object->transport->close(object->handle);
         }
 
+        libambit_protocol_sched_deinit(object);
+        free(object->log_resume_path);
         free((char *) object->device_info.path);
         free(object);
     }
 }
 
+int libambit_log_resume_set(ambit_object_t *object, const char *path)
+{
+    char *copy = NULL;
+
+    if (path != NULL && (copy = strdup(path)) == NULL) {
+        return -1;
+    }
+
+    free(object->log_resume_path);
+    object->log_resume_path = copy;
+
+    return 0;
+}
+
 void libambit_sync_display_show(ambit_object_t *object)
 {
     if (object->driver != NULL && object->driver->lock_log != NULL) {
@@ -609,7 +623,7 @@ static inline void version_string(char string[LIBAMBIT_VERSION_LENGTH+1],
            version[0], version[1], (version[2] << 0) | (version[3] << 8));
 }
 
-static ambit_device_info_t * ambit_device_info_new(const struct hid_device_info *dev)
+ambit_device_info_t * libambit_device_info_new(const ambit_transport_t *transport, const struct hid_device_info *dev)
 {
     ambit_device_info_t *device = NULL;
     const ambit_known_device_t *known_device = NULL;
@@ -679,7 +693,7 @@ static ambit_device_info_t * ambit_device_info_new(const struct hid_device_info
              device->path, device->name, device->serial,
              device->vendor_id, device->product_id);
 
-    hid = hid_open_path(device->path);
+    hid = transport->open_path(device->path);
     if (hid) {
         /* HACK ALERT: minimally initialize an ambit object so we can
          * call device_info_get().  Note that this function sets the
@@ -688,8 +702,10 @@ static ambit_device_info_t * ambit_device_info_new(const struct hid_device_info
          */
         char *serial = device->serial;
         ambit_object_t obj;
+        obj.transport = transport;
         obj.handle = hid;
         obj.sequence_no = 0;
+        libambit_protocol_sched_init(&obj);
         if (0 == device_info_get(&obj, device)) {
 
             if (!device->serial) { /* fall back to HID information */
@@ -740,7 +756,8 @@ static ambit_device_info_t * ambit_device_info_new(const struct hid_device_info
         else {
             LOG_ERROR("cannot get device info from %s", device->path);
         }
-        hid_close(hid);
+        libambit_protocol_sched_deinit(&obj);
+        transport->close(hid);
     }
     else {
         /* Store an educated guess as to why we cannot open the HID
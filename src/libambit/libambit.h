@@ -582,6 +582,27 @@ typedef struct ambit_app_rules_s {
     ambit_app_rule_t *app_rules;
 } ambit_app_rules_t;
 
+/** \brief Select how to talk to clocks
+ *
+ *  Until this is called the transport is taken from the
+ *  LIBAMBIT_TRANSPORT environment variable, or picked automatically.
+ *  Automatic selection prefers the first hardware transport that finds
+ *  a Suunto device.  Objects already created keep the transport they
+ *  were opened with.
+ * \param name One of libambit_transport_list(), NULL or "auto" to pick
+ * automatically
+ * \return 0 on success, else -1
+ */
+int libambit_transport_set(const char *name);
+
+/** \brief Get name of the transport in use
+ */
+const char * libambit_transport_name(void);
+
+/** \brief Get \c NULL terminated list of transports built into libambit
+ */
+const char ** libambit_transport_list(void);
+
 /** \brief Create a list of all known Ambit clocks on the system
  *
  *  The list may include clocks that are not supported or cannot be
@@ -608,6 +629,65 @@ ambit_object_t * libambit_new(const ambit_device_info_t *device);
  */
 ambit_object_t * libambit_new_from_pathname(const char *pathname);
 
+typedef struct ambit_hotplug_s ambit_hotplug_t;
+
+typedef enum ambit_hotplug_event_e {
+    ambit_hotplug_event_arrived,
+    ambit_hotplug_event_left
+} ambit_hotplug_event_t;
+
+/**
+ * Callback function to notify about clocks arriving or leaving
+ * \param userref User reference given to libambit_hotplug_new()
+ * \param event Type of event
+ * \param device Info of the clock concerned. Only valid during the call,
+ * use libambit_hotplug_enumerate() to get a copy
+ */
+typedef void (*ambit_hotplug_cb)(void *userref, ambit_hotplug_event_t event, const ambit_device_info_t *device);
+
+/**
+ * Subscribe to clock hotplug events
+ * The initial set of clocks is enumerated once here. After that only
+ * clocks that arrive get queried for device info, and a clock that is
+ * reconnected reuses the info from its previous connection.
+ * Clocks found by the initial enumeration are not reported through cb.
+ * \param cb Callback to notify about changes, may be NULL
+ * \param userref User reference passed to the callback
+ * \return Hotplug object, or NULL on failure
+ */
+ambit_hotplug_t * libambit_hotplug_new(ambit_hotplug_cb cb, void *userref);
+
+/**
+ * Get file descriptor to watch for pending hotplug events
+ * \param hotplug Hotplug object
+ * \return Descriptor that becomes readable when libambit_hotplug_process()
+ * should be called, or -1 if events are not supported on this platform, in
+ * which case libambit_hotplug_process() has to be called periodically
+ */
+int libambit_hotplug_get_fd(ambit_hotplug_t *hotplug);
+
+/**
+ * Handle pending hotplug events, callbacks are called from here.
+ * Should only be called from one thread.
+ * \param hotplug Hotplug object
+ * \return Number of changes found, or -1 on error
+ */
+int libambit_hotplug_process(ambit_hotplug_t *hotplug);
+
+/**
+ * Get a copy of the cached list of connected clocks, may be called from
+ * any thread
+ * \param hotplug Hotplug object
+ * \return List to be released with libambit_free_enumeration()
+ */
+ambit_device_info_t * libambit_hotplug_enumerate(ambit_hotplug_t *hotplug);
+
+/**
+ * Unsubscribe and free hotplug object
+ * \param hotplug Hotplug object
+ */
+void libambit_hotplug_free(ambit_hotplug_t *hotplug);
+
 /**
  * Close open Ambit object
  * \param object Object to close
@@ -721,6 +801,15 @@ int libambit_log_read(ambit_object_t *object, ambit_log_skip_cb skip_cb, ambit_l
  * \param log_entry Log entry to free
  */
 void libambit_log_entry_free(ambit_log_entry_t *log_entry);
+/**
+ * Keep log download state in the given file, so that a log read that
+ * fails halfway continues where it stopped next time, instead of
+ * starting over
+ * \param object Object reference
+ * \param path File to keep state in, NULL to not keep any
+ * \return 0 on success, else -1
+ */
+int libambit_log_resume_set(ambit_object_t *object, const char *path);
 /**
  * Init ambit_route_t struct
  */
@@ -850,6 +939,138 @@ ambit_app_rules_t *liblibambit_malloc_app_rules(void);
  */
 bool libambit_malloc_app_rule(uint16_t count, ambit_app_rules_t *ambit_app_rules);
 
+/*
+ * Asynchronous operations
+ *
+ * Each libambit_async_*() submit call below queues the corresponding
+ * blocking call and returns at once. No threads are started, the queue
+ * runs its operations from libambit_async_process() in the calling
+ * thread. Where the blocking call would wait for the clock, the
+ * operation returns to the queue instead and is resumed by a later
+ * libambit_async_process() call. The queue file descriptor becomes
+ * readable whenever that call is due, both to continue operations and
+ * to hand out completions.
+ *
+ * Operations on the same object run one at a time in submit order,
+ * except libambit_async_device_status_get() which goes in between the
+ * commands of a running operation. Log read callbacks and completion
+ * callbacks are all called from libambit_async_process(). A queue and
+ * the objects of its operations should only be used from one thread,
+ * and no blocking call should be made on an object while it has
+ * operations pending.
+ */
+typedef struct ambit_async_s ambit_async_t;
+
+typedef struct ambit_async_completion_s {
+    int id;                             /* As returned when submitted */
+    ambit_object_t *object;
+    int result;                         /* Return value of the blocking call */
+    bool cancelled;
+    ambit_device_status_t status;       /* libambit_async_device_status_get() */
+} ambit_async_completion_t;
+
+/**
+ * Callback function to hand out a completed operation
+ * \param userref User reference given when submitting
+ * \param completion Result, only valid during the call
+ */
+typedef void (*ambit_async_cb)(void *userref, const ambit_async_completion_t *completion);
+
+/**
+ * Create completion queue
+ * \return Queue, or NULL on failure
+ */
+ambit_async_t * libambit_async_new(void);
+
+/**
+ * Cancel all operations and free the queue. Completion callbacks of
+ * unfinished operations are not called.
+ * \param async Queue to free
+ */
+void libambit_async_free(ambit_async_t *async);
+
+/**
+ * Get file descriptor to watch for the queue
+ * \param async Queue
+ * \return Descriptor that becomes readable when libambit_async_process()
+ * should be called
+ */
+int libambit_async_get_fd(ambit_async_t *async);
+
+/**
+ * Continue operations that are due and hand out completed ones, all
+ * callbacks are called from here
+ * \param async Queue
+ * \return Number of completions handed out, or -1 on error
+ */
+int libambit_async_process(ambit_async_t *async);
+
+/**
+ * Cancel operation. One that is running gives up as it is resumed,
+ * the completion is then flagged as cancelled.
+ * \param async Queue
+ * \param id Operation to cancel
+ * \return 0 on success, -1 if no such operation is pending
+ */
+int libambit_async_cancel(ambit_async_t *async, int id);
+
+/**
+ * Cancel all operations on object and drop them, e.g. before closing
+ * it. Cancelled operations fail without waiting for the clock, so this
+ * returns at once. Their completion callbacks are not called.
+ * \param async Queue
+ * \param object Object
+ */
+void libambit_async_abandon(ambit_async_t *async, ambit_object_t *object);
+
+/**
+ * Submit operations, see the blocking versions for parameters. Pointer
+ * arguments must stay valid until completion, except data for
+ * libambit_async_gps_orbit_write() and date_time, which are copied.
+ * \return Operation id (> 0), or -1 on failure
+ */
+int libambit_async_device_status_get(ambit_async_t *async, ambit_object_t *object, ambit_async_cb cb, void *userref);
+int libambit_async_personal_settings_get(ambit_async_t *async, ambit_object_t *object, ambit_personal_settings_t *settings, ambit_async_cb cb, void *userref);
+int libambit_async_sync_display_show(ambit_async_t *async, ambit_object_t *object, ambit_async_cb cb, void *userref);
+int libambit_async_sync_display_clear(ambit_async_t *async, ambit_object_t *object, ambit_async_cb cb, void *userref);
+int libambit_async_date_time_set(ambit_async_t *async, ambit_object_t *object, const struct tm *date_time, ambit_async_cb cb, void *userref);
+int libambit_async_log_read(ambit_async_t *async, ambit_object_t *object, ambit_log_skip_cb skip_cb, ambit_log_push_cb push_cb, ambit_log_progress_cb progress_cb, ambit_async_cb cb, void *userref);
+int libambit_async_gps_orbit_write(ambit_async_t *async, ambit_object_t *object, const uint8_t *data, size_t datalen, ambit_async_cb cb, void *userref);
+int libambit_async_navigation_read(ambit_async_t *async, ambit_object_t *object, ambit_personal_settings_t *settings, ambit_async_cb cb, void *userref);
+int libambit_async_navigation_write(ambit_async_t *async, ambit_object_t *object, ambit_personal_settings_t *settings, ambit_async_cb cb, void *userref);
+int libambit_async_sport_mode_write(ambit_async_t *async, ambit_object_t *object, ambit_sport_mode_device_settings_t *sport_modes, ambit_async_cb cb, void *userref);
+int libambit_async_app_data_write(ambit_async_t *async, ambit_object_t *object, ambit_sport_mode_device_settings_t *sport_modes, ambit_app_rules_t *apps, ambit_async_cb cb, void *userref);
+
+/*
+ * Tracing
+ *
+ * Setting environment variable LIBAMBIT_TRACE to a file name records
+ * timed spans in a per-thread ring buffer, which is written to that file
+ * in Chrome trace event format (see chrome://tracing) at exit. Without it
+ * the calls below cost a check of a flag.
+ */
+
+/**
+ * Start span
+ * \return Start time to pass to libambit_trace_end(), 0 if not tracing
+ */
+uint64_t libambit_trace_begin(void);
+
+/**
+ * End span and record it
+ * \param name Span name, must stay valid until dumped (e.g. a literal)
+ * \param begin Return value of libambit_trace_begin()
+ * \param arg Value shown with the span, e.g. command or address
+ */
+void libambit_trace_end(const char *name, uint64_t begin, int64_t arg);
+
+/**
+ * Write recorded spans to file
+ * \param path File to write, NULL for the one given by LIBAMBIT_TRACE
+ * \return 0 on success, else -1
+ */
+int libambit_trace_dump(const char *path);
+
 #ifdef __cplusplus /* If this is a C++ compiler, end C linkage */
 }
 #endif
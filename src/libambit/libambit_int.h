@@ -23,18 +23,59 @@
 #define __LIBAMBIT_INT_H__
 
 #include <stdint.h>
+#include <pthread.h>
 #include "hidapi/hidapi.h"
 #include "libambit.h"
+#include "transport.h"
 
 struct ambit_object_s {
+    const ambit_transport_t *transport; // Transport handle was opened with
     hid_device *handle;
     uint16_t sequence_no;
     ambit_device_info_t device_info;
 
+    struct {                            // Command scheduler, see protocol.c
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        bool busy;
+        int urgent_waiting;
+    } sched;
+
+    char *log_resume_path;              // Log download state, see pmem20.c
+
     struct ambit_device_driver_s *driver;
     struct ambit_device_driver_data_s *driver_data; // Driver specific struct,
                                                     // should be defined
                                                     // locally for each driver
 };
 
+/**
+ * Create device info for a HID device, querying the clock itself
+ * \param transport Transport that enumerated dev
+ * \param dev HID device to query
+ * \return Device info, or NULL if the device is not a known clock
+ */
+ambit_device_info_t * libambit_device_info_new(const ambit_transport_t *transport, const struct hid_device_info *dev);
+
+/**
+ * Check if the async operation running on the calling thread has been
+ * cancelled, see async.c
+ * \return true if the caller should give up
+ */
+bool libambit_async_cancelled(void);
+
+/**
+ * Check if the calling thread is running an async operation, see async.c
+ * \return true if waits should go through libambit_async_wait()
+ */
+bool libambit_async_running(void);
+
+/**
+ * Hand the thread back to the queue of the running async operation,
+ * which resumes it once timeout has passed
+ * \param timeout Milliseconds to wait
+ * \return 0 when resumed, -1 if cancelled or no operation is running
+ */
+int libambit_async_wait(unsigned int timeout);
+
 #endif /* __LIBAMBIT_INT_H__ */
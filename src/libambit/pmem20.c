@@ -20,6 +20,7 @@
  *
  */
 #include "pmem20.h"
+#include "libambit_int.h"
 #include "protocol.h"
 #include "sha256.h"
 #include "utils.h"
@@ -28,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 /*
  * Local definitions
@@ -35,6 +37,13 @@
 #define PMEM20_LOG_WRAP_START_OFFSET      0x00000012
 #define PMEM20_LOG_WRAP_BUFFER_MARGIN     0x00010000 /* Max theoretical size of sample */
 #define PMEM20_LOG_HEADER_MIN_LEN                512 /* Header actually longer, but not interesting*/
+#define PMEM20_TRACE_BATCH                       256 /* Samples per parse_samples trace span */
+#define PMEM20_CHUNK_RETRIES                       3 /* Extra attempts for a failed chunk read */
+#define PMEM20_RESUME_SAVE_INTERVAL              256 /* Chunks read between resume state saves */
+
+#define PMEM20_RESUME_MAGIC               "AMBITRSM"
+#define PMEM20_RESUME_MAGIC_LEN                    8
+#define PMEM20_RESUME_VERSION                      1
 
 #define PMEM20_GPS_ORBIT_START            0x000704e0
 #define PMEM20_SPORT_MODE_START          0x00002000
@@ -53,6 +62,9 @@ static int parse_sample(uint8_t *buf, size_t offset, uint8_t **spec, ambit_log_e
 static void correct_samples(ambit_log_entry_t *log_entry, int32_t *time_compensators);
 static int read_upto(libambit_pmem20_t *object, uint32_t address, uint32_t length);
 static int read_log_chunk(libambit_pmem20_t *object, uint32_t address, uint32_t length, uint8_t *buffer);
+static int resume_load(libambit_pmem20_t *object);
+static int resume_save(libambit_pmem20_t *object);
+static void resume_remove(libambit_pmem20_t *object);
 static int write_data_chunk(ambit_object_t *object, uint32_t address, size_t buffer_count, const uint8_t **buffers, const size_t *buffer_sizes);
 static void add_time(ambit_date_time_t *intime, int32_t offset, ambit_date_time_t *outtime);
 static int is_leap(unsigned int y);
@@ -119,6 +131,8 @@ int libambit_pmem20_log_init(libambit_pmem20_t *object, uint32_t mem_start, uint
 
             LOG_INFO("log data header read, entries=%d, first_entry=%08x, last_entry=%08x, next_free_address=%08x", object->log.entries, object->log.first_entry, object->log.last_entry, object->log.next_free_address);
 
+            resume_load(object);
+
             // Set initialized
             object->log.initialized = true;
         }
@@ -132,6 +146,27 @@ int libambit_pmem20_log_init(libambit_pmem20_t *object, uint32_t mem_start, uint
 
 int libambit_pmem20_deinit(libambit_pmem20_t *object)
 {
+    // Interrupted download, keep what was read for next time
+    if (object->log.buffer != NULL && !object->log.complete && object->log.chunks_unsaved > 0) {
+        resume_save(object);
+    }
+
+    if (object->log.buffer != NULL) {
+        free(object->log.buffer);
+    }
+    if (object->log.chunks_read != NULL) {
+        free(object->log.chunks_read);
+    }
+    memset(&object->log, 0, sizeof(object->log));
+
+    return 0;
+}
+
+int libambit_pmem20_log_deinit(libambit_pmem20_t *object)
+{
+    // All entries walked, nothing left to resume
+    resume_remove(object);
+
     if (object->log.buffer != NULL) {
         free(object->log.buffer);
     }
@@ -159,6 +194,8 @@ int libambit_pmem20_log_next_header(libambit_pmem20_t *object, ambit_log_header_
     // Check if we reached end of entries
     if (object->log.current.current == object->log.current.next) {
         LOG_INFO("No more entries to read");
+        object->log.complete = true;
+        resume_remove(object);
         return 0;
     }
 
@@ -205,6 +242,9 @@ ambit_log_entry_t *libambit_pmem20_log_read_entry(libambit_pmem20_t *object, uin
     size_t buffer_offset, sample_count = 0;
     ambit_log_entry_t *log_entry;
     int32_t *time_compensators;
+    uint64_t trace;
+    int batch = 0;
+    int read_res = 0;
 
     if (!object->log.initialized) {
         LOG_ERROR("Trying to get log entry without initialization");
@@ -261,6 +301,7 @@ ambit_log_entry_t *libambit_pmem20_log_read_entry(libambit_pmem20_t *object, uin
     LOG_INFO("Log entry got %d samples, reading", log_entry->samples_count);
 
     // OK, so we are at start of samples, get them all!
+    trace = libambit_trace_begin();
     while (sample_count < log_entry->samples_count) {
         /* NOTE! The double reads below seems a bit unoptimized,
            but if we need optimization, we should optimize read_upto
@@ -270,34 +311,53 @@ ambit_log_entry_t *libambit_pmem20_log_read_entry(libambit_pmem20_t *object, uin
 
         // First check for log area wrap
         if (buffer_offset >= object->log.mem_size - 1) {
-            read_upto(object, object->log.mem_start + PMEM20_LOG_WRAP_START_OFFSET, 2);
+            read_res |= read_upto(object, object->log.mem_start + PMEM20_LOG_WRAP_START_OFFSET, 2);
             sample_len = read16(object->log.buffer, PMEM20_LOG_WRAP_START_OFFSET);
         }
         else if (buffer_offset == object->log.mem_size - 2) {
-            read_upto(object, object->log.mem_start + PMEM20_LOG_WRAP_START_OFFSET, 1);
+            read_res |= read_upto(object, object->log.mem_start + PMEM20_LOG_WRAP_START_OFFSET, 1);
             sample_len = object->log.buffer[buffer_offset] | (object->log.buffer[PMEM20_LOG_WRAP_START_OFFSET] << 8);
         }
         else {
-            read_upto(object, object->log.mem_start + buffer_offset, 2);
+            read_res |= read_upto(object, object->log.mem_start + buffer_offset, 2);
             sample_len = read16(object->log.buffer, buffer_offset);
         }
 
         // Read all data
         if (buffer_offset + 2 < (object->log.mem_size-1)) {
-            read_upto(object, object->log.mem_start + buffer_offset + 2, sample_len);
+            read_res |= read_upto(object, object->log.mem_start + buffer_offset + 2, sample_len);
         }
         if (buffer_offset + 2 + sample_len > object->log.mem_size) {
-            read_upto(object, object->log.mem_start + PMEM20_LOG_WRAP_START_OFFSET, (buffer_offset + 2 + sample_len) - object->log.mem_size);
+            read_res |= read_upto(object, object->log.mem_start + PMEM20_LOG_WRAP_START_OFFSET, (buffer_offset + 2 + sample_len) - object->log.mem_size);
             memcpy(object->log.buffer + object->log.mem_size, object->log.buffer + PMEM20_LOG_WRAP_START_OFFSET, (buffer_offset + 2 + sample_len) - object->log.mem_size);
         }
 
+        // Chunks read so far are kept, a later attempt (or a resumed
+        // download, see resume_save) continues from there
+        if (read_res != 0) {
+            LOG_WARNING("Failed to read log entry data");
+            libambit_trace_end("parse_samples", trace, sample_count);
+            libambit_log_entry_free(log_entry);
+            free(time_compensators);
+            object->log.initialized = false;
+            return NULL;
+        }
+
         parse_sample(object->log.buffer, buffer_offset, &periodic_sample_spec, log_entry, &sample_count, time_compensators);
         buffer_offset += 2 + sample_len;
         // Wrap
         if (buffer_offset >= object->log.mem_size) {
             buffer_offset = PMEM20_LOG_WRAP_START_OFFSET + (buffer_offset - object->log.mem_size);
         }
+
+        // Chunk reads show up nested in the batch spans
+        if (++batch == PMEM20_TRACE_BATCH) {
+            libambit_trace_end("parse_samples", trace, sample_count);
+            trace = libambit_trace_begin();
+            batch = 0;
+        }
     }
+    libambit_trace_end("parse_samples", trace, sample_count);
 
     correct_samples(log_entry, time_compensators);
 
@@ -306,9 +366,9 @@ ambit_log_entry_t *libambit_pmem20_log_read_entry(libambit_pmem20_t *object, uin
     return log_entry;
 }
 
-static void libambit_pmem20_log_read_log_data_part(libambit_pmem20_t *object,
-                                                   uint32_t address, uint32_t length,
-                                                   uint8_t *buffer)
+static int libambit_pmem20_log_read_log_data_part(libambit_pmem20_t *object,
+                                                  uint32_t address, uint32_t length,
+                                                  uint8_t *buffer)
 {
     uint32_t next_address;
     uint32_t buffer_read = 0, read_length;
@@ -330,11 +390,15 @@ static void libambit_pmem20_log_read_log_data_part(libambit_pmem20_t *object,
         }
 
         LOG_INFO("Reading buffer region %p -> %p (%u bytes in total)", next_address, next_address + read_length, buffer_read);
-        read_log_chunk(object, next_address, read_length, buffer + buffer_read);
+        if (read_log_chunk(object, next_address, read_length, buffer + buffer_read) != 0) {
+            return -1;
+        }
 
         next_address += read_length;
         buffer_read += read_length;
     }
+
+    return 0;
 }
 
 ambit_log_entry_t *libambit_pmem20_log_read_entry_address(libambit_pmem20_t *object,
@@ -349,6 +413,7 @@ ambit_log_entry_t *libambit_pmem20_log_read_entry_address(libambit_pmem20_t *obj
     size_t buffer_offset, sample_count = 0;
     ambit_log_entry_t *log_entry;
     int32_t *time_compensators;
+    uint64_t trace;
 
     // Allocate log entry
     if ((log_entry = calloc(1, sizeof(ambit_log_entry_t))) == NULL) {
@@ -366,10 +431,14 @@ ambit_log_entry_t *libambit_pmem20_log_read_entry_address(libambit_pmem20_t *obj
     log_entry->header.activity_name = NULL;
 
     LOG_INFO("Reading log entry from address1=%08x", address1);
-    libambit_pmem20_log_read_log_data_part(object, address1, length1, buffer);
-    if (address2) {
-        LOG_INFO("Reading log entry from address2=%08x", address2);
-        libambit_pmem20_log_read_log_data_part(object, address2, length2, buffer + length1);
+    if (libambit_pmem20_log_read_log_data_part(object, address1, length1, buffer) != 0 ||
+        (address2 && libambit_pmem20_log_read_log_data_part(object, address2, length2, buffer + length1) != 0)) {
+        // Failed or cancelled halfway, the samples would be garbage
+        LOG_ERROR("Failed to read log entry data");
+        free(buffer);
+        free(log_entry);
+        object->log.initialized = false;
+        return NULL;
     }
 
     buffer_offset = 12;
@@ -412,12 +481,14 @@ ambit_log_entry_t *libambit_pmem20_log_read_entry_address(libambit_pmem20_t *obj
     LOG_INFO("Log entry got %d samples, reading", log_entry->samples_count);
 
     // OK, so we are at start of samples, get them all!
+    trace = libambit_trace_begin();
     while (sample_count < log_entry->samples_count) {
         sample_len = read16(buffer, buffer_offset);
 
         parse_sample(buffer, buffer_offset, &periodic_sample_spec, log_entry, &sample_count, time_compensators);
         buffer_offset += 2 + sample_len;
     }
+    libambit_trace_end("parse_samples", trace, sample_count);
 
     LOG_INFO("Log entry finish reading  %d samples", log_entry->samples_count);
     correct_samples(log_entry, time_compensators);
@@ -535,6 +606,14 @@ int libambit_pmem20_gps_orbit_write(libambit_pmem20_t *object, const uint8_t *da
     bufsizes[1] = object->chunk_size - 4; // We assume that data is
                                           // always > chunk_size
 
+    // Hash is calculated chunk by chunk along with the writes, instead of
+    // in one go over the complete buffer once everything is sent
+    if (include_sha256_hash) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, startheader, sizeof(startheader));
+        sha256_update(&ctx, data, bufsizes[1]);
+    }
+
     // Write first chunk (including length)
     ret = write_data_chunk(object->ambit_object, address, 2, bufptrs, bufsizes);
     offset += bufsizes[1];
@@ -545,6 +624,10 @@ int libambit_pmem20_gps_orbit_write(libambit_pmem20_t *object, const uint8_t *da
         bufptrs[0] = data + offset;
         bufsizes[0] = (datalen - offset > object->chunk_size ? object->chunk_size : datalen - offset);
 
+        if (include_sha256_hash) {
+            sha256_update(&ctx, bufptrs[0], bufsizes[0]);
+        }
+
         ret = write_data_chunk(object->ambit_object, address, 1, bufptrs, bufsizes);
         offset += bufsizes[0];
         address += bufsizes[0];
@@ -554,9 +637,6 @@ int libambit_pmem20_gps_orbit_write(libambit_pmem20_t *object, const uint8_t *da
     if (ret == 0) {
         // Handle hash (if wanted)
         if (include_sha256_hash) {
-            sha256_init(&ctx);
-            sha256_update(&ctx, startheader, sizeof(startheader));
-            sha256_update(&ctx, data, datalen);
             sha256_final(&ctx, hash);
             tail_datalen += 64;
         }
@@ -1054,9 +1134,15 @@ static int read_upto(libambit_pmem20_t *object, uint32_t address, uint32_t lengt
     while (start_address < address + length) {
         if (object->log.chunks_read[(start_address - object->log.mem_start)/object->chunk_size] == 0) {
             if (read_log_chunk(object, start_address, object->chunk_size, object->log.buffer + (start_address - object->log.mem_start)) != 0) {
+                if (object->log.chunks_unsaved > 0) {
+                    resume_save(object);
+                }
                 return -1;
             }
             object->log.chunks_read[(start_address - object->log.mem_start)/object->chunk_size] = 1;
+            if (++object->log.chunks_unsaved >= PMEM20_RESUME_SAVE_INTERVAL) {
+                resume_save(object);
+            }
         }
         start_address += object->chunk_size;
     }
@@ -1066,33 +1152,168 @@ static int read_upto(libambit_pmem20_t *object, uint32_t address, uint32_t lengt
 
 static int read_log_chunk(libambit_pmem20_t *object, uint32_t address, uint32_t length, uint8_t *buffer)
 {
+    uint64_t trace = libambit_trace_begin();
     int ret = -1;
+    int attempt;
 
-    uint8_t *reply = NULL;
     size_t replylen = 0;
 
     uint8_t send_data[8];
     uint32_t *_address = (uint32_t*)&send_data[0];
     uint32_t *_length = (uint32_t*)&send_data[4];
 
-    if ((address + object->chunk_size) > (object->log.mem_start + object->log.mem_size)) {
+    if ((address + length) > (object->log.mem_start + object->log.mem_size)) {
         length = object->log.mem_start + object->log.mem_size - address;
     }
 
     *_address = htole32(address);
     *_length = htole32(length);
 
-    if (libambit_protocol_command(object->ambit_object, ambit_command_log_read, send_data, sizeof(send_data), &reply, &replylen, 0) == 0 &&
-        replylen == length + 8) {
-        memcpy(buffer, reply + 8, length);
-        ret = 0;
+    // A short or lost reply is usually a glitch on the bus, the protocol
+    // layer drops late parts of it before the next attempt
+    for (attempt=0; ret != 0 && attempt<=PMEM20_CHUNK_RETRIES && !libambit_async_cancelled(); attempt++) {
+        if (attempt > 0) {
+            LOG_WARNING("Retrying read of log chunk at %08x (attempt %d)", address, attempt + 1);
+        }
+        // Reply is an 8 byte header followed by the chunk, which goes
+        // right into its place in the buffer
+        if (libambit_protocol_command_buf(object->ambit_object, ambit_command_log_read, send_data, sizeof(send_data), buffer, 8, length, &replylen, 0) == 0 &&
+            replylen == length + 8) {
+            ret = 0;
+        }
+        replylen = 0;
+    }
+
+    libambit_trace_end("read_log_chunk", trace, address);
+
+    return ret;
+}
+
+/**
+ * Write the chunks read so far to the resume file of the object, along
+ * with the first chunk, which tells if the log area changed since
+ * \return 0 on success or when not keeping resume state, else -1
+ */
+static int resume_save(libambit_pmem20_t *object)
+{
+    const char *path = object->ambit_object->log_resume_path;
+    size_t chunks = object->log.mem_size/object->chunk_size + 1;
+    uint32_t mem_start = htole32(object->log.mem_start);
+    uint32_t mem_size = htole32(object->log.mem_size);
+    uint16_t chunk_size = htole16(object->chunk_size);
+    char *tmppath;
+    size_t i;
+    FILE *f;
+    int ret;
+
+    object->log.chunks_unsaved = 0;
+    if (path == NULL) {
+        return 0;
     }
 
-    libambit_protocol_free(reply);
+    // Written aside and renamed, so a crash leaves the last good state
+    if ((tmppath = malloc(strlen(path) + 5)) == NULL) {
+        return -1;
+    }
+    sprintf(tmppath, "%s.tmp", path);
+    if ((f = fopen(tmppath, "wb")) == NULL) {
+        LOG_WARNING("Failed to open log resume file %s", tmppath);
+        free(tmppath);
+        return -1;
+    }
+
+    fwrite(PMEM20_RESUME_MAGIC, 1, PMEM20_RESUME_MAGIC_LEN, f);
+    fputc(PMEM20_RESUME_VERSION, f);
+    fwrite(&mem_start, sizeof(mem_start), 1, f);
+    fwrite(&mem_size, sizeof(mem_size), 1, f);
+    fwrite(&chunk_size, sizeof(chunk_size), 1, f);
+    fwrite(object->log.buffer, 1, object->chunk_size, f);
+    fwrite(object->log.chunks_read, 1, chunks, f);
+    for (i=0; i<chunks; i++) {
+        if (object->log.chunks_read[i]) {
+            fwrite(object->log.buffer + i*object->chunk_size, 1, object->chunk_size, f);
+        }
+    }
+
+    ret = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0 || ret != 0 || rename(tmppath, path) != 0) {
+        LOG_WARNING("Failed to write log resume file %s", path);
+        unlink(tmppath);
+        ret = -1;
+    }
+    free(tmppath);
 
     return ret;
 }
 
+/**
+ * Take over the chunks of an earlier, interrupted download from the
+ * resume file of the object, if the log area is still the same. Expects
+ * the first chunk to be freshly read.
+ * \return 0 if resumed, else -1
+ */
+static int resume_load(libambit_pmem20_t *object)
+{
+    const char *path = object->ambit_object->log_resume_path;
+    size_t chunks = object->log.mem_size/object->chunk_size + 1;
+    uint8_t magic[PMEM20_RESUME_MAGIC_LEN + 1];
+    uint32_t mem_start, mem_size;
+    uint16_t chunk_size;
+    uint8_t *first_chunk;
+    size_t i, resumed = 0;
+    bool valid;
+    FILE *f;
+
+    if (path == NULL || (f = fopen(path, "rb")) == NULL) {
+        return -1;
+    }
+
+    valid = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+            memcmp(magic, PMEM20_RESUME_MAGIC, PMEM20_RESUME_MAGIC_LEN) == 0 &&
+            magic[PMEM20_RESUME_MAGIC_LEN] == PMEM20_RESUME_VERSION &&
+            fread(&mem_start, sizeof(mem_start), 1, f) == 1 && le32toh(mem_start) == object->log.mem_start &&
+            fread(&mem_size, sizeof(mem_size), 1, f) == 1 && le32toh(mem_size) == object->log.mem_size &&
+            fread(&chunk_size, sizeof(chunk_size), 1, f) == 1 && le16toh(chunk_size) == object->chunk_size;
+
+    if (valid && (first_chunk = malloc(object->chunk_size)) != NULL) {
+        valid = fread(first_chunk, 1, object->chunk_size, f) == object->chunk_size &&
+                memcmp(first_chunk, object->log.buffer, object->chunk_size) == 0;
+        free(first_chunk);
+    }
+    else {
+        valid = false;
+    }
+
+    if (valid) {
+        valid = fread(object->log.chunks_read, 1, chunks, f) == chunks;
+        for (i=0; valid && i<chunks; i++) {
+            if (object->log.chunks_read[i]) {
+                valid = fread(object->log.buffer + i*object->chunk_size, 1, object->chunk_size, f) == object->chunk_size;
+                resumed++;
+            }
+        }
+    }
+    fclose(f);
+
+    if (!valid) {
+        LOG_INFO("Log area changed or resume file broken, downloading from start");
+        memset(object->log.chunks_read, 0, chunks);
+        return -1;
+    }
+
+    LOG_INFO("Resuming log download, %zu chunks already read", resumed);
+
+    return 0;
+}
+
+static void resume_remove(libambit_pmem20_t *object)
+{
+    object->log.chunks_unsaved = 0;
+    if (object->ambit_object->log_resume_path != NULL) {
+        unlink(object->ambit_object->log_resume_path);
+    }
+}
+
 static int write_data_chunk(ambit_object_t *object, uint32_t address, size_t buffer_count, const uint8_t **buffers, const size_t *buffer_sizes)
 {
     int ret = -1;
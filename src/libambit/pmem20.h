@@ -48,6 +48,8 @@ typedef struct libambit_pmem20_s {
         } current;
         uint8_t *buffer;
         uint8_t *chunks_read;
+        uint32_t chunks_unsaved;        /* Read since last resume state save */
+        bool complete;                  /* All entries walked */
     } log;
     ambit_object_t *ambit_object;
 } libambit_pmem20_t;
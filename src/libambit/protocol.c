@@ -22,6 +22,7 @@
 #include "protocol.h"
 #include "libambit_int.h"
 #include "crc16.h"
+#include "debug.h"
 
 #include "hidapi/hidapi.h"
 
@@ -37,6 +38,8 @@
 #define READ_TIMEOUT       20000 // ms
 #define READ_POLL_INTERVAL 100  // ms
 #define READ_POLL_RETRY    (READ_TIMEOUT / READ_POLL_INTERVAL)
+#define SCHED_POLL_INTERVAL 10  // ms, async operations waiting for their turn
+#define STALE_PACKETS_MAX  64   // Leftovers of an earlier, failed reply
 
 typedef struct __attribute__((__packed__)) ambit_msg_header_s {
     uint8_t UId;
@@ -55,6 +58,51 @@ typedef struct __attribute__((__packed__)) ambit_msg_header_s {
 /*
  * Static functions
  */
+/**
+ * Run a single command exchange, without scheduling. The reply goes to
+ * a newly allocated buffer if reply_data is given, else the part of it
+ * starting at reply_skip goes into reply_buf.
+ */
+static int protocol_command(ambit_object_t *object, uint16_t command, uint8_t *data, size_t datalen, uint8_t **reply_data, uint8_t *reply_buf, size_t reply_skip, size_t reply_bufsize, size_t *replylen, uint8_t legacy_format);
+
+/**
+ * Copy the part of a reply packet that falls inside the reply buffer
+ * \param reply_buf Reply buffer
+ * \param reply_skip Reply offset of first byte in buffer
+ * \param reply_bufsize Size of reply buffer
+ * \param offset Reply offset of packet payload
+ * \param payload Packet payload
+ * \param payload_len Length of packet payload
+ */
+static void reply_copy(uint8_t *reply_buf, size_t reply_skip, size_t reply_bufsize, size_t offset, const uint8_t *payload, size_t payload_len);
+
+/**
+ * Wait for our turn to talk to the device
+ * \param object Connection object
+ * \param urgent Go before waiting non-urgent commands
+ * \return 0 on success, -1 if the async operation was cancelled meanwhile
+ */
+static int sched_acquire(ambit_object_t *object, bool urgent);
+
+/**
+ * Let the next command run
+ * \param object Connection object
+ */
+static void sched_release(ambit_object_t *object);
+
+/**
+ * Check if command is short enough to go before bulk transfers
+ */
+static bool command_is_urgent(uint16_t command);
+
+/**
+ * Wait before polling the device again. Async operations hand the thread
+ * back to their queue meanwhile.
+ * \param interval Milliseconds to wait
+ * \return 0 on success, -1 if the async operation was cancelled
+ */
+static int poll_wait(unsigned int interval);
+
 /**
  * Write packet to bus. The data buffer should include space for headers
  * which is automatically filled in.
@@ -72,6 +120,15 @@ static int protocol_write_packet(ambit_object_t *object, uint8_t *data);
  */
 static int protocol_read_packet(ambit_object_t *object, uint8_t *data);
 
+/**
+ * Read first packet of the reply to the current command, skipping
+ * packets left over from earlier replies that failed halfway.
+ * \param object Connection object
+ * \param data Data buffer to write (64 byte)
+ * \return 0 on success, else -1
+ */
+static int protocol_read_reply_start(ambit_object_t *object, uint8_t *data);
+
 /**
  * Finalize packet. Add lengths and calculate checksums
  * \param data Data buffer
@@ -86,7 +143,70 @@ static void finalize_packet(uint8_t *data, uint8_t payload_len);
 /*
  * Public functions
  */
+void libambit_protocol_sched_init(ambit_object_t *object)
+{
+    pthread_mutex_init(&object->sched.mutex, NULL);
+    pthread_cond_init(&object->sched.cond, NULL);
+    object->sched.busy = false;
+    object->sched.urgent_waiting = 0;
+}
+
+void libambit_protocol_sched_deinit(ambit_object_t *object)
+{
+    pthread_cond_destroy(&object->sched.cond);
+    pthread_mutex_destroy(&object->sched.mutex);
+}
+
 int libambit_protocol_command(ambit_object_t *object, uint16_t command, uint8_t *data, size_t datalen, uint8_t **reply_data, size_t *replylen, uint8_t legacy_format)
+{
+    uint64_t trace = libambit_trace_begin();
+    int ret;
+
+    // Async operations hand the thread back between commands, cancelled
+    // ones stop there
+    if (libambit_async_running() && libambit_async_wait(0) != 0) {
+        return -1;
+    }
+
+    if (sched_acquire(object, command_is_urgent(command)) != 0) {
+        return -1;
+    }
+    ret = protocol_command(object, command, data, datalen, reply_data, NULL, 0, 0, replylen, legacy_format);
+    sched_release(object);
+
+    libambit_trace_end("protocol_command", trace, command);
+
+    return ret;
+}
+
+int libambit_protocol_command_buf(ambit_object_t *object, uint16_t command, uint8_t *data, size_t datalen, uint8_t *reply_buf, size_t reply_skip, size_t reply_bufsize, size_t *replylen, uint8_t legacy_format)
+{
+    uint64_t trace = libambit_trace_begin();
+    int ret;
+
+    if (libambit_async_running() && libambit_async_wait(0) != 0) {
+        return -1;
+    }
+
+    if (sched_acquire(object, command_is_urgent(command)) != 0) {
+        return -1;
+    }
+    ret = protocol_command(object, command, data, datalen, NULL, reply_buf, reply_skip, reply_bufsize, replylen, legacy_format);
+    sched_release(object);
+
+    libambit_trace_end("protocol_command", trace, command);
+
+    return ret;
+}
+
+void libambit_protocol_free(uint8_t *data)
+{
+    if (data != NULL) {
+        free(data);
+    }
+}
+
+static int protocol_command(ambit_object_t *object, uint16_t command, uint8_t *data, size_t datalen, uint8_t **reply_data, uint8_t *reply_buf, size_t reply_skip, size_t reply_bufsize, size_t *replylen, uint8_t legacy_format)
 {
     int ret = 0;
     uint8_t buf[64];
@@ -132,16 +252,20 @@ int libambit_protocol_command(ambit_object_t *object, uint16_t command, uint8_t
     }
 
     // Retrieve reply packets
-    if (protocol_read_packet(object, buf) == 0 &&
-        msg->MP == 0x5d && le16toh(msg->sequence) == object->sequence_no) {
+    if (protocol_read_reply_start(object, buf) == 0) {
         reply_data_len = le32toh(msg->payload_len);
         dataoffset = 0;
         packet_payload_len = fmin(42, reply_data_len);
         if (reply_data != NULL && replylen != NULL) {
-            *replylen = reply_data_len;
             *reply_data = malloc(reply_data_len);
-            memcpy(&(*reply_data)[dataoffset], &buf[20], packet_payload_len);
+            reply_buf = *reply_data;
+            reply_skip = 0;
+            reply_bufsize = (reply_buf != NULL ? reply_data_len : 0);
         }
+        if (replylen != NULL) {
+            *replylen = reply_data_len;
+        }
+        reply_copy(reply_buf, reply_skip, reply_bufsize, dataoffset, &buf[20], packet_payload_len);
         dataoffset += packet_payload_len;
         reply_data_len -= packet_payload_len;
 
@@ -150,9 +274,7 @@ int libambit_protocol_command(ambit_object_t *object, uint16_t command, uint8_t
         for (i=2; ret == 0 && i<=msg_parts; i++) {
             if (protocol_read_packet(object, buf) == 0 && msg->MP == 0x5e && le16toh(msg->parts_seq) < msg_parts) {
                 packet_payload_len = fmin(54, reply_data_len);
-                if (reply_data != NULL) {
-                    memcpy(&(*reply_data)[42+(le16toh(msg->parts_seq)-1)*54], &buf[8], packet_payload_len);
-                }
+                reply_copy(reply_buf, reply_skip, reply_bufsize, 42+(le16toh(msg->parts_seq)-1)*54, &buf[8], packet_payload_len);
                 dataoffset += packet_payload_len;
                 reply_data_len -= packet_payload_len;
             }
@@ -171,16 +293,85 @@ int libambit_protocol_command(ambit_object_t *object, uint16_t command, uint8_t
     return ret;
 }
 
-void libambit_protocol_free(uint8_t *data)
+static void reply_copy(uint8_t *reply_buf, size_t reply_skip, size_t reply_bufsize, size_t offset, const uint8_t *payload, size_t payload_len)
 {
-    if (data != NULL) {
-        free(data);
+    size_t start = (offset > reply_skip ? offset : reply_skip);
+    size_t end = offset + payload_len;
+
+    if (end > reply_skip + reply_bufsize) {
+        end = reply_skip + reply_bufsize;
+    }
+    if (reply_buf != NULL && start < end) {
+        memcpy(&reply_buf[start - reply_skip], &payload[start - offset], end - start);
     }
 }
 
+static int sched_acquire(ambit_object_t *object, bool urgent)
+{
+    bool async = libambit_async_running();
+    int ret = 0;
+
+    pthread_mutex_lock(&object->sched.mutex);
+    if (urgent) {
+        object->sched.urgent_waiting++;
+    }
+    while (object->sched.busy || (!urgent && object->sched.urgent_waiting > 0)) {
+        if (async) {
+            // The command in the way may be one of another operation on
+            // this thread, which only goes on once this one hands it back
+            pthread_mutex_unlock(&object->sched.mutex);
+            ret = libambit_async_wait(SCHED_POLL_INTERVAL);
+            pthread_mutex_lock(&object->sched.mutex);
+            if (ret != 0) {
+                break;
+            }
+        }
+        else {
+            pthread_cond_wait(&object->sched.cond, &object->sched.mutex);
+        }
+    }
+    if (urgent) {
+        object->sched.urgent_waiting--;
+    }
+    if (ret == 0) {
+        object->sched.busy = true;
+    }
+    else {
+        // Commands held back by this urgent one may go now
+        pthread_cond_broadcast(&object->sched.cond);
+    }
+    pthread_mutex_unlock(&object->sched.mutex);
+
+    return ret;
+}
+
+static void sched_release(ambit_object_t *object)
+{
+    pthread_mutex_lock(&object->sched.mutex);
+    object->sched.busy = false;
+    pthread_cond_broadcast(&object->sched.cond);
+    pthread_mutex_unlock(&object->sched.mutex);
+}
+
+static bool command_is_urgent(uint16_t command)
+{
+    return command == ambit_command_status;
+}
+
+static int poll_wait(unsigned int interval)
+{
+    if (libambit_async_running()) {
+        return libambit_async_wait(interval);
+    }
+
+    usleep(interval * 1000);
+
+    return 0;
+}
+
 static int protocol_write_packet(ambit_object_t *object, uint8_t *data)
 {
-    hid_write(object->handle, data, 64);
+    object->transport->write(object->handle, data, 64);
 
     return 0;
 }
@@ -189,16 +380,33 @@ static int protocol_read_packet(ambit_object_t *object, uint8_t *data)
 {
     int i, res = -1;
     for (i=0; i<READ_POLL_RETRY; i++) {
-        res = hid_read(object->handle, data, 64);
-        if (res != 0) {
+        res = object->transport->read(object->handle, data, 64);
+        if (res != 0 || poll_wait(READ_POLL_INTERVAL) != 0) {
             break;
         }
-        usleep(READ_POLL_INTERVAL * 1000);
     }
 
     return (res > 0 ? 0 : -1);
 }
 
+static int protocol_read_reply_start(ambit_object_t *object, uint8_t *data)
+{
+    ambit_msg_header_t *msg = (ambit_msg_header_t *)data;
+    int i;
+
+    for (i=0; i<=STALE_PACKETS_MAX; i++) {
+        if (protocol_read_packet(object, data) != 0) {
+            return -1;
+        }
+        if (msg->MP == 0x5d && le16toh(msg->sequence) == object->sequence_no) {
+            return 0;
+        }
+        LOG_WARNING("Dropping stale packet (MP=%02x, sequence=%d, expected %d)", msg->MP, le16toh(msg->sequence), object->sequence_no);
+    }
+
+    return -1;
+}
+
 static void finalize_packet(uint8_t *data, uint8_t payload_len)
 {
     ambit_msg_header_t *msg = (ambit_msg_header_t *)data;
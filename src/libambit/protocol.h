@@ -62,11 +62,32 @@ enum ambit_commands_e {
     ambit_command_unknown8              = 0x1202, // Ambit3 Peak fw 2.0.4
 };
 
+/**
+ * Set up / tear down the command scheduler of an object
+ */
+void libambit_protocol_sched_init(ambit_object_t *object);
+void libambit_protocol_sched_deinit(ambit_object_t *object);
+
 /**
  * Write command to device
+ * Safe to call from several threads on the same object, each command is
+ * run to completion before the next one starts. Short commands (status)
+ * go before any waiting bulk command, so they get through in between the
+ * commands of a long running log read.
  * \param legacy_format 0=normal, 1=legacy, 2=version 2
  */
 int libambit_protocol_command(ambit_object_t *object, uint16_t command, uint8_t *data, size_t datalen, uint8_t **reply_data, size_t *replylen, uint8_t legacy_format);
+/**
+ * Write command to device, reassembling the reply straight into a caller
+ * owned buffer instead of allocating one. Bytes of the reply before
+ * reply_skip or beyond the buffer are dropped.
+ * \param reply_buf Buffer to fill
+ * \param reply_skip Number of leading reply bytes to leave out
+ * \param reply_bufsize Size of reply_buf
+ * \param replylen Set to complete length of reply, including skipped bytes
+ * \param legacy_format 0=normal, 1=legacy, 2=version 2
+ */
+int libambit_protocol_command_buf(ambit_object_t *object, uint16_t command, uint8_t *data, size_t datalen, uint8_t *reply_buf, size_t reply_skip, size_t reply_bufsize, size_t *replylen, uint8_t legacy_format);
 void libambit_protocol_free(uint8_t *data);
 
 #endif /* __PROTOCOL_H__ */
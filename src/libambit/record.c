@@ -0,0 +1,293 @@
+/*
+ * (C) Copyright 2014 Emil Ljungdahl
+ *
+ * This file is part of libambit.
+ *
+ * libambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "record.h"
+#include "transport.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+/*
+ * Local definitions
+ */
+#define RECORD_ENV          "LIBAMBIT_RECORD"
+
+/*
+ * Static functions
+ */
+static struct hid_device_info *record_enumerate(unsigned short vendor_id, unsigned short product_id);
+static hid_device *record_open_path(const char *path);
+static void record_close(hid_device *dev);
+static int record_write(hid_device *dev, const unsigned char *data, size_t length);
+static int record_read(hid_device *dev, unsigned char *data, size_t length);
+static int record_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
+static void record_read_result(const unsigned char *data, int ret);
+static bool record_begin(uint8_t type);
+static void record_varint(uint64_t value);
+static void record_string(const char *str);
+static void record_wstring(const wchar_t *str);
+static void record_u16(uint16_t value);
+static void record_report(const unsigned char *data, int length);
+static void record_atexit(void);
+
+/*
+ * Static variables
+ */
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *record_file = NULL;
+static uint64_t record_last_us;
+static const ambit_transport_t *record_inner = NULL;
+static ambit_transport_t record_transport;
+
+/*
+ * Public functions
+ */
+const ambit_transport_t *libambit_record_wrap(const ambit_transport_t *transport)
+{
+    const char *path = getenv(RECORD_ENV);
+    const ambit_transport_t *ret = transport;
+
+    if (path == NULL || *path == '\0') {
+        return transport;
+    }
+
+    pthread_mutex_lock(&record_mutex);
+    if (record_inner != NULL && record_inner != transport) {
+        // Objects already opened keep calling through record_transport
+        LOG_WARNING("Already recording transport \"%s\", not \"%s\"", record_inner->name, transport->name);
+    }
+    else if (record_inner == NULL) {
+        if ((record_file = fopen(path, "wb")) == NULL) {
+            LOG_ERROR("Failed to open record file %s", path);
+        }
+        else {
+            fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_LEN, record_file);
+            fputc(RECORD_VERSION, record_file);
+            record_last_us = 0;
+            atexit(record_atexit);
+
+            record_inner = transport;
+            record_transport = *transport;
+            record_transport.enumerate = record_enumerate;
+            record_transport.open_path = record_open_path;
+            record_transport.close = record_close;
+            record_transport.write = record_write;
+            record_transport.read = record_read;
+            record_transport.read_timeout = record_read_timeout;
+            LOG_INFO("Recording transport \"%s\" to %s", transport->name, path);
+        }
+    }
+    if (record_inner == transport) {
+        ret = &record_transport;
+    }
+    pthread_mutex_unlock(&record_mutex);
+
+    return ret;
+}
+
+/*
+ * Static functions
+ */
+static struct hid_device_info *record_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    struct hid_device_info *devs = record_inner->enumerate(vendor_id, product_id), *dev;
+
+    pthread_mutex_lock(&record_mutex);
+    for (dev = devs; dev != NULL && record_begin(RECORD_DEVICE); dev = dev->next) {
+        record_u16(dev->vendor_id);
+        record_u16(dev->product_id);
+        record_u16(dev->release_number);
+        record_string(dev->path);
+        record_wstring(dev->serial_number);
+        record_wstring(dev->manufacturer_string);
+        record_wstring(dev->product_string);
+    }
+    pthread_mutex_unlock(&record_mutex);
+
+    return devs;
+}
+
+static hid_device *record_open_path(const char *path)
+{
+    hid_device *dev = record_inner->open_path(path);
+
+    if (dev != NULL) {
+        pthread_mutex_lock(&record_mutex);
+        if (record_begin(RECORD_OPEN)) {
+            record_string(path);
+        }
+        pthread_mutex_unlock(&record_mutex);
+    }
+
+    return dev;
+}
+
+static void record_close(hid_device *dev)
+{
+    record_inner->close(dev);
+
+    pthread_mutex_lock(&record_mutex);
+    if (record_begin(RECORD_CLOSE)) {
+        fflush(record_file);
+    }
+    pthread_mutex_unlock(&record_mutex);
+}
+
+static int record_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+    pthread_mutex_lock(&record_mutex);
+    if (record_begin(RECORD_WRITE)) {
+        record_report(data, length);
+    }
+    pthread_mutex_unlock(&record_mutex);
+
+    return record_inner->write(dev, data, length);
+}
+
+static int record_read(hid_device *dev, unsigned char *data, size_t length)
+{
+    int ret = record_inner->read(dev, data, length);
+
+    record_read_result(data, ret);
+
+    return ret;
+}
+
+static int record_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+    int ret = record_inner->read_timeout(dev, data, length, milliseconds);
+
+    record_read_result(data, ret);
+
+    return ret;
+}
+
+static void record_read_result(const unsigned char *data, int ret)
+{
+    // Empty polls would only bloat the file
+    if (ret == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&record_mutex);
+    if (ret > 0 && record_begin(RECORD_READ)) {
+        record_report(data, ret);
+    }
+    else if (ret < 0) {
+        record_begin(RECORD_READ_ERROR);
+    }
+    pthread_mutex_unlock(&record_mutex);
+}
+
+/**
+ * Start record, stamped with the time since the last one. Caller holds
+ * record_mutex.
+ * \return true if the payload should follow, false once the file is closed
+ */
+static bool record_begin(uint8_t type)
+{
+    struct timespec ts;
+    uint64_t now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (record_last_us == 0) {
+        record_last_us = now;
+    }
+
+    if (record_file == NULL) {
+        return false;
+    }
+
+    fputc(type, record_file);
+    record_varint(now - record_last_us);
+    record_last_us = now;
+
+    return true;
+}
+
+static void record_varint(uint64_t value)
+{
+    while (value >= 0x80) {
+        fputc((value & 0x7f) | 0x80, record_file);
+        value >>= 7;
+    }
+    fputc(value, record_file);
+}
+
+static void record_string(const char *str)
+{
+    size_t len = str != NULL ? strlen(str) : 0;
+
+    record_varint(len);
+    fwrite(str, 1, len, record_file);
+}
+
+static void record_wstring(const wchar_t *str)
+{
+    char *utf8 = NULL;
+    size_t len;
+
+    if (str != NULL && (len = wcstombs(NULL, str, 0)) != (size_t)-1) {
+        if ((utf8 = malloc(len + 1)) != NULL) {
+            wcstombs(utf8, str, len + 1);
+        }
+    }
+    record_string(utf8);
+    free(utf8);
+}
+
+static void record_u16(uint16_t value)
+{
+    fputc(value & 0xff, record_file);
+    fputc(value >> 8, record_file);
+}
+
+static void record_report(const unsigned char *data, int length)
+{
+    // Only up to the payload checksum, the rest is padding
+    if (length > 2 && data[1] + 2 < length) {
+        length = data[1] + 2;
+    }
+    if (length > 0xff) {
+        length = 0xff;
+    }
+
+    fputc(length, record_file);
+    fwrite(data, 1, length, record_file);
+}
+
+static void record_atexit(void)
+{
+    pthread_mutex_lock(&record_mutex);
+    if (record_file != NULL) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+    pthread_mutex_unlock(&record_mutex);
+}
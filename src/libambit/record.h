@@ -0,0 +1,59 @@
+/*
+ * (C) Copyright 2014 Emil Ljungdahl
+ *
+ * This file is part of libambit.
+ *
+ * libambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+/*
+ * Session recording format, written when LIBAMBIT_RECORD names a file
+ * (see record.c) and replayed by the replay transport
+ * (hidapi/hid-replay.c).
+ *
+ * The file starts with RECORD_MAGIC and RECORD_VERSION (1 byte),
+ * followed by records of
+ *   type (1 byte), µs since the previous record (LEB128 varint), payload
+ *
+ * Payloads by type:
+ *   RECORD_DEVICE      vendor id, product id, release (16 bit little
+ *                      endian each), then path, serial number,
+ *                      manufacturer and product as strings
+ *   RECORD_OPEN        path as string
+ *   RECORD_CLOSE       none
+ *   RECORD_WRITE       report length (1 byte) and report
+ *   RECORD_READ        report length (1 byte) and report
+ *   RECORD_READ_ERROR  none, a read that failed
+ *
+ * Strings are a varint length and UTF-8 without terminator. Reports are
+ * cut after their payload checksum, the rest is padding. Empty polling
+ * reads are not recorded.
+ */
+#define RECORD_MAGIC        "AMBITREC"
+#define RECORD_MAGIC_LEN    8
+#define RECORD_VERSION      1
+
+#define RECORD_DEVICE       'D'
+#define RECORD_OPEN         'O'
+#define RECORD_CLOSE        'C'
+#define RECORD_WRITE        'W'
+#define RECORD_READ         'R'
+#define RECORD_READ_ERROR   'E'
+
+#endif /* __RECORD_H__ */
@@ -19,10 +19,17 @@
  * Contributors:
  *
  */
+#include <pthread.h>
 #include <string.h>
 
 #include "sha256.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_HAVE_SHANI 1
+#endif
+
 /*
  * Local definitions
  */
@@ -35,11 +42,29 @@
 #define SIG0(x)       (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
 #define SIG1(x)       (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
 
+// One round with the message schedule kept in a 16 word ring
+#define ROUND(a,b,c,d,e,f,g,h,i) \
+    do { \
+        if ((i) >= 16) { \
+            m[(i)&15] += SIG1(m[((i)-2)&15]) + m[((i)-7)&15] + SIG0(m[((i)-15)&15]); \
+        } \
+        t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[(i)&15]; \
+        d += t1; \
+        h = t1 + EP0(a) + MAJ(a,b,c); \
+    } while (0)
+
+typedef void (*sha256_transform_fn)(uint32_t *state, const uint8_t *data, size_t blocks);
 
 /*
  * Static functions
  */
-static void sha256_transform(sha256_ctx *ctx, const uint8_t *data);
+static void sha256_transform_generic(uint32_t *state, const uint8_t *data, size_t blocks);
+#ifdef SHA256_HAVE_SHANI
+static void sha256_transform_shani(uint32_t *state, const uint8_t *data, size_t blocks);
+static int cpu_has_shani(void);
+#endif
+static sha256_transform_fn sha256_transform(void);
+static void sha256_auto_init(void);
 
 /*
  * Static variables
@@ -66,6 +91,16 @@ static const uint32_t k[SHA256_BLOCK_SIZE] = {
     0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
 };
 
+// Fastest block transform supported by the CPU, resolved once
+static pthread_once_t auto_once = PTHREAD_ONCE_INIT;
+static sha256_transform_fn auto_fn = sha256_transform_generic;
+static sha256_impl_t auto_impl = sha256_impl_generic;
+
+// Forced block transform, NULL for the automatic one. Only accessed
+// atomically, orbit writes of several devices may hash concurrently
+static sha256_transform_fn transform_fn = NULL;
+static sha256_impl_t transform_impl = sha256_impl_auto;
+
 /*
  * Public functions
  */
@@ -90,20 +125,47 @@ void sha256_init(sha256_ctx *ctx)
 
 void sha256_update(sha256_ctx *ctx, const uint8_t *data, size_t len)
 {
-    size_t i;
+    sha256_transform_fn transform = sha256_transform();
+    size_t fill, blocks;
+
+    // Top up a partially filled block first
+    if (ctx->datalen > 0) {
+        fill = SHA256_BLOCK_SIZE - ctx->datalen;
+        if (fill > len) {
+            fill = len;
+        }
+        memcpy(ctx->data + ctx->datalen, data, fill);
+        ctx->datalen += fill;
+        data += fill;
+        len -= fill;
 
-    for (i=0; i<len; i++) {
-        ctx->data[ctx->datalen++] = data[i];
-        if (ctx->datalen == SHA256_BLOCK_SIZE) {
-            sha256_transform(ctx, ctx->data);
-            ctx->bitlen += 512;
-            ctx->datalen = 0;
+        if (ctx->datalen < SHA256_BLOCK_SIZE) {
+            return;
         }
+        transform(ctx->h, ctx->data, 1);
+        ctx->bitlen += 512;
+        ctx->datalen = 0;
+    }
+
+    // Hash whole blocks straight from the input buffer
+    blocks = len / SHA256_BLOCK_SIZE;
+    if (blocks > 0) {
+        transform(ctx->h, data, blocks);
+        ctx->bitlen += 512 * (uint64_t)blocks;
+        data += blocks * SHA256_BLOCK_SIZE;
+        len -= blocks * SHA256_BLOCK_SIZE;
+    }
+
+    // Keep the tail for the next update (or final)
+    if (len > 0) {
+        memcpy(ctx->data, data, len);
+        ctx->datalen = len;
     }
 }
 
 void sha256_final(sha256_ctx *ctx, uint8_t *hash)
 {
+    sha256_transform_fn transform = sha256_transform();
     uint32_t i;
 
     i = ctx->datalen;
@@ -122,7 +184,7 @@ void sha256_final(sha256_ctx *ctx, uint8_t *hash)
         while (i < 64) {
             ctx->data[i++] = 0x00;
         }
-        sha256_transform(ctx, ctx->data);
+        transform(ctx->h, ctx->data, 1);
         memset(ctx->data, 0, 56);
     }
 
@@ -131,7 +193,7 @@ void sha256_final(sha256_ctx *ctx, uint8_t *hash)
     for (i=0; i<8; i++) {
         ctx->data[63-i] = ctx->bitlen >> (8*i);
     }
-    sha256_transform(ctx, ctx->data);
+    transform(ctx->h, ctx->data, 1);
 
     // Get hash (stored as 8 (4-byte) words)
     for (i=0; i<8; i++) {
@@ -142,35 +204,196 @@ void sha256_final(sha256_ctx *ctx, uint8_t *hash)
     }
 }
 
-static void sha256_transform(sha256_ctx *ctx, const uint8_t *data)
+int sha256_select_impl(sha256_impl_t impl)
+{
+    sha256_transform_fn fn;
+
+    switch (impl) {
+      case sha256_impl_auto:
+        fn = NULL;
+        break;
+      case sha256_impl_generic:
+        fn = sha256_transform_generic;
+        break;
+      case sha256_impl_shani:
+#ifdef SHA256_HAVE_SHANI
+        if (cpu_has_shani()) {
+            fn = sha256_transform_shani;
+            break;
+        }
+#endif
+        return -1;
+      default:
+        return -1;
+    }
+
+    __atomic_store_n(&transform_impl, impl, __ATOMIC_RELAXED);
+    __atomic_store_n(&transform_fn, fn, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+const char *sha256_impl_name(void)
+{
+    sha256_impl_t impl = __atomic_load_n(&transform_impl, __ATOMIC_RELAXED);
+
+    if (impl == sha256_impl_auto) {
+        pthread_once(&auto_once, sha256_auto_init);
+        impl = auto_impl;
+    }
+
+    switch (impl) {
+      case sha256_impl_shani:
+        return "sha-ni";
+      case sha256_impl_generic:
+      default:
+        return "generic";
+    }
+}
+
+/**
+ * Get block transform to use, picks the fastest one supported by the CPU
+ * the first time it is called.
+ */
+static sha256_transform_fn sha256_transform(void)
+{
+    sha256_transform_fn fn = __atomic_load_n(&transform_fn, __ATOMIC_ACQUIRE);
+
+    if (fn == NULL) {
+        pthread_once(&auto_once, sha256_auto_init);
+        fn = auto_fn;
+    }
+
+    return fn;
+}
+
+static void sha256_auto_init(void)
+{
+#ifdef SHA256_HAVE_SHANI
+    if (cpu_has_shani()) {
+        auto_impl = sha256_impl_shani;
+        auto_fn = sha256_transform_shani;
+    }
+#endif
+}
+
+static void sha256_transform_generic(uint32_t *state, const uint8_t *data, size_t blocks)
 {
     size_t i;
-    uint32_t m[64];
-    uint32_t th[8];
-    uint32_t t1, t2;
+    uint32_t m[16];
+    uint32_t a, b, c, d, e, f, g, hh;
+    uint32_t t1;
+
+    while (blocks--) {
+        for (i=0; i<16; i++) {
+            m[i] = ((uint32_t)data[(i<<2)] << 24) | (data[(i<<2)+1] << 16) | (data[(i<<2)+2] << 8) | (data[(i<<2)+3]);
+        }
 
-    for (i=0; i<16; i++) {
-        m[i] = (data[(i<<2)] << 24) | (data[(i<<2)+1] << 16) | (data[(i<<2)+2] << 8) | (data[(i<<2)+3]);
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; hh = state[7];
+
+        // Rotate variable names instead of values, 8 rounds per turn
+        for (i=0; i<64; i+=8) {
+            ROUND(a,b,c,d,e,f,g,hh,i);
+            ROUND(hh,a,b,c,d,e,f,g,i+1);
+            ROUND(g,hh,a,b,c,d,e,f,i+2);
+            ROUND(f,g,hh,a,b,c,d,e,i+3);
+            ROUND(e,f,g,hh,a,b,c,d,i+4);
+            ROUND(d,e,f,g,hh,a,b,c,i+5);
+            ROUND(c,d,e,f,g,hh,a,b,i+6);
+            ROUND(b,c,d,e,f,g,hh,a,i+7);
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += hh;
+
+        data += SHA256_BLOCK_SIZE;
     }
-    for (i=16; i<64; i++) {
-        m[i] = SIG1(m[i-2]) + m[i-7] + SIG0(m[i-15]) + m[i-16];
+}
+
+#ifdef SHA256_HAVE_SHANI
+static int cpu_has_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    // SSSE3 + SSE4.1 are needed for the byte shuffles and blends
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+        !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
     }
-    for (i=0; i<8; i++) {
-        th[i] = ctx->h[i];
-    }
-    for (i=0; i<64; i++) {
-        t1 = th[7] + EP1(th[4]) + CH(th[4], th[5], th[6]) + k[i] + m[i];
-        t2 = EP0(th[0]) + MAJ(th[0], th[1], th[2]);
-        th[7] = th[6];
-        th[6] = th[5];
-        th[5] = th[4];
-        th[4] = th[3] + t1;
-        th[3] = th[2];
-        th[2] = th[1];
-        th[1] = th[0];
-        th[0] = t1 + t2;
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
     }
-    for (i=0; i<8; i++) {
-        ctx->h[i] += th[i];
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    return (ebx & (1 << 29)) != 0;
+}
+
+// Four rounds using (pre-scheduled) message words in msg
+#define SHANI_ROUNDS(msg, i) \
+    do { \
+        tmp = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i *)&k[i])); \
+        state1 = _mm_sha256rnds2_epu32(state1, state0, tmp); \
+        tmp = _mm_shuffle_epi32(tmp, 0x0e); \
+        state0 = _mm_sha256rnds2_epu32(state0, state1, tmp); \
+    } while (0)
+#define SHANI_SCHED1(prev, cur) \
+    prev = _mm_sha256msg1_epu32(prev, cur)
+#define SHANI_SCHED2(next, cur, prev) \
+    next = _mm_sha256msg2_epu32(_mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4)), cur)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_transform_shani(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, save0, save1, tmp;
+    __m128i msg0, msg1, msg2, msg3;
+
+    // Reorder state to the ABEF/CDGH layout used by the SHA instructions
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks--) {
+        save0 = state0;
+        save1 = state1;
+
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), bswap);
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+
+        SHANI_ROUNDS(msg0, 0);
+        SHANI_ROUNDS(msg1, 4);  SHANI_SCHED1(msg0, msg1);
+        SHANI_ROUNDS(msg2, 8);  SHANI_SCHED1(msg1, msg2);
+        SHANI_ROUNDS(msg3, 12); SHANI_SCHED2(msg0, msg3, msg2); SHANI_SCHED1(msg2, msg3);
+        SHANI_ROUNDS(msg0, 16); SHANI_SCHED2(msg1, msg0, msg3); SHANI_SCHED1(msg3, msg0);
+        SHANI_ROUNDS(msg1, 20); SHANI_SCHED2(msg2, msg1, msg0); SHANI_SCHED1(msg0, msg1);
+        SHANI_ROUNDS(msg2, 24); SHANI_SCHED2(msg3, msg2, msg1); SHANI_SCHED1(msg1, msg2);
+        SHANI_ROUNDS(msg3, 28); SHANI_SCHED2(msg0, msg3, msg2); SHANI_SCHED1(msg2, msg3);
+        SHANI_ROUNDS(msg0, 32); SHANI_SCHED2(msg1, msg0, msg3); SHANI_SCHED1(msg3, msg0);
+        SHANI_ROUNDS(msg1, 36); SHANI_SCHED2(msg2, msg1, msg0); SHANI_SCHED1(msg0, msg1);
+        SHANI_ROUNDS(msg2, 40); SHANI_SCHED2(msg3, msg2, msg1); SHANI_SCHED1(msg1, msg2);
+        SHANI_ROUNDS(msg3, 44); SHANI_SCHED2(msg0, msg3, msg2); SHANI_SCHED1(msg2, msg3);
+        SHANI_ROUNDS(msg0, 48); SHANI_SCHED2(msg1, msg0, msg3); SHANI_SCHED1(msg3, msg0);
+        SHANI_ROUNDS(msg1, 52); SHANI_SCHED2(msg2, msg1, msg0);
+        SHANI_ROUNDS(msg2, 56); SHANI_SCHED2(msg3, msg2, msg1);
+        SHANI_ROUNDS(msg3, 60);
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+
+        data += SHA256_BLOCK_SIZE;
     }
+
+    // Back to the A..H order
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
 }
+#endif
@@ -34,9 +34,27 @@ typedef struct {
     uint32_t h[8];
 } sha256_ctx;
 
+typedef enum sha256_impl_e {
+    sha256_impl_auto,                   /* Fastest supported by the CPU */
+    sha256_impl_generic,
+    sha256_impl_shani                   /* x86 SHA extensions */
+} sha256_impl_t;
+
 void sha256(const uint8_t *data, size_t len, uint8_t *hash);
 void sha256_init(sha256_ctx *ctx);
 void sha256_update(sha256_ctx *ctx, const uint8_t *data, size_t len);
 void sha256_final(sha256_ctx *ctx, uint8_t *hash);
 
+/**
+ * Force a specific block transform implementation (mainly for benchmarks)
+ * \param impl Implementation to use
+ * \return 0 on success, -1 if not supported on this CPU
+ */
+int sha256_select_impl(sha256_impl_t impl);
+
+/**
+ * Get name of the block transform currently in use
+ */
+const char *sha256_impl_name(void);
+
 #endif /* __SHA256_H__ */
@@ -0,0 +1,226 @@
+/*
+ * (C) Copyright 2014 Emil Ljungdahl
+ *
+ * This file is part of libambit.
+ *
+ * libambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "libambit.h"
+#include "libambit_int.h"
+#include "debug.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * Local definitions
+ */
+#define TRACE_RING_SIZE 16384           // Events kept per thread
+
+typedef struct trace_event_s {
+    const char *name;
+    uint64_t ts;                        // ns, CLOCK_MONOTONIC
+    uint64_t dur;
+    int64_t arg;
+    pid_t tid;
+} trace_event_t;
+
+// Only written by the thread owning it, rings of finished threads are
+// handed to new ones so that short lived async threads reuse them
+typedef struct trace_ring_s {
+    struct trace_ring_s *next;
+    bool in_use;                        // protected by trace_mutex
+    uint32_t head;                      // events written in total
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+/*
+ * Static functions
+ */
+static void trace_init(void);
+static void trace_atexit(void);
+static void trace_ring_release(void *ring);
+static trace_ring_t *trace_ring_get(void);
+static uint64_t trace_now(void);
+
+/*
+ * Static variables
+ */
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static bool trace_enabled = false;
+static char *trace_path = NULL;
+static trace_ring_t *trace_rings = NULL;
+
+/*
+ * Public functions
+ */
+uint64_t libambit_trace_begin(void)
+{
+    pthread_once(&trace_once, trace_init);
+
+    if (!trace_enabled) {
+        return 0;
+    }
+
+    return trace_now();
+}
+
+void libambit_trace_end(const char *name, uint64_t begin, int64_t arg)
+{
+    trace_ring_t *ring;
+    trace_event_t *event;
+    uint64_t now;
+
+    if (begin == 0 || (ring = trace_ring_get()) == NULL) {
+        return;
+    }
+
+    now = trace_now();
+    event = &ring->events[ring->head % TRACE_RING_SIZE];
+    event->name = name;
+    event->ts = begin;
+    event->dur = now - begin;
+    event->arg = arg;
+    event->tid = syscall(SYS_gettid);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+int libambit_trace_dump(const char *path)
+{
+    FILE *f;
+    trace_ring_t *ring;
+    trace_event_t *event;
+    uint32_t head, i, count;
+    bool first = true;
+    pid_t pid = getpid();
+
+    if (path == NULL) {
+        path = trace_path;
+    }
+    if (path == NULL) {
+        return -1;
+    }
+
+    if ((f = fopen(path, "w")) == NULL) {
+        LOG_ERROR("Failed to open trace file %s", path);
+        return -1;
+    }
+
+    // Chrome trace event format, complete events with µs timestamps
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    pthread_mutex_lock(&trace_mutex);
+    for (ring = trace_rings; ring != NULL; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+        for (i = head - count; i != head; i++) {
+            event = &ring->events[i % TRACE_RING_SIZE];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"libambit\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,\"args\":{\"arg\":%" PRId64 "}}",
+                    first ? "" : ",", event->name, (int)pid, (int)event->tid,
+                    event->ts / 1000, (unsigned int)(event->ts % 1000),
+                    event->dur / 1000, (unsigned int)(event->dur % 1000), event->arg);
+            first = false;
+        }
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        LOG_ERROR("Failed to write trace file %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Static functions
+ */
+static void trace_init(void)
+{
+    const char *path = getenv("LIBAMBIT_TRACE");
+
+    if (path == NULL || *path == '\0' || pthread_key_create(&trace_key, trace_ring_release) != 0) {
+        return;
+    }
+
+    trace_path = strdup(path);
+    trace_enabled = trace_path != NULL;
+    if (trace_enabled) {
+        LOG_INFO("Tracing to %s", trace_path);
+        atexit(trace_atexit);
+    }
+}
+
+static void trace_atexit(void)
+{
+    libambit_trace_dump(NULL);
+}
+
+static void trace_ring_release(void *ring)
+{
+    pthread_mutex_lock(&trace_mutex);
+    ((trace_ring_t *)ring)->in_use = false;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static trace_ring_t *trace_ring_get(void)
+{
+    trace_ring_t *ring = pthread_getspecific(trace_key);
+
+    if (ring != NULL) {
+        return ring;
+    }
+
+    pthread_mutex_lock(&trace_mutex);
+    for (ring = trace_rings; ring != NULL; ring = ring->next) {
+        if (!ring->in_use) {
+            break;
+        }
+    }
+    if (ring == NULL && (ring = calloc(1, sizeof(trace_ring_t))) != NULL) {
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    if (ring != NULL) {
+        ring->in_use = true;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (ring != NULL) {
+        pthread_setspecific(trace_key, ring);
+    }
+
+    return ring;
+}
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,233 @@
+/*
+ * (C) Copyright 2014 Emil Ljungdahl
+ *
+ * This file is part of libambit.
+ *
+ * libambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "libambit.h"
+#include "transport.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Local definitions
+ */
+#define TRANSPORT_ENV       "LIBAMBIT_TRANSPORT"
+#define SUUNTO_USB_VENDOR   0x1493
+
+/*
+ * Declare the API of a backend built with HIDAPI_NAMESPACE=ns (see
+ * hidapi/hidapi.h) and a transport wrapping it. stats is the backend's
+ * hid_get_input_stats(), or NULL if it has none.
+ */
+#define TRANSPORT_DEFINE(ns, hw, udev, stats) \
+    int ns##_hid_init(void); \
+    int ns##_hid_exit(void); \
+    struct hid_device_info *ns##_hid_enumerate(unsigned short vendor_id, unsigned short product_id); \
+    void ns##_hid_free_enumeration(struct hid_device_info *devs); \
+    hid_device *ns##_hid_open_path(const char *path); \
+    void ns##_hid_close(hid_device *dev); \
+    int ns##_hid_write(hid_device *dev, const unsigned char *data, size_t length); \
+    int ns##_hid_read(hid_device *dev, unsigned char *data, size_t length); \
+    int ns##_hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds); \
+    int ns##_hid_set_nonblocking(hid_device *dev, int nonblock); \
+    static const ambit_transport_t transport_##ns = { \
+        #ns, hw, udev, \
+        ns##_hid_init, ns##_hid_exit, \
+        ns##_hid_enumerate, ns##_hid_free_enumeration, \
+        ns##_hid_open_path, ns##_hid_close, \
+        ns##_hid_write, ns##_hid_read, ns##_hid_read_timeout, \
+        ns##_hid_set_nonblocking, stats \
+    }
+
+#ifdef LIBAMBIT_TRANSPORT_HIDRAW
+TRANSPORT_DEFINE(hidraw, true, true, NULL);
+#endif
+#ifdef LIBAMBIT_TRANSPORT_LIBUSB
+int libusb_hid_get_input_stats(hid_device *dev, unsigned int *dropped, unsigned int *late);
+TRANSPORT_DEFINE(libusb, true, false, libusb_hid_get_input_stats);
+#endif
+#ifdef LIBAMBIT_TRANSPORT_PCAP
+TRANSPORT_DEFINE(pcap, false, false, NULL);
+#endif
+TRANSPORT_DEFINE(replay, false, false, NULL);
+TRANSPORT_DEFINE(emulator, false, false, NULL);
+TRANSPORT_DEFINE(loopback, false, false, NULL);
+
+/*
+ * Static functions
+ */
+static const ambit_transport_t *transport_auto(void);
+
+/*
+ * Static variables
+ */
+// In order of preference for automatic selection. hidraw reads come
+// straight from the kernel while libusb hands them over from a thread.
+static const ambit_transport_t *transports[] = {
+#ifdef LIBAMBIT_TRANSPORT_HIDRAW
+    &transport_hidraw,
+#endif
+#ifdef LIBAMBIT_TRANSPORT_LIBUSB
+    &transport_libusb,
+#endif
+#ifdef LIBAMBIT_TRANSPORT_PCAP
+    &transport_pcap,
+#endif
+    &transport_replay,
+    &transport_emulator,
+    &transport_loopback,
+    NULL
+};
+
+static const ambit_transport_t *transport_current = NULL;
+static pthread_mutex_t transport_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Public functions
+ */
+int libambit_transport_set(const char *name)
+{
+    const ambit_transport_t *transport;
+
+    if (name == NULL || strcmp(name, "auto") == 0) {
+        transport = transport_auto();
+    }
+    else {
+        transport = libambit_transport_find(name);
+        if (transport == NULL) {
+            LOG_ERROR("Transport \"%s\" is not built into libambit", name);
+            return -1;
+        }
+        if (transport->init() != 0) {
+            LOG_ERROR("Failed to initialize transport \"%s\"", name);
+            return -1;
+        }
+    }
+
+    transport = libambit_record_wrap(transport);
+
+    pthread_mutex_lock(&transport_mutex);
+    transport_current = transport;
+    pthread_mutex_unlock(&transport_mutex);
+
+    LOG_INFO("Using transport \"%s\"", transport->name);
+
+    return 0;
+}
+
+const char * libambit_transport_name(void)
+{
+    return libambit_transport()->name;
+}
+
+const char ** libambit_transport_list(void)
+{
+    static const char *names[sizeof(transports)/sizeof(transports[0])];
+    int i;
+
+    for (i=0; transports[i] != NULL; i++) {
+        names[i] = transports[i]->name;
+    }
+    names[i] = NULL;
+
+    return names;
+}
+
+const ambit_transport_t *libambit_transport(void)
+{
+    const char *name;
+    const ambit_transport_t *transport;
+
+    pthread_mutex_lock(&transport_mutex);
+    transport = transport_current;
+    pthread_mutex_unlock(&transport_mutex);
+
+    if (transport == NULL) {
+        name = getenv(TRANSPORT_ENV);
+#ifdef LIBAMBIT_TRANSPORT_DEFAULT
+        if (name == NULL) {
+            name = LIBAMBIT_TRANSPORT_DEFAULT;
+        }
+#endif
+        if (libambit_transport_set(name) != 0) {
+            libambit_transport_set(NULL);
+        }
+
+        pthread_mutex_lock(&transport_mutex);
+        transport = transport_current;
+        pthread_mutex_unlock(&transport_mutex);
+    }
+
+    return transport;
+}
+
+const ambit_transport_t *libambit_transport_find(const char *name)
+{
+    int i;
+
+    for (i=0; transports[i] != NULL; i++) {
+        if (strcmp(transports[i]->name, name) == 0) {
+            return transports[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Static functions
+ */
+/**
+ * Pick the first hardware transport that sees a Suunto device, else the
+ * first one that initializes at all. loopback always does, so this never
+ * returns NULL.
+ */
+static const ambit_transport_t *transport_auto(void)
+{
+    const ambit_transport_t *fallback = NULL;
+    struct hid_device_info *devs;
+    int i;
+
+    for (i=0; transports[i] != NULL; i++) {
+        if (!transports[i]->hardware || transports[i]->init() != 0) {
+            continue;
+        }
+
+        devs = transports[i]->enumerate(SUUNTO_USB_VENDOR, 0);
+        if (devs != NULL) {
+            transports[i]->free_enumeration(devs);
+            return transports[i];
+        }
+        if (fallback == NULL) {
+            fallback = transports[i];
+        }
+    }
+
+    // Nothing to talk to real clocks with, use whatever is built in
+    for (i=0; fallback == NULL && transports[i] != NULL; i++) {
+        if (!transports[i]->hardware && transports[i]->init() == 0) {
+            fallback = transports[i];
+        }
+    }
+
+    return fallback;
+}
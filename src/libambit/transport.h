@@ -0,0 +1,72 @@
+/*
+ * (C) Copyright 2014 Emil Ljungdahl
+ *
+ * This file is part of libambit.
+ *
+ * libambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "hidapi/hidapi.h"
+
+/**
+ * One hidapi backend. Several are built into libambit and the one to
+ * use is picked at runtime, see transport.c
+ */
+typedef struct ambit_transport_s {
+    const char *name;
+    bool hardware;                      /* Talks to real clocks */
+    bool udev_hotplug;                  /* Paths are hidraw nodes */
+
+    int (*init)(void);
+    int (*exit)(void);
+    struct hid_device_info *(*enumerate)(unsigned short vendor_id, unsigned short product_id);
+    void (*free_enumeration)(struct hid_device_info *devs);
+    hid_device *(*open_path)(const char *path);
+    void (*close)(hid_device *dev);
+    int (*write)(hid_device *dev, const unsigned char *data, size_t length);
+    int (*read)(hid_device *dev, unsigned char *data, size_t length);
+    int (*read_timeout)(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
+    int (*set_nonblocking)(hid_device *dev, int nonblock);
+    int (*input_stats)(hid_device *dev, unsigned int *dropped, unsigned int *late); /* NULL if not counted */
+} ambit_transport_t;
+
+/**
+ * Get transport in use, resolving the default on first call
+ * \return Transport, never NULL
+ */
+const ambit_transport_t *libambit_transport(void);
+
+/**
+ * Find a built in transport by name
+ * \param name Transport name
+ * \return Transport, or NULL if not built in
+ */
+const ambit_transport_t *libambit_transport_find(const char *name);
+
+/**
+ * Wrap transport so that everything passing through it is recorded to
+ * the file named by LIBAMBIT_RECORD, see record.h
+ * \param transport Initialized transport
+ * \return Recording transport, or transport itself when not recording
+ */
+const ambit_transport_t *libambit_record_wrap(const ambit_transport_t *transport);
+
+#endif /* __TRANSPORT_H__ */
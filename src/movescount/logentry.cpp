@@ -20,78 +20,16 @@
  *
  */
 #include "logentry.h"
+#include "logstore.h"
 
-LogEntry::LogEntry() :
+LogEntryData::LogEntryData() :
     personalSettings(NULL),
-    logEntry(NULL)
+    logEntry(NULL),
+    samplesOffset(-1)
 {
 }
 
-LogEntry::LogEntry(const LogEntry &other)
-{
-    u_int32_t i;
-
-    device = other.device;
-    time = other.time;
-    movescountId = other.movescountId;
-    deviceInfo = other.deviceInfo;
-
-    if (other.personalSettings != NULL) {
-        personalSettings = (ambit_personal_settings_t*)malloc(sizeof(ambit_personal_settings_t));
-        memcpy(personalSettings, other.personalSettings, sizeof(ambit_personal_settings_t));
-    }
-    else {
-        personalSettings = NULL;
-    }
-
-    if (other.logEntry != NULL) {
-        logEntry = (ambit_log_entry_t*)malloc(sizeof(ambit_log_entry_t));
-        memcpy(logEntry, other.logEntry, sizeof(ambit_log_entry_t));
-        if (other.logEntry->header.activity_name) {
-            logEntry->header.activity_name = strdup(other.logEntry->header.activity_name);
-        }
-        if (other.logEntry->samples != NULL) {
-            logEntry->samples = (ambit_log_sample_t*)malloc(sizeof(ambit_log_sample_t)*other.logEntry->samples_count);
-            memcpy(logEntry->samples, other.logEntry->samples, sizeof(ambit_log_sample_t)*other.logEntry->samples_count);
-            for (i=0; i<other.logEntry->samples_count; i++) {
-                if (other.logEntry->samples[i].type == ambit_log_sample_type_periodic) {
-                    if (other.logEntry->samples[i].u.periodic.values != NULL) {
-                        logEntry->samples[i].u.periodic.values = (ambit_log_sample_periodic_value_t*)malloc(sizeof(ambit_log_sample_periodic_value_t)*other.logEntry->samples[i].u.periodic.value_count);
-                        memcpy(logEntry->samples[i].u.periodic.values, other.logEntry->samples[i].u.periodic.values, sizeof(ambit_log_sample_periodic_value_t)*other.logEntry->samples[i].u.periodic.value_count);
-                    }
-                }
-                if (other.logEntry->samples[i].type == ambit_log_sample_type_gps_base) {
-                    if (other.logEntry->samples[i].u.gps_base.satellites != NULL) {
-                        logEntry->samples[i].u.gps_base.satellites = (ambit_log_gps_satellite_t*)malloc(sizeof(ambit_log_gps_satellite_t)*logEntry->samples[i].u.gps_base.satellites_count);
-                        memcpy(logEntry->samples[i].u.gps_base.satellites, other.logEntry->samples[i].u.gps_base.satellites, sizeof(ambit_log_gps_satellite_t)*logEntry->samples[i].u.gps_base.satellites_count);
-                    }
-                }
-                if (other.logEntry->samples[i].type == ambit_log_sample_type_unknown) {
-                    if (other.logEntry->samples[i].u.unknown.datalen > 0 && other.logEntry->samples[i].u.unknown.data != NULL) {
-                        logEntry->samples[i].u.unknown.data = (uint8_t*)malloc(other.logEntry->samples[i].u.unknown.datalen);
-                        memcpy(logEntry->samples[i].u.unknown.data, other.logEntry->samples[i].u.unknown.data, other.logEntry->samples[i].u.unknown.datalen);
-                    }
-                }
-            }
-        }
-    }
-}
-
-LogEntry& LogEntry::operator=(const LogEntry &rhs)
-{
-    LogEntry tmp(rhs);
-
-    std::swap(device, tmp.device);
-    std::swap(time, tmp.time);
-    std::swap(movescountId, tmp.movescountId);
-    std::swap(deviceInfo, tmp.deviceInfo);
-    std::swap(personalSettings, tmp.personalSettings);
-    std::swap(logEntry, tmp.logEntry);
-
-    return *this;
-}
-
-LogEntry::~LogEntry()
+LogEntryData::~LogEntryData()
 {
     u_int32_t i;
 
@@ -121,12 +59,109 @@ LogEntry::~LogEntry()
             }
             free(logEntry->samples);
         }
+        if (logEntry->header.activity_name != NULL) {
+            free(logEntry->header.activity_name);
+        }
         free(logEntry);
     }
 
     logEntry = NULL;
 }
 
+LogEntry::LogEntry() :
+    personalSettings(NULL),
+    logEntry(NULL),
+    d(new LogEntryData())
+{
+}
+
+LogEntry::LogEntry(const LogEntry &other) :
+    device(other.device),
+    time(other.time),
+    movescountId(other.movescountId),
+    deviceInfo(other.deviceInfo),
+    personalSettings(other.personalSettings),
+    logEntry(other.logEntry),
+    d(other.d)
+{
+}
+
+#ifdef Q_COMPILER_RVALUE_REFS
+// Leaves other without a payload, it may only be destroyed or assigned to
+LogEntry::LogEntry(LogEntry &&other) :
+    personalSettings(NULL),
+    logEntry(NULL)
+{
+    swap(other);
+}
+#endif
+
+LogEntry::~LogEntry()
+{
+}
+
+LogEntry& LogEntry::operator=(const LogEntry &rhs)
+{
+    LogEntry tmp(rhs);
+
+    swap(tmp);
+
+    return *this;
+}
+
+#ifdef Q_COMPILER_RVALUE_REFS
+LogEntry& LogEntry::operator=(LogEntry &&rhs)
+{
+    swap(rhs);
+
+    return *this;
+}
+#endif
+
+void LogEntry::swap(LogEntry &other)
+{
+    std::swap(device, other.device);
+    std::swap(time, other.time);
+    std::swap(movescountId, other.movescountId);
+    std::swap(deviceInfo, other.deviceInfo);
+    std::swap(personalSettings, other.personalSettings);
+    std::swap(logEntry, other.logEntry);
+    d.swap(other.d);
+}
+
+void LogEntry::setPersonalSettings(ambit_personal_settings_t *personalSettings)
+{
+    d->personalSettings = this->personalSettings = personalSettings;
+}
+
+void LogEntry::setLogEntry(ambit_log_entry_t *logEntry)
+{
+    d->logEntry = this->logEntry = logEntry;
+}
+
+// Samples of an entry read with LogStore::read(..., true) are only loaded
+// here, anything walking them has to call this first. Copies on other
+// threads wait for the one loading them.
+bool LogEntry::loadSamples()
+{
+    if (!d) {
+        return true;
+    }
+
+    QMutexLocker locker(&d->samplesMutex);
+
+    if (d->samplesOffset < 0) {
+        return true;
+    }
+    if (!LogStore::readSamples(this, d->samplesPath, d->samplesOffset)) {
+        return false;
+    }
+    d->samplesPath = "";
+    d->samplesOffset = -1;
+
+    return true;
+}
+
 bool LogEntry::isUploaded(){
     if (this->movescountId == NULL){
         return false;
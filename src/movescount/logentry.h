@@ -23,20 +23,57 @@
 #define LOGENTRY_H
 
 #include <QDateTime>
+#include <QSharedData>
+#include <QMutex>
 #include <libambit.h>
 
 #include "deviceinfo.h"
 
+// Settings and samples of a log, shared by every copy of the LogEntry it
+// was read into. Only the samples of a lazily read entry are filled in
+// later, once, under samplesMutex.
+class LogEntryData : public QSharedData
+{
+public:
+    LogEntryData();
+    ~LogEntryData();
+
+    ambit_personal_settings_t *personalSettings;
+    ambit_log_entry_t *logEntry;
+
+    // Where the samples of a lazily read entry are, offset is -1 once
+    // they are loaded, see LogStore::read()
+    QString samplesPath;
+    qint64 samplesOffset;
+    QMutex samplesMutex;
+
+private:
+    Q_DISABLE_COPY(LogEntryData)
+};
+
+/*
+ * Copies share the payload, so passing entries around costs no more than
+ * their summary fields. personalSettings and logEntry point into it and
+ * are read only, only LogStore fills them in.
+ */
 class LogEntry
 {
 public:
     explicit LogEntry();
     LogEntry(const LogEntry &other);
+#ifdef Q_COMPILER_RVALUE_REFS
+    LogEntry(LogEntry &&other);
+#endif
     ~LogEntry();
 
     LogEntry& operator=(const LogEntry &rhs);
+#ifdef Q_COMPILER_RVALUE_REFS
+    LogEntry& operator=(LogEntry &&rhs);
+#endif
+    void swap(LogEntry &other);
 
     bool isUploaded();
+    bool loadSamples();
 
     QString device;
     QDateTime time;
@@ -44,6 +81,14 @@ public:
     DeviceInfo deviceInfo;
     ambit_personal_settings_t *personalSettings;
     ambit_log_entry_t *logEntry;
+
+private:
+    friend class LogStore;
+
+    void setPersonalSettings(ambit_personal_settings_t *personalSettings);
+    void setLogEntry(ambit_log_entry_t *logEntry);
+
+    QExplicitlySharedDataPointer<LogEntryData> d;
 };
 
 #endif // LOGENTRY_H
@@ -25,6 +25,19 @@
 #include <QStringList>
 #include <QDir>
 #include <QRegExp>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QMap>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QtEndian>
+#include <QBuffer>
+#include <QElapsedTimer>
+#include <QtConcurrent/QtConcurrentMap>
+#include <zlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <QDebug>
 
@@ -122,663 +135,1392 @@ static sample_swimming_style_name_t sampleSwimmingStyleNames[] = {
     { 0, "" }
 };
 
-LogStore::LogStore(QObject *parent) :
-    QObject(parent)
+// Shared by all LogStore instances, as devices are synced from separate
+// threads while the GUI and movescount threads read the same files.
+// Recursive, as the index is loaded and rebuilt from within reads and
+// stores.
+static QMutex storeMutex(QMutex::Recursive);
+
+// Summary of every stored log by filename, shared and guarded the same
+// way. Mirrors the index file, see LogStore::indexSave()
+static QMap<QString, LogStore::LogDirEntry> logIndex;
+static bool logIndexLoaded = false;
+QFuture<LogStore::RebuildResult> LogStore::rebuildFuture;
+bool LogStore::rebuildPending = false;
+static QElapsedTimer rebuildTimer;
+static LogStore::Compression rebuildCompression;
+static int rebuildLevel;
+
+// Open batches of any LogStore, and whether logs were stored that the
+// directory and index do not have on disk yet, as all workers share the
+// index they are committed to
+static int batchUsers = 0;
+static bool commitPending = false;
+#define INDEX_MAGIC   0x4f414958 /* "OAIX" */
+#define INDEX_VERSION 1
+
+static QDataStream& operator<<(QDataStream& out, const LogStore::LogDirEntry& entry)
 {
-    storagePath = QString(getenv("HOME")) + "/.openambit";
+    return out << entry.filename << entry.device << entry.time << entry.duration << entry.distance
+               << entry.activityName << entry.movescountId << entry.fileSize << entry.checksum;
 }
 
-LogEntry *LogStore::store(const DeviceInfo& deviceInfo, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry)
+static QDataStream& operator>>(QDataStream& in, LogStore::LogDirEntry& entry)
 {
-    QDateTime dateTime(QDate(logEntry->header.date_time.year, logEntry->header.date_time.month, logEntry->header.date_time.day),
-                       QTime(logEntry->header.date_time.hour, logEntry->header.date_time.minute, logEntry->header.date_time.msec/1000));
+    return in >> entry.filename >> entry.device >> entry.time >> entry.duration >> entry.distance
+              >> entry.activityName >> entry.movescountId >> entry.fileSize >> entry.checksum;
+}
 
-    return storeInternal(deviceInfo.serial, dateTime, deviceInfo, personalSettings, logEntry);
+// Puts tmpPath in the place of path in one step, a crash leaves either
+// the old or the new file, never a missing or partial one
+static bool replaceFile(const QString& tmpPath, const QString& path)
+{
+    return rename(QFile::encodeName(tmpPath).constData(), QFile::encodeName(path).constData()) == 0;
 }
 
-LogEntry *LogStore::store(LogEntry *entry)
+// fsync() of a file, or of a directory to make renames in it durable
+static bool syncPath(const QString& path)
 {
-    return storeInternal(entry->device, entry->time, entry->deviceInfo, entry->personalSettings, entry->logEntry, entry->movescountId);
+    int fd = open(QFile::encodeName(path).constData(), O_RDONLY);
+    bool ret;
+
+    if (fd < 0) {
+        return false;
+    }
+    ret = fsync(fd) == 0;
+    close(fd);
+
+    return ret;
 }
 
-void LogStore::storeMovescountId(QString device, QDateTime time, QString movescountId)
+static quint32 checksumOf(const QString& path)
 {
-    LogEntry *entry, *retEntry;
+    QFile file(path);
+    quint32 checksum = crc32(0, NULL, 0);
+
+    if (file.open(QIODevice::ReadOnly)) {
+        QByteArray data = file.readAll();
+        checksum = crc32(checksum, (const Bytef*)data.constData(), data.length());
+    }
+
+    return checksum;
+}
 
-    if ((entry = read(device, time)) != NULL) {
-        entry->movescountId = movescountId;
+// Binary log format, see LogStore::BinaryWriter::write() for the layout
+static const char binaryMagic[8] = { 'O', 'A', 'M', 'B', 'T', 'L', 'O', 'G' };
+#define BINARY_VERSION 2 /* 1 had no codec byte and plain sections */
 
-        retEntry = store(entry);
-        delete retEntry;
-        delete entry;
+static void putVarint(QByteArray& out, quint64 value)
+{
+    while (value >= 0x80) {
+        out.append((char)((value & 0x7f) | 0x80));
+        value >>= 7;
     }
+    out.append((char)value);
 }
 
-bool LogStore::logExists(QString device, ambit_log_header_t *logHeader)
+static void putSigned(QByteArray& out, qint64 value)
 {
-    QDateTime dateTime(QDate(logHeader->date_time.year, logHeader->date_time.month, logHeader->date_time.day),
-                       QTime(logHeader->date_time.hour, logHeader->date_time.minute, logHeader->date_time.msec/1000));
+    // Zigzag, so small negative deltas stay short too
+    putVarint(out, ((quint64)value << 1) ^ (quint64)(value >> 63));
+}
+
+static void putString(QByteArray& out, const QString& string)
+{
+    QByteArray utf8 = string.toUtf8();
 
-    return QFile::exists(logEntryPath(device, dateTime));
+    putVarint(out, utf8.length());
+    out.append(utf8);
 }
 
-LogEntry *LogStore::read(QString device, QDateTime time)
+static void putRaw(QByteArray& out, const void *data, size_t length)
 {
-    return readInternal(logEntryPath(device, time));
+    out.append((const char*)data, length);
 }
 
-LogEntry *LogStore::read(LogDirEntry dirEntry)
+static void putDateTime(QByteArray& out, const ambit_date_time_t *dateTime)
 {
-    return readInternal(storagePath + "/" + dirEntry.filename);
+    putVarint(out, dateTime->year);
+    putVarint(out, dateTime->month);
+    putVarint(out, dateTime->day);
+    putVarint(out, dateTime->hour);
+    putVarint(out, dateTime->minute);
+    putVarint(out, dateTime->msec);
 }
 
-LogEntry *LogStore::read(QString filename)
+// Field-wise packing keeps the difference between two close sample
+// times small without the cost (and time zone pitfalls) of QDateTime
+static quint64 packDateTime(const ambit_date_time_t *dateTime)
 {
-    return readInternal(storagePath + "/" + filename);
+    return ((quint64)dateTime->year << 48) | ((quint64)dateTime->month << 40) |
+           ((quint64)dateTime->day << 32) | ((quint64)dateTime->hour << 24) |
+           ((quint64)dateTime->minute << 16) | dateTime->msec;
 }
 
-QList<LogStore::LogDirEntry> LogStore::dir(QString device)
+static void unpackDateTime(quint64 packed, ambit_date_time_t *dateTime)
 {
-    QList<LogDirEntry> dirList;
-    QRegExp rx("log_([0-9a-zA-Z]+)_([0-9]{4})_([0-9]{2})_([0-9]{2})_([0-9]{2})_([0-9]{2})_([0-9]{2}).log");
+    dateTime->year = (packed >> 48) & 0xffff;
+    dateTime->month = (packed >> 40) & 0xff;
+    dateTime->day = (packed >> 32) & 0xff;
+    dateTime->hour = (packed >> 24) & 0xff;
+    dateTime->minute = (packed >> 16) & 0xff;
+    dateTime->msec = packed & 0xffff;
+}
 
-    QStringList nameFilter;
-    if (device == "") {
-        nameFilter.append("log_*.log");
-    }
-    else {
-        nameFilter.append("log_" + device + "_*.log");
+static bool periodicValue(const ambit_log_sample_periodic_value_t *value, qint64 *result)
+{
+    switch(value->type) {
+    case ambit_log_sample_periodic_type_latitude:
+        *result = value->u.latitude;
+        break;
+    case ambit_log_sample_periodic_type_longitude:
+        *result = value->u.longitude;
+        break;
+    case ambit_log_sample_periodic_type_distance:
+        *result = value->u.distance;
+        break;
+    case ambit_log_sample_periodic_type_speed:
+        *result = value->u.speed;
+        break;
+    case ambit_log_sample_periodic_type_hr:
+        *result = value->u.hr;
+        break;
+    case ambit_log_sample_periodic_type_time:
+        *result = value->u.time;
+        break;
+    case ambit_log_sample_periodic_type_gpsspeed:
+        *result = value->u.gpsspeed;
+        break;
+    case ambit_log_sample_periodic_type_wristaccspeed:
+        *result = value->u.wristaccspeed;
+        break;
+    case ambit_log_sample_periodic_type_bikepodspeed:
+        *result = value->u.bikepodspeed;
+        break;
+    case ambit_log_sample_periodic_type_ehpe:
+        *result = value->u.ehpe;
+        break;
+    case ambit_log_sample_periodic_type_evpe:
+        *result = value->u.evpe;
+        break;
+    case ambit_log_sample_periodic_type_altitude:
+        *result = value->u.altitude;
+        break;
+    case ambit_log_sample_periodic_type_abspressure:
+        *result = value->u.abspressure;
+        break;
+    case ambit_log_sample_periodic_type_energy:
+        *result = value->u.energy;
+        break;
+    case ambit_log_sample_periodic_type_temperature:
+        *result = value->u.temperature;
+        break;
+    case ambit_log_sample_periodic_type_charge:
+        *result = value->u.charge;
+        break;
+    case ambit_log_sample_periodic_type_gpsaltitude:
+        *result = value->u.gpsaltitude;
+        break;
+    case ambit_log_sample_periodic_type_gpsheading:
+        *result = value->u.gpsheading;
+        break;
+    case ambit_log_sample_periodic_type_gpshdop:
+        *result = value->u.gpshdop;
+        break;
+    case ambit_log_sample_periodic_type_gpsvdop:
+        *result = value->u.gpsvdop;
+        break;
+    case ambit_log_sample_periodic_type_wristcadence:
+        *result = value->u.wristcadence;
+        break;
+    case ambit_log_sample_periodic_type_noofsatellites:
+        *result = value->u.noofsatellites;
+        break;
+    case ambit_log_sample_periodic_type_sealevelpressure:
+        *result = value->u.sealevelpressure;
+        break;
+    case ambit_log_sample_periodic_type_verticalspeed:
+        *result = value->u.verticalspeed;
+        break;
+    case ambit_log_sample_periodic_type_cadence:
+        *result = value->u.cadence;
+        break;
+    case ambit_log_sample_periodic_type_bikepower:
+        *result = value->u.bikepower;
+        break;
+    case ambit_log_sample_periodic_type_swimingstrokecnt:
+        *result = value->u.swimingstrokecnt;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput1:
+        *result = value->u.ruleoutput1;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput2:
+        *result = value->u.ruleoutput2;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput3:
+        *result = value->u.ruleoutput3;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput4:
+        *result = value->u.ruleoutput4;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput5:
+        *result = value->u.ruleoutput5;
+        break;
+    default:
+        // snr and types we know nothing about are stored as raw bytes
+        return false;
     }
 
-    QDir directory(storagePath);
-    QStringList matches = directory.entryList(nameFilter, QDir::Files, QDir::Name);
-    foreach (QString match, matches) {
-        if (rx.indexIn(match) >= 0) {
-            LogDirEntry dirEntry;
-            dirEntry.filename = rx.cap(0);
-            dirEntry.device = rx.cap(1);
-            dirEntry.time = QDateTime(QDate(rx.cap(2).toInt(), rx.cap(3).toInt(), rx.cap(4).toInt()),
-                                      QTime(rx.cap(5).toInt(), rx.cap(6).toInt(), rx.cap(7).toInt()));
-            dirList.append(dirEntry);
-        }
+    return true;
+}
+
+static bool setPeriodicValue(ambit_log_sample_periodic_value_t *value, qint64 newValue)
+{
+    switch(value->type) {
+    case ambit_log_sample_periodic_type_latitude:
+        value->u.latitude = newValue;
+        break;
+    case ambit_log_sample_periodic_type_longitude:
+        value->u.longitude = newValue;
+        break;
+    case ambit_log_sample_periodic_type_distance:
+        value->u.distance = newValue;
+        break;
+    case ambit_log_sample_periodic_type_speed:
+        value->u.speed = newValue;
+        break;
+    case ambit_log_sample_periodic_type_hr:
+        value->u.hr = newValue;
+        break;
+    case ambit_log_sample_periodic_type_time:
+        value->u.time = newValue;
+        break;
+    case ambit_log_sample_periodic_type_gpsspeed:
+        value->u.gpsspeed = newValue;
+        break;
+    case ambit_log_sample_periodic_type_wristaccspeed:
+        value->u.wristaccspeed = newValue;
+        break;
+    case ambit_log_sample_periodic_type_bikepodspeed:
+        value->u.bikepodspeed = newValue;
+        break;
+    case ambit_log_sample_periodic_type_ehpe:
+        value->u.ehpe = newValue;
+        break;
+    case ambit_log_sample_periodic_type_evpe:
+        value->u.evpe = newValue;
+        break;
+    case ambit_log_sample_periodic_type_altitude:
+        value->u.altitude = newValue;
+        break;
+    case ambit_log_sample_periodic_type_abspressure:
+        value->u.abspressure = newValue;
+        break;
+    case ambit_log_sample_periodic_type_energy:
+        value->u.energy = newValue;
+        break;
+    case ambit_log_sample_periodic_type_temperature:
+        value->u.temperature = newValue;
+        break;
+    case ambit_log_sample_periodic_type_charge:
+        value->u.charge = newValue;
+        break;
+    case ambit_log_sample_periodic_type_gpsaltitude:
+        value->u.gpsaltitude = newValue;
+        break;
+    case ambit_log_sample_periodic_type_gpsheading:
+        value->u.gpsheading = newValue;
+        break;
+    case ambit_log_sample_periodic_type_gpshdop:
+        value->u.gpshdop = newValue;
+        break;
+    case ambit_log_sample_periodic_type_gpsvdop:
+        value->u.gpsvdop = newValue;
+        break;
+    case ambit_log_sample_periodic_type_wristcadence:
+        value->u.wristcadence = newValue;
+        break;
+    case ambit_log_sample_periodic_type_noofsatellites:
+        value->u.noofsatellites = newValue;
+        break;
+    case ambit_log_sample_periodic_type_sealevelpressure:
+        value->u.sealevelpressure = newValue;
+        break;
+    case ambit_log_sample_periodic_type_verticalspeed:
+        value->u.verticalspeed = newValue;
+        break;
+    case ambit_log_sample_periodic_type_cadence:
+        value->u.cadence = newValue;
+        break;
+    case ambit_log_sample_periodic_type_bikepower:
+        value->u.bikepower = newValue;
+        break;
+    case ambit_log_sample_periodic_type_swimingstrokecnt:
+        value->u.swimingstrokecnt = newValue;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput1:
+        value->u.ruleoutput1 = newValue;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput2:
+        value->u.ruleoutput2 = newValue;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput3:
+        value->u.ruleoutput3 = newValue;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput4:
+        value->u.ruleoutput4 = newValue;
+        break;
+    case ambit_log_sample_periodic_type_ruleoutput5:
+        value->u.ruleoutput5 = newValue;
+        break;
+    default:
+        return false;
     }
 
-    return dirList;
+    return true;
 }
 
-QString LogStore::logEntryPath(QString device, QDateTime time)
+LogStore::LogStore(QObject *parent) :
+    QObject(parent), verifyWrites(false), compression(CompressionZlib), compressionLevel(Z_DEFAULT_COMPRESSION)
 {
-    return storagePath + "/log_" + device + "_" + time.toString("yyyy_MM_dd_hh_mm_ss") + ".log";
+    storagePath = QString(getenv("HOME")) + "/.openambit";
+
+    connect(&rebuildWatcher, SIGNAL(progressValueChanged(int)), this, SLOT(rebuildProgress(int)));
+    connect(&rebuildWatcher, SIGNAL(finished()), this, SLOT(rebuildFinished()));
 }
 
-LogEntry *LogStore::storeInternal(QString serial, QDateTime dateTime, const DeviceInfo& deviceInfo, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry, QString movescountId)
+/*
+ * Takes ownership of logEntry, which ends up in the returned LogEntry, or
+ * is freed if storing fails. The personal settings are copied.
+ */
+LogEntry *LogStore::store(const DeviceInfo& deviceInfo, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry)
 {
-    LogEntry *retEntry = new LogEntry();
-
-    XMLWriter writer(deviceInfo, dateTime, movescountId, personalSettings, logEntry);
-    QFile logfile(logEntryPath(serial, dateTime));
-    logfile.open(QIODevice::WriteOnly);
-    writer.write(&logfile);
-    logfile.close();
-    logfile.open(QIODevice::ReadOnly);
-    XMLReader reader(retEntry);
-    if (!reader.read(&logfile)) {
-        if (retEntry->logEntry && retEntry->logEntry->header.activity_name) {
-            free(retEntry->logEntry->header.activity_name);
-        }
-        delete retEntry;
-        retEntry = NULL;
+    uint64_t trace = libambit_trace_begin();
+    uint32_t samplesCount = logEntry->samples_count;
+    LogEntry *entry = new LogEntry();
+
+    entry->device = deviceInfo.serial;
+    entry->time = QDateTime(QDate(logEntry->header.date_time.year, logEntry->header.date_time.month, logEntry->header.date_time.day),
+                            QTime(logEntry->header.date_time.hour, logEntry->header.date_time.minute, logEntry->header.date_time.msec/1000));
+    entry->deviceInfo = deviceInfo;
+    if (personalSettings != NULL) {
+        entry->setPersonalSettings((ambit_personal_settings_t*)malloc(sizeof(ambit_personal_settings_t)));
+        memcpy(entry->personalSettings, personalSettings, sizeof(ambit_personal_settings_t));
+        // Owned by the caller, and never stored
+        memset(&entry->personalSettings->routes, 0, sizeof(entry->personalSettings->routes));
+        memset(&entry->personalSettings->waypoints, 0, sizeof(entry->personalSettings->waypoints));
+    }
+    entry->setLogEntry(logEntry);
+
+    if (!storeInternal(entry)) {
+        delete entry;
+        entry = NULL;
     }
+    libambit_trace_end("LogStore::store", trace, samplesCount);
 
-    return retEntry;
+    return entry;
 }
 
-LogEntry *LogStore::readInternal(QString path)
+LogEntry *LogStore::store(LogEntry *entry)
 {
-    LogEntry *retEntry = NULL;
-
-    if (QFile::exists(path)) {
-        retEntry = new LogEntry();
-        QFile logfile(path);
-        logfile.open(QIODevice::ReadOnly);
-        XMLReader reader(retEntry);
-        if (!reader.read(&logfile)) {
-            QString error = reader.errorString();
-            qDebug() << "Failed to read " << path << ": " << error;
-            delete retEntry;
-            retEntry = NULL;
-        }
+    if (!storeInternal(entry)) {
+        return NULL;
     }
 
-    return retEntry;
+    return new LogEntry(*entry);
 }
 
+void LogStore::setVerifyWrites(bool verify)
+{
+    QMutexLocker locker(&storeMutex);
 
+    verifyWrites = verify;
+}
 
-LogStore::XMLReader::XMLReader(LogEntry *logEntry) : logEntry(logEntry)
+/*
+ * Applies to logs written from now on, existing logs are converted when
+ * the index is rebuilt. Level is the zlib one, -1 for its default.
+ */
+void LogStore::setCompression(Compression compression, int level)
 {
+    QMutexLocker locker(&storeMutex);
+
+    this->compression = compression;
+    compressionLevel = qBound(Z_DEFAULT_COMPRESSION, level, Z_BEST_COMPRESSION);
 }
 
-bool LogStore::XMLReader::read(QIODevice *device)
+/*
+ * Ids live in the index instead of rewriting the log, and are laid over
+ * the id stored in the log whenever it is read. The change goes to the
+ * index journal like any other, so it is folded into the next save.
+ */
+void LogStore::storeMovescountId(QString device, QDateTime time, QString movescountId)
 {
-    xml.setDevice(device);
+    QString path = logEntryPath(device, time);
+    QString filename = QFileInfo(path).fileName();
+    QMutexLocker locker(&storeMutex);
 
-    if (xml.readNextStartElement()) {
-        if (xml.name() == "openambitlog" && xml.attributes().value("version") == "1.0") {
-            readRoot();
-        }
-        else {
-            xml.raiseError(QObject::tr("The file is not an openambit version 1.0 file."));
+    indexLoad();
+    if (!logIndex.contains(filename) || !QFile::exists(path)) {
+        return;
+    }
+
+    if (!logIndexLoaded) {
+        // The index is being rebuilt, it picks the id up when done
+        QFile journal(movescountIdsPath());
+        if (!journal.open(QIODevice::WriteOnly | QIODevice::Append) ||
+            journal.write(QString("%1 %2\n").arg(filename).arg(movescountId).toUtf8()) < 0) {
+            qDebug() << "Failed to record movescount id in " << movescountIdsPath();
         }
+        return;
     }
 
-    return !xml.error();
+    logIndex[filename].movescountId = movescountId;
+    if (!indexJournalAppend(logIndex[filename])) {
+        qDebug() << "Failed to append to " << indexJournalPath();
+    }
 }
 
-QString LogStore::XMLReader::errorString() const
+/*
+ * Asks the index rather than the directory, so a log left damaged by a
+ * crash before it was flushed is read from the device again.
+ */
+bool LogStore::logExists(QString device, ambit_log_header_t *logHeader)
 {
-    return QObject::tr("%1\nLine %2, column %3")
-            .arg(xml.errorString())
-            .arg(xml.lineNumber())
-            .arg(xml.columnNumber());
-}
+    QDateTime dateTime(QDate(logHeader->date_time.year, logHeader->date_time.month, logHeader->date_time.day),
+                       QTime(logHeader->date_time.hour, logHeader->date_time.minute, logHeader->date_time.msec/1000));
+    QString path = logEntryPath(device, dateTime);
+    QMutexLocker locker(&storeMutex);
 
-void LogStore::XMLReader::readRoot()
-{
-    Q_ASSERT(xml.isStartElement() && xml.name() == "openambitlog");
+    indexLoad();
 
-    while (xml.readNextStartElement()) {
-        if (xml.name() == "SerialNumber") {
-            readSerial();
-        }
-        else if (xml.name() == "Time") {
-            readTime();
-        }
-        else if (xml.name() == "MovescountId") {
-            readMovescountId();
-        }
-        else if (xml.name() == "DeviceInfo") {
-            readDeviceInfo();
-        }
-        else if (xml.name() == "PersonalSettings") {
-            readPersonalSettings();
-        }
-        else if (xml.name() == "Log") {
-            readLog();
-        }
-        else {
-            xml.skipCurrentElement();
-        }
-    }
+    return logIndex.contains(QFileInfo(path).fileName()) && QFile::exists(path);
 }
 
-void LogStore::XMLReader::readSerial()
+LogEntry *LogStore::read(QString device, QDateTime time)
 {
-    Q_ASSERT(xml.isStartElement() && xml.name() == "SerialNumber");
-
-    logEntry->device = xml.readElementText();
+    indexLoad();
+    return readInternal(logEntryPath(device, time));
 }
 
-void LogStore::XMLReader::readTime()
+LogEntry *LogStore::read(LogDirEntry dirEntry, bool lazy)
 {
-    Q_ASSERT(xml.isStartElement() && xml.name() == "Time");
+    indexLoad();
+    return readInternal(storagePath + "/" + dirEntry.filename, lazy);
+}
 
-    QString datestring = xml.readElementText();
-    logEntry->time = QDateTime::fromString(datestring, Qt::ISODate);
+/*
+ * A lazy read only parses the header section, samples are read by
+ * LogEntry::loadSamples() when needed, which keeps showing a summary of
+ * a long log cheap.
+ */
+LogEntry *LogStore::read(QString filename, bool lazy)
+{
+    indexLoad();
+    return readInternal(storagePath + "/" + filename, lazy);
 }
 
-void LogStore::XMLReader::readMovescountId()
+/*
+ * Reads the samples section at offset of path into entry, for
+ * LogEntry::loadSamples(). The store is not locked, the section checksum
+ * catches a log that was replaced since.
+ */
+bool LogStore::readSamples(LogEntry *entry, QString path, qint64 offset)
 {
-    Q_ASSERT(xml.isStartElement() && xml.name() == "MovescountId");
+    BinaryReader reader(entry);
+    QFile logfile(path);
 
-    logEntry->movescountId = xml.readElementText();
+    if (!logfile.open(QIODevice::ReadOnly)) {
+        qDebug() << "Failed to open " << path;
+        return false;
+    }
+    // The start of the file tells how the samples section is coded
+    if (!reader.readStart(&logfile) || !logfile.seek(offset) || !reader.readSampleSection(&logfile)) {
+        qDebug() << "Failed to read samples of " << path << ": " << reader.errorString();
+        return false;
+    }
+
+    return true;
 }
 
-void LogStore::XMLReader::readDeviceInfo()
+QList<LogStore::LogDirEntry> LogStore::dir(QString device)
 {
-    QRegExp versionRX("([0-9]+)\\.([0-9]+)\\.([0-9]+)");
-
-    Q_ASSERT(xml.isStartElement() && xml.name() == "DeviceInfo");
+    QList<LogDirEntry> dirList;
+    QMutexLocker locker(&storeMutex);
 
-    while (xml.readNextStartElement()) {
-        if (xml.name() == "Serial") {
-            logEntry->deviceInfo.serial = xml.readElementText().toUtf8();
-        }
-        else if (xml.name() == "Model") {
-            logEntry->deviceInfo.model = xml.readElementText().toUtf8();
-        }
-        else if (xml.name() == "Name") {
-            logEntry->deviceInfo.name = xml.readElementText().toUtf8();
-        }
-        else if (xml.name() == "FWVersion") {
-            if (versionRX.indexIn(xml.readElementText()) >= 0) {
-                logEntry->deviceInfo.fw_version[0] = versionRX.cap(1).toInt();
-                logEntry->deviceInfo.fw_version[1] = versionRX.cap(2).toInt();
-                logEntry->deviceInfo.fw_version[2] = versionRX.cap(3).toInt();
-            }
-        }
-        else if (xml.name() == "HWVersion") {
-            if (versionRX.indexIn(xml.readElementText()) >= 0) {
-                logEntry->deviceInfo.hw_version[0] = versionRX.cap(1).toInt();
-                logEntry->deviceInfo.hw_version[1] = versionRX.cap(2).toInt();
-                logEntry->deviceInfo.hw_version[2] = versionRX.cap(3).toInt();
-            }
-        }
-        else {
-            xml.skipCurrentElement();
+    indexLoad();
+    foreach (const LogDirEntry& entry, logIndex) {
+        if (device == "" || entry.device == device) {
+            dirList.append(entry);
         }
     }
+
+    return dirList;
 }
 
-void LogStore::XMLReader::readPersonalSettings()
+bool LogStore::dirEntry(QString device, QDateTime time, LogDirEntry *dirEntry)
 {
-    Q_ASSERT(xml.isStartElement() && xml.name() == "PersonalSettings");
+    QString filename = QFileInfo(logEntryPath(device, time)).fileName();
+    QMutexLocker locker(&storeMutex);
 
-    if (logEntry->personalSettings == NULL) {
-        logEntry->personalSettings = (ambit_personal_settings_t*)malloc(sizeof(ambit_personal_settings_t));
-        memset(logEntry->personalSettings, 0, sizeof(ambit_personal_settings_t));
+    indexLoad();
+    if (!logIndex.contains(filename)) {
+        return false;
     }
+    *dirEntry = logIndex[filename];
 
-    while (xml.readNextStartElement()) {
-        if (xml.name() == "SportModeButtonLock") {
-            logEntry->personalSettings->sportmode_button_lock = xml.readElementText().toUInt();
+    return true;
+}
+
+QList<LogStore::LogDirEntry> LogStore::notUploaded(QString device)
+{
+    QList<LogDirEntry> dirList;
+    QMutexLocker locker(&storeMutex);
+
+    indexLoad();
+    if (!logIndexLoaded) {
+        // Which logs have an id is only known once the rebuild is done
+        return dirList;
+    }
+    foreach (const LogDirEntry& entry, logIndex) {
+        if ((device == "" || entry.device == device) && entry.movescountId.length() == 0) {
+            dirList.append(entry);
         }
-        else if (xml.name() == "TimeModeButtonLock") {
-            logEntry->personalSettings->timemode_button_lock = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "CompassDeclination") {
-            logEntry->personalSettings->compass_declination = xml.readElementText().toInt();
-        }
-        else if (xml.name() == "UnitsMode") {
-            logEntry->personalSettings->units_mode = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Units") {
-            while (xml.readNextStartElement()) {
-                if (xml.name() == "AirPressureUnit") {
-                    logEntry->personalSettings->units.pressure = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "AltitudeUnit") {
-                    logEntry->personalSettings->units.altitude = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "DistanceUnit") {
-                    logEntry->personalSettings->units.distance = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "HeightUnit") {
-                    logEntry->personalSettings->units.height = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "TemperatureUnit") {
-                    logEntry->personalSettings->units.temperature = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "VerticalSpeedUnit") {
-                    logEntry->personalSettings->units.verticalspeed = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "WeightUnit") {
-                    logEntry->personalSettings->units.weight = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "CompassUnit") {
-                    logEntry->personalSettings->units.compass = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "HRUnit") {
-                    logEntry->personalSettings->units.heartrate = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "SpeedUnit") {
-                    logEntry->personalSettings->units.speed = xml.readElementText().toUInt();
-                }
-                else {
-                    xml.skipCurrentElement();
+    }
+
+    return dirList;
+}
+
+/*
+ * Logs are parsed on the global thread pool, without holding the store.
+ * Meanwhile the index lists the logs by their filenames only, the full one
+ * takes its place once done and indexRebuilt() is emitted.
+ */
+void LogStore::rebuildIndex()
+{
+    QMutexLocker locker(&storeMutex);
+
+    if (!rebuildPending) {
+        rebuildStart();
+    }
+}
+
+bool LogStore::indexRebuilding()
+{
+    QMutexLocker locker(&storeMutex);
+
+    return rebuildPending;
+}
+
+void LogStore::rebuildStart()
+{
+    QRegExp rx("log_([0-9a-zA-Z]+)_([0-9]{4})_([0-9]{2})_([0-9]{2})_([0-9]{2})_([0-9]{2})_([0-9]{2}).log");
+    QStringList paths;
+
+    rebuildTimer.start();
+    rebuildCompression = compression;
+    rebuildLevel = compressionLevel;
+
+    // Ids of a sound index are not in the logs, they are laid over the
+    // rebuilt one like those of older versions
+    if (logIndexLoaded) {
+        QFile journal(movescountIdsPath());
+        if (journal.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            foreach (const LogDirEntry& entry, logIndex) {
+                if (entry.movescountId.length() > 0) {
+                    journal.write(QString("%1 %2\n").arg(entry.filename).arg(entry.movescountId).toUtf8());
                 }
             }
         }
-        else if (xml.name() == "GPSPositionFormat") {
-            logEntry->personalSettings->gps_position_format = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Language") {
-            logEntry->personalSettings->language = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "NavigationStyle") {
-            logEntry->personalSettings->navigation_style = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "GPSTimeKeeping") {
-            logEntry->personalSettings->sync_time_w_gps = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Use24hClock") {
-            logEntry->personalSettings->time_format = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Alarm") {
-            QTime time = QTime::fromString(xml.readElementText(), "hh:mm");
-            logEntry->personalSettings->alarm.hour = time.hour();
-            logEntry->personalSettings->alarm.minute = time.minute();
-        }
-        else if (xml.name() == "AlarmEnable") {
-            logEntry->personalSettings->alarm_enable = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "DualTime") {
-            QTime time = QTime::fromString(xml.readElementText(), "hh:mm");
-            logEntry->personalSettings->dual_time.hour = time.hour();
-            logEntry->personalSettings->dual_time.minute = time.minute();
-        }
-        else if (xml.name() == "DisplayDateMode") {
-            logEntry->personalSettings->date_format = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "TonesMode") {
-            logEntry->personalSettings->tones_mode = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "BacklightMode") {
-            logEntry->personalSettings->backlight_mode = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "BacklightBrightness") {
-            logEntry->personalSettings->backlight_brightness = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "DisplayBrightness") {
-            logEntry->personalSettings->display_brightness = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "DisplayIsNegative") {
-            logEntry->personalSettings->display_is_negative = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Weight") {
-            logEntry->personalSettings->weight = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "BirthYear") {
-            logEntry->personalSettings->birthyear = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "MaxHR") {
-            logEntry->personalSettings->max_hr = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "RestHR") {
-            logEntry->personalSettings->rest_hr = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "FitnessLevel") {
-            logEntry->personalSettings->fitness_level = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "IsMale") {
-            logEntry->personalSettings->is_male = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Length") {
-            logEntry->personalSettings->length = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "AltiBaroMode") {
-            logEntry->personalSettings->alti_baro_mode = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "StormAlarm") {
-            logEntry->personalSettings->storm_alarm = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "FusedAltiDisabled") {
-            logEntry->personalSettings->fused_alti_disabled = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "BikePODCalibration") {
-            logEntry->personalSettings->bikepod_calibration = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "BikePODCalibration2") {
-            logEntry->personalSettings->bikepod_calibration2 = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "BikePODCalibration3") {
-            logEntry->personalSettings->bikepod_calibration3 = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "FootPODCalibration") {
-            logEntry->personalSettings->footpod_calibration = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "AutomaticBikePowerCalibration") {
-            logEntry->personalSettings->automatic_bikepower_calib = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "AutomaticFootPODCalibration") {
-            logEntry->personalSettings->automatic_footpod_calib = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "TrainingProgram") {
-            logEntry->personalSettings->training_program = xml.readElementText().toUInt();
-        }
-        else {
-            xml.skipCurrentElement();
-        }
     }
+
+    // Not loaded until the scan is done, so the partial index is not saved
+    logIndex.clear();
+    logIndexLoaded = false;
+
+    QDir directory(storagePath);
+    QStringList matches = directory.entryList(QStringList("log_*.log"), QDir::Files, QDir::Name);
+    foreach (QString match, matches) {
+        if (rx.exactMatch(match)) {
+            LogDirEntry entry;
+            entry.filename = match;
+            entry.device = rx.cap(1);
+            entry.time = QDateTime(QDate(rx.cap(2).toInt(), rx.cap(3).toInt(), rx.cap(4).toInt()),
+                                   QTime(rx.cap(5).toInt(), rx.cap(6).toInt(), rx.cap(7).toInt()));
+            entry.duration = 0;
+            entry.distance = 0;
+            entry.fileSize = QFileInfo(storagePath + "/" + match).size();
+            entry.checksum = 0;
+            logIndex.insert(match, entry);
+            paths.append(storagePath + "/" + match);
+        }
+    }
+
+    rebuildFuture = QtConcurrent::mappedReduced(paths, LogScanner(compression), rebuildReduce);
+    rebuildPending = true;
+    QMetaObject::invokeMethod(this, "watchRebuild", Qt::QueuedConnection);
 }
 
-void LogStore::XMLReader::readLog()
+// Runs on the thread pool, one result at a time
+void LogStore::rebuildReduce(RebuildResult& result, const ScanResult& scan)
 {
-    Q_ASSERT(xml.isStartElement() && xml.name() == "Log");
+    if (scan.valid) {
+        LogDirEntry dirEntry = scan.convert ? rebuildConvert(scan) : scan.dirEntry;
+        result.index.insert(dirEntry.filename, dirEntry);
+        result.bytes += dirEntry.fileSize;
+    }
+    else {
+        result.failed++;
+    }
+}
 
-    if (logEntry->logEntry == NULL) {
-        logEntry->logEntry = (ambit_log_entry_t*)calloc(1, sizeof(ambit_log_entry_t));
+/*
+ * Second step of the rebuild for logs in an older format or codec, with
+ * the store held. The log is read again and only replaced if it is still
+ * what was scanned, one stored meanwhile is left alone and listed by the
+ * journal replayed in rebuildSwap().
+ */
+LogStore::LogDirEntry LogStore::rebuildConvert(const ScanResult& scan)
+{
+    QMutexLocker locker(&storeMutex);
+    QFileInfo info(scan.path);
+    LogEntry entry;
+    quint32 checksum;
+    bool parsed;
+
+    if (info.size() != scan.dirEntry.fileSize || info.lastModified() != scan.modified) {
+        return scan.dirEntry;
     }
 
-    while (xml.readNextStartElement()) {
-        if (xml.name() == "Header") {
-            readLogHeader();
-        }
-        else if (xml.name() == "Samples") {
-            readLogSamples();
-        }
-        else {
-            xml.skipCurrentElement();
-        }
+    QFile logfile(scan.path);
+    if (!logfile.open(QIODevice::ReadOnly)) {
+        return scan.dirEntry;
+    }
+    if (BinaryReader::isBinary(&logfile)) {
+        BinaryReader reader(&entry);
+        parsed = reader.read(&logfile);
+    }
+    else {
+        XMLReader reader(&entry);
+        parsed = reader.read(&logfile);
+    }
+    logfile.close();
+
+    if (!parsed || !writeBinary(scan.path, &entry, rebuildCompression, rebuildLevel, &checksum)) {
+        qDebug() << "Failed to convert " << scan.path;
+        return scan.dirEntry;
     }
+
+    return makeDirEntry(scan.path, &entry, checksum);
 }
 
-void LogStore::XMLReader::readLogHeader()
+// Called with the store held, once the scan is finished
+void LogStore::rebuildSwap()
 {
-    Q_ASSERT(xml.isStartElement() && xml.name() == "Header");
+    RebuildResult result = rebuildFuture.result();
 
-    while (xml.readNextStartElement()) {
-        if (xml.name() == "DateTime") {
-            QDateTime datetime = QDateTime::fromString(xml.readElementText(), Qt::ISODate);
-            logEntry->logEntry->header.date_time.year = datetime.date().year();
-            logEntry->logEntry->header.date_time.month = datetime.date().month();
-            logEntry->logEntry->header.date_time.day = datetime.date().day();
-            logEntry->logEntry->header.date_time.hour = datetime.time().hour();
-            logEntry->logEntry->header.date_time.minute = datetime.time().minute();
-            logEntry->logEntry->header.date_time.msec = datetime.time().second()*1000 + datetime.time().msec();
-        }
-        else if (xml.name() == "Duration") {
-            logEntry->logEntry->header.duration = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Ascent") {
-            logEntry->logEntry->header.ascent = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Descent") {
-            logEntry->logEntry->header.descent = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "AscentTime") {
-            logEntry->logEntry->header.ascent_time = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "DescentTime") {
-            logEntry->logEntry->header.descent_time = xml.readElementText().toUInt();
+    rebuildPending = false;
+    rebuildFuture = QFuture<RebuildResult>();
+    logIndex = result.index;
+
+    // Logs stored and ids recorded while scanning, or since the damaged
+    // index was last saved
+    indexReplayJournal();
+    indexApplyMovescountIds();
+    logIndexLoaded = true;
+    if (!indexSave()) {
+        qDebug() << "Failed to write log index " << indexPath();
+    }
+
+    qDebug() << "Indexed" << logIndex.count() << "logs (" << result.failed << "failed," << result.bytes / 1024 << "KiB) in" << rebuildTimer.elapsed() << "ms";
+}
+
+// The watcher lives in the thread of this store, so it is set up there
+void LogStore::watchRebuild()
+{
+    QMutexLocker locker(&storeMutex);
+
+    if (rebuildPending && rebuildWatcher.future() != rebuildFuture) {
+        rebuildWatcher.setFuture(rebuildFuture);
+    }
+}
+
+void LogStore::rebuildProgress(int done)
+{
+    emit indexProgress(done, rebuildWatcher.progressMaximum());
+}
+
+void LogStore::rebuildFinished()
+{
+    QMutexLocker locker(&storeMutex);
+
+    indexLoad();
+    if (logIndexLoaded) {
+        locker.unlock();
+        emit indexRebuilt();
+    }
+}
+
+LogStore::LogScanner::LogScanner(Compression compression) :
+    compression(compression)
+{
+}
+
+// Runs on the thread pool without the store held, so the log is only read
+// here, conversions are left to rebuildConvert()
+LogStore::ScanResult LogStore::LogScanner::operator()(const QString& path) const
+{
+    ScanResult result;
+    LogEntry entry;
+    quint32 checksum;
+
+    result.valid = false;
+    result.convert = false;
+    result.path = path;
+    result.modified = QFileInfo(path).lastModified();
+
+    QFile logfile(path);
+    if (!logfile.open(QIODevice::ReadOnly)) {
+        qDebug() << "Failed to open " << path;
+        return result;
+    }
+    QByteArray data = logfile.readAll();
+    logfile.close();
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+
+    if (BinaryReader::isBinary(&buffer)) {
+        // Samples are read too, which verifies the crc of every section
+        BinaryReader reader(&entry);
+        if (!reader.read(&buffer)) {
+            qDebug() << "Failed to read " << path << ": " << reader.errorString();
+            return result;
         }
-        else if (xml.name() == "RecoveryTime") {
-            logEntry->logEntry->header.recovery_time = xml.readElementText().toUInt();
+        result.convert = reader.compression() != compression;
+    }
+    else {
+        XMLReader reader(&entry);
+        if (!reader.read(&buffer)) {
+            qDebug() << "Failed to read " << path << ": " << reader.errorString();
+            return result;
         }
-        else if (xml.name() == "Speed") {
-            while (xml.readNextStartElement()) {
-                if (xml.name() == "Avg") {
-                    logEntry->logEntry->header.speed_avg = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "Max") {
-                    logEntry->logEntry->header.speed_max = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "MaxTime") {
-                    logEntry->logEntry->header.speed_max_time = xml.readElementText().toUInt();
-                }
-                else {
-                    xml.skipCurrentElement();
-                }
+        result.convert = true;
+    }
+
+    checksum = crc32(crc32(0, NULL, 0), (const Bytef*)data.constData(), data.length());
+    result.dirEntry = makeDirEntry(path, &entry, checksum);
+    // What was read, the file may have changed since
+    result.dirEntry.fileSize = data.length();
+    result.valid = true;
+
+    return result;
+}
+
+bool LogStore::exportXML(LogEntry *entry, QString path)
+{
+    ambit_personal_settings_t noSettings;
+    bool ret;
+
+    if (entry == NULL || entry->logEntry == NULL || !entry->loadSamples()) {
+        return false;
+    }
+
+    // XMLWriter always writes a settings block
+    memset(&noSettings, 0, sizeof(noSettings));
+
+    XMLWriter writer(entry->deviceInfo, entry->time, entry->movescountId, entry->personalSettings != NULL ? entry->personalSettings : &noSettings, entry->logEntry);
+    QFile xmlfile(path);
+    if (!xmlfile.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    ret = writer.write(&xmlfile);
+    xmlfile.close();
+
+    return ret;
+}
+
+LogEntry *LogStore::importXML(QString path)
+{
+    LogEntry *entry = new LogEntry();
+
+    QFile xmlfile(path);
+    if (!xmlfile.open(QIODevice::ReadOnly)) {
+        delete entry;
+        return NULL;
+    }
+
+    XMLReader reader(entry);
+    if (!reader.read(&xmlfile)) {
+        qDebug() << "Failed to import " << path << ": " << reader.errorString();
+        delete entry;
+        return NULL;
+    }
+    if (!storeInternal(entry)) {
+        delete entry;
+        return NULL;
+    }
+
+    return entry;
+}
+
+QString LogStore::logEntryPath(QString device, QDateTime time)
+{
+    return storagePath + "/log_" + device + "_" + time.toString("yyyy_MM_dd_hh_mm_ss") + ".log";
+}
+
+bool LogStore::storeInternal(LogEntry *entry)
+{
+    QString path = logEntryPath(entry->device, entry->time);
+    QMutexLocker locker(&storeMutex);
+
+    indexLoad();
+
+    // Lazily read entries may be stored back over their own file
+    if (!entry->loadSamples()) {
+        return false;
+    }
+
+    // Like QSaveFile the log is on disk before it replaces the old one, only
+    // the directory and the index are left to indexCommit()
+    BinaryWriter writer(entry->device, entry->deviceInfo, entry->time, entry->movescountId, entry->personalSettings, entry->logEntry);
+    writer.setCompression(compression, compressionLevel);
+    QFile logfile(path + ".tmp");
+    if (!logfile.open(QIODevice::WriteOnly) || !writer.write(&logfile) ||
+        !logfile.flush() || fsync(logfile.handle()) != 0) {
+        qDebug() << "Failed to write " << path << ": " << logfile.errorString();
+        logfile.close();
+        logfile.remove();
+        return false;
+    }
+    logfile.close();
+
+    // The entry written is the one returned, so there is nothing to parse
+    // back, at most the bytes on disk to compare
+    if (verifyWrites && checksumOf(path + ".tmp") != writer.checksum()) {
+        qDebug() << "Verification of " << path << " failed";
+        logfile.remove();
+        return false;
+    }
+
+    if (!replaceFile(path + ".tmp", path)) {
+        qDebug() << "Failed to replace " << path;
+        logfile.remove();
+        return false;
+    }
+    commitPending = true;
+
+    indexUpdate(path, entry, writer.checksum());
+    if (batchUsers == 0 && !indexCommit()) {
+        qDebug() << "Failed to write log index " << indexPath();
+    }
+
+    return true;
+}
+
+/*
+ * Logs stored until commitBatch() are written out one by one, but the
+ * directory and the index are only flushed together there. Until then the
+ * logs are only in the index journal, which is checked against the logs
+ * when replayed. Batches of several workers overlap, the last one to
+ * commit flushes for all.
+ */
+void LogStore::beginBatch()
+{
+    QMutexLocker locker(&storeMutex);
+
+    batchUsers++;
+}
+
+bool LogStore::commitBatch()
+{
+    QMutexLocker locker(&storeMutex);
+
+    if (batchUsers > 0) {
+        batchUsers--;
+    }
+    if (batchUsers > 0 || !commitPending) {
+        return true;
+    }
+
+    return indexCommit();
+}
+
+LogEntry *LogStore::readInternal(QString path, bool lazy)
+{
+    LogEntry *retEntry = NULL;
+    QMutexLocker locker(&storeMutex);
+
+    if (QFile::exists(path)) {
+        retEntry = new LogEntry();
+        QFile logfile(path);
+        logfile.open(QIODevice::ReadOnly);
+        if (BinaryReader::isBinary(&logfile)) {
+            BinaryReader reader(retEntry);
+            if (!reader.read(&logfile, !lazy)) {
+                QString error = reader.errorString();
+                qDebug() << "Failed to read " << path << ": " << error;
+                delete retEntry;
+                retEntry = NULL;
             }
-        }
-        else if (xml.name() == "Cadence") {
-            while (xml.readNextStartElement()) {
-                if (xml.name() == "Avg") {
-                    logEntry->logEntry->header.cadence_avg = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "Max") {
-                    logEntry->logEntry->header.cadence_max = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "MaxTime") {
-                    logEntry->logEntry->header.cadence_max_time = xml.readElementText().toUInt();
-                }
-                else {
-                    xml.skipCurrentElement();
-                }
+            else if (lazy) {
+                retEntry->d->samplesPath = path;
+                retEntry->d->samplesOffset = logfile.pos();
             }
         }
-        else if (xml.name() == "Altitude") {
-            while (xml.readNextStartElement()) {
-                if (xml.name() == "Max") {
-                    logEntry->logEntry->header.altitude_max = xml.readElementText().toInt();
-                }
-                else if (xml.name() == "Min") {
-                    logEntry->logEntry->header.altitude_min = xml.readElementText().toInt();
-                }
-                else if (xml.name() == "MaxTime") {
-                    logEntry->logEntry->header.altitude_max_time = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "MinTime") {
-                    logEntry->logEntry->header.altitude_min_time = xml.readElementText().toUInt();
-                }
-                else {
-                    xml.skipCurrentElement();
-                }
+        else {
+            XMLReader reader(retEntry);
+            if (!reader.read(&logfile)) {
+                QString error = reader.errorString();
+                qDebug() << "Failed to read " << path << ": " << error;
+                delete retEntry;
+                retEntry = NULL;
             }
-        }
-        else if (xml.name() == "HR") {
-            while (xml.readNextStartElement()) {
-                if (xml.name() == "Avg") {
-                    logEntry->logEntry->header.heartrate_avg = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "Max") {
-                    logEntry->logEntry->header.heartrate_max = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "Min") {
-                    logEntry->logEntry->header.heartrate_min = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "MaxTime") {
-                    logEntry->logEntry->header.heartrate_max_time = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "MinTime") {
-                    logEntry->logEntry->header.heartrate_min_time = xml.readElementText().toUInt();
-                }
-                else {
-                    xml.skipCurrentElement();
+            else {
+                logfile.close();
+                if (!migrateXML(path, retEntry)) {
+                    qDebug() << "Failed to convert " << path << " to the binary format";
                 }
             }
         }
-        else if (xml.name() == "PeakTrainingEffect") {
-            logEntry->logEntry->header.peak_training_effect = xml.readElementText().toUInt();
+    }
+
+    if (retEntry != NULL && logIndexLoaded && logIndex.contains(QFileInfo(path).fileName())) {
+        const LogDirEntry& dirEntry = logIndex[QFileInfo(path).fileName()];
+        if (dirEntry.movescountId.length() > 0) {
+            retEntry->movescountId = dirEntry.movescountId;
         }
-        else if (xml.name() == "ActivityType") {
-            logEntry->logEntry->header.activity_type = xml.readElementText().toUInt();
+    }
+
+    return retEntry;
+}
+
+bool LogStore::migrateXML(QString path, LogEntry *entry)
+{
+    quint32 checksum;
+
+    // A running rebuild converts it itself
+    if (rebuildPending) {
+        return true;
+    }
+
+    if (!writeBinary(path, entry, compression, compressionLevel, &checksum)) {
+        return false;
+    }
+
+    if (logIndexLoaded) {
+        indexUpdate(path, entry, checksum);
+    }
+
+    return true;
+}
+
+bool LogStore::writeBinary(QString path, LogEntry *entry, Compression compression, int level, quint32 *checksum)
+{
+    BinaryWriter writer(entry->device, entry->deviceInfo, entry->time, entry->movescountId, entry->personalSettings, entry->logEntry);
+    writer.setCompression(compression, level);
+    QFile tmpfile(path + ".tmp");
+
+    // Written next to the old file first, so a failed conversion leaves
+    // the XML in place to be retried on the next read
+    if (!tmpfile.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    // Replaces a log that is already listed, so it is flushed right away
+    if (!writer.write(&tmpfile) || !tmpfile.flush() || fsync(tmpfile.handle()) != 0) {
+        tmpfile.close();
+        tmpfile.remove();
+        return false;
+    }
+    tmpfile.close();
+
+    if (!replaceFile(path + ".tmp", path)) {
+        tmpfile.remove();
+        return false;
+    }
+    *checksum = writer.checksum();
+
+    return true;
+}
+
+QString LogStore::indexPath()
+{
+    return storagePath + "/logindex.bin";
+}
+
+void LogStore::indexLoad()
+{
+    QMutexLocker locker(&storeMutex);
+
+    if (logIndexLoaded) {
+        return;
+    }
+    if (rebuildPending) {
+        if (rebuildFuture.isFinished()) {
+            rebuildSwap();
         }
-        else if (xml.name() == "Activity") {
-            QByteArray ba = xml.readElementText().toUtf8();
-            const char *c_str = ba.data();
-            logEntry->logEntry->header.activity_name = strdup(c_str);
+        else {
+            QMetaObject::invokeMethod(this, "watchRebuild", Qt::QueuedConnection);
         }
-        else if (xml.name() == "Temperature") {
-            while (xml.readNextStartElement()) {
-                if (xml.name() == "Max") {
-                    logEntry->logEntry->header.temperature_max = xml.readElementText().toInt();
-                }
-                else if (xml.name() == "Min") {
-                    logEntry->logEntry->header.temperature_min = xml.readElementText().toInt();
-                }
-                else if (xml.name() == "MaxTime") {
-                    logEntry->logEntry->header.temperature_max_time = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "MinTime") {
-                    logEntry->logEntry->header.temperature_min_time = xml.readElementText().toUInt();
-                }
-                else {
-                    xml.skipCurrentElement();
-                }
+        return;
+    }
+
+    QFile indexfile(indexPath());
+    if (indexfile.open(QIODevice::ReadOnly)) {
+        if (indexParse(indexfile.readAll())) {
+            bool replayed = indexReplayJournal();
+            if (indexApplyMovescountIds()) {
+                replayed = true;
             }
+            if (replayed && !indexSave()) {
+                qDebug() << "Failed to write log index " << indexPath();
+            }
+            logIndexLoaded = true;
+            return;
         }
-        else if (xml.name() == "Distance") {
-            logEntry->logEntry->header.distance = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "LogItemCount") {
-            logEntry->logEntry->header.samples_count = xml.readElementText().toUInt();
-        }
-        else if (xml.name() == "Energy") {
-            logEntry->logEntry->header.energy_consumption = xml.readElementText().toUInt();
+        qDebug() << "Log index " << indexPath() << " is damaged, rebuilding";
+    }
+
+    rebuildStart();
+}
+
+QString LogStore::indexJournalPath()
+{
+    return storagePath + "/logindex.journal";
+}
+
+/*
+ * Records of the index changes since it was last saved, each a le32
+ * length, the LogDirEntry and a le32 crc32 of it. A crash may tear the
+ * last record, which ends the replay. Returns true if anything was
+ * replayed, so the caller can fold it into the index.
+ */
+bool LogStore::indexReplayJournal()
+{
+    QFile journal(indexJournalPath());
+    QByteArray data;
+    int pos = 0;
+    bool replayed = false;
+
+    if (!journal.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    data = journal.readAll();
+    journal.close();
+
+    while (data.length() - pos >= 8) {
+        quint32 length = qFromLittleEndian<quint32>((const uchar*)data.constData() + pos);
+        if (length > (quint32)(data.length() - pos - 8)) {
+            break;
         }
-        else if (xml.name() == "TimeToFirstFix") {
-            logEntry->logEntry->header.first_fix_time = xml.readElementText().toUInt();
+        QByteArray record = data.mid(pos + 4, length);
+        if (qFromLittleEndian<quint32>((const uchar*)data.constData() + pos + 4 + length) !=
+            crc32(0, (const Bytef*)record.constData(), record.length())) {
+            break;
         }
-        else if (xml.name() == "BatteryChargeAtStart") {
-            logEntry->logEntry->header.battery_start = xml.readElementText().toUInt();
+        pos += length + 8;
+
+        LogDirEntry entry;
+        QDataStream in(record);
+        in.setVersion(QDataStream::Qt_5_0);
+        in >> entry;
+        if (in.status() != QDataStream::Ok) {
+            break;
         }
-        else if (xml.name() == "BatteryCharge") {
-            logEntry->logEntry->header.battery_end = xml.readElementText().toUInt();
+
+        // The log may not have been flushed before a crash, keep the
+        // record only if what is on disk is what it describes
+        QString path = storagePath + "/" + entry.filename;
+        if (QFileInfo(path).size() == entry.fileSize && checksumOf(path) == entry.checksum) {
+            logIndex.insert(entry.filename, entry);
         }
-        else if (xml.name() == "DistanceBeforeCalibrationChange") {
-            logEntry->logEntry->header.distance_before_calib = xml.readElementText().toUInt();
+        replayed = true;
+    }
+
+    return replayed;
+}
+
+bool LogStore::indexJournalAppend(const LogDirEntry& entry)
+{
+    QByteArray record;
+    uchar header[4], crc[4];
+
+    QDataStream out(&record, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << entry;
+    qToLittleEndian<quint32>(record.length(), header);
+    qToLittleEndian<quint32>(crc32(0, (const Bytef*)record.constData(), record.length()), crc);
+    record.prepend(QByteArray((const char*)header, sizeof(header)));
+    record.append((const char*)crc, sizeof(crc));
+
+    QFile journal(indexJournalPath());
+    if (!journal.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        return false;
+    }
+
+    return journal.write(record) == record.length();
+}
+
+// Makes the renames of the logs stored so far durable, then the index that
+// lists them
+bool LogStore::indexCommit()
+{
+    bool ret = true;
+
+    commitPending = false;
+    if (!syncPath(storagePath)) {
+        ret = false;
+    }
+
+    // While the index is rebuilt the journal holds the logs, see rebuildSwap()
+    if (!logIndexLoaded) {
+        return ret;
+    }
+
+    return indexSave() && ret;
+}
+
+QString LogStore::movescountIdsPath()
+{
+    return storagePath + "/movescountids.txt";
+}
+
+/*
+ * Lines of "<log filename> <movescount id>" left by older versions, later
+ * lines win. Returns true if there were any, they are gone once the index
+ * holding them is saved.
+ */
+bool LogStore::indexApplyMovescountIds()
+{
+    QFile journal(movescountIdsPath());
+
+    if (!journal.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    while (!journal.atEnd()) {
+        QStringList fields = QString::fromUtf8(journal.readLine()).trimmed().split(' ');
+        if (fields.count() == 2 && logIndex.contains(fields[0])) {
+            logIndex[fields[0]].movescountId = fields[1];
         }
-        else if (xml.name() == "Swimming") {
-            while (xml.readNextStartElement()) {
-                if (xml.name() == "PoolLengths") {
-                    logEntry->logEntry->header.swimming_pool_lengths = xml.readElementText().toUInt();
-                }
-                else if (xml.name() == "PoolLength") {
-                    logEntry->logEntry->header.swimming_pool_length = xml.readElementText().toUInt();
-                }
-                else {
-                    xml.skipCurrentElement();
-                }
-            }
+    }
+
+    return true;
+}
+
+bool LogStore::indexParse(const QByteArray& data)
+{
+    QMap<QString, LogDirEntry> index;
+    quint32 magic, version, count, i;
+
+    if (data.length() < 16) {
+        return false;
+    }
+    if (qFromLittleEndian<quint32>((const uchar*)data.constData() + data.length() - 4) !=
+        crc32(0, (const Bytef*)data.constData(), data.length() - 4)) {
+        return false;
+    }
+
+    QDataStream in(data.left(data.length() - 4));
+    in.setVersion(QDataStream::Qt_5_0);
+    in >> magic >> version >> count;
+    if (magic != INDEX_MAGIC || version != INDEX_VERSION) {
+        return false;
+    }
+    for (i=0; i<count && in.status() == QDataStream::Ok; i++) {
+        LogDirEntry entry;
+        in >> entry;
+        index.insert(entry.filename, entry);
+    }
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    logIndex = index;
+
+    return true;
+}
+
+/*
+ * The index is small next to the logs, so it is always written as a whole,
+ * next to the old one and renamed over it, with a trailing crc32 to catch
+ * a damaged file, which is then rebuilt from the logs. Once it is on disk
+ * the journals are folded into it and dropped.
+ */
+bool LogStore::indexSave()
+{
+    QByteArray data;
+    uchar crc[4];
+
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << (quint32)INDEX_MAGIC << (quint32)INDEX_VERSION << (quint32)logIndex.count();
+    foreach (const LogDirEntry& entry, logIndex) {
+        out << entry;
+    }
+    qToLittleEndian<quint32>(crc32(0, (const Bytef*)data.constData(), data.length()), crc);
+    data.append((const char*)crc, sizeof(crc));
+
+    QFile indexfile(indexPath() + ".tmp");
+    if (!indexfile.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    if (indexfile.write(data) != data.length() || !indexfile.flush() || fsync(indexfile.handle()) != 0) {
+        indexfile.close();
+        indexfile.remove();
+        return false;
+    }
+    indexfile.close();
+
+    if (!replaceFile(indexPath() + ".tmp", indexPath()) || !syncPath(storagePath)) {
+        return false;
+    }
+    QFile::remove(indexJournalPath());
+    QFile::remove(movescountIdsPath());
+
+    return true;
+}
+
+void LogStore::indexUpdate(QString path, LogEntry *entry, quint32 checksum)
+{
+    LogDirEntry dirEntry = makeDirEntry(path, entry, checksum);
+
+    if (dirEntry.movescountId.length() == 0 && logIndex.contains(dirEntry.filename)) {
+        // Resynced logs keep an id recorded by storeMovescountId()
+        dirEntry.movescountId = logIndex[dirEntry.filename].movescountId;
+    }
+    logIndex.insert(dirEntry.filename, dirEntry);
+    if (!indexJournalAppend(dirEntry)) {
+        qDebug() << "Failed to append to " << indexJournalPath();
+    }
+}
+
+LogStore::LogDirEntry LogStore::makeDirEntry(QString path, LogEntry *entry, quint32 checksum)
+{
+    QFileInfo info(path);
+    LogDirEntry dirEntry;
+
+    dirEntry.filename = info.fileName();
+    dirEntry.device = entry->device;
+    dirEntry.time = entry->time;
+    dirEntry.duration = entry->logEntry != NULL ? entry->logEntry->header.duration : 0;
+    dirEntry.distance = entry->logEntry != NULL ? entry->logEntry->header.distance : 0;
+    dirEntry.activityName = entry->logEntry != NULL ? QString::fromUtf8(entry->logEntry->header.activity_name) : "";
+    dirEntry.movescountId = entry->movescountId;
+    dirEntry.fileSize = info.size();
+    dirEntry.checksum = checksum;
+
+    return dirEntry;
+}
+
+
+
+LogStore::XMLReader::XMLReader(LogEntry *logEntry) : logEntry(logEntry)
+{
+}
+
+bool LogStore::XMLReader::read(QIODevice *device)
+{
+    xml.setDevice(device);
+
+    if (xml.readNextStartElement()) {
+        if (xml.name() == "openambitlog" && xml.attributes().value("version") == "1.0") {
+            readRoot();
         }
-        else if (xml.name() == "Unknown1") {
-            QByteArray val = xml.readElementText().toLocal8Bit();
-            const char *c_str = val.data();
-            for (int i=0; i<5 && i<val.length()/2; i++) {
-                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown1[i]);
-                c_str += 2 * sizeof(char);
-            }
+        else {
+            xml.raiseError(QObject::tr("The file is not an openambit version 1.0 file."));
         }
-        else if (xml.name() == "Unknown2") {
-            QByteArray val = xml.readElementText().toLocal8Bit();
-            const char *c_str = val.data();
-            sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown2);
+    }
+
+    return !xml.error();
+}
+
+QString LogStore::XMLReader::errorString() const
+{
+    return QObject::tr("%1\nLine %2, column %3")
+            .arg(xml.errorString())
+            .arg(xml.lineNumber())
+            .arg(xml.columnNumber());
+}
+
+void LogStore::XMLReader::readRoot()
+{
+    Q_ASSERT(xml.isStartElement() && xml.name() == "openambitlog");
+
+    while (xml.readNextStartElement()) {
+        if (xml.name() == "SerialNumber") {
+            readSerial();
         }
-        else if (xml.name() == "Unknown3") {
-            QByteArray val = xml.readElementText().toLocal8Bit();
-            const char *c_str = val.data();
-            // Handle previously unknown cadence data
-            if (val.length() == 12) {
-                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.cadence_max);
-                c_str += 2 * sizeof(char);
-                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.cadence_avg);
-                c_str += 2 * sizeof(char);
-            }
-            for (int i=0; i<2 && i<val.length()/2; i++) {
-                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown3[i]);
-                c_str += 2 * sizeof(char);
-            }
+        else if (xml.name() == "Time") {
+            readTime();
         }
-        else if (xml.name() == "Unknown4") {
-            QByteArray val = xml.readElementText().toLocal8Bit();
-            const char *c_str = val.data();
-            // Handle previously unknown cadence data
-            if (val.length() == 16) {
-                uint32_t cadence_max_time = 0;
-                uint8_t tmpval;
-                for (int i=0; i<4; i++) {
-                    sscanf(c_str, "%2hhx", &tmpval);
-                    cadence_max_time |= (tmpval << (8*(3-i)));
-                    c_str += 2 * sizeof(char);
-                }
-                logEntry->logEntry->header.cadence_max_time = cadence_max_time;
-            }
+        else if (xml.name() == "MovescountId") {
+            readMovescountId();
         }
-        else if (xml.name() == "Unknown5") {
-            QByteArray val = xml.readElementText().toLocal8Bit();
-            const char *c_str = val.data();
-            for (int i=0; i<4 && i<val.length()/2; i++) {
-                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown5[i]);
-                c_str += 2 * sizeof(char);
+        else if (xml.name() == "DeviceInfo") {
+            readDeviceInfo();
+        }
+        else if (xml.name() == "PersonalSettings") {
+            readPersonalSettings();
+        }
+        else if (xml.name() == "Log") {
+            readLog();
+        }
+        else {
+            xml.skipCurrentElement();
+        }
+    }
+}
+
+void LogStore::XMLReader::readSerial()
+{
+    Q_ASSERT(xml.isStartElement() && xml.name() == "SerialNumber");
+
+    logEntry->device = xml.readElementText();
+}
+
+void LogStore::XMLReader::readTime()
+{
+    Q_ASSERT(xml.isStartElement() && xml.name() == "Time");
+
+    QString datestring = xml.readElementText();
+    logEntry->time = QDateTime::fromString(datestring, Qt::ISODate);
+}
+
+void LogStore::XMLReader::readMovescountId()
+{
+    Q_ASSERT(xml.isStartElement() && xml.name() == "MovescountId");
+
+    logEntry->movescountId = xml.readElementText();
+}
+
+void LogStore::XMLReader::readDeviceInfo()
+{
+    QRegExp versionRX("([0-9]+)\\.([0-9]+)\\.([0-9]+)");
+
+    Q_ASSERT(xml.isStartElement() && xml.name() == "DeviceInfo");
+
+    while (xml.readNextStartElement()) {
+        if (xml.name() == "Serial") {
+            logEntry->deviceInfo.serial = xml.readElementText().toUtf8();
+        }
+        else if (xml.name() == "Model") {
+            logEntry->deviceInfo.model = xml.readElementText().toUtf8();
+        }
+        else if (xml.name() == "Name") {
+            logEntry->deviceInfo.name = xml.readElementText().toUtf8();
+        }
+        else if (xml.name() == "FWVersion") {
+            if (versionRX.indexIn(xml.readElementText()) >= 0) {
+                logEntry->deviceInfo.fw_version[0] = versionRX.cap(1).toInt();
+                logEntry->deviceInfo.fw_version[1] = versionRX.cap(2).toInt();
+                logEntry->deviceInfo.fw_version[2] = versionRX.cap(3).toInt();
             }
         }
-        else if (xml.name() == "Unknown6") {
-            QByteArray val = xml.readElementText().toLocal8Bit();
-            const char *c_str = val.data();
-            for (int i=0; i<24 && i<val.length()/2; i++) {
-                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown6[i]);
-                c_str += 2 * sizeof(char);
+        else if (xml.name() == "HWVersion") {
+            if (versionRX.indexIn(xml.readElementText()) >= 0) {
+                logEntry->deviceInfo.hw_version[0] = versionRX.cap(1).toInt();
+                logEntry->deviceInfo.hw_version[1] = versionRX.cap(2).toInt();
+                logEntry->deviceInfo.hw_version[2] = versionRX.cap(3).toInt();
             }
         }
         else {
@@ -787,42 +1529,459 @@ void LogStore::XMLReader::readLogHeader()
     }
 }
 
-void LogStore::XMLReader::readLogSamples()
+void LogStore::XMLReader::readPersonalSettings()
 {
-    int sampleCount = 0;
-    ambit_log_sample_type_t type;
-
-    Q_ASSERT(xml.isStartElement() && xml.name() == "Samples");
+    Q_ASSERT(xml.isStartElement() && xml.name() == "PersonalSettings");
 
-    if (logEntry->logEntry->samples == NULL) {
-        logEntry->logEntry->samples = (ambit_log_sample_t *)calloc(logEntry->logEntry->header.samples_count, sizeof(ambit_log_sample_t));
-        logEntry->logEntry->samples_count = logEntry->logEntry->header.samples_count;
+    if (logEntry->personalSettings == NULL) {
+        logEntry->setPersonalSettings((ambit_personal_settings_t*)malloc(sizeof(ambit_personal_settings_t)));
+        memset(logEntry->personalSettings, 0, sizeof(ambit_personal_settings_t));
     }
 
     while (xml.readNextStartElement()) {
-        if (xml.name() == "Sample") {
-            QList<ambit_log_sample_periodic_value_t> periodicValues;
-            int ibiCount = 0;
-            type = ambit_log_sample_type_unknown;
+        if (xml.name() == "SportModeButtonLock") {
+            logEntry->personalSettings->sportmode_button_lock = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "TimeModeButtonLock") {
+            logEntry->personalSettings->timemode_button_lock = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "CompassDeclination") {
+            logEntry->personalSettings->compass_declination = xml.readElementText().toInt();
+        }
+        else if (xml.name() == "UnitsMode") {
+            logEntry->personalSettings->units_mode = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Units") {
             while (xml.readNextStartElement()) {
-                if (xml.name() == "Type") {
-                    type = (ambit_log_sample_type_t)xml.attributes().value("id").toString().toUInt();
-                    logEntry->logEntry->samples[sampleCount].type = type;
-                    xml.skipCurrentElement();
+                if (xml.name() == "AirPressureUnit") {
+                    logEntry->personalSettings->units.pressure = xml.readElementText().toUInt();
                 }
-                else if (xml.name() == "UTC") {
-                    QDateTime datetime = QDateTime::fromString(xml.readElementText(), "yyyy-MM-ddThh:mm:ss.zzzZ");
-                    logEntry->logEntry->samples[sampleCount].utc_time.year = datetime.date().year();
-                    logEntry->logEntry->samples[sampleCount].utc_time.month = datetime.date().month();
-                    logEntry->logEntry->samples[sampleCount].utc_time.day = datetime.date().day();
-                    logEntry->logEntry->samples[sampleCount].utc_time.hour = datetime.time().hour();
-                    logEntry->logEntry->samples[sampleCount].utc_time.minute = datetime.time().minute();
-                    logEntry->logEntry->samples[sampleCount].utc_time.msec = datetime.time().second()*1000 + datetime.time().msec();
+                else if (xml.name() == "AltitudeUnit") {
+                    logEntry->personalSettings->units.altitude = xml.readElementText().toUInt();
                 }
-                else if (xml.name() == "Time") {
-                    logEntry->logEntry->samples[sampleCount].time = xml.readElementText().toUInt();
+                else if (xml.name() == "DistanceUnit") {
+                    logEntry->personalSettings->units.distance = xml.readElementText().toUInt();
                 }
-                else {
+                else if (xml.name() == "HeightUnit") {
+                    logEntry->personalSettings->units.height = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "TemperatureUnit") {
+                    logEntry->personalSettings->units.temperature = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "VerticalSpeedUnit") {
+                    logEntry->personalSettings->units.verticalspeed = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "WeightUnit") {
+                    logEntry->personalSettings->units.weight = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "CompassUnit") {
+                    logEntry->personalSettings->units.compass = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "HRUnit") {
+                    logEntry->personalSettings->units.heartrate = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "SpeedUnit") {
+                    logEntry->personalSettings->units.speed = xml.readElementText().toUInt();
+                }
+                else {
+                    xml.skipCurrentElement();
+                }
+            }
+        }
+        else if (xml.name() == "GPSPositionFormat") {
+            logEntry->personalSettings->gps_position_format = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Language") {
+            logEntry->personalSettings->language = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "NavigationStyle") {
+            logEntry->personalSettings->navigation_style = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "GPSTimeKeeping") {
+            logEntry->personalSettings->sync_time_w_gps = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Use24hClock") {
+            logEntry->personalSettings->time_format = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Alarm") {
+            QTime time = QTime::fromString(xml.readElementText(), "hh:mm");
+            logEntry->personalSettings->alarm.hour = time.hour();
+            logEntry->personalSettings->alarm.minute = time.minute();
+        }
+        else if (xml.name() == "AlarmEnable") {
+            logEntry->personalSettings->alarm_enable = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "DualTime") {
+            QTime time = QTime::fromString(xml.readElementText(), "hh:mm");
+            logEntry->personalSettings->dual_time.hour = time.hour();
+            logEntry->personalSettings->dual_time.minute = time.minute();
+        }
+        else if (xml.name() == "DisplayDateMode") {
+            logEntry->personalSettings->date_format = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "TonesMode") {
+            logEntry->personalSettings->tones_mode = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BacklightMode") {
+            logEntry->personalSettings->backlight_mode = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BacklightBrightness") {
+            logEntry->personalSettings->backlight_brightness = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "DisplayBrightness") {
+            logEntry->personalSettings->display_brightness = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "DisplayIsNegative") {
+            logEntry->personalSettings->display_is_negative = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Weight") {
+            logEntry->personalSettings->weight = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BirthYear") {
+            logEntry->personalSettings->birthyear = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "MaxHR") {
+            logEntry->personalSettings->max_hr = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "RestHR") {
+            logEntry->personalSettings->rest_hr = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "FitnessLevel") {
+            logEntry->personalSettings->fitness_level = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "IsMale") {
+            logEntry->personalSettings->is_male = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Length") {
+            logEntry->personalSettings->length = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "AltiBaroMode") {
+            logEntry->personalSettings->alti_baro_mode = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "StormAlarm") {
+            logEntry->personalSettings->storm_alarm = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "FusedAltiDisabled") {
+            logEntry->personalSettings->fused_alti_disabled = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BikePODCalibration") {
+            logEntry->personalSettings->bikepod_calibration = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BikePODCalibration2") {
+            logEntry->personalSettings->bikepod_calibration2 = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BikePODCalibration3") {
+            logEntry->personalSettings->bikepod_calibration3 = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "FootPODCalibration") {
+            logEntry->personalSettings->footpod_calibration = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "AutomaticBikePowerCalibration") {
+            logEntry->personalSettings->automatic_bikepower_calib = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "AutomaticFootPODCalibration") {
+            logEntry->personalSettings->automatic_footpod_calib = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "TrainingProgram") {
+            logEntry->personalSettings->training_program = xml.readElementText().toUInt();
+        }
+        else {
+            xml.skipCurrentElement();
+        }
+    }
+}
+
+void LogStore::XMLReader::readLog()
+{
+    Q_ASSERT(xml.isStartElement() && xml.name() == "Log");
+
+    if (logEntry->logEntry == NULL) {
+        logEntry->setLogEntry((ambit_log_entry_t*)calloc(1, sizeof(ambit_log_entry_t)));
+    }
+
+    while (xml.readNextStartElement()) {
+        if (xml.name() == "Header") {
+            readLogHeader();
+        }
+        else if (xml.name() == "Samples") {
+            readLogSamples();
+        }
+        else {
+            xml.skipCurrentElement();
+        }
+    }
+}
+
+void LogStore::XMLReader::readLogHeader()
+{
+    Q_ASSERT(xml.isStartElement() && xml.name() == "Header");
+
+    while (xml.readNextStartElement()) {
+        if (xml.name() == "DateTime") {
+            QDateTime datetime = QDateTime::fromString(xml.readElementText(), Qt::ISODate);
+            logEntry->logEntry->header.date_time.year = datetime.date().year();
+            logEntry->logEntry->header.date_time.month = datetime.date().month();
+            logEntry->logEntry->header.date_time.day = datetime.date().day();
+            logEntry->logEntry->header.date_time.hour = datetime.time().hour();
+            logEntry->logEntry->header.date_time.minute = datetime.time().minute();
+            logEntry->logEntry->header.date_time.msec = datetime.time().second()*1000 + datetime.time().msec();
+        }
+        else if (xml.name() == "Duration") {
+            logEntry->logEntry->header.duration = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Ascent") {
+            logEntry->logEntry->header.ascent = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Descent") {
+            logEntry->logEntry->header.descent = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "AscentTime") {
+            logEntry->logEntry->header.ascent_time = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "DescentTime") {
+            logEntry->logEntry->header.descent_time = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "RecoveryTime") {
+            logEntry->logEntry->header.recovery_time = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Speed") {
+            while (xml.readNextStartElement()) {
+                if (xml.name() == "Avg") {
+                    logEntry->logEntry->header.speed_avg = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "Max") {
+                    logEntry->logEntry->header.speed_max = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "MaxTime") {
+                    logEntry->logEntry->header.speed_max_time = xml.readElementText().toUInt();
+                }
+                else {
+                    xml.skipCurrentElement();
+                }
+            }
+        }
+        else if (xml.name() == "Cadence") {
+            while (xml.readNextStartElement()) {
+                if (xml.name() == "Avg") {
+                    logEntry->logEntry->header.cadence_avg = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "Max") {
+                    logEntry->logEntry->header.cadence_max = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "MaxTime") {
+                    logEntry->logEntry->header.cadence_max_time = xml.readElementText().toUInt();
+                }
+                else {
+                    xml.skipCurrentElement();
+                }
+            }
+        }
+        else if (xml.name() == "Altitude") {
+            while (xml.readNextStartElement()) {
+                if (xml.name() == "Max") {
+                    logEntry->logEntry->header.altitude_max = xml.readElementText().toInt();
+                }
+                else if (xml.name() == "Min") {
+                    logEntry->logEntry->header.altitude_min = xml.readElementText().toInt();
+                }
+                else if (xml.name() == "MaxTime") {
+                    logEntry->logEntry->header.altitude_max_time = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "MinTime") {
+                    logEntry->logEntry->header.altitude_min_time = xml.readElementText().toUInt();
+                }
+                else {
+                    xml.skipCurrentElement();
+                }
+            }
+        }
+        else if (xml.name() == "HR") {
+            while (xml.readNextStartElement()) {
+                if (xml.name() == "Avg") {
+                    logEntry->logEntry->header.heartrate_avg = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "Max") {
+                    logEntry->logEntry->header.heartrate_max = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "Min") {
+                    logEntry->logEntry->header.heartrate_min = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "MaxTime") {
+                    logEntry->logEntry->header.heartrate_max_time = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "MinTime") {
+                    logEntry->logEntry->header.heartrate_min_time = xml.readElementText().toUInt();
+                }
+                else {
+                    xml.skipCurrentElement();
+                }
+            }
+        }
+        else if (xml.name() == "PeakTrainingEffect") {
+            logEntry->logEntry->header.peak_training_effect = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "ActivityType") {
+            logEntry->logEntry->header.activity_type = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Activity") {
+            QByteArray ba = xml.readElementText().toUtf8();
+            const char *c_str = ba.data();
+            logEntry->logEntry->header.activity_name = strdup(c_str);
+        }
+        else if (xml.name() == "Temperature") {
+            while (xml.readNextStartElement()) {
+                if (xml.name() == "Max") {
+                    logEntry->logEntry->header.temperature_max = xml.readElementText().toInt();
+                }
+                else if (xml.name() == "Min") {
+                    logEntry->logEntry->header.temperature_min = xml.readElementText().toInt();
+                }
+                else if (xml.name() == "MaxTime") {
+                    logEntry->logEntry->header.temperature_max_time = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "MinTime") {
+                    logEntry->logEntry->header.temperature_min_time = xml.readElementText().toUInt();
+                }
+                else {
+                    xml.skipCurrentElement();
+                }
+            }
+        }
+        else if (xml.name() == "Distance") {
+            logEntry->logEntry->header.distance = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "LogItemCount") {
+            logEntry->logEntry->header.samples_count = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Energy") {
+            logEntry->logEntry->header.energy_consumption = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "TimeToFirstFix") {
+            logEntry->logEntry->header.first_fix_time = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BatteryChargeAtStart") {
+            logEntry->logEntry->header.battery_start = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "BatteryCharge") {
+            logEntry->logEntry->header.battery_end = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "DistanceBeforeCalibrationChange") {
+            logEntry->logEntry->header.distance_before_calib = xml.readElementText().toUInt();
+        }
+        else if (xml.name() == "Swimming") {
+            while (xml.readNextStartElement()) {
+                if (xml.name() == "PoolLengths") {
+                    logEntry->logEntry->header.swimming_pool_lengths = xml.readElementText().toUInt();
+                }
+                else if (xml.name() == "PoolLength") {
+                    logEntry->logEntry->header.swimming_pool_length = xml.readElementText().toUInt();
+                }
+                else {
+                    xml.skipCurrentElement();
+                }
+            }
+        }
+        else if (xml.name() == "Unknown1") {
+            QByteArray val = xml.readElementText().toLocal8Bit();
+            const char *c_str = val.data();
+            for (int i=0; i<5 && i<val.length()/2; i++) {
+                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown1[i]);
+                c_str += 2 * sizeof(char);
+            }
+        }
+        else if (xml.name() == "Unknown2") {
+            QByteArray val = xml.readElementText().toLocal8Bit();
+            const char *c_str = val.data();
+            sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown2);
+        }
+        else if (xml.name() == "Unknown3") {
+            QByteArray val = xml.readElementText().toLocal8Bit();
+            const char *c_str = val.data();
+            // Handle previously unknown cadence data
+            if (val.length() == 12) {
+                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.cadence_max);
+                c_str += 2 * sizeof(char);
+                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.cadence_avg);
+                c_str += 2 * sizeof(char);
+            }
+            for (int i=0; i<2 && i<val.length()/2; i++) {
+                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown3[i]);
+                c_str += 2 * sizeof(char);
+            }
+        }
+        else if (xml.name() == "Unknown4") {
+            QByteArray val = xml.readElementText().toLocal8Bit();
+            const char *c_str = val.data();
+            // Handle previously unknown cadence data
+            if (val.length() == 16) {
+                uint32_t cadence_max_time = 0;
+                uint8_t tmpval;
+                for (int i=0; i<4; i++) {
+                    sscanf(c_str, "%2hhx", &tmpval);
+                    cadence_max_time |= (tmpval << (8*(3-i)));
+                    c_str += 2 * sizeof(char);
+                }
+                logEntry->logEntry->header.cadence_max_time = cadence_max_time;
+            }
+        }
+        else if (xml.name() == "Unknown5") {
+            QByteArray val = xml.readElementText().toLocal8Bit();
+            const char *c_str = val.data();
+            for (int i=0; i<4 && i<val.length()/2; i++) {
+                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown5[i]);
+                c_str += 2 * sizeof(char);
+            }
+        }
+        else if (xml.name() == "Unknown6") {
+            QByteArray val = xml.readElementText().toLocal8Bit();
+            const char *c_str = val.data();
+            for (int i=0; i<24 && i<val.length()/2; i++) {
+                sscanf(c_str, "%2hhx", &logEntry->logEntry->header.unknown6[i]);
+                c_str += 2 * sizeof(char);
+            }
+        }
+        else {
+            xml.skipCurrentElement();
+        }
+    }
+}
+
+void LogStore::XMLReader::readLogSamples()
+{
+    int sampleCount = 0;
+    ambit_log_sample_type_t type;
+
+    Q_ASSERT(xml.isStartElement() && xml.name() == "Samples");
+
+    if (logEntry->logEntry->samples == NULL) {
+        logEntry->logEntry->samples = (ambit_log_sample_t *)calloc(logEntry->logEntry->header.samples_count, sizeof(ambit_log_sample_t));
+        logEntry->logEntry->samples_count = logEntry->logEntry->header.samples_count;
+    }
+
+    while (xml.readNextStartElement()) {
+        if (xml.name() == "Sample") {
+            QList<ambit_log_sample_periodic_value_t> periodicValues;
+            int ibiCount = 0;
+            type = ambit_log_sample_type_unknown;
+            while (xml.readNextStartElement()) {
+                if (xml.name() == "Type") {
+                    type = (ambit_log_sample_type_t)xml.attributes().value("id").toString().toUInt();
+                    logEntry->logEntry->samples[sampleCount].type = type;
+                    xml.skipCurrentElement();
+                }
+                else if (xml.name() == "UTC") {
+                    QDateTime datetime = QDateTime::fromString(xml.readElementText(), "yyyy-MM-ddThh:mm:ss.zzzZ");
+                    logEntry->logEntry->samples[sampleCount].utc_time.year = datetime.date().year();
+                    logEntry->logEntry->samples[sampleCount].utc_time.month = datetime.date().month();
+                    logEntry->logEntry->samples[sampleCount].utc_time.day = datetime.date().day();
+                    logEntry->logEntry->samples[sampleCount].utc_time.hour = datetime.time().hour();
+                    logEntry->logEntry->samples[sampleCount].utc_time.minute = datetime.time().minute();
+                    logEntry->logEntry->samples[sampleCount].utc_time.msec = datetime.time().second()*1000 + datetime.time().msec();
+                }
+                else if (xml.name() == "Time") {
+                    logEntry->logEntry->samples[sampleCount].time = xml.readElementText().toUInt();
+                }
+                else {
                     switch(type) {
                     case ambit_log_sample_type_periodic:
                         readPeriodicSample(&periodicValues);
@@ -1111,798 +2270,1743 @@ void LogStore::XMLReader::readLogSamples()
                     {
                         QRegExp versionRX("([0-9]+)\\.([0-9]+)\\.([0-9]+)");
 
-                        if (xml.name() == "Version") {
-                            if (versionRX.indexIn(xml.readElementText()) >= 0) {
-                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[0] = versionRX.cap(1).toInt();
-                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[1] = versionRX.cap(2).toInt();
-                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[2] = versionRX.cap(3).toInt() & 0xff;
-                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[3] = (versionRX.cap(3).toInt() >> 8) & 0xff;
-                            }
-                        }
-                        else if (xml.name() == "BuildDate") {
-                            QDateTime datetime = QDateTime::fromString(xml.readElementText(), Qt::ISODate);
-                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.year = datetime.date().year();
-                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.month = datetime.date().month();
-                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.day = datetime.date().day();
-                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.hour = datetime.time().hour();
-                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.minute = datetime.time().minute();
-                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.msec = datetime.time().second()*1000 + datetime.time().msec();
-                        }
-                        else {
-                            /* Should not get here! */
-                            xml.skipCurrentElement();
-                        }
-                        break;
-                    }
-                    case ambit_log_sample_type_unknown:
-                        if (xml.name() == "Data") {
-                            QByteArray val = xml.readElementText().toLocal8Bit();
-                            const char *c_str = val.data();
-                            if (val.length() >= 2) {
-                                logEntry->logEntry->samples[sampleCount].u.unknown.data = (uint8_t*)malloc(val.length()/2);
-                                for (int i=0; i<val.length()/2; i++) {
-                                    sscanf(c_str, "%2hhx", &logEntry->logEntry->samples[sampleCount].u.unknown.data[i]);
-                                    c_str += 2 * sizeof(char);
-                                }
-                                logEntry->logEntry->samples[sampleCount].u.unknown.datalen = val.length()/2;
-                            }
-                        }
-                        else {
-                            /* Should not get here! */
-                            xml.skipCurrentElement();
-                        }
-                        break;
-                    default:
-                        xml.skipCurrentElement();
-                    }
-                }
+                        if (xml.name() == "Version") {
+                            if (versionRX.indexIn(xml.readElementText()) >= 0) {
+                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[0] = versionRX.cap(1).toInt();
+                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[1] = versionRX.cap(2).toInt();
+                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[2] = versionRX.cap(3).toInt() & 0xff;
+                                logEntry->logEntry->samples[sampleCount].u.fwinfo.version[3] = (versionRX.cap(3).toInt() >> 8) & 0xff;
+                            }
+                        }
+                        else if (xml.name() == "BuildDate") {
+                            QDateTime datetime = QDateTime::fromString(xml.readElementText(), Qt::ISODate);
+                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.year = datetime.date().year();
+                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.month = datetime.date().month();
+                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.day = datetime.date().day();
+                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.hour = datetime.time().hour();
+                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.minute = datetime.time().minute();
+                            logEntry->logEntry->samples[sampleCount].u.fwinfo.build_date.msec = datetime.time().second()*1000 + datetime.time().msec();
+                        }
+                        else {
+                            /* Should not get here! */
+                            xml.skipCurrentElement();
+                        }
+                        break;
+                    }
+                    case ambit_log_sample_type_unknown:
+                        if (xml.name() == "Data") {
+                            QByteArray val = xml.readElementText().toLocal8Bit();
+                            const char *c_str = val.data();
+                            if (val.length() >= 2) {
+                                logEntry->logEntry->samples[sampleCount].u.unknown.data = (uint8_t*)malloc(val.length()/2);
+                                for (int i=0; i<val.length()/2; i++) {
+                                    sscanf(c_str, "%2hhx", &logEntry->logEntry->samples[sampleCount].u.unknown.data[i]);
+                                    c_str += 2 * sizeof(char);
+                                }
+                                logEntry->logEntry->samples[sampleCount].u.unknown.datalen = val.length()/2;
+                            }
+                        }
+                        else {
+                            /* Should not get here! */
+                            xml.skipCurrentElement();
+                        }
+                        break;
+                    default:
+                        xml.skipCurrentElement();
+                    }
+                }
+            }
+            if (type == ambit_log_sample_type_periodic && periodicValues.count() > 0) {
+                logEntry->logEntry->samples[sampleCount].u.periodic.value_count = periodicValues.count();
+                logEntry->logEntry->samples[sampleCount].u.periodic.values = (ambit_log_sample_periodic_value_t*)calloc(periodicValues.count(), sizeof(ambit_log_sample_periodic_value_t));
+                for (int i=0; i<periodicValues.count(); i++) {
+                    logEntry->logEntry->samples[sampleCount].u.periodic.values[i] = periodicValues.at(i);
+                }
+            }
+            sampleCount++;
+        }
+        else {
+            xml.skipCurrentElement();
+        }
+    }
+}
+
+void LogStore::XMLReader::readPeriodicSample(QList<ambit_log_sample_periodic_value_t> *valueContent)
+{
+    ambit_log_sample_periodic_value_t value;
+
+    if (xml.name() == "Latitude") {
+        value.type = ambit_log_sample_periodic_type_latitude;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "Longitude") {
+        value.type = ambit_log_sample_periodic_type_longitude;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "Distance") {
+        value.type = ambit_log_sample_periodic_type_distance;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "Speed") {
+        value.type = ambit_log_sample_periodic_type_speed;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "HR") {
+        value.type = ambit_log_sample_periodic_type_hr;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "Time") {
+        value.type = ambit_log_sample_periodic_type_time;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "GPSSpeed") {
+        value.type = ambit_log_sample_periodic_type_gpsspeed;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "WristAccSpeed") {
+        value.type = ambit_log_sample_periodic_type_wristaccspeed;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "BikePodSpeed") {
+        value.type = ambit_log_sample_periodic_type_bikepodspeed;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "EHPE") {
+        value.type = ambit_log_sample_periodic_type_ehpe;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "EVPE") {
+        value.type = ambit_log_sample_periodic_type_evpe;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "Altitude") {
+        value.type = ambit_log_sample_periodic_type_altitude;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "AbsPressure") {
+        value.type = ambit_log_sample_periodic_type_abspressure;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "EnergyConsumption") {
+        value.type = ambit_log_sample_periodic_type_energy;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "Temperature") {
+        value.type = ambit_log_sample_periodic_type_temperature;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "BatteryCharge") {
+        value.type = ambit_log_sample_periodic_type_charge;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "GPSAltitude") {
+        value.type = ambit_log_sample_periodic_type_gpsaltitude;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "GPSHeading") {
+        value.type = ambit_log_sample_periodic_type_gpsheading;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "GpsHDOP") {
+        value.type = ambit_log_sample_periodic_type_gpshdop;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "GpsVDOP") {
+        value.type = ambit_log_sample_periodic_type_gpsvdop;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "WristCadence") {
+        value.type = ambit_log_sample_periodic_type_wristcadence;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "SNR") {
+        value.type = ambit_log_sample_periodic_type_snr;
+        QByteArray val = xml.readElementText().toLocal8Bit();
+        const char *c_str = val.data();
+        for (int i=0; i<16 && i<val.length()/2; i++) {
+            sscanf(c_str, "%2hhx", &value.u.snr[i]);
+            c_str += 2 * sizeof(char);
+        }
+        valueContent->append(value);
+    }
+    else if (xml.name() == "NumberOfSatellites") {
+        value.type = ambit_log_sample_periodic_type_noofsatellites;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "SeaLevelPressure") {
+        value.type = ambit_log_sample_periodic_type_sealevelpressure;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "VerticalSpeed") {
+        value.type = ambit_log_sample_periodic_type_verticalspeed;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "Cadence") {
+        value.type = ambit_log_sample_periodic_type_cadence;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "BikePower") {
+        value.type = ambit_log_sample_periodic_type_bikepower;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "SwimmingStrokeCount") {
+        value.type = ambit_log_sample_periodic_type_swimingstrokecnt;
+        value.u.latitude = xml.readElementText().toUInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "RuleOutput1") {
+        value.type = ambit_log_sample_periodic_type_ruleoutput1;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "RuleOutput2") {
+        value.type = ambit_log_sample_periodic_type_ruleoutput2;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "RuleOutput3") {
+        value.type = ambit_log_sample_periodic_type_ruleoutput3;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "RuleOutput4") {
+        value.type = ambit_log_sample_periodic_type_ruleoutput4;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else if (xml.name() == "RuleOutput5") {
+        value.type = ambit_log_sample_periodic_type_ruleoutput5;
+        value.u.latitude = xml.readElementText().toInt();
+        valueContent->append(value);
+    }
+    else {
+        xml.skipCurrentElement();
+    }
+}
+
+
+LogStore::XMLWriter::XMLWriter(const DeviceInfo& deviceInfo, QDateTime time, QString movescountId, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry) :
+    deviceInfo(deviceInfo), time(time), movescountId(movescountId), personalSettings(personalSettings), logEntry(logEntry)
+{
+    xml.setAutoFormatting(true);
+}
+
+bool LogStore::XMLWriter::write(QIODevice *device)
+{
+    bool ret = true;
+
+    xml.setDevice(device);
+
+    xml.writeStartDocument();
+    xml.writeDTD("<!DOCTYPE openambitlog>");
+    xml.writeStartElement("openambitlog");
+    xml.writeAttribute("version", "1.0");
+
+    xml.writeTextElement("SerialNumber", deviceInfo.serial);
+    xml.writeTextElement("Time", time.toString(Qt::ISODate));
+    xml.writeTextElement("MovescountId", QString("%1").arg(movescountId));
+    ret = writeDeviceInfo();
+    ret = writePersonalSettings();
+    if (ret) {
+        ret = writeLogEntry();
+    }
+
+    xml.writeEndDocument();
+
+    return ret;
+}
+
+bool LogStore::XMLWriter::writeDeviceInfo()
+{
+    xml.writeStartElement("DeviceInfo");
+    xml.writeTextElement("Serial", deviceInfo.serial);
+    xml.writeTextElement("Model", deviceInfo.model);
+    xml.writeTextElement("Name", deviceInfo.name);
+    xml.writeTextElement("FWVersion", QString("%1.%2.%3").arg(deviceInfo.fw_version[0]).arg(deviceInfo.fw_version[1]).arg(deviceInfo.fw_version[2]));
+    xml.writeTextElement("HWVersion", QString("%1.%2.%3").arg(deviceInfo.hw_version[0]).arg(deviceInfo.hw_version[1]).arg(deviceInfo.hw_version[2]));
+    xml.writeEndElement();
+
+    return true;
+}
+
+bool LogStore::XMLWriter::writePersonalSettings()
+{
+    xml.writeStartElement("PersonalSettings");
+    xml.writeTextElement("SportModeButtonLock", QString("%1").arg(personalSettings->sportmode_button_lock));
+    xml.writeTextElement("TimeModeButtonLock", QString("%1").arg(personalSettings->timemode_button_lock));
+    xml.writeTextElement("CompassDeclination", QString("%1").arg(personalSettings->compass_declination));
+    xml.writeTextElement("UnitsMode", QString("%1").arg(personalSettings->units_mode));
+    xml.writeStartElement("Units");
+        xml.writeTextElement("AirPressureUnit", QString("%1").arg(personalSettings->units.pressure));
+        xml.writeTextElement("AltitudeUnit", QString("%1").arg(personalSettings->units.altitude));
+        xml.writeTextElement("DistanceUnit", QString("%1").arg(personalSettings->units.distance));
+        xml.writeTextElement("HeightUnit", QString("%1").arg(personalSettings->units.height));
+        xml.writeTextElement("TemperatureUnit", QString("%1").arg(personalSettings->units.temperature));
+        xml.writeTextElement("VerticalSpeedUnit", QString("%1").arg(personalSettings->units.verticalspeed));
+        xml.writeTextElement("WeightUnit", QString("%1").arg(personalSettings->units.weight));
+        xml.writeTextElement("CompassUnit", QString("%1").arg(personalSettings->units.compass));
+        xml.writeTextElement("HRUnit", QString("%1").arg(personalSettings->units.heartrate));
+        xml.writeTextElement("SpeedUnit", QString("%1").arg(personalSettings->units.speed));
+    xml.writeEndElement();
+    xml.writeTextElement("GPSPositionFormat", QString("%1").arg(personalSettings->gps_position_format));
+    xml.writeTextElement("Language", QString("%1").arg(personalSettings->language));
+    xml.writeTextElement("NavigationStyle", QString("%1").arg(personalSettings->navigation_style));
+    xml.writeTextElement("GPSTimeKeeping", QString("%1").arg(personalSettings->sync_time_w_gps));
+    xml.writeTextElement("Use24hClock", QString("%1").arg(personalSettings->time_format));
+    QString timeFormat;
+    timeFormat.sprintf("%02u:%02u", personalSettings->alarm.hour, personalSettings->alarm.minute);
+    xml.writeTextElement("Alarm", timeFormat.sprintf("%02u:%02u", personalSettings->alarm.hour, personalSettings->alarm.minute));
+    xml.writeTextElement("AlarmEnable", QString("%1").arg(personalSettings->alarm_enable));
+    xml.writeTextElement("DualTime", timeFormat.sprintf("%02u:%02u", personalSettings->dual_time.hour, personalSettings->dual_time.minute));
+    xml.writeTextElement("DisplayDateMode", QString("%1").arg(personalSettings->date_format));
+    xml.writeTextElement("TonesMode", QString("%1").arg(personalSettings->tones_mode));
+    xml.writeTextElement("BacklightMode", QString("%1").arg(personalSettings->backlight_mode));
+    xml.writeTextElement("BacklightBrightness", QString("%1").arg(personalSettings->backlight_brightness));
+    xml.writeTextElement("DisplayBrightness", QString("%1").arg(personalSettings->display_brightness));
+    xml.writeTextElement("DisplayIsNegative", QString("%1").arg(personalSettings->display_is_negative));
+    xml.writeTextElement("Weight", QString("%1").arg(personalSettings->weight));
+    xml.writeTextElement("BirthYear", QString("%1").arg(personalSettings->birthyear));
+    xml.writeTextElement("MaxHR", QString("%1").arg(personalSettings->max_hr));
+    xml.writeTextElement("RestHR", QString("%1").arg(personalSettings->rest_hr));
+    xml.writeTextElement("FitnessLevel", QString("%1").arg(personalSettings->fitness_level));
+    xml.writeTextElement("IsMale", QString("%1").arg(personalSettings->is_male));
+    xml.writeTextElement("Length", QString("%1").arg(personalSettings->length));
+    xml.writeTextElement("AltiBaroMode", QString("%1").arg(personalSettings->alti_baro_mode));
+    xml.writeTextElement("StormAlarm", QString("%1").arg(personalSettings->storm_alarm));
+    xml.writeTextElement("FusedAltiDisabled", QString("%1").arg(personalSettings->fused_alti_disabled));
+    xml.writeTextElement("BikePODCalibration", QString("%1").arg(personalSettings->bikepod_calibration));
+    xml.writeTextElement("BikePODCalibration2", QString("%1").arg(personalSettings->bikepod_calibration2));
+    xml.writeTextElement("BikePODCalibration3", QString("%1").arg(personalSettings->bikepod_calibration3));
+    xml.writeTextElement("FootPODCalibration", QString("%1").arg(personalSettings->footpod_calibration));
+    xml.writeTextElement("AutomaticBikePowerCalibration", QString("%1").arg(personalSettings->automatic_bikepower_calib));
+    xml.writeTextElement("AutomaticFootPODCalibration", QString("%1").arg(personalSettings->automatic_footpod_calib));
+    xml.writeTextElement("TrainingProgram", QString("%1").arg(personalSettings->training_program));
+
+    xml.writeEndElement();
+
+    return true;
+}
+
+bool LogStore::XMLWriter::writeLogEntry()
+{
+    u_int32_t i;
+
+    xml.writeStartElement("Log");
+    xml.writeStartElement("Header");
+    QDateTime dateTime(QDate(logEntry->header.date_time.year, logEntry->header.date_time.month, logEntry->header.date_time.day), QTime(logEntry->header.date_time.hour, logEntry->header.date_time.minute, 0).addMSecs(logEntry->header.date_time.msec));
+    xml.writeTextElement("DateTime", dateTime.toString(Qt::ISODate));
+    xml.writeTextElement("Duration", QString("%1").arg(logEntry->header.duration));
+    xml.writeTextElement("Ascent", QString("%1").arg(logEntry->header.ascent));
+    xml.writeTextElement("Descent", QString("%1").arg(logEntry->header.descent));
+    xml.writeTextElement("AscentTime", QString("%1").arg(logEntry->header.ascent_time));
+    xml.writeTextElement("DescentTime", QString("%1").arg(logEntry->header.descent_time));
+    xml.writeTextElement("RecoveryTime", QString("%1").arg(logEntry->header.recovery_time));
+    xml.writeStartElement("Speed");
+    xml.writeTextElement("Avg", QString("%1").arg(logEntry->header.speed_avg));
+    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.speed_max));
+    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.speed_max_time));
+    xml.writeEndElement();
+    xml.writeStartElement("Cadence");
+    xml.writeTextElement("Avg", QString("%1").arg(logEntry->header.cadence_avg));
+    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.cadence_max));
+    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.cadence_max_time));
+    xml.writeEndElement();
+    xml.writeStartElement("Altitude");
+    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.altitude_max));
+    xml.writeTextElement("Min", QString("%1").arg(logEntry->header.altitude_min));
+    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.altitude_max_time));
+    xml.writeTextElement("MinTime", QString("%1").arg(logEntry->header.altitude_min_time));
+    xml.writeEndElement();
+    xml.writeStartElement("HR");
+    xml.writeTextElement("Avg", QString("%1").arg(logEntry->header.heartrate_avg));
+    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.heartrate_max));
+    xml.writeTextElement("Min", QString("%1").arg(logEntry->header.heartrate_min));
+    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.heartrate_max_time));
+    xml.writeTextElement("MinTime", QString("%1").arg(logEntry->header.heartrate_min_time));
+    xml.writeEndElement();
+    xml.writeTextElement("PeakTrainingEffect", QString("%1").arg(logEntry->header.peak_training_effect));
+    xml.writeTextElement("ActivityType", QString("%1").arg(logEntry->header.activity_type));
+    xml.writeTextElement("Activity", QString::fromUtf8(logEntry->header.activity_name));
+    xml.writeStartElement("Temperature");
+    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.temperature_max));
+    xml.writeTextElement("Min", QString("%1").arg(logEntry->header.temperature_min));
+    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.temperature_max_time));
+    xml.writeTextElement("MinTime", QString("%1").arg(logEntry->header.temperature_min_time));
+    xml.writeEndElement();
+    xml.writeTextElement("Distance", QString("%1").arg(logEntry->header.distance));
+    xml.writeTextElement("LogItemCount", QString("%1").arg(logEntry->header.samples_count));
+    xml.writeTextElement("Energy", QString("%1").arg(logEntry->header.energy_consumption));
+    xml.writeTextElement("TimeToFirstFix", QString("%1").arg(logEntry->header.first_fix_time));
+    xml.writeTextElement("BatteryChargeAtStart", QString("%1").arg(logEntry->header.battery_start));
+    xml.writeTextElement("BatteryCharge", QString("%1").arg(logEntry->header.battery_end));
+    xml.writeTextElement("DistanceBeforeCalibrationChange", QString("%1").arg(logEntry->header.distance_before_calib));
+    xml.writeStartElement("Swimming");
+    xml.writeTextElement("PoolLengths", QString("%1").arg(logEntry->header.swimming_pool_lengths));
+    xml.writeTextElement("PoolLength", QString("%1").arg(logEntry->header.swimming_pool_length));
+    xml.writeEndElement();
+
+    QString hexstring;
+    hexstring = hexstring.sprintf("%02x%02x%02x%02x%02x", logEntry->header.unknown1[0],
+                                                          logEntry->header.unknown1[1],
+                                                          logEntry->header.unknown1[2],
+                                                          logEntry->header.unknown1[3],
+                                                          logEntry->header.unknown1[4]);
+    xml.writeTextElement("Unknown1", hexstring);
+    hexstring = hexstring.sprintf("%02x", logEntry->header.unknown2);
+    xml.writeTextElement("Unknown2", hexstring);
+    hexstring = hexstring.sprintf("%02x%02x", logEntry->header.unknown3[0],
+                                              logEntry->header.unknown3[1]);
+    xml.writeTextElement("Unknown3", hexstring);
+    hexstring = hexstring.sprintf("%02x%02x%02x%02x", logEntry->header.unknown5[0],
+                                                      logEntry->header.unknown5[1],
+                                                      logEntry->header.unknown5[2],
+                                                      logEntry->header.unknown5[3]);
+    xml.writeTextElement("Unknown5", hexstring);
+    hexstring = hexstring.sprintf("%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+                                  logEntry->header.unknown6[0],
+                                  logEntry->header.unknown6[1],
+                                  logEntry->header.unknown6[2],
+                                  logEntry->header.unknown6[3],
+                                  logEntry->header.unknown6[4],
+                                  logEntry->header.unknown6[5],
+                                  logEntry->header.unknown6[6],
+                                  logEntry->header.unknown6[7],
+                                  logEntry->header.unknown6[8],
+                                  logEntry->header.unknown6[9],
+                                  logEntry->header.unknown6[10],
+                                  logEntry->header.unknown6[11],
+                                  logEntry->header.unknown6[12],
+                                  logEntry->header.unknown6[13],
+                                  logEntry->header.unknown6[14],
+                                  logEntry->header.unknown6[15],
+                                  logEntry->header.unknown6[16],
+                                  logEntry->header.unknown6[17],
+                                  logEntry->header.unknown6[18],
+                                  logEntry->header.unknown6[19],
+                                  logEntry->header.unknown6[20],
+                                  logEntry->header.unknown6[21],
+                                  logEntry->header.unknown6[22],
+                                  logEntry->header.unknown6[23]);
+    xml.writeTextElement("Unknown6", hexstring);
+
+    xml.writeEndElement();
+    xml.writeStartElement("Samples");
+    for (i=0; i<logEntry->samples_count; i++) {
+        writeLogSample(&logEntry->samples[i]);
+    }
+    xml.writeEndElement();
+    xml.writeEndElement();
+
+    return true;
+}
+
+bool LogStore::XMLWriter::writeLogSample(ambit_log_sample_t *sample)
+{
+    sample_type_names_t *sample_type_name;
+    sample_distance_source_name_t *distance_source_name;
+    sample_altitude_source_name_t *altitude_source_name;
+    sample_lap_event_type_t *lap_type_name;
+    sample_cadence_source_name_t *cadence_source_name;
+    sample_swimming_style_name_t *swimming_style_name;
+    int i;
+
+    xml.writeStartElement("Sample");
+    xml.writeStartElement("Type");
+    xml.writeAttribute("id", QString("%1").arg(sample->type));
+    for (sample_type_name = &sampleTypeNames[0]; sample_type_name->XMLName != NULL; sample_type_name++) {
+        if (sample_type_name->id == sample->type) {
+            xml.writeCharacters(QString(sample_type_name->XMLName));
+            break;
+        }
+    }
+    xml.writeEndElement();
+    QDateTime dateTime(QDate(sample->utc_time.year, sample->utc_time.month, sample->utc_time.day), QTime(sample->utc_time.hour, sample->utc_time.minute, 0).addMSecs(sample->utc_time.msec));
+    dateTime.setTimeSpec(Qt::UTC);
+    xml.writeTextElement("UTC", dateTime.toString("yyyy-MM-ddThh:mm:ss.zzzZ"));
+    xml.writeTextElement("Time", QString("%1").arg(sample->time));
+    switch(sample->type) {
+    case ambit_log_sample_type_periodic:
+        writePeriodicSample(sample);
+        break;
+    case ambit_log_sample_type_logpause:
+        break;
+    case ambit_log_sample_type_logrestart:
+        break;
+    case ambit_log_sample_type_ibi:
+        for (i=0; i<sample->u.ibi.ibi_count; i++) {
+            xml.writeTextElement("IBI", QString("%1").arg(sample->u.ibi.ibi[i]));
+        }
+        break;
+    case ambit_log_sample_type_ttff:
+        xml.writeTextElement("ttff", QString("%1").arg(sample->u.ttff.value));
+        break;
+    case ambit_log_sample_type_distance_source:
+    {
+        xml.writeStartElement("DistanceSource");
+        xml.writeAttribute("id", QString("%1").arg(sample->u.distance_source.value));
+        for (distance_source_name = &sampleDistanceSourceNames[0]; distance_source_name->XMLName != ""; distance_source_name++) {
+            if (distance_source_name->source_id == sample->u.distance_source.value) {
+                xml.writeCharacters(QString(distance_source_name->XMLName));
+                break;
             }
-            if (type == ambit_log_sample_type_periodic && periodicValues.count() > 0) {
-                logEntry->logEntry->samples[sampleCount].u.periodic.value_count = periodicValues.count();
-                logEntry->logEntry->samples[sampleCount].u.periodic.values = (ambit_log_sample_periodic_value_t*)calloc(periodicValues.count(), sizeof(ambit_log_sample_periodic_value_t));
-                for (int i=0; i<periodicValues.count(); i++) {
-                    logEntry->logEntry->samples[sampleCount].u.periodic.values[i] = periodicValues.at(i);
-                }
+        }
+        xml.writeEndElement();
+        break;
+    }
+    case ambit_log_sample_type_lapinfo:
+    {
+        xml.writeStartElement("Lap");
+        xml.writeStartElement("Type");
+        xml.writeAttribute("id", QString("%1").arg(sample->u.lapinfo.event_type));
+        for (lap_type_name = &sampleLapEventTypeNames[0]; lap_type_name->XMLName != ""; lap_type_name++) {
+            if (lap_type_name->event_type == sample->u.lapinfo.event_type) {
+                xml.writeCharacters(QString(lap_type_name->XMLName));
+            }
+        }
+        xml.writeEndElement();
+        QDateTime dateTime(QDate(sample->u.lapinfo.date_time.year, sample->u.lapinfo.date_time.month, sample->u.lapinfo.date_time.day), QTime(sample->u.lapinfo.date_time.hour, sample->u.lapinfo.date_time.minute, 0).addMSecs(sample->u.lapinfo.date_time.msec));
+        xml.writeTextElement("DateTime", dateTime.toString(Qt::ISODate));
+        xml.writeTextElement("Duration", QString("%1").arg(sample->u.lapinfo.duration));
+        xml.writeTextElement("Distance", QString("%1").arg(sample->u.lapinfo.distance));
+        xml.writeEndElement();
+        break;
+    }
+    case ambit_log_sample_type_altitude_source:
+    {
+        xml.writeStartElement("AltitudeSource");
+        xml.writeAttribute("id", QString("%1").arg(sample->u.altitude_source.source_type));
+        for (altitude_source_name = &sampleAltitudeSourceNames[0]; altitude_source_name->XMLName != ""; altitude_source_name++) {
+            if (altitude_source_name->source_id == sample->u.altitude_source.source_type) {
+                xml.writeCharacters(QString(altitude_source_name->XMLName));
+                break;
+            }
+        }
+        xml.writeEndElement();
+        xml.writeTextElement("AltitudeOffset", QString("%1").arg(sample->u.altitude_source.altitude_offset));
+        xml.writeTextElement("PressureOffset", QString("%1").arg(sample->u.altitude_source.pressure_offset));
+        break;
+    }
+    case ambit_log_sample_type_gps_base:
+    {
+        xml.writeTextElement("NavValid", QString("%1").arg(sample->u.gps_base.navvalid));
+        xml.writeTextElement("NavType", QString("%1").arg(sample->u.gps_base.navtype));
+        QDateTime dateTime(QDate(sample->u.gps_base.utc_base_time.year, sample->u.gps_base.utc_base_time.month, sample->u.gps_base.utc_base_time.day), QTime(sample->u.gps_base.utc_base_time.hour, sample->u.gps_base.utc_base_time.minute, 0).addMSecs(sample->u.gps_base.utc_base_time.msec));
+        dateTime.setTimeSpec(Qt::UTC);
+        xml.writeTextElement("UTCReference", dateTime.toString("yyyy-MM-ddThh:mm:ss.zzzZ"));
+        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.gps_base.latitude));
+        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.gps_base.longitude));
+        xml.writeTextElement("GPSAltitude", QString("%1").arg(sample->u.gps_base.altitude));
+        xml.writeTextElement("GPSSpeed", QString("%1").arg(sample->u.gps_base.speed));
+        xml.writeTextElement("GPSHeading", QString("%1").arg(sample->u.gps_base.heading));
+        xml.writeTextElement("EHPE", QString("%1").arg(sample->u.gps_base.ehpe));
+        xml.writeTextElement("NumberOfSatellites", QString("%1").arg(sample->u.gps_base.noofsatellites));
+        xml.writeTextElement("GpsHDOP", QString("%1").arg(sample->u.gps_base.hdop));
+        xml.writeStartElement("Satellites");
+        ambit_log_gps_satellite_t *satellite;
+        for (i=0; i<sample->u.gps_base.satellites_count; i++) {
+            xml.writeStartElement("Satellite");
+            satellite = &sample->u.gps_base.satellites[i];
+            xml.writeTextElement("SV", QString("%1").arg(satellite->sv));
+            xml.writeTextElement("SNR", QString("%1").arg(satellite->snr));
+            xml.writeTextElement("State", QString("%1").arg(satellite->state));
+            xml.writeEndElement();
+        }
+        xml.writeEndElement();
+        break;
+    }
+    case ambit_log_sample_type_gps_small:
+    {
+        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.gps_small.latitude));
+        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.gps_small.longitude));
+        xml.writeTextElement("EHPE", QString("%1").arg(sample->u.gps_small.ehpe));
+        xml.writeTextElement("NumberOfSatellites", QString("%1").arg(sample->u.gps_small.noofsatellites));
+        break;
+    }
+    case ambit_log_sample_type_gps_tiny:
+    {
+        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.gps_tiny.latitude));
+        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.gps_tiny.longitude));
+        xml.writeTextElement("EHPE", QString("%1").arg(sample->u.gps_tiny.ehpe));
+        xml.writeTextElement("Unknown", QString("%1").arg(sample->u.gps_tiny.unknown));
+        break;
+    }
+    case ambit_log_sample_type_time:
+    {
+        QTime timeref(sample->u.time.hour, sample->u.time.minute, sample->u.time.second);
+        xml.writeTextElement("TimeRef", timeref.toString(Qt::ISODate));
+        break;
+    }
+    case ambit_log_sample_type_swimming_turn:
+    {
+        xml.writeTextElement("Distance", QString("%1").arg(sample->u.swimming_turn.distance));
+        xml.writeTextElement("Lengths", QString("%1").arg(sample->u.swimming_turn.lengths));
+        xml.writeStartElement("Classification");
+        for (size_t i=0; i<(sizeof(sample->u.swimming_turn.classification)/sizeof(sample->u.swimming_turn.classification[0])); i++) {
+            xml.writeTextElement("Item", QString("%1").arg(sample->u.swimming_turn.classification[i]));
+        }
+        xml.writeEndElement();
+        xml.writeStartElement("Style");
+        xml.writeAttribute("id", QString("%1").arg(sample->u.swimming_turn.style));
+        for (swimming_style_name = &sampleSwimmingStyleNames[0]; swimming_style_name->XMLName != ""; swimming_style_name++) {
+            if (swimming_style_name->source_id == sample->u.swimming_turn.style) {
+                xml.writeCharacters(QString(swimming_style_name->XMLName));
+                break;
             }
-            sampleCount++;
-        }
-        else {
-            xml.skipCurrentElement();
         }
+        xml.writeEndElement();
+        break;
     }
-}
-
-void LogStore::XMLReader::readPeriodicSample(QList<ambit_log_sample_periodic_value_t> *valueContent)
-{
-    ambit_log_sample_periodic_value_t value;
-
-    if (xml.name() == "Latitude") {
-        value.type = ambit_log_sample_periodic_type_latitude;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
-    }
-    else if (xml.name() == "Longitude") {
-        value.type = ambit_log_sample_periodic_type_longitude;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+    case ambit_log_sample_type_swimming_stroke:
+        break;
+    case ambit_log_sample_type_activity:
+    {
+        xml.writeTextElement("ActivityType", QString("%1").arg(sample->u.activity.activitytype));
+        xml.writeTextElement("CustomModeId", QString("%1").arg(sample->u.activity.sportmode));
+        break;
     }
-    else if (xml.name() == "Distance") {
-        value.type = ambit_log_sample_periodic_type_distance;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    case ambit_log_sample_type_cadence_source:
+    {
+        xml.writeStartElement("CadenceSource");
+        xml.writeAttribute("id", QString("%1").arg(sample->u.cadence_source.value));
+        for (cadence_source_name = &sampleCadenceSourceNames[0]; cadence_source_name->XMLName != ""; cadence_source_name++) {
+            if (cadence_source_name->source_id == sample->u.cadence_source.value) {
+                xml.writeCharacters(QString(cadence_source_name->XMLName));
+                break;
+            }
+        }
+        xml.writeEndElement();
+        break;
     }
-    else if (xml.name() == "Speed") {
-        value.type = ambit_log_sample_periodic_type_speed;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    case ambit_log_sample_type_position:
+    {
+        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.position.latitude));
+        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.position.longitude));
+        break;
     }
-    else if (xml.name() == "HR") {
-        value.type = ambit_log_sample_periodic_type_hr;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    case ambit_log_sample_type_fwinfo:
+    {
+        xml.writeTextElement("Version", QString("%1.%2.%3").arg((int)sample->u.fwinfo.version[0]).arg((int)sample->u.fwinfo.version[1]).arg((int)sample->u.fwinfo.version[2] | ((int)sample->u.fwinfo.version[3] << 8)));
+        QDateTime dateTime(QDate(sample->u.fwinfo.build_date.year, sample->u.fwinfo.build_date.month, sample->u.fwinfo.build_date.day), QTime(sample->u.fwinfo.build_date.hour, sample->u.fwinfo.build_date.minute, 0).addMSecs(sample->u.fwinfo.build_date.msec));
+        xml.writeTextElement("BuildDate", dateTime.toString(Qt::ISODate));
+        break;
     }
-    else if (xml.name() == "Time") {
-        value.type = ambit_log_sample_periodic_type_time;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    case ambit_log_sample_type_unknown:
+    {
+        QString data = "";
+        for (size_t i=0; i<sample->u.unknown.datalen; i++) {
+            data += data.sprintf("%02x", sample->u.unknown.data[i]);
+        }
+        xml.writeTextElement("Data", data);
+        break;
     }
-    else if (xml.name() == "GPSSpeed") {
-        value.type = ambit_log_sample_periodic_type_gpsspeed;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
     }
-    else if (xml.name() == "WristAccSpeed") {
-        value.type = ambit_log_sample_periodic_type_wristaccspeed;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+
+    xml.writeEndElement();
+
+    return true;
+}
+
+bool LogStore::XMLWriter::writePeriodicSample(ambit_log_sample_t *sample)
+{
+    int i;
+    ambit_log_sample_periodic_value_t *value;
+
+    for (i=0; i<sample->u.periodic.value_count; i++) {
+        value = &sample->u.periodic.values[i];
+
+        switch(value->type) {
+        case ambit_log_sample_periodic_type_latitude:
+            xml.writeTextElement("Latitude", QString("%1").arg(value->u.latitude));
+            break;
+        case ambit_log_sample_periodic_type_longitude:
+            xml.writeTextElement("Longitude", QString("%1").arg(value->u.longitude));
+            break;
+        case ambit_log_sample_periodic_type_distance:
+            xml.writeTextElement("Distance", QString("%1").arg(value->u.distance));
+            break;
+        case ambit_log_sample_periodic_type_speed:
+            xml.writeTextElement("Speed", QString("%1").arg(value->u.speed));
+            break;
+        case ambit_log_sample_periodic_type_hr:
+            xml.writeTextElement("HR", QString("%1").arg(value->u.hr));
+            break;
+        case ambit_log_sample_periodic_type_time:
+            xml.writeTextElement("Time", QString("%1").arg(value->u.time));
+            break;
+        case ambit_log_sample_periodic_type_gpsspeed:
+            xml.writeTextElement("GPSSpeed", QString("%1").arg(value->u.gpsspeed));
+            break;
+        case ambit_log_sample_periodic_type_wristaccspeed:
+            xml.writeTextElement("WristAccSpeed", QString("%1").arg(value->u.wristaccspeed));
+            break;
+        case ambit_log_sample_periodic_type_bikepodspeed:
+            xml.writeTextElement("BikePodSpeed", QString("%1").arg(value->u.bikepodspeed));
+            break;
+        case ambit_log_sample_periodic_type_ehpe:
+            xml.writeTextElement("EHPE", QString("%1").arg(value->u.ehpe));
+            break;
+        case ambit_log_sample_periodic_type_evpe:
+            xml.writeTextElement("EVPE", QString("%1").arg(value->u.evpe));
+            break;
+        case ambit_log_sample_periodic_type_altitude:
+            xml.writeTextElement("Altitude", QString("%1").arg(value->u.altitude));
+            break;
+        case ambit_log_sample_periodic_type_abspressure:
+            xml.writeTextElement("AbsPressure", QString("%1").arg(value->u.abspressure));
+            break;
+        case ambit_log_sample_periodic_type_energy:
+            xml.writeTextElement("EnergyConsumption", QString("%1").arg(value->u.energy));
+            break;
+        case ambit_log_sample_periodic_type_temperature:
+            xml.writeTextElement("Temperature", QString("%1").arg(value->u.temperature));
+            break;
+        case ambit_log_sample_periodic_type_charge:
+            xml.writeTextElement("BatteryCharge", QString("%1").arg(value->u.charge));
+            break;
+        case ambit_log_sample_periodic_type_gpsaltitude:
+            xml.writeTextElement("GPSAltitude", QString("%1").arg(value->u.gpsaltitude));
+            break;
+        case ambit_log_sample_periodic_type_gpsheading:
+            xml.writeTextElement("GPSHeading", QString("%1").arg(value->u.gpsheading));
+            break;
+        case ambit_log_sample_periodic_type_gpshdop:
+            xml.writeTextElement("GpsHDOP", QString("%1").arg(value->u.gpshdop));
+            break;
+        case ambit_log_sample_periodic_type_gpsvdop:
+            xml.writeTextElement("GpsVDOP", QString("%1").arg(value->u.gpsvdop));
+            break;
+        case ambit_log_sample_periodic_type_wristcadence:
+            xml.writeTextElement("WristCadence", QString("%1").arg(value->u.wristcadence));
+            break;
+        case ambit_log_sample_periodic_type_snr:
+        {
+            QString format;
+            QString snr = format.sprintf("%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+                                         value->u.snr[0],
+                                         value->u.snr[1],
+                                         value->u.snr[2],
+                                         value->u.snr[3],
+                                         value->u.snr[4],
+                                         value->u.snr[5],
+                                         value->u.snr[6],
+                                         value->u.snr[7],
+                                         value->u.snr[8],
+                                         value->u.snr[9],
+                                         value->u.snr[10],
+                                         value->u.snr[11],
+                                         value->u.snr[12],
+                                         value->u.snr[13],
+                                         value->u.snr[14],
+                                         value->u.snr[15]);
+            xml.writeTextElement("SNR", snr);
+            break;
+        }
+        case ambit_log_sample_periodic_type_noofsatellites:
+            xml.writeTextElement("NumberOfSatellites", QString("%1").arg(value->u.noofsatellites));
+            break;
+        case ambit_log_sample_periodic_type_sealevelpressure:
+            xml.writeTextElement("SeaLevelPressure", QString("%1").arg(value->u.sealevelpressure));
+            break;
+        case ambit_log_sample_periodic_type_verticalspeed:
+            xml.writeTextElement("VerticalSpeed", QString("%1").arg(value->u.verticalspeed));
+            break;
+        case ambit_log_sample_periodic_type_cadence:
+            xml.writeTextElement("Cadence", QString("%1").arg(value->u.cadence));
+            break;
+        case ambit_log_sample_periodic_type_bikepower:
+            xml.writeTextElement("BikePower", QString("%1").arg(value->u.bikepower));
+            break;
+        case ambit_log_sample_periodic_type_swimingstrokecnt:
+            xml.writeTextElement("SwimmingStrokeCount", QString("%1").arg(value->u.swimingstrokecnt));
+            break;
+        case ambit_log_sample_periodic_type_ruleoutput1:
+            xml.writeTextElement("RuleOutput1", QString("%1").arg(value->u.ruleoutput1));
+            break;
+        case ambit_log_sample_periodic_type_ruleoutput2:
+            xml.writeTextElement("RuleOutput2", QString("%1").arg(value->u.ruleoutput2));
+            break;
+        case ambit_log_sample_periodic_type_ruleoutput3:
+            xml.writeTextElement("RuleOutput3", QString("%1").arg(value->u.ruleoutput3));
+            break;
+        case ambit_log_sample_periodic_type_ruleoutput4:
+            xml.writeTextElement("RuleOutput4", QString("%1").arg(value->u.ruleoutput4));
+            break;
+        case ambit_log_sample_periodic_type_ruleoutput5:
+            xml.writeTextElement("RuleOutput5", QString("%1").arg(value->u.ruleoutput5));
+            break;
+        }
     }
-    else if (xml.name() == "BikePodSpeed") {
-        value.type = ambit_log_sample_periodic_type_bikepodspeed;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+
+    return true;
+}
+
+
+LogStore::BinaryReader::BinaryReader(LogEntry *logEntry) :
+    logEntry(logEntry), codec(CompressionNone), pos(NULL), end(NULL)
+{
+}
+
+bool LogStore::BinaryReader::isBinary(QIODevice *device)
+{
+    QByteArray start = device->peek(sizeof(binaryMagic));
+
+    return start.length() == sizeof(binaryMagic) && memcmp(start.constData(), binaryMagic, sizeof(binaryMagic)) == 0;
+}
+
+bool LogStore::BinaryReader::read(QIODevice *device, bool withSamples)
+{
+    QByteArray header;
+
+    if (!readStart(device) || !readSection(device, header)) {
+        return false;
     }
-    else if (xml.name() == "EHPE") {
-        value.type = ambit_log_sample_periodic_type_ehpe;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    pos = (const uchar*)header.constData();
+    end = pos + header.length();
+    readHeader();
+    if (!error.isEmpty()) {
+        return false;
     }
-    else if (xml.name() == "EVPE") {
-        value.type = ambit_log_sample_periodic_type_evpe;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+
+    if (!withSamples) {
+        return true;
     }
-    else if (xml.name() == "Altitude") {
-        value.type = ambit_log_sample_periodic_type_altitude;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+
+    return readSampleSection(device);
+}
+
+bool LogStore::BinaryReader::readStart(QIODevice *device)
+{
+    char version, c;
+
+    QByteArray start = device->read(sizeof(binaryMagic) + 1);
+    if (start.length() != sizeof(binaryMagic) + 1 || memcmp(start.constData(), binaryMagic, sizeof(binaryMagic)) != 0) {
+        error = QObject::tr("The file is not an openambit binary log.");
+        return false;
     }
-    else if (xml.name() == "AbsPressure") {
-        value.type = ambit_log_sample_periodic_type_abspressure;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    version = start.at(sizeof(binaryMagic));
+    if (version < 1 || version > BINARY_VERSION) {
+        error = QObject::tr("Unsupported binary log version %1.").arg((int)version);
+        return false;
     }
-    else if (xml.name() == "EnergyConsumption") {
-        value.type = ambit_log_sample_periodic_type_energy;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+
+    codec = CompressionNone;
+    if (version >= 2) {
+        if (!device->getChar(&c)) {
+            error = QObject::tr("Unexpected end of file.");
+            return false;
+        }
+        if (c != CompressionNone && c != CompressionZlib) {
+            error = QObject::tr("Unsupported compression %1.").arg((int)c);
+            return false;
+        }
+        codec = (Compression)c;
     }
-    else if (xml.name() == "Temperature") {
-        value.type = ambit_log_sample_periodic_type_temperature;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+
+    return true;
+}
+
+LogStore::Compression LogStore::BinaryReader::compression() const
+{
+    return codec;
+}
+
+bool LogStore::BinaryReader::readSampleSection(QIODevice *device)
+{
+    QByteArray samples;
+    quint64 samplesCount;
+
+    if (!readSection(device, samples)) {
+        return false;
     }
-    else if (xml.name() == "BatteryCharge") {
-        value.type = ambit_log_sample_periodic_type_charge;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    pos = (const uchar*)samples.constData();
+    end = pos + samples.length();
+    samplesCount = readVarint();
+    // Every sample takes at least three bytes, which bounds the
+    // allocation below for corrupt counts that passed the checksum
+    if (samplesCount > (quint64)(end - pos)) {
+        error = QObject::tr("Sample count %1 exceeds the sample table.").arg(samplesCount);
+        return false;
     }
-    else if (xml.name() == "GPSAltitude") {
-        value.type = ambit_log_sample_periodic_type_gpsaltitude;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+    if (samplesCount > 0 && logEntry->logEntry == NULL) {
+        error = QObject::tr("Samples without a log header.");
+        return false;
     }
-    else if (xml.name() == "GPSHeading") {
-        value.type = ambit_log_sample_periodic_type_gpsheading;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+    readSamples(samplesCount);
+
+    return error.isEmpty();
+}
+
+QString LogStore::BinaryReader::errorString() const
+{
+    return error;
+}
+
+bool LogStore::BinaryReader::readSection(QIODevice *device, QByteArray& section)
+{
+    quint64 length = 0;
+    char c;
+    int shift;
+    uchar crc[4];
+
+    for (shift = 0; ; shift += 7) {
+        if (shift >= 64 || !device->getChar(&c)) {
+            error = QObject::tr("Unexpected end of file.");
+            return false;
+        }
+        length |= (quint64)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            break;
+        }
     }
-    else if (xml.name() == "GpsHDOP") {
-        value.type = ambit_log_sample_periodic_type_gpshdop;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    if (length > (quint64)device->bytesAvailable()) {
+        error = QObject::tr("Section length %1 exceeds the file.").arg(length);
+        return false;
     }
-    else if (xml.name() == "GpsVDOP") {
-        value.type = ambit_log_sample_periodic_type_gpsvdop;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+
+    section = device->read(length);
+    if ((quint64)section.length() != length || device->read((char*)crc, sizeof(crc)) != sizeof(crc)) {
+        error = QObject::tr("Unexpected end of file.");
+        return false;
     }
-    else if (xml.name() == "WristCadence") {
-        value.type = ambit_log_sample_periodic_type_wristcadence;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    if (qFromLittleEndian<quint32>(crc) != crc32(0, (const Bytef*)section.constData(), section.length())) {
+        error = QObject::tr("Checksum mismatch.");
+        return false;
     }
-    else if (xml.name() == "SNR") {
-        value.type = ambit_log_sample_periodic_type_snr;
-        QByteArray val = xml.readElementText().toLocal8Bit();
-        const char *c_str = val.data();
-        for (int i=0; i<16 && i<val.length()/2; i++) {
-            sscanf(c_str, "%2hhx", &value.u.snr[i]);
-            c_str += 2 * sizeof(char);
+
+    if (codec == CompressionZlib) {
+        // Compressed sections start with their inflated length
+        QByteArray packed = section;
+        quint64 inflated;
+        uLongf inflatedLength;
+
+        pos = (const uchar*)packed.constData();
+        end = pos + packed.length();
+        inflated = readVarint();
+        if (!error.isEmpty()) {
+            return false;
+        }
+        // zlib never compresses better than 1032:1
+        if (inflated > (quint64)(end - pos) * 1032) {
+            error = QObject::tr("Section length %1 exceeds the compressed data.").arg(inflated);
+            return false;
+        }
+        section.resize(inflated);
+        inflatedLength = inflated;
+        if (uncompress((Bytef*)section.data(), &inflatedLength, pos, end - pos) != Z_OK || inflatedLength != inflated) {
+            error = QObject::tr("Failed to decompress section.");
+            return false;
         }
-        valueContent->append(value);
     }
-    else if (xml.name() == "NumberOfSatellites") {
-        value.type = ambit_log_sample_periodic_type_noofsatellites;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+
+    return true;
+}
+
+void LogStore::BinaryReader::readHeader()
+{
+    int i;
+
+    logEntry->device = readString();
+    qint64 julianDay = readSigned();
+    qint64 msecs = readSigned();
+    logEntry->time = QDateTime(QDate::fromJulianDay(julianDay), QTime(0, 0).addMSecs(msecs));
+    logEntry->movescountId = readString();
+
+    logEntry->deviceInfo.serial = readString();
+    logEntry->deviceInfo.model = readString();
+    logEntry->deviceInfo.name = readString();
+    for (i=0; i<3; i++) {
+        logEntry->deviceInfo.fw_version[i] = readSigned();
     }
-    else if (xml.name() == "SeaLevelPressure") {
-        value.type = ambit_log_sample_periodic_type_sealevelpressure;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    for (i=0; i<3; i++) {
+        logEntry->deviceInfo.hw_version[i] = readSigned();
     }
-    else if (xml.name() == "VerticalSpeed") {
-        value.type = ambit_log_sample_periodic_type_verticalspeed;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+
+    if (readVarint() != 0) {
+        readPersonalSettings();
     }
-    else if (xml.name() == "Cadence") {
-        value.type = ambit_log_sample_periodic_type_cadence;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+    if (readVarint() != 0) {
+        readLogHeader();
     }
-    else if (xml.name() == "BikePower") {
-        value.type = ambit_log_sample_periodic_type_bikepower;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+}
+
+void LogStore::BinaryReader::readPersonalSettings()
+{
+    ambit_personal_settings_t *settings;
+
+    settings = (ambit_personal_settings_t*)calloc(1, sizeof(ambit_personal_settings_t));
+    logEntry->setPersonalSettings(settings);
+    settings->sportmode_button_lock = readVarint();
+    settings->timemode_button_lock = readVarint();
+    settings->compass_declination = readVarint();
+    readRaw(&settings->compass_declination_f, sizeof(settings->compass_declination_f));
+    settings->units_mode = readVarint();
+    settings->units.pressure = readVarint();
+    settings->units.altitude = readVarint();
+    settings->units.distance = readVarint();
+    settings->units.height = readVarint();
+    settings->units.temperature = readVarint();
+    settings->units.verticalspeed = readVarint();
+    settings->units.weight = readVarint();
+    settings->units.compass = readVarint();
+    settings->units.heartrate = readVarint();
+    settings->units.speed = readVarint();
+    settings->gps_position_format = readVarint();
+    settings->language = readVarint();
+    settings->navigation_style = readVarint();
+    settings->sync_time_w_gps = readVarint();
+    settings->time_format = readVarint();
+    settings->alarm.hour = readVarint();
+    settings->alarm.minute = readVarint();
+    settings->alarm_enable = readVarint();
+    settings->dual_time.hour = readVarint();
+    settings->dual_time.minute = readVarint();
+    settings->date_format = readVarint();
+    settings->tones_mode = readVarint();
+    settings->backlight_mode = readVarint();
+    settings->backlight_brightness = readVarint();
+    settings->display_brightness = readVarint();
+    settings->display_is_negative = readVarint();
+    settings->weight = readVarint();
+    settings->birthyear = readVarint();
+    settings->max_hr = readVarint();
+    settings->rest_hr = readVarint();
+    settings->fitness_level = readVarint();
+    settings->is_male = readVarint();
+    settings->length = readVarint();
+    settings->alti_baro_mode = readVarint();
+    settings->storm_alarm = readVarint();
+    settings->fused_alti_disabled = readVarint();
+    settings->bikepod_calibration = readVarint();
+    settings->bikepod_calibration2 = readVarint();
+    settings->bikepod_calibration3 = readVarint();
+    settings->footpod_calibration = readVarint();
+    settings->automatic_bikepower_calib = readVarint();
+    settings->automatic_footpod_calib = readVarint();
+    settings->training_program = readVarint();
+}
+
+void LogStore::BinaryReader::readLogHeader()
+{
+    ambit_log_header_t *header;
+
+    logEntry->setLogEntry((ambit_log_entry_t*)calloc(1, sizeof(ambit_log_entry_t)));
+    header = &logEntry->logEntry->header;
+    readDateTime(&header->date_time);
+    header->duration = readVarint();
+    header->ascent = readVarint();
+    header->descent = readVarint();
+    header->ascent_time = readVarint();
+    header->descent_time = readVarint();
+    header->recovery_time = readVarint();
+    header->speed_avg = readVarint();
+    header->speed_max = readVarint();
+    header->speed_max_time = readVarint();
+    header->altitude_max = readSigned();
+    header->altitude_min = readSigned();
+    header->altitude_max_time = readVarint();
+    header->altitude_min_time = readVarint();
+    header->heartrate_avg = readVarint();
+    header->heartrate_max = readVarint();
+    header->heartrate_min = readVarint();
+    header->heartrate_max_time = readVarint();
+    header->heartrate_min_time = readVarint();
+    header->peak_training_effect = readVarint();
+    header->activity_type = readVarint();
+    header->activity_name = strdup(readString().toUtf8().data());
+    header->temperature_max = readSigned();
+    header->temperature_min = readSigned();
+    header->temperature_max_time = readVarint();
+    header->temperature_min_time = readVarint();
+    header->distance = readVarint();
+    header->samples_count = readVarint();
+    header->energy_consumption = readVarint();
+    header->first_fix_time = readVarint();
+    header->battery_start = readVarint();
+    header->battery_end = readVarint();
+    header->distance_before_calib = readVarint();
+    readRaw(header->unknown1, sizeof(header->unknown1));
+    header->unknown2 = readVarint();
+    header->cadence_max = readVarint();
+    header->cadence_avg = readVarint();
+    readRaw(header->unknown3, sizeof(header->unknown3));
+    header->swimming_pool_lengths = readVarint();
+    header->cadence_max_time = readVarint();
+    header->swimming_pool_length = readVarint();
+    readRaw(header->unknown5, sizeof(header->unknown5));
+    readRaw(header->unknown6, sizeof(header->unknown6));
+}
+
+void LogStore::BinaryReader::readSamples(quint32 count)
+{
+    quint32 i;
+
+    lastTime = 0;
+    lastUTC = 0;
+    lastLatitude = 0;
+    lastLongitude = 0;
+    memset(lastPeriodic, 0, sizeof(lastPeriodic));
+
+    if (count == 0) {
+        return;
     }
-    else if (xml.name() == "SwimmingStrokeCount") {
-        value.type = ambit_log_sample_periodic_type_swimingstrokecnt;
-        value.u.latitude = xml.readElementText().toUInt();
-        valueContent->append(value);
+
+    logEntry->logEntry->samples = (ambit_log_sample_t*)calloc(count, sizeof(ambit_log_sample_t));
+    logEntry->logEntry->samples_count = count;
+    for (i=0; i<count && error.isEmpty(); i++) {
+        readSample(&logEntry->logEntry->samples[i]);
     }
-    else if (xml.name() == "RuleOutput1") {
-        value.type = ambit_log_sample_periodic_type_ruleoutput1;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+}
+
+void LogStore::BinaryReader::readSample(ambit_log_sample_t *sample)
+{
+    int i;
+    quint64 satellites;
+
+    sample->type = (ambit_log_sample_type_t)readVarint();
+    sample->time = lastTime = lastTime + readSigned();
+    lastUTC += readSigned();
+    unpackDateTime(lastUTC, &sample->utc_time);
+
+    switch(sample->type) {
+    case ambit_log_sample_type_periodic:
+        readPeriodicSample(sample);
+        break;
+    case ambit_log_sample_type_logpause:
+    case ambit_log_sample_type_logrestart:
+    case ambit_log_sample_type_swimming_stroke:
+        break;
+    case ambit_log_sample_type_ibi:
+        sample->u.ibi.ibi_count = readVarint();
+        if (sample->u.ibi.ibi_count > sizeof(sample->u.ibi.ibi)/sizeof(sample->u.ibi.ibi[0])) {
+            error = QObject::tr("Too many IBI values.");
+            sample->u.ibi.ibi_count = 0;
+            break;
+        }
+        for (i=0; i<sample->u.ibi.ibi_count; i++) {
+            sample->u.ibi.ibi[i] = readVarint();
+        }
+        break;
+    case ambit_log_sample_type_ttff:
+        sample->u.ttff.value = readVarint();
+        break;
+    case ambit_log_sample_type_distance_source:
+        sample->u.distance_source.value = readVarint();
+        break;
+    case ambit_log_sample_type_lapinfo:
+        sample->u.lapinfo.event_type = readVarint();
+        readDateTime(&sample->u.lapinfo.date_time);
+        sample->u.lapinfo.duration = readVarint();
+        sample->u.lapinfo.distance = readVarint();
+        break;
+    case ambit_log_sample_type_altitude_source:
+        sample->u.altitude_source.source_type = readVarint();
+        sample->u.altitude_source.altitude_offset = readSigned();
+        sample->u.altitude_source.pressure_offset = readSigned();
+        break;
+    case ambit_log_sample_type_gps_base:
+        sample->u.gps_base.navvalid = readVarint();
+        sample->u.gps_base.navtype = readVarint();
+        readDateTime(&sample->u.gps_base.utc_base_time);
+        readPosition(&sample->u.gps_base.latitude, &sample->u.gps_base.longitude);
+        sample->u.gps_base.altitude = readSigned();
+        sample->u.gps_base.speed = readVarint();
+        sample->u.gps_base.heading = readVarint();
+        sample->u.gps_base.ehpe = readVarint();
+        sample->u.gps_base.noofsatellites = readVarint();
+        sample->u.gps_base.hdop = readVarint();
+        satellites = readVarint();
+        // Each satellite takes at least three bytes, anything more than
+        // what is left of the section (or fits the count) is corrupt
+        if (satellites > 0xff || satellites > (quint64)(end - pos) / 3) {
+            error = QObject::tr("Too many satellites.");
+            sample->u.gps_base.satellites_count = 0;
+            break;
+        }
+        sample->u.gps_base.satellites_count = satellites;
+        if (sample->u.gps_base.satellites_count > 0) {
+            sample->u.gps_base.satellites = (ambit_log_gps_satellite_t*)calloc(sample->u.gps_base.satellites_count, sizeof(ambit_log_gps_satellite_t));
+            for (i=0; i<sample->u.gps_base.satellites_count; i++) {
+                sample->u.gps_base.satellites[i].sv = readVarint();
+                sample->u.gps_base.satellites[i].snr = readVarint();
+                sample->u.gps_base.satellites[i].state = readVarint();
+            }
+        }
+        break;
+    case ambit_log_sample_type_gps_small:
+        sample->u.gps_small.noofsatellites = readVarint();
+        readPosition(&sample->u.gps_small.latitude, &sample->u.gps_small.longitude);
+        sample->u.gps_small.ehpe = readVarint();
+        break;
+    case ambit_log_sample_type_gps_tiny:
+        readPosition(&sample->u.gps_tiny.latitude, &sample->u.gps_tiny.longitude);
+        sample->u.gps_tiny.ehpe = readVarint();
+        sample->u.gps_tiny.unknown = readVarint();
+        break;
+    case ambit_log_sample_type_time:
+        sample->u.time.hour = readVarint();
+        sample->u.time.minute = readVarint();
+        sample->u.time.second = readVarint();
+        break;
+    case ambit_log_sample_type_swimming_turn:
+        sample->u.swimming_turn.distance = readVarint();
+        sample->u.swimming_turn.lengths = readVarint();
+        for (i=0; i<4; i++) {
+            sample->u.swimming_turn.classification[i] = readVarint();
+        }
+        sample->u.swimming_turn.style = readVarint();
+        break;
+    case ambit_log_sample_type_activity:
+        sample->u.activity.activitytype = readVarint();
+        sample->u.activity.sportmode = readVarint();
+        break;
+    case ambit_log_sample_type_cadence_source:
+        sample->u.cadence_source.value = readVarint();
+        break;
+    case ambit_log_sample_type_position:
+        readPosition(&sample->u.position.latitude, &sample->u.position.longitude);
+        break;
+    case ambit_log_sample_type_fwinfo:
+        readRaw(sample->u.fwinfo.version, sizeof(sample->u.fwinfo.version));
+        readDateTime(&sample->u.fwinfo.build_date);
+        break;
+    case ambit_log_sample_type_unknown:
+    {
+        quint64 datalen = readVarint();
+        if (datalen > (quint64)(end - pos)) {
+            error = QObject::tr("Sample data exceeds the sample table.");
+            break;
+        }
+        if (datalen > 0) {
+            sample->u.unknown.data = (uint8_t*)malloc(datalen);
+            sample->u.unknown.datalen = datalen;
+            readRaw(sample->u.unknown.data, datalen);
+        }
+        break;
     }
-    else if (xml.name() == "RuleOutput2") {
-        value.type = ambit_log_sample_periodic_type_ruleoutput2;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+    default:
+        // Written without payload, like XMLWriter does
+        break;
     }
-    else if (xml.name() == "RuleOutput3") {
-        value.type = ambit_log_sample_periodic_type_ruleoutput3;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+}
+
+void LogStore::BinaryReader::readPeriodicSample(ambit_log_sample_t *sample)
+{
+    ambit_log_sample_periodic_value_t *value;
+    qint64 newValue;
+    quint64 type;
+    int i;
+
+    sample->u.periodic.value_count = readVarint();
+    if (sample->u.periodic.value_count == 0) {
+        return;
     }
-    else if (xml.name() == "RuleOutput4") {
-        value.type = ambit_log_sample_periodic_type_ruleoutput4;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+
+    sample->u.periodic.values = (ambit_log_sample_periodic_value_t*)calloc(sample->u.periodic.value_count, sizeof(ambit_log_sample_periodic_value_t));
+    for (i=0; i<sample->u.periodic.value_count && error.isEmpty(); i++) {
+        value = &sample->u.periodic.values[i];
+        type = readVarint();
+        if (type >= sizeof(lastPeriodic)/sizeof(lastPeriodic[0])) {
+            error = QObject::tr("Unknown periodic value type %1.").arg(type);
+            break;
+        }
+        value->type = (ambit_log_sample_periodic_type_t)type;
+        // Only tells whether the type is stored as a number here
+        if (periodicValue(value, &newValue)) {
+            setPeriodicValue(value, lastPeriodic[type] + readSigned());
+            periodicValue(value, &lastPeriodic[type]);
+        }
+        else {
+            readRaw(&value->u, sizeof(value->u));
+        }
     }
-    else if (xml.name() == "RuleOutput5") {
-        value.type = ambit_log_sample_periodic_type_ruleoutput5;
-        value.u.latitude = xml.readElementText().toInt();
-        valueContent->append(value);
+}
+
+quint64 LogStore::BinaryReader::readVarint()
+{
+    quint64 value = 0;
+    int shift;
+
+    for (shift = 0; shift < 64 && pos < end; shift += 7) {
+        value |= (quint64)(*pos & 0x7f) << shift;
+        if ((*pos++ & 0x80) == 0) {
+            return value;
+        }
     }
-    else {
-        xml.skipCurrentElement();
+
+    if (error.isEmpty()) {
+        error = QObject::tr("Truncated or malformed value.");
     }
+    pos = end;
+
+    return 0;
 }
 
+qint64 LogStore::BinaryReader::readSigned()
+{
+    quint64 value = readVarint();
 
-LogStore::XMLWriter::XMLWriter(const DeviceInfo& deviceInfo, QDateTime time, QString movescountId, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry) :
-    deviceInfo(deviceInfo), time(time), movescountId(movescountId), personalSettings(personalSettings), logEntry(logEntry)
+    return (qint64)(value >> 1) ^ -(qint64)(value & 1);
+}
+
+bool LogStore::BinaryReader::readRaw(void *data, size_t length)
 {
-    xml.setAutoFormatting(true);
+    if (length > (size_t)(end - pos)) {
+        if (error.isEmpty()) {
+            error = QObject::tr("Truncated or malformed value.");
+        }
+        pos = end;
+        memset(data, 0, length);
+        return false;
+    }
+
+    memcpy(data, pos, length);
+    pos += length;
+
+    return true;
 }
 
-bool LogStore::XMLWriter::write(QIODevice *device)
+QString LogStore::BinaryReader::readString()
 {
-    bool ret = true;
+    quint64 length = readVarint();
+    QString string;
 
-    xml.setDevice(device);
+    if (length > (quint64)(end - pos)) {
+        if (error.isEmpty()) {
+            error = QObject::tr("Truncated or malformed value.");
+        }
+        pos = end;
+        return string;
+    }
+
+    string = QString::fromUtf8((const char*)pos, length);
+    pos += length;
+
+    return string;
+}
+
+void LogStore::BinaryReader::readDateTime(ambit_date_time_t *dateTime)
+{
+    dateTime->year = readVarint();
+    dateTime->month = readVarint();
+    dateTime->day = readVarint();
+    dateTime->hour = readVarint();
+    dateTime->minute = readVarint();
+    dateTime->msec = readVarint();
+}
+
+void LogStore::BinaryReader::readPosition(int32_t *latitude, int32_t *longitude)
+{
+    *latitude = lastLatitude = lastLatitude + readSigned();
+    *longitude = lastLongitude = lastLongitude + readSigned();
+}
+
+
+LogStore::BinaryWriter::BinaryWriter(QString device, const DeviceInfo& deviceInfo, QDateTime time, QString movescountId, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry) :
+    device(device), deviceInfo(deviceInfo), time(time), movescountId(movescountId), personalSettings(personalSettings), logEntry(logEntry),
+    compression(CompressionNone), compressionLevel(Z_DEFAULT_COMPRESSION), fileChecksum(0)
+{
+}
+
+void LogStore::BinaryWriter::setCompression(Compression compression, int level)
+{
+    this->compression = compression;
+    compressionLevel = level;
+}
+
+/*
+ * File layout, all integers as LEB128 varints (zigzag for signed ones)
+ * unless noted otherwise:
+ *   "OAMBTLOG", version byte
+ *   header section:  length, device, time, movescount id, device info,
+ *                    personal settings and log header, le32 crc32
+ *   samples section: length, sample count, samples, le32 crc32
+ * Sample times, UTC times and positions are stored as differences to the
+ * previous sample, periodic values as differences to the last value of
+ * the same type, which makes most of them a single byte.
+ */
+bool LogStore::BinaryWriter::write(QIODevice *device)
+{
+    QByteArray header, samples;
+    u_int32_t i;
+
+    writeHeader(header);
+
+    lastTime = 0;
+    lastUTC = 0;
+    lastLatitude = 0;
+    lastLongitude = 0;
+    memset(lastPeriodic, 0, sizeof(lastPeriodic));
+
+    if (logEntry != NULL && logEntry->samples != NULL) {
+        samples.reserve(logEntry->samples_count * 16);
+        putVarint(samples, logEntry->samples_count);
+        for (i=0; i<logEntry->samples_count; i++) {
+            writeSample(samples, &logEntry->samples[i]);
+        }
+    }
+    else {
+        putVarint(samples, 0);
+    }
 
-    xml.writeStartDocument();
-    xml.writeDTD("<!DOCTYPE openambitlog>");
-    xml.writeStartElement("openambitlog");
-    xml.writeAttribute("version", "1.0");
+    fileChecksum = crc32(0, NULL, 0);
 
-    xml.writeTextElement("SerialNumber", deviceInfo.serial);
-    xml.writeTextElement("Time", time.toString(Qt::ISODate));
-    xml.writeTextElement("MovescountId", QString("%1").arg(movescountId));
-    ret = writeDeviceInfo();
-    ret = writePersonalSettings();
-    if (ret) {
-        ret = writeLogEntry();
+    QByteArray start(binaryMagic, sizeof(binaryMagic));
+    start.append((char)BINARY_VERSION);
+    start.append((char)compression);
+    if (!writeData(device, start)) {
+        return false;
     }
 
-    xml.writeEndDocument();
+    return writeSection(device, header) && writeSection(device, samples);
+}
 
-    return ret;
+// crc32 of the whole file as written, for the log index
+quint32 LogStore::BinaryWriter::checksum() const
+{
+    return fileChecksum;
 }
 
-bool LogStore::XMLWriter::writeDeviceInfo()
+bool LogStore::BinaryWriter::writeData(QIODevice *device, const QByteArray& data)
 {
-    xml.writeStartElement("DeviceInfo");
-    xml.writeTextElement("Serial", deviceInfo.serial);
-    xml.writeTextElement("Model", deviceInfo.model);
-    xml.writeTextElement("Name", deviceInfo.name);
-    xml.writeTextElement("FWVersion", QString("%1.%2.%3").arg(deviceInfo.fw_version[0]).arg(deviceInfo.fw_version[1]).arg(deviceInfo.fw_version[2]));
-    xml.writeTextElement("HWVersion", QString("%1.%2.%3").arg(deviceInfo.hw_version[0]).arg(deviceInfo.hw_version[1]).arg(deviceInfo.hw_version[2]));
-    xml.writeEndElement();
+    fileChecksum = crc32(fileChecksum, (const Bytef*)data.constData(), data.length());
 
-    return true;
+    return device->write(data) == data.length();
 }
 
-bool LogStore::XMLWriter::writePersonalSettings()
+bool LogStore::BinaryWriter::writeSection(QIODevice *device, const QByteArray& section)
 {
-    xml.writeStartElement("PersonalSettings");
-    xml.writeTextElement("SportModeButtonLock", QString("%1").arg(personalSettings->sportmode_button_lock));
-    xml.writeTextElement("TimeModeButtonLock", QString("%1").arg(personalSettings->timemode_button_lock));
-    xml.writeTextElement("CompassDeclination", QString("%1").arg(personalSettings->compass_declination));
-    xml.writeTextElement("UnitsMode", QString("%1").arg(personalSettings->units_mode));
-    xml.writeStartElement("Units");
-        xml.writeTextElement("AirPressureUnit", QString("%1").arg(personalSettings->units.pressure));
-        xml.writeTextElement("AltitudeUnit", QString("%1").arg(personalSettings->units.altitude));
-        xml.writeTextElement("DistanceUnit", QString("%1").arg(personalSettings->units.distance));
-        xml.writeTextElement("HeightUnit", QString("%1").arg(personalSettings->units.height));
-        xml.writeTextElement("TemperatureUnit", QString("%1").arg(personalSettings->units.temperature));
-        xml.writeTextElement("VerticalSpeedUnit", QString("%1").arg(personalSettings->units.verticalspeed));
-        xml.writeTextElement("WeightUnit", QString("%1").arg(personalSettings->units.weight));
-        xml.writeTextElement("CompassUnit", QString("%1").arg(personalSettings->units.compass));
-        xml.writeTextElement("HRUnit", QString("%1").arg(personalSettings->units.heartrate));
-        xml.writeTextElement("SpeedUnit", QString("%1").arg(personalSettings->units.speed));
-    xml.writeEndElement();
-    xml.writeTextElement("GPSPositionFormat", QString("%1").arg(personalSettings->gps_position_format));
-    xml.writeTextElement("Language", QString("%1").arg(personalSettings->language));
-    xml.writeTextElement("NavigationStyle", QString("%1").arg(personalSettings->navigation_style));
-    xml.writeTextElement("GPSTimeKeeping", QString("%1").arg(personalSettings->sync_time_w_gps));
-    xml.writeTextElement("Use24hClock", QString("%1").arg(personalSettings->time_format));
-    QString timeFormat;
-    timeFormat.sprintf("%02u:%02u", personalSettings->alarm.hour, personalSettings->alarm.minute);
-    xml.writeTextElement("Alarm", timeFormat.sprintf("%02u:%02u", personalSettings->alarm.hour, personalSettings->alarm.minute));
-    xml.writeTextElement("AlarmEnable", QString("%1").arg(personalSettings->alarm_enable));
-    xml.writeTextElement("DualTime", timeFormat.sprintf("%02u:%02u", personalSettings->dual_time.hour, personalSettings->dual_time.minute));
-    xml.writeTextElement("DisplayDateMode", QString("%1").arg(personalSettings->date_format));
-    xml.writeTextElement("TonesMode", QString("%1").arg(personalSettings->tones_mode));
-    xml.writeTextElement("BacklightMode", QString("%1").arg(personalSettings->backlight_mode));
-    xml.writeTextElement("BacklightBrightness", QString("%1").arg(personalSettings->backlight_brightness));
-    xml.writeTextElement("DisplayBrightness", QString("%1").arg(personalSettings->display_brightness));
-    xml.writeTextElement("DisplayIsNegative", QString("%1").arg(personalSettings->display_is_negative));
-    xml.writeTextElement("Weight", QString("%1").arg(personalSettings->weight));
-    xml.writeTextElement("BirthYear", QString("%1").arg(personalSettings->birthyear));
-    xml.writeTextElement("MaxHR", QString("%1").arg(personalSettings->max_hr));
-    xml.writeTextElement("RestHR", QString("%1").arg(personalSettings->rest_hr));
-    xml.writeTextElement("FitnessLevel", QString("%1").arg(personalSettings->fitness_level));
-    xml.writeTextElement("IsMale", QString("%1").arg(personalSettings->is_male));
-    xml.writeTextElement("Length", QString("%1").arg(personalSettings->length));
-    xml.writeTextElement("AltiBaroMode", QString("%1").arg(personalSettings->alti_baro_mode));
-    xml.writeTextElement("StormAlarm", QString("%1").arg(personalSettings->storm_alarm));
-    xml.writeTextElement("FusedAltiDisabled", QString("%1").arg(personalSettings->fused_alti_disabled));
-    xml.writeTextElement("BikePODCalibration", QString("%1").arg(personalSettings->bikepod_calibration));
-    xml.writeTextElement("BikePODCalibration2", QString("%1").arg(personalSettings->bikepod_calibration2));
-    xml.writeTextElement("BikePODCalibration3", QString("%1").arg(personalSettings->bikepod_calibration3));
-    xml.writeTextElement("FootPODCalibration", QString("%1").arg(personalSettings->footpod_calibration));
-    xml.writeTextElement("AutomaticBikePowerCalibration", QString("%1").arg(personalSettings->automatic_bikepower_calib));
-    xml.writeTextElement("AutomaticFootPODCalibration", QString("%1").arg(personalSettings->automatic_footpod_calib));
-    xml.writeTextElement("TrainingProgram", QString("%1").arg(personalSettings->training_program));
+    QByteArray stored, length;
+    uchar crc[4];
 
-    xml.writeEndElement();
+    if (compression == CompressionZlib) {
+        uLongf packedLength = compressBound(section.length());
+        int offset;
 
-    return true;
+        putVarint(stored, section.length());
+        offset = stored.length();
+        stored.resize(offset + packedLength);
+        if (compress2((Bytef*)stored.data() + offset, &packedLength, (const Bytef*)section.constData(), section.length(), compressionLevel) != Z_OK) {
+            return false;
+        }
+        stored.resize(offset + packedLength);
+    }
+    else {
+        stored = section;
+    }
+
+    // The checksum covers the bytes as stored, so damage is caught before
+    // anything is inflated
+    putVarint(length, stored.length());
+    qToLittleEndian<quint32>(crc32(0, (const Bytef*)stored.constData(), stored.length()), crc);
+
+    return writeData(device, length) &&
+           writeData(device, stored) &&
+           writeData(device, QByteArray((const char*)crc, sizeof(crc)));
 }
 
-bool LogStore::XMLWriter::writeLogEntry()
+void LogStore::BinaryWriter::writeHeader(QByteArray& out)
 {
-    u_int32_t i;
+    int i;
 
-    xml.writeStartElement("Log");
-    xml.writeStartElement("Header");
-    QDateTime dateTime(QDate(logEntry->header.date_time.year, logEntry->header.date_time.month, logEntry->header.date_time.day), QTime(logEntry->header.date_time.hour, logEntry->header.date_time.minute, 0).addMSecs(logEntry->header.date_time.msec));
-    xml.writeTextElement("DateTime", dateTime.toString(Qt::ISODate));
-    xml.writeTextElement("Duration", QString("%1").arg(logEntry->header.duration));
-    xml.writeTextElement("Ascent", QString("%1").arg(logEntry->header.ascent));
-    xml.writeTextElement("Descent", QString("%1").arg(logEntry->header.descent));
-    xml.writeTextElement("AscentTime", QString("%1").arg(logEntry->header.ascent_time));
-    xml.writeTextElement("DescentTime", QString("%1").arg(logEntry->header.descent_time));
-    xml.writeTextElement("RecoveryTime", QString("%1").arg(logEntry->header.recovery_time));
-    xml.writeStartElement("Speed");
-    xml.writeTextElement("Avg", QString("%1").arg(logEntry->header.speed_avg));
-    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.speed_max));
-    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.speed_max_time));
-    xml.writeEndElement();
-    xml.writeStartElement("Cadence");
-    xml.writeTextElement("Avg", QString("%1").arg(logEntry->header.cadence_avg));
-    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.cadence_max));
-    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.cadence_max_time));
-    xml.writeEndElement();
-    xml.writeStartElement("Altitude");
-    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.altitude_max));
-    xml.writeTextElement("Min", QString("%1").arg(logEntry->header.altitude_min));
-    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.altitude_max_time));
-    xml.writeTextElement("MinTime", QString("%1").arg(logEntry->header.altitude_min_time));
-    xml.writeEndElement();
-    xml.writeStartElement("HR");
-    xml.writeTextElement("Avg", QString("%1").arg(logEntry->header.heartrate_avg));
-    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.heartrate_max));
-    xml.writeTextElement("Min", QString("%1").arg(logEntry->header.heartrate_min));
-    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.heartrate_max_time));
-    xml.writeTextElement("MinTime", QString("%1").arg(logEntry->header.heartrate_min_time));
-    xml.writeEndElement();
-    xml.writeTextElement("PeakTrainingEffect", QString("%1").arg(logEntry->header.peak_training_effect));
-    xml.writeTextElement("ActivityType", QString("%1").arg(logEntry->header.activity_type));
-    xml.writeTextElement("Activity", QString::fromUtf8(logEntry->header.activity_name));
-    xml.writeStartElement("Temperature");
-    xml.writeTextElement("Max", QString("%1").arg(logEntry->header.temperature_max));
-    xml.writeTextElement("Min", QString("%1").arg(logEntry->header.temperature_min));
-    xml.writeTextElement("MaxTime", QString("%1").arg(logEntry->header.temperature_max_time));
-    xml.writeTextElement("MinTime", QString("%1").arg(logEntry->header.temperature_min_time));
-    xml.writeEndElement();
-    xml.writeTextElement("Distance", QString("%1").arg(logEntry->header.distance));
-    xml.writeTextElement("LogItemCount", QString("%1").arg(logEntry->header.samples_count));
-    xml.writeTextElement("Energy", QString("%1").arg(logEntry->header.energy_consumption));
-    xml.writeTextElement("TimeToFirstFix", QString("%1").arg(logEntry->header.first_fix_time));
-    xml.writeTextElement("BatteryChargeAtStart", QString("%1").arg(logEntry->header.battery_start));
-    xml.writeTextElement("BatteryCharge", QString("%1").arg(logEntry->header.battery_end));
-    xml.writeTextElement("DistanceBeforeCalibrationChange", QString("%1").arg(logEntry->header.distance_before_calib));
-    xml.writeStartElement("Swimming");
-    xml.writeTextElement("PoolLengths", QString("%1").arg(logEntry->header.swimming_pool_lengths));
-    xml.writeTextElement("PoolLength", QString("%1").arg(logEntry->header.swimming_pool_length));
-    xml.writeEndElement();
+    putString(out, device);
+    putSigned(out, time.date().toJulianDay());
+    putSigned(out, QTime(0, 0).msecsTo(time.time()));
+    putString(out, movescountId);
 
-    QString hexstring;
-    hexstring = hexstring.sprintf("%02x%02x%02x%02x%02x", logEntry->header.unknown1[0],
-                                                          logEntry->header.unknown1[1],
-                                                          logEntry->header.unknown1[2],
-                                                          logEntry->header.unknown1[3],
-                                                          logEntry->header.unknown1[4]);
-    xml.writeTextElement("Unknown1", hexstring);
-    hexstring = hexstring.sprintf("%02x", logEntry->header.unknown2);
-    xml.writeTextElement("Unknown2", hexstring);
-    hexstring = hexstring.sprintf("%02x%02x", logEntry->header.unknown3[0],
-                                              logEntry->header.unknown3[1]);
-    xml.writeTextElement("Unknown3", hexstring);
-    hexstring = hexstring.sprintf("%02x%02x%02x%02x", logEntry->header.unknown5[0],
-                                                      logEntry->header.unknown5[1],
-                                                      logEntry->header.unknown5[2],
-                                                      logEntry->header.unknown5[3]);
-    xml.writeTextElement("Unknown5", hexstring);
-    hexstring = hexstring.sprintf("%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-                                  logEntry->header.unknown6[0],
-                                  logEntry->header.unknown6[1],
-                                  logEntry->header.unknown6[2],
-                                  logEntry->header.unknown6[3],
-                                  logEntry->header.unknown6[4],
-                                  logEntry->header.unknown6[5],
-                                  logEntry->header.unknown6[6],
-                                  logEntry->header.unknown6[7],
-                                  logEntry->header.unknown6[8],
-                                  logEntry->header.unknown6[9],
-                                  logEntry->header.unknown6[10],
-                                  logEntry->header.unknown6[11],
-                                  logEntry->header.unknown6[12],
-                                  logEntry->header.unknown6[13],
-                                  logEntry->header.unknown6[14],
-                                  logEntry->header.unknown6[15],
-                                  logEntry->header.unknown6[16],
-                                  logEntry->header.unknown6[17],
-                                  logEntry->header.unknown6[18],
-                                  logEntry->header.unknown6[19],
-                                  logEntry->header.unknown6[20],
-                                  logEntry->header.unknown6[21],
-                                  logEntry->header.unknown6[22],
-                                  logEntry->header.unknown6[23]);
-    xml.writeTextElement("Unknown6", hexstring);
+    putString(out, deviceInfo.serial);
+    putString(out, deviceInfo.model);
+    putString(out, deviceInfo.name);
+    for (i=0; i<3; i++) {
+        putSigned(out, deviceInfo.fw_version[i]);
+    }
+    for (i=0; i<3; i++) {
+        putSigned(out, deviceInfo.hw_version[i]);
+    }
 
-    xml.writeEndElement();
-    xml.writeStartElement("Samples");
-    for (i=0; i<logEntry->samples_count; i++) {
-        writeLogSample(&logEntry->samples[i]);
+    putVarint(out, personalSettings != NULL);
+    if (personalSettings != NULL) {
+        writePersonalSettings(out);
     }
-    xml.writeEndElement();
-    xml.writeEndElement();
+    putVarint(out, logEntry != NULL);
+    if (logEntry != NULL) {
+        writeLogHeader(out);
+    }
+}
 
-    return true;
+void LogStore::BinaryWriter::writePersonalSettings(QByteArray& out)
+{
+    putVarint(out, personalSettings->sportmode_button_lock);
+    putVarint(out, personalSettings->timemode_button_lock);
+    putVarint(out, personalSettings->compass_declination);
+    putRaw(out, &personalSettings->compass_declination_f, sizeof(personalSettings->compass_declination_f));
+    putVarint(out, personalSettings->units_mode);
+    putVarint(out, personalSettings->units.pressure);
+    putVarint(out, personalSettings->units.altitude);
+    putVarint(out, personalSettings->units.distance);
+    putVarint(out, personalSettings->units.height);
+    putVarint(out, personalSettings->units.temperature);
+    putVarint(out, personalSettings->units.verticalspeed);
+    putVarint(out, personalSettings->units.weight);
+    putVarint(out, personalSettings->units.compass);
+    putVarint(out, personalSettings->units.heartrate);
+    putVarint(out, personalSettings->units.speed);
+    putVarint(out, personalSettings->gps_position_format);
+    putVarint(out, personalSettings->language);
+    putVarint(out, personalSettings->navigation_style);
+    putVarint(out, personalSettings->sync_time_w_gps);
+    putVarint(out, personalSettings->time_format);
+    putVarint(out, personalSettings->alarm.hour);
+    putVarint(out, personalSettings->alarm.minute);
+    putVarint(out, personalSettings->alarm_enable);
+    putVarint(out, personalSettings->dual_time.hour);
+    putVarint(out, personalSettings->dual_time.minute);
+    putVarint(out, personalSettings->date_format);
+    putVarint(out, personalSettings->tones_mode);
+    putVarint(out, personalSettings->backlight_mode);
+    putVarint(out, personalSettings->backlight_brightness);
+    putVarint(out, personalSettings->display_brightness);
+    putVarint(out, personalSettings->display_is_negative);
+    putVarint(out, personalSettings->weight);
+    putVarint(out, personalSettings->birthyear);
+    putVarint(out, personalSettings->max_hr);
+    putVarint(out, personalSettings->rest_hr);
+    putVarint(out, personalSettings->fitness_level);
+    putVarint(out, personalSettings->is_male);
+    putVarint(out, personalSettings->length);
+    putVarint(out, personalSettings->alti_baro_mode);
+    putVarint(out, personalSettings->storm_alarm);
+    putVarint(out, personalSettings->fused_alti_disabled);
+    putVarint(out, personalSettings->bikepod_calibration);
+    putVarint(out, personalSettings->bikepod_calibration2);
+    putVarint(out, personalSettings->bikepod_calibration3);
+    putVarint(out, personalSettings->footpod_calibration);
+    putVarint(out, personalSettings->automatic_bikepower_calib);
+    putVarint(out, personalSettings->automatic_footpod_calib);
+    putVarint(out, personalSettings->training_program);
 }
 
-bool LogStore::XMLWriter::writeLogSample(ambit_log_sample_t *sample)
+void LogStore::BinaryWriter::writeLogHeader(QByteArray& out)
 {
-    sample_type_names_t *sample_type_name;
-    sample_distance_source_name_t *distance_source_name;
-    sample_altitude_source_name_t *altitude_source_name;
-    sample_lap_event_type_t *lap_type_name;
-    sample_cadence_source_name_t *cadence_source_name;
-    sample_swimming_style_name_t *swimming_style_name;
-    int i;
+    ambit_log_header_t *header = &logEntry->header;
+
+    putDateTime(out, &header->date_time);
+    putVarint(out, header->duration);
+    putVarint(out, header->ascent);
+    putVarint(out, header->descent);
+    putVarint(out, header->ascent_time);
+    putVarint(out, header->descent_time);
+    putVarint(out, header->recovery_time);
+    putVarint(out, header->speed_avg);
+    putVarint(out, header->speed_max);
+    putVarint(out, header->speed_max_time);
+    putSigned(out, header->altitude_max);
+    putSigned(out, header->altitude_min);
+    putVarint(out, header->altitude_max_time);
+    putVarint(out, header->altitude_min_time);
+    putVarint(out, header->heartrate_avg);
+    putVarint(out, header->heartrate_max);
+    putVarint(out, header->heartrate_min);
+    putVarint(out, header->heartrate_max_time);
+    putVarint(out, header->heartrate_min_time);
+    putVarint(out, header->peak_training_effect);
+    putVarint(out, header->activity_type);
+    putString(out, QString::fromUtf8(header->activity_name));
+    putSigned(out, header->temperature_max);
+    putSigned(out, header->temperature_min);
+    putVarint(out, header->temperature_max_time);
+    putVarint(out, header->temperature_min_time);
+    putVarint(out, header->distance);
+    putVarint(out, header->samples_count);
+    putVarint(out, header->energy_consumption);
+    putVarint(out, header->first_fix_time);
+    putVarint(out, header->battery_start);
+    putVarint(out, header->battery_end);
+    putVarint(out, header->distance_before_calib);
+    putRaw(out, header->unknown1, sizeof(header->unknown1));
+    putVarint(out, header->unknown2);
+    putVarint(out, header->cadence_max);
+    putVarint(out, header->cadence_avg);
+    putRaw(out, header->unknown3, sizeof(header->unknown3));
+    putVarint(out, header->swimming_pool_lengths);
+    putVarint(out, header->cadence_max_time);
+    putVarint(out, header->swimming_pool_length);
+    putRaw(out, header->unknown5, sizeof(header->unknown5));
+    putRaw(out, header->unknown6, sizeof(header->unknown6));
+}
+
+void LogStore::BinaryWriter::writeSample(QByteArray& out, ambit_log_sample_t *sample)
+{
+    quint64 utc = packDateTime(&sample->utc_time);
+    int i, count;
+
+    putVarint(out, sample->type);
+    putSigned(out, (qint64)sample->time - lastTime);
+    putSigned(out, (qint64)(utc - lastUTC));
+    lastTime = sample->time;
+    lastUTC = utc;
 
-    xml.writeStartElement("Sample");
-    xml.writeStartElement("Type");
-    xml.writeAttribute("id", QString("%1").arg(sample->type));
-    for (sample_type_name = &sampleTypeNames[0]; sample_type_name->XMLName != NULL; sample_type_name++) {
-        if (sample_type_name->id == sample->type) {
-            xml.writeCharacters(QString(sample_type_name->XMLName));
-            break;
-        }
-    }
-    xml.writeEndElement();
-    QDateTime dateTime(QDate(sample->utc_time.year, sample->utc_time.month, sample->utc_time.day), QTime(sample->utc_time.hour, sample->utc_time.minute, 0).addMSecs(sample->utc_time.msec));
-    dateTime.setTimeSpec(Qt::UTC);
-    xml.writeTextElement("UTC", dateTime.toString("yyyy-MM-ddThh:mm:ss.zzzZ"));
-    xml.writeTextElement("Time", QString("%1").arg(sample->time));
     switch(sample->type) {
     case ambit_log_sample_type_periodic:
-        writePeriodicSample(sample);
+        writePeriodicSample(out, sample);
         break;
     case ambit_log_sample_type_logpause:
-        break;
     case ambit_log_sample_type_logrestart:
-        break;
-    case ambit_log_sample_type_ibi:
-        for (i=0; i<sample->u.ibi.ibi_count; i++) {
-            xml.writeTextElement("IBI", QString("%1").arg(sample->u.ibi.ibi[i]));
-        }
-        break;
-    case ambit_log_sample_type_ttff:
-        xml.writeTextElement("ttff", QString("%1").arg(sample->u.ttff.value));
-        break;
-    case ambit_log_sample_type_distance_source:
-    {
-        xml.writeStartElement("DistanceSource");
-        xml.writeAttribute("id", QString("%1").arg(sample->u.distance_source.value));
-        for (distance_source_name = &sampleDistanceSourceNames[0]; distance_source_name->XMLName != ""; distance_source_name++) {
-            if (distance_source_name->source_id == sample->u.distance_source.value) {
-                xml.writeCharacters(QString(distance_source_name->XMLName));
-                break;
-            }
-        }
-        xml.writeEndElement();
-        break;
-    }
-    case ambit_log_sample_type_lapinfo:
-    {
-        xml.writeStartElement("Lap");
-        xml.writeStartElement("Type");
-        xml.writeAttribute("id", QString("%1").arg(sample->u.lapinfo.event_type));
-        for (lap_type_name = &sampleLapEventTypeNames[0]; lap_type_name->XMLName != ""; lap_type_name++) {
-            if (lap_type_name->event_type == sample->u.lapinfo.event_type) {
-                xml.writeCharacters(QString(lap_type_name->XMLName));
-            }
+    case ambit_log_sample_type_swimming_stroke:
+        break;
+    case ambit_log_sample_type_ibi:
+        count = qMin<int>(sample->u.ibi.ibi_count, sizeof(sample->u.ibi.ibi)/sizeof(sample->u.ibi.ibi[0]));
+        putVarint(out, count);
+        for (i=0; i<count; i++) {
+            putVarint(out, sample->u.ibi.ibi[i]);
         }
-        xml.writeEndElement();
-        QDateTime dateTime(QDate(sample->u.lapinfo.date_time.year, sample->u.lapinfo.date_time.month, sample->u.lapinfo.date_time.day), QTime(sample->u.lapinfo.date_time.hour, sample->u.lapinfo.date_time.minute, 0).addMSecs(sample->u.lapinfo.date_time.msec));
-        xml.writeTextElement("DateTime", dateTime.toString(Qt::ISODate));
-        xml.writeTextElement("Duration", QString("%1").arg(sample->u.lapinfo.duration));
-        xml.writeTextElement("Distance", QString("%1").arg(sample->u.lapinfo.distance));
-        xml.writeEndElement();
         break;
-    }
+    case ambit_log_sample_type_ttff:
+        putVarint(out, sample->u.ttff.value);
+        break;
+    case ambit_log_sample_type_distance_source:
+        putVarint(out, sample->u.distance_source.value);
+        break;
+    case ambit_log_sample_type_lapinfo:
+        putVarint(out, sample->u.lapinfo.event_type);
+        putDateTime(out, &sample->u.lapinfo.date_time);
+        putVarint(out, sample->u.lapinfo.duration);
+        putVarint(out, sample->u.lapinfo.distance);
+        break;
     case ambit_log_sample_type_altitude_source:
-    {
-        xml.writeStartElement("AltitudeSource");
-        xml.writeAttribute("id", QString("%1").arg(sample->u.altitude_source.source_type));
-        for (altitude_source_name = &sampleAltitudeSourceNames[0]; altitude_source_name->XMLName != ""; altitude_source_name++) {
-            if (altitude_source_name->source_id == sample->u.altitude_source.source_type) {
-                xml.writeCharacters(QString(altitude_source_name->XMLName));
-                break;
-            }
-        }
-        xml.writeEndElement();
-        xml.writeTextElement("AltitudeOffset", QString("%1").arg(sample->u.altitude_source.altitude_offset));
-        xml.writeTextElement("PressureOffset", QString("%1").arg(sample->u.altitude_source.pressure_offset));
+        putVarint(out, sample->u.altitude_source.source_type);
+        putSigned(out, sample->u.altitude_source.altitude_offset);
+        putSigned(out, sample->u.altitude_source.pressure_offset);
         break;
-    }
     case ambit_log_sample_type_gps_base:
-    {
-        xml.writeTextElement("NavValid", QString("%1").arg(sample->u.gps_base.navvalid));
-        xml.writeTextElement("NavType", QString("%1").arg(sample->u.gps_base.navtype));
-        QDateTime dateTime(QDate(sample->u.gps_base.utc_base_time.year, sample->u.gps_base.utc_base_time.month, sample->u.gps_base.utc_base_time.day), QTime(sample->u.gps_base.utc_base_time.hour, sample->u.gps_base.utc_base_time.minute, 0).addMSecs(sample->u.gps_base.utc_base_time.msec));
-        dateTime.setTimeSpec(Qt::UTC);
-        xml.writeTextElement("UTCReference", dateTime.toString("yyyy-MM-ddThh:mm:ss.zzzZ"));
-        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.gps_base.latitude));
-        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.gps_base.longitude));
-        xml.writeTextElement("GPSAltitude", QString("%1").arg(sample->u.gps_base.altitude));
-        xml.writeTextElement("GPSSpeed", QString("%1").arg(sample->u.gps_base.speed));
-        xml.writeTextElement("GPSHeading", QString("%1").arg(sample->u.gps_base.heading));
-        xml.writeTextElement("EHPE", QString("%1").arg(sample->u.gps_base.ehpe));
-        xml.writeTextElement("NumberOfSatellites", QString("%1").arg(sample->u.gps_base.noofsatellites));
-        xml.writeTextElement("GpsHDOP", QString("%1").arg(sample->u.gps_base.hdop));
-        xml.writeStartElement("Satellites");
-        ambit_log_gps_satellite_t *satellite;
-        for (i=0; i<sample->u.gps_base.satellites_count; i++) {
-            xml.writeStartElement("Satellite");
-            satellite = &sample->u.gps_base.satellites[i];
-            xml.writeTextElement("SV", QString("%1").arg(satellite->sv));
-            xml.writeTextElement("SNR", QString("%1").arg(satellite->snr));
-            xml.writeTextElement("State", QString("%1").arg(satellite->state));
-            xml.writeEndElement();
+        putVarint(out, sample->u.gps_base.navvalid);
+        putVarint(out, sample->u.gps_base.navtype);
+        putDateTime(out, &sample->u.gps_base.utc_base_time);
+        writePosition(out, sample->u.gps_base.latitude, sample->u.gps_base.longitude);
+        putSigned(out, sample->u.gps_base.altitude);
+        putVarint(out, sample->u.gps_base.speed);
+        putVarint(out, sample->u.gps_base.heading);
+        putVarint(out, sample->u.gps_base.ehpe);
+        putVarint(out, sample->u.gps_base.noofsatellites);
+        putVarint(out, sample->u.gps_base.hdop);
+        if (sample->u.gps_base.satellites != NULL) {
+            putVarint(out, sample->u.gps_base.satellites_count);
+            for (i=0; i<sample->u.gps_base.satellites_count; i++) {
+                putVarint(out, sample->u.gps_base.satellites[i].sv);
+                putVarint(out, sample->u.gps_base.satellites[i].snr);
+                putVarint(out, sample->u.gps_base.satellites[i].state);
+            }
+        }
+        else {
+            putVarint(out, 0);
         }
-        xml.writeEndElement();
         break;
-    }
     case ambit_log_sample_type_gps_small:
-    {
-        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.gps_small.latitude));
-        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.gps_small.longitude));
-        xml.writeTextElement("EHPE", QString("%1").arg(sample->u.gps_small.ehpe));
-        xml.writeTextElement("NumberOfSatellites", QString("%1").arg(sample->u.gps_small.noofsatellites));
+        putVarint(out, sample->u.gps_small.noofsatellites);
+        writePosition(out, sample->u.gps_small.latitude, sample->u.gps_small.longitude);
+        putVarint(out, sample->u.gps_small.ehpe);
         break;
-    }
     case ambit_log_sample_type_gps_tiny:
-    {
-        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.gps_tiny.latitude));
-        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.gps_tiny.longitude));
-        xml.writeTextElement("EHPE", QString("%1").arg(sample->u.gps_tiny.ehpe));
-        xml.writeTextElement("Unknown", QString("%1").arg(sample->u.gps_tiny.unknown));
+        writePosition(out, sample->u.gps_tiny.latitude, sample->u.gps_tiny.longitude);
+        putVarint(out, sample->u.gps_tiny.ehpe);
+        putVarint(out, sample->u.gps_tiny.unknown);
         break;
-    }
     case ambit_log_sample_type_time:
-    {
-        QTime timeref(sample->u.time.hour, sample->u.time.minute, sample->u.time.second);
-        xml.writeTextElement("TimeRef", timeref.toString(Qt::ISODate));
+        putVarint(out, sample->u.time.hour);
+        putVarint(out, sample->u.time.minute);
+        putVarint(out, sample->u.time.second);
         break;
-    }
     case ambit_log_sample_type_swimming_turn:
-    {
-        xml.writeTextElement("Distance", QString("%1").arg(sample->u.swimming_turn.distance));
-        xml.writeTextElement("Lengths", QString("%1").arg(sample->u.swimming_turn.lengths));
-        xml.writeStartElement("Classification");
-        for (size_t i=0; i<(sizeof(sample->u.swimming_turn.classification)/sizeof(sample->u.swimming_turn.classification[0])); i++) {
-            xml.writeTextElement("Item", QString("%1").arg(sample->u.swimming_turn.classification[i]));
-        }
-        xml.writeEndElement();
-        xml.writeStartElement("Style");
-        xml.writeAttribute("id", QString("%1").arg(sample->u.swimming_turn.style));
-        for (swimming_style_name = &sampleSwimmingStyleNames[0]; swimming_style_name->XMLName != ""; swimming_style_name++) {
-            if (swimming_style_name->source_id == sample->u.swimming_turn.style) {
-                xml.writeCharacters(QString(swimming_style_name->XMLName));
-                break;
-            }
+        putVarint(out, sample->u.swimming_turn.distance);
+        putVarint(out, sample->u.swimming_turn.lengths);
+        for (i=0; i<4; i++) {
+            putVarint(out, sample->u.swimming_turn.classification[i]);
         }
-        xml.writeEndElement();
-        break;
-    }
-    case ambit_log_sample_type_swimming_stroke:
+        putVarint(out, sample->u.swimming_turn.style);
         break;
     case ambit_log_sample_type_activity:
-    {
-        xml.writeTextElement("ActivityType", QString("%1").arg(sample->u.activity.activitytype));
-        xml.writeTextElement("CustomModeId", QString("%1").arg(sample->u.activity.sportmode));
+        putVarint(out, sample->u.activity.activitytype);
+        putVarint(out, sample->u.activity.sportmode);
         break;
-    }
     case ambit_log_sample_type_cadence_source:
-    {
-        xml.writeStartElement("CadenceSource");
-        xml.writeAttribute("id", QString("%1").arg(sample->u.cadence_source.value));
-        for (cadence_source_name = &sampleCadenceSourceNames[0]; cadence_source_name->XMLName != ""; cadence_source_name++) {
-            if (cadence_source_name->source_id == sample->u.cadence_source.value) {
-                xml.writeCharacters(QString(cadence_source_name->XMLName));
-                break;
-            }
-        }
-        xml.writeEndElement();
+        putVarint(out, sample->u.cadence_source.value);
         break;
-    }
     case ambit_log_sample_type_position:
-    {
-        xml.writeTextElement("Latitude", QString("%1").arg(sample->u.position.latitude));
-        xml.writeTextElement("Longitude", QString("%1").arg(sample->u.position.longitude));
+        writePosition(out, sample->u.position.latitude, sample->u.position.longitude);
         break;
-    }
     case ambit_log_sample_type_fwinfo:
-    {
-        xml.writeTextElement("Version", QString("%1.%2.%3").arg((int)sample->u.fwinfo.version[0]).arg((int)sample->u.fwinfo.version[1]).arg((int)sample->u.fwinfo.version[2] | ((int)sample->u.fwinfo.version[3] << 8)));
-        QDateTime dateTime(QDate(sample->u.fwinfo.build_date.year, sample->u.fwinfo.build_date.month, sample->u.fwinfo.build_date.day), QTime(sample->u.fwinfo.build_date.hour, sample->u.fwinfo.build_date.minute, 0).addMSecs(sample->u.fwinfo.build_date.msec));
-        xml.writeTextElement("BuildDate", dateTime.toString(Qt::ISODate));
+        putRaw(out, sample->u.fwinfo.version, sizeof(sample->u.fwinfo.version));
+        putDateTime(out, &sample->u.fwinfo.build_date);
         break;
-    }
     case ambit_log_sample_type_unknown:
-    {
-        QString data = "";
-        for (size_t i=0; i<sample->u.unknown.datalen; i++) {
-            data += data.sprintf("%02x", sample->u.unknown.data[i]);
+        if (sample->u.unknown.data != NULL) {
+            putVarint(out, sample->u.unknown.datalen);
+            putRaw(out, sample->u.unknown.data, sample->u.unknown.datalen);
+        }
+        else {
+            putVarint(out, 0);
         }
-        xml.writeTextElement("Data", data);
+        break;
+    default:
         break;
     }
-    }
-
-    xml.writeEndElement();
-
-    return true;
 }
 
-bool LogStore::XMLWriter::writePeriodicSample(ambit_log_sample_t *sample)
+void LogStore::BinaryWriter::writePeriodicSample(QByteArray& out, ambit_log_sample_t *sample)
 {
-    int i;
     ambit_log_sample_periodic_value_t *value;
+    qint64 newValue;
+    int i;
+
+    if (sample->u.periodic.values == NULL) {
+        putVarint(out, 0);
+        return;
+    }
 
+    putVarint(out, sample->u.periodic.value_count);
     for (i=0; i<sample->u.periodic.value_count; i++) {
         value = &sample->u.periodic.values[i];
 
-        switch(value->type) {
-        case ambit_log_sample_periodic_type_latitude:
-            xml.writeTextElement("Latitude", QString("%1").arg(value->u.latitude));
-            break;
-        case ambit_log_sample_periodic_type_longitude:
-            xml.writeTextElement("Longitude", QString("%1").arg(value->u.longitude));
-            break;
-        case ambit_log_sample_periodic_type_distance:
-            xml.writeTextElement("Distance", QString("%1").arg(value->u.distance));
-            break;
-        case ambit_log_sample_periodic_type_speed:
-            xml.writeTextElement("Speed", QString("%1").arg(value->u.speed));
-            break;
-        case ambit_log_sample_periodic_type_hr:
-            xml.writeTextElement("HR", QString("%1").arg(value->u.hr));
-            break;
-        case ambit_log_sample_periodic_type_time:
-            xml.writeTextElement("Time", QString("%1").arg(value->u.time));
-            break;
-        case ambit_log_sample_periodic_type_gpsspeed:
-            xml.writeTextElement("GPSSpeed", QString("%1").arg(value->u.gpsspeed));
-            break;
-        case ambit_log_sample_periodic_type_wristaccspeed:
-            xml.writeTextElement("WristAccSpeed", QString("%1").arg(value->u.wristaccspeed));
-            break;
-        case ambit_log_sample_periodic_type_bikepodspeed:
-            xml.writeTextElement("BikePodSpeed", QString("%1").arg(value->u.bikepodspeed));
-            break;
-        case ambit_log_sample_periodic_type_ehpe:
-            xml.writeTextElement("EHPE", QString("%1").arg(value->u.ehpe));
-            break;
-        case ambit_log_sample_periodic_type_evpe:
-            xml.writeTextElement("EVPE", QString("%1").arg(value->u.evpe));
-            break;
-        case ambit_log_sample_periodic_type_altitude:
-            xml.writeTextElement("Altitude", QString("%1").arg(value->u.altitude));
-            break;
-        case ambit_log_sample_periodic_type_abspressure:
-            xml.writeTextElement("AbsPressure", QString("%1").arg(value->u.abspressure));
-            break;
-        case ambit_log_sample_periodic_type_energy:
-            xml.writeTextElement("EnergyConsumption", QString("%1").arg(value->u.energy));
-            break;
-        case ambit_log_sample_periodic_type_temperature:
-            xml.writeTextElement("Temperature", QString("%1").arg(value->u.temperature));
-            break;
-        case ambit_log_sample_periodic_type_charge:
-            xml.writeTextElement("BatteryCharge", QString("%1").arg(value->u.charge));
-            break;
-        case ambit_log_sample_periodic_type_gpsaltitude:
-            xml.writeTextElement("GPSAltitude", QString("%1").arg(value->u.gpsaltitude));
-            break;
-        case ambit_log_sample_periodic_type_gpsheading:
-            xml.writeTextElement("GPSHeading", QString("%1").arg(value->u.gpsheading));
-            break;
-        case ambit_log_sample_periodic_type_gpshdop:
-            xml.writeTextElement("GpsHDOP", QString("%1").arg(value->u.gpshdop));
-            break;
-        case ambit_log_sample_periodic_type_gpsvdop:
-            xml.writeTextElement("GpsVDOP", QString("%1").arg(value->u.gpsvdop));
-            break;
-        case ambit_log_sample_periodic_type_wristcadence:
-            xml.writeTextElement("WristCadence", QString("%1").arg(value->u.wristcadence));
-            break;
-        case ambit_log_sample_periodic_type_snr:
-        {
-            QString format;
-            QString snr = format.sprintf("%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-                                         value->u.snr[0],
-                                         value->u.snr[1],
-                                         value->u.snr[2],
-                                         value->u.snr[3],
-                                         value->u.snr[4],
-                                         value->u.snr[5],
-                                         value->u.snr[6],
-                                         value->u.snr[7],
-                                         value->u.snr[8],
-                                         value->u.snr[9],
-                                         value->u.snr[10],
-                                         value->u.snr[11],
-                                         value->u.snr[12],
-                                         value->u.snr[13],
-                                         value->u.snr[14],
-                                         value->u.snr[15]);
-            xml.writeTextElement("SNR", snr);
-            break;
+        putVarint(out, value->type & 0xff);
+        if (periodicValue(value, &newValue)) {
+            putSigned(out, newValue - lastPeriodic[value->type & 0xff]);
+            lastPeriodic[value->type & 0xff] = newValue;
         }
-        case ambit_log_sample_periodic_type_noofsatellites:
-            xml.writeTextElement("NumberOfSatellites", QString("%1").arg(value->u.noofsatellites));
-            break;
-        case ambit_log_sample_periodic_type_sealevelpressure:
-            xml.writeTextElement("SeaLevelPressure", QString("%1").arg(value->u.sealevelpressure));
-            break;
-        case ambit_log_sample_periodic_type_verticalspeed:
-            xml.writeTextElement("VerticalSpeed", QString("%1").arg(value->u.verticalspeed));
-            break;
-        case ambit_log_sample_periodic_type_cadence:
-            xml.writeTextElement("Cadence", QString("%1").arg(value->u.cadence));
-            break;
-        case ambit_log_sample_periodic_type_bikepower:
-            xml.writeTextElement("BikePower", QString("%1").arg(value->u.bikepower));
-            break;
-        case ambit_log_sample_periodic_type_swimingstrokecnt:
-            xml.writeTextElement("SwimmingStrokeCount", QString("%1").arg(value->u.swimingstrokecnt));
-            break;
-        case ambit_log_sample_periodic_type_ruleoutput1:
-            xml.writeTextElement("RuleOutput1", QString("%1").arg(value->u.ruleoutput1));
-            break;
-        case ambit_log_sample_periodic_type_ruleoutput2:
-            xml.writeTextElement("RuleOutput2", QString("%1").arg(value->u.ruleoutput2));
-            break;
-        case ambit_log_sample_periodic_type_ruleoutput3:
-            xml.writeTextElement("RuleOutput3", QString("%1").arg(value->u.ruleoutput3));
-            break;
-        case ambit_log_sample_periodic_type_ruleoutput4:
-            xml.writeTextElement("RuleOutput4", QString("%1").arg(value->u.ruleoutput4));
-            break;
-        case ambit_log_sample_periodic_type_ruleoutput5:
-            xml.writeTextElement("RuleOutput5", QString("%1").arg(value->u.ruleoutput5));
-            break;
+        else {
+            putRaw(out, &value->u, sizeof(value->u));
         }
     }
+}
 
-    return true;
+void LogStore::BinaryWriter::writePosition(QByteArray& out, int32_t latitude, int32_t longitude)
+{
+    putSigned(out, (qint64)latitude - lastLatitude);
+    putSigned(out, (qint64)longitude - lastLongitude);
+    lastLatitude = latitude;
+    lastLongitude = longitude;
 }
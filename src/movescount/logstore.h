@@ -25,6 +25,10 @@
 #include <QObject>
 #include <QDateTime>
 #include <QList>
+#include <QMap>
+#include <QStringList>
+#include <QFuture>
+#include <QFutureWatcher>
 #include <QIODevice>
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
@@ -43,27 +47,119 @@ public:
         QString device;
         QDateTime time;
         QString filename;
+
+        // Summary kept in the log index, so listings need not open the logs
+        quint32 duration;
+        quint32 distance;
+        QString activityName;
+        QString movescountId;
+        qint64 fileSize;
+        quint32 checksum;
+    };
+
+    // Codec for the sections of binary logs, values are stored in the file
+    enum Compression {
+        CompressionNone = 0,
+        CompressionZlib = 1
     };
 
     explicit LogStore(QObject *parent = 0);
     LogEntry *store(const DeviceInfo& deviceInfo, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry);
     LogEntry *store(LogEntry *entry);
     void storeMovescountId(QString device, QDateTime time, QString movescountId);
+    void setVerifyWrites(bool verify);
+    void setCompression(Compression compression, int level = -1);
+    void beginBatch();
+    bool commitBatch();
     bool logExists(QString device, ambit_log_header_t *logHeader);
     LogEntry *read(QString device, QDateTime time);
-    LogEntry *read(LogDirEntry dirEntry);
-    LogEntry *read(QString filename);
+    LogEntry *read(LogDirEntry dirEntry, bool lazy = false);
+    LogEntry *read(QString filename, bool lazy = false);
+    static bool readSamples(LogEntry *entry, QString path, qint64 offset);
     QList<LogDirEntry> dir(QString device = "");
+    bool dirEntry(QString device, QDateTime time, LogDirEntry *dirEntry);
+    QList<LogDirEntry> notUploaded(QString device = "");
+    void rebuildIndex();
+    bool indexRebuilding();
+    bool exportXML(LogEntry *entry, QString path);
+    LogEntry *importXML(QString path);
 signals:
-    
+    void indexProgress(int done, int total);
+    void indexRebuilt();
+
 public slots:
 
+private slots:
+    void watchRebuild();
+    void rebuildProgress(int done);
+    void rebuildFinished();
+
 private:
     QString logEntryPath(QString device, QDateTime time);
-    LogEntry *storeInternal(QString serial, QDateTime dateTime, const DeviceInfo& deviceInfo, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry, QString movescountId = "");
-    LogEntry *readInternal(QString path);
+    bool storeInternal(LogEntry *entry);
+    LogEntry *readInternal(QString path, bool lazy = false);
+    bool migrateXML(QString path, LogEntry *entry);
+    static bool writeBinary(QString path, LogEntry *entry, Compression compression, int level, quint32 *checksum);
+    QString indexPath();
+    void indexLoad();
+    bool indexParse(const QByteArray& data);
+    bool indexSave();
+    QString indexJournalPath();
+    bool indexReplayJournal();
+    bool indexJournalAppend(const LogDirEntry& entry);
+    bool indexCommit();
+    void indexUpdate(QString path, LogEntry *entry, quint32 checksum);
+    static LogDirEntry makeDirEntry(QString path, LogEntry *entry, quint32 checksum);
+    QString movescountIdsPath();
+    bool indexApplyMovescountIds();
+    void rebuildStart();
+    void rebuildSwap();
+
+    class ScanResult
+    {
+    public:
+        LogDirEntry dirEntry;
+        bool valid;
+
+        // Set if the log is to be converted, with the time it was last
+        // modified when scanned
+        bool convert;
+        QString path;
+        QDateTime modified;
+    };
+
+    // Parses one log on the thread pool for rebuildIndex()
+    class LogScanner
+    {
+    public:
+        typedef ScanResult result_type;
+        LogScanner(Compression compression);
+        ScanResult operator()(const QString& path) const;
+
+    private:
+        Compression compression;
+    };
+
+    class RebuildResult
+    {
+    public:
+        RebuildResult() : bytes(0), failed(0) {}
+        QMap<QString, LogDirEntry> index;
+        qint64 bytes;
+        int failed;
+    };
+    static void rebuildReduce(RebuildResult& result, const ScanResult& scan);
+    static LogDirEntry rebuildConvert(const ScanResult& scan);
+
+    // Shared by all stores like the index, guarded by the same mutex
+    static QFuture<RebuildResult> rebuildFuture;
+    static bool rebuildPending;
+    QFutureWatcher<RebuildResult> rebuildWatcher;
 
     QString storagePath;
+    bool verifyWrites;
+    Compression compression;
+    int compressionLevel;
 
     class XMLReader
     {
@@ -107,6 +203,82 @@ private:
         ambit_personal_settings_t *personalSettings;
         ambit_log_entry_t *logEntry;
     };
+
+    class BinaryReader
+    {
+    public:
+        BinaryReader(LogEntry *logEntry);
+        bool read(QIODevice *device, bool withSamples = true);
+        bool readStart(QIODevice *device);
+        bool readSampleSection(QIODevice *device);
+        static bool isBinary(QIODevice *device);
+        Compression compression() const;
+
+        QString errorString() const;
+    private:
+        bool readSection(QIODevice *device, QByteArray& section);
+        void readHeader();
+        void readPersonalSettings();
+        void readLogHeader();
+        void readSamples(quint32 count);
+        void readSample(ambit_log_sample_t *sample);
+        void readPeriodicSample(ambit_log_sample_t *sample);
+        quint64 readVarint();
+        qint64 readSigned();
+        bool readRaw(void *data, size_t length);
+        QString readString();
+        void readDateTime(ambit_date_time_t *dateTime);
+        void readPosition(int32_t *latitude, int32_t *longitude);
+
+        LogEntry *logEntry;
+        Compression codec;
+        const uchar *pos;
+        const uchar *end;
+        QString error;
+
+        quint32 lastTime;
+        quint64 lastUTC;
+        qint32 lastLatitude;
+        qint32 lastLongitude;
+        qint64 lastPeriodic[256];
+    };
+
+    class BinaryWriter
+    {
+    public:
+        BinaryWriter(QString device, const DeviceInfo& deviceInfo, QDateTime time, QString movescountId, ambit_personal_settings_t *personalSettings, ambit_log_entry_t *logEntry);
+        void setCompression(Compression compression, int level);
+        bool write(QIODevice *device);
+        quint32 checksum() const;
+
+    private:
+        bool writeData(QIODevice *device, const QByteArray& data);
+        bool writeSection(QIODevice *device, const QByteArray& section);
+        void writeHeader(QByteArray& out);
+        void writePersonalSettings(QByteArray& out);
+        void writeLogHeader(QByteArray& out);
+        void writeSample(QByteArray& out, ambit_log_sample_t *sample);
+        void writePeriodicSample(QByteArray& out, ambit_log_sample_t *sample);
+        void writePosition(QByteArray& out, int32_t latitude, int32_t longitude);
+
+        QString device;
+        DeviceInfo deviceInfo;
+        QDateTime time;
+        QString movescountId;
+        ambit_personal_settings_t *personalSettings;
+        ambit_log_entry_t *logEntry;
+        Compression compression;
+        int compressionLevel;
+        quint32 fileChecksum;
+
+        // Sample times and positions are stored as the difference to the
+        // previous sample, periodic values to the previous one of their type
+        quint32 lastTime;
+        quint64 lastUTC;
+        qint32 lastLatitude;
+        qint32 lastLongitude;
+        qint64 lastPeriodic[256];
+    };
 };
 
 #endif // LOGSTORE_H
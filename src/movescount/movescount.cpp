@@ -265,6 +265,14 @@ void MovesCount::writeLog(LogEntry *logEntry)
     }
 }
 
+// Upload without waiting for the reply, takes ownership of logEntry.
+// Uploads from all devices share the worker thread's event queue.
+void MovesCount::queueLog(LogEntry *logEntry)
+{
+    QMetaObject::invokeMethod(this, "queueLogInThread", Qt::QueuedConnection,
+                              Q_ARG(LogEntry *, logEntry));
+}
+
 void MovesCount::authCheckFinished()
 {
     if (authCheckReply != NULL) {
@@ -561,6 +569,7 @@ void MovesCount::writePersonalSettingsInThread(ambit_personal_settings_t *settin
 
 void MovesCount::writeLogInThread(LogEntry *logEntry)
 {
+    uint64_t trace = libambit_trace_begin();
     QByteArray output;
     QNetworkReply *reply;
     QString moveId;
@@ -585,6 +594,14 @@ void MovesCount::writeLogInThread(LogEntry *logEntry)
     else {
         qDebug() << "Failed to upload log (err code:" << reply->error() << "), movescount.com replied with \"" << reply->readAll() << "\"";
     }
+
+    libambit_trace_end("MovesCount::writeLogInThread", trace, output.size());
+}
+
+void MovesCount::queueLogInThread(LogEntry *logEntry)
+{
+    writeLogInThread(logEntry);
+    delete logEntry;
 }
 
 MovesCount::MovesCount() :
@@ -594,6 +611,8 @@ MovesCount::MovesCount() :
 
     this->logChecker = new MovesCountLogChecker();
 
+    qRegisterMetaType<LogEntry *>("LogEntry *");
+
     this->moveToThread(&workerThread);
     workerThread.start();
 
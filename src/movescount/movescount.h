@@ -67,6 +67,7 @@ public:
     void checkLatestFirmwareVersion();
     void writePersonalSettings(ambit_personal_settings_t *settings);
     void writeLog(LogEntry *logEntry);
+    void queueLog(LogEntry *logEntry);
 
 signals:
     void newerFirmwareExists(QByteArray fw_version);
@@ -92,6 +93,7 @@ private slots:
     void checkLatestFirmwareVersionInThread();
     void writePersonalSettingsInThread(ambit_personal_settings_t *settings);
     void writeLogInThread(LogEntry *logEntry);
+    void queueLogInThread(LogEntry *logEntry);
 
 private:
     MovesCount();
@@ -524,6 +524,10 @@ int MovesCountJSON::generateLogData(LogEntry *logEntry, QByteArray &output)
                             QTime(logEntry->logEntry->header.date_time.hour,
                                   logEntry->logEntry->header.date_time.minute, 0).addMSecs(logEntry->logEntry->header.date_time.msec));
 
+    if (!logEntry->loadSamples()) {
+        return -1;
+    }
+
     // Loop through content
     QList<int> order = rearrangeSamples(logEntry);
     for (int i=0; i<order.length(); i++) {
@@ -41,7 +41,8 @@ void MovesCountLogChecker::checkUploadedLogs()
 
     running = true;
 
-    QList<LogStore::LogDirEntry> entries = logStore.dir();
+    // The index knows which logs lack an id, only those are read in full
+    QList<LogStore::LogDirEntry> entries = logStore.notUploaded();
     foreach(LogStore::LogDirEntry entry, entries) {
         // This is a long operation, exit if application want to quit
         if (cancelRun) {
@@ -50,17 +51,12 @@ void MovesCountLogChecker::checkUploadedLogs()
         }
         LogEntry *logEntry = logStore.read(entry);
         if (logEntry != NULL) {
-            if (logEntry->movescountId.length() == 0) {
-                missingEntries.append(logEntry);
-                if (logEntry->time < firstUnknown) {
-                    firstUnknown = logEntry->time;
-                }
-                if (logEntry->time > lastUnknown) {
-                    lastUnknown = logEntry->time;
-                }
+            missingEntries.append(logEntry);
+            if (logEntry->time < firstUnknown) {
+                firstUnknown = logEntry->time;
             }
-            else {
-                delete logEntry;
+            if (logEntry->time > lastUnknown) {
+                lastUnknown = logEntry->time;
             }
         }
     }
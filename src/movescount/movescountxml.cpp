@@ -170,6 +170,10 @@ MovesCountXML::MovesCountXML(QObject *parent) :
 
 void MovesCountXML::writeLog(LogEntry *logEntry)
 {
+    if (!logEntry->loadSamples()) {
+        return;
+    }
+
     XMLWriter writer(logEntry);
     QFile logfile(logEntryPath(logEntry));
     logfile.open(QIODevice::WriteOnly | QIODevice::Truncate);
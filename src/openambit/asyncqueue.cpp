@@ -0,0 +1,52 @@
+/*
+ * (C) Copyright 2013 Emil Ljungdahl
+ *
+ * This file is part of Openambit.
+ *
+ * Openambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "asyncqueue.h"
+
+AsyncQueue::AsyncQueue(QObject *parent) :
+    QObject(parent), socketNotifier(NULL)
+{
+    async = libambit_async_new();
+
+    if (async != NULL) {
+        socketNotifier = new QSocketNotifier(libambit_async_get_fd(async), QSocketNotifier::Read, this);
+        connect(socketNotifier, SIGNAL(activated(int)), this, SLOT(fdActivated(int)));
+    }
+}
+
+AsyncQueue::~AsyncQueue()
+{
+    delete socketNotifier;
+
+    libambit_async_free(async);
+}
+
+ambit_async_t *AsyncQueue::handle() const
+{
+    return async;
+}
+
+void AsyncQueue::fdActivated(int fd)
+{
+    Q_UNUSED(fd);
+
+    libambit_async_process(async);
+}
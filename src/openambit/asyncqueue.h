@@ -0,0 +1,50 @@
+/*
+ * (C) Copyright 2013 Emil Ljungdahl
+ *
+ * This file is part of Openambit.
+ *
+ * Openambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#ifndef ASYNCQUEUE_H
+#define ASYNCQUEUE_H
+
+#include <QObject>
+#include <QSocketNotifier>
+
+#include <libambit.h>
+
+// Queue for asynchronous libambit operations. The operations run, and
+// their completion callbacks are called, in the thread this object lives
+// in, by its event loop whenever the queue fd says they are due.
+class AsyncQueue : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AsyncQueue(QObject *parent = 0);
+    ~AsyncQueue();
+
+    ambit_async_t *handle() const;
+
+private slots:
+    void fdActivated(int fd);
+
+private:
+    ambit_async_t *async;
+    QSocketNotifier *socketNotifier;
+};
+
+#endif // ASYNCQUEUE_H
@@ -20,30 +20,32 @@
  *
  */
 #include "devicemanager.h"
+#include "settings.h"
 
 #include <QTimer>
+#include <QStringList>
 #include <QDebug>
-#include <stdio.h>
 #include <libambit.h>
 
 DeviceManager::DeviceManager(QObject *parent) :
-    QObject(parent), deviceObject(NULL), udevListener(NULL)
+    QObject(parent), hotplugListener(NULL), syncSuccess(true)
 {
     movesCount = MovesCount::instance();
-    currentPersonalSettings = libambit_personal_settings_alloc();
+
+    // All worker operations run and complete here, in this thread
+    queue = new AsyncQueue(this);
 }
 
 DeviceManager::~DeviceManager()
 {
-    mutex.lock();
-    delete udevListener;
     chargeTimer.stop();
+    delete hotplugListener;
 
-    if(currentPersonalSettings != NULL) {
-        libambit_personal_settings_free(currentPersonalSettings);
+    foreach (QString path, workers.keys()) {
+        removeWorker(path);
     }
 
-    mutex.unlock();
+    delete queue;
 }
 
 void DeviceManager::start()
@@ -52,9 +54,10 @@ void DeviceManager::start()
     chargeTimer.setInterval(10000);
     chargeTimer.start();
 
-    // Connect udev listener, fire a chargeTimerHit (implicit device detect), if hit
-    udevListener = new UdevListener();
-    connect(udevListener, SIGNAL(deviceEvent()), this, SLOT(chargeTimerHit()));
+    // Connect hotplug listener, redo detect from the cached device list
+    // whenever a clock arrives or leaves
+    hotplugListener = new HotplugListener();
+    connect(hotplugListener, SIGNAL(deviceEvent()), this, SLOT(detect()));
 
     // Connect movescount Id feedback to local handler
     connect(movesCount, SIGNAL(logMoveID(QString,QDateTime,QString)), this, SLOT(logMovescountID(QString,QDateTime,QString)));
@@ -62,175 +65,119 @@ void DeviceManager::start()
 
 void DeviceManager::detect()
 {
-    int res = -1;
-
-    mutex.lock();
-    if (this->deviceObject != NULL) {
-        libambit_close(this->deviceObject);
-        this->deviceObject = NULL;
-        emit deviceRemoved();
-    }
+    QStringList present;
+    DeviceInfo unusableInfo;
+    bool unusable = false;
+    bool removed = false;
+
+    // The hotplug cache lets a reconnect skip enumerating and querying the
+    // clock again, only the HID device itself has to be reopened
+    ambit_device_info_t *devinfo = hotplugListener != NULL ? hotplugListener->enumerate() : libambit_enumerate();
+    for (ambit_device_info_t *current = devinfo; current != NULL; current = current->next) {
+        QString path = QString::fromLocal8Bit(current->path);
+
+        if (!workers.contains(path)) {
+            DeviceWorker *worker = new DeviceWorker(current, &logStore, queue);
+            if (!worker->isOpen()) {
+                delete worker;
+                unusableInfo = *current;
+                unusable = true;
+                continue;
+            }
 
-    ambit_device_info_t *devinfo = libambit_enumerate();
-    if (devinfo) {
-        this->currentDeviceInfo = *devinfo;
-        emit deviceDetected(this->currentDeviceInfo);
-        this->deviceObject = libambit_new(devinfo);
+            connect(worker, SIGNAL(deviceCharge(quint8)), this, SIGNAL(deviceCharge(quint8)));
+            // Queued, the worker is deleted by the slot and may not be
+            // from within its own emit
+            connect(worker, SIGNAL(deviceFailed()), this, SLOT(workerFailed()), Qt::QueuedConnection);
+            connect(worker, SIGNAL(syncFinished(bool)), this, SLOT(workerSyncFinished(bool)));
+            connect(worker, SIGNAL(syncProgressInform(QString,bool,bool,quint8)), this, SLOT(workerSyncProgressInform(QString,bool,bool,quint8)));
+            connect(worker, SIGNAL(logStored(QString,QDateTime)), this, SIGNAL(logStored(QString,QDateTime)));
+            workers.insert(path, worker);
+
+            emit deviceDetected(worker->deviceInfo());
+            worker->pollCharge();
+        }
+        present.append(path);
     }
     libambit_free_enumeration(devinfo);
 
-    mutex.unlock();
+    foreach (QString path, workers.keys()) {
+        if (!present.contains(path)) {
+            removeWorker(path);
+            removed = true;
+        }
+    }
 
-    if (res == 0) {
-        chargeTimerHit();
+    if (removed) {
+        emit deviceRemoved();
+        if (!workers.isEmpty()) {
+            emit deviceDetected(workers.begin().value()->deviceInfo());
+        }
+    }
+    if (workers.isEmpty() && unusable) {
+        // Let the user know why nothing can be synced
+        emit deviceDetected(unusableInfo);
     }
 }
 
 void DeviceManager::startSync(bool readAllLogs = false)
 {
-    Settings settings;
-    int res = -1;
-    int waypoint_sync_res = -1;
-    time_t current_time;
-    struct tm *local_time;
-    uint8_t *orbitData = NULL;
-    int orbitDataLen;
-    ambit_personal_settings_t *movecountPersonalSettings = libambit_personal_settings_alloc();
-
-    bool syncTime = settings.value("syncSettings/syncTime", true).toBool();
-    bool syncOrbit = settings.value("syncSettings/syncOrbit", true).toBool();
-    bool syncSportMode = settings.value("syncSettings/syncSportMode", false).toBool();
-    bool syncNavigation = settings.value("syncSettings/syncNavigation", false).toBool();
-    bool syncMovescount = settings.value("movescountSettings/movescountEnable", false).toBool();
-
-    mutex.lock();
-    this->syncMovescount = syncMovescount;
-    currentSyncPart = 0;
-    syncParts = 2;
-    if (syncTime) syncParts++;
-    if (syncOrbit) syncParts+=2;
-    if (syncSportMode) syncParts++;
-    if (syncMovescount) syncParts++;
-
-    if (this->deviceObject != NULL) {
-        emit this->syncProgressInform(QString(tr("Reading personal settings")), false, true, 0);
-
-        // Reading personal settings + waypoints
-        res = libambit_personal_settings_get(this->deviceObject, currentPersonalSettings);
-        waypoint_sync_res = libambit_navigation_read(this->deviceObject, currentPersonalSettings);
-        currentSyncPart++;
-
-        libambit_sync_display_show(this->deviceObject);
-
-        if (syncTime && res != -1) {
-            emit this->syncProgressInform(QString(tr("Setting date/time")), false, true, 100*currentSyncPart/syncParts);
-            current_time = time(NULL);
-            local_time = localtime(&current_time);
-            res = libambit_date_time_set(this->deviceObject, local_time);
-            currentSyncPart++;
-        }
-
-        if (res != -1) {
-            qDebug() << "Start reading log...";
-            emit this->syncProgressInform(QString(tr("Reading log files")), false, true, 100*currentSyncPart/syncParts);
-            res = libambit_log_read(this->deviceObject, readAllLogs ? NULL : &log_skip_cb, &log_push_cb, &log_progress_cb, this);
-            currentSyncPart++;
-            qDebug() << "End reading log...";
-        }
-
-        if (waypoint_sync_res != -1 && syncNavigation) {
-            qDebug() << "Start reading navigation...";
-            emit this->syncProgressInform(QString(tr("Synchronizing navigation")), false, true, 100*currentSyncPart/syncParts);
-            currentSyncPart++;
-
-            if((movesCount->getPersonalSettings(movecountPersonalSettings, true)) != -1) {
-                 movesCount->applyPersonalSettingsFromDevice(movecountPersonalSettings, currentPersonalSettings);
-                 movesCount->writePersonalSettings(movecountPersonalSettings);
-                 emit this->syncProgressInform(QString(tr("Write navigation")), false, false, 100*currentSyncPart/syncParts);
-                 libambit_navigation_write(this->deviceObject, movecountPersonalSettings);
-                 emit this->syncProgressInform(QString(tr("Synchronized navigation")), false, false, 100*currentSyncPart/syncParts);
-            }
-            qDebug() << "End reading navigation...";
-        }
-
-        if (syncSportMode && res != -1) {
-            qDebug() << "Start sport mode";
-            emit this->syncProgressInform(QString(tr("Fetching sport modes")), false, true, 100*currentSyncPart/syncParts);
-
-            ambit_app_rules_t* ambitApps = liblibambit_malloc_app_rules();
-            movesCount->getAppsData(ambitApps);
-
-            ambit_sport_mode_device_settings_t *ambitDeviceSettings = libambit_malloc_sport_mode_device_settings();
-            if (movesCount->getCustomModeData(ambitDeviceSettings) != -1) {
-                emit this->syncProgressInform(QString(tr("Write sport modes")), false, false, 100*currentSyncPart/syncParts);
-                res = libambit_sport_mode_write(this->deviceObject, ambitDeviceSettings);
-
-                emit this->syncProgressInform(QString(tr("Write apps")), false, true, 100*currentSyncPart/syncParts);
-                res = libambit_app_data_write(this->deviceObject, ambitDeviceSettings, ambitApps);
-            }
-            libambit_sport_mode_device_settings_free(ambitDeviceSettings);
-            libambit_app_rules_free(ambitApps);
-
-            currentSyncPart++;
-            qDebug() << "End reading sport mode";
-        }
-
-        qDebug() << "Outer space debug message";
-
-        if (syncOrbit && res != -1) {
-            qDebug() << "Start sync Orbit";
-            emit this->syncProgressInform(QString(tr("Fetching orbital data")), false, true, 100*currentSyncPart/syncParts);
-            if ((orbitDataLen = movesCount->getOrbitalData(&orbitData)) != -1) {
-                currentSyncPart++;
-                emit this->syncProgressInform(QString(tr("Writing orbital data")), false, false, 100*currentSyncPart/syncParts);
-                res = libambit_gps_orbit_write(this->deviceObject, orbitData, orbitDataLen);
-                free(orbitData);
-            }
-            else {
-                currentSyncPart++;
-                emit this->syncProgressInform(QString(tr("Failed to get orbital data")), true, false, 100*currentSyncPart/syncParts);
-                res = -1;
-            }
-
-            qDebug() << "End Orbit sync";
-
-            currentSyncPart++;
-        }
-
-        libambit_sync_display_clear(this->deviceObject);
+    if (!syncPending.isEmpty()) {
+        // Already running
+        return;
     }
-    mutex.unlock();
 
-    libambit_personal_settings_free(movecountPersonalSettings);
-    movecountPersonalSettings = NULL;
+    // The workers share the store, so it is set up here, once for all of
+    // them and before any of them stores a log
+    Settings settings;
+    QString logCompression = settings.value("syncSettings/logCompression", "zlib").toString();
+    logStore.setVerifyWrites(settings.value("syncSettings/verifyStoredLogs", false).toBool());
+    logStore.setCompression(logCompression == "none" ? LogStore::CompressionNone : LogStore::CompressionZlib,
+                            settings.value("syncSettings/logCompressionLevel", -1).toInt());
+
+    syncSuccess = true;
+    syncProgress.clear();
+    foreach (DeviceWorker *worker, workers) {
+        syncProgress.insert(worker, 0);
+        syncPending.insert(worker);
+        worker->setSyncCancelled(false);
+        QMetaObject::invokeMethod(worker, "startSync", Qt::QueuedConnection, Q_ARG(bool, readAllLogs));
+    }
 
-    emit syncFinished(res >= 0);
+    if (syncPending.isEmpty()) {
+        emit syncFinished(false);
+    }
+}
 
-    if (res == -1) {
-        // Failed to read! We better try another detect
-        detect();
+void DeviceManager::cancelSync()
+{
+    // Workers stop at their next command to the clock and report the
+    // sync as failed
+    foreach (DeviceWorker *worker, syncPending) {
+        worker->setSyncCancelled(true);
     }
 }
 
 void DeviceManager::chargeTimerHit()
 {
-    int res = -1;
-    ambit_device_status_t status;
+    QStringList failed;
 
-    if (mutex.tryLock()) {
-        if (this->deviceObject != NULL) {
-            if ((res = libambit_device_status_get(this->deviceObject, &status)) == 0) {
-                emit deviceCharge(status.charge);
-            }
+    // Polls only submit the status read, the charge is reported when it
+    // completes, so this keeps going while workers sync
+    foreach (QString path, workers.keys()) {
+        if (!workers.value(path)->pollCharge()) {
+            failed.append(path);
         }
-        mutex.unlock();
     }
-    else {
-        res = 0;
+
+    if (!failed.isEmpty()) {
+        foreach (QString path, failed) {
+            removeWorker(path);
+        }
+        emit deviceRemoved();
     }
 
-    if (res != 0) {
-        // Failed to read! We better try another detect
+    if (workers.isEmpty() || !failed.isEmpty()) {
         detect();
     }
 }
@@ -240,34 +187,66 @@ void DeviceManager::logMovescountID(QString device, QDateTime time, QString move
     logStore.storeMovescountId(device, time, moveID);
 }
 
-int DeviceManager::log_skip_cb(void *ref, ambit_log_header_t *log_header)
+void DeviceManager::workerFailed()
 {
-    DeviceManager *manager = static_cast<DeviceManager*> (ref);
-    if (manager->logStore.logExists(manager->currentDeviceInfo.serial, log_header)) {
-        return 0;
+    DeviceWorker *worker = static_cast<DeviceWorker*>(sender());
+    QString path = workers.key(worker);
+
+    // Reopen the device, with a fresh worker
+    if (!path.isEmpty()) {
+        removeWorker(path);
+        emit deviceRemoved();
+        detect();
     }
-    return 1;
 }
 
-void DeviceManager::log_push_cb(void *ref, ambit_log_entry_t *log_entry)
+void DeviceManager::workerSyncFinished(bool success)
 {
-    DeviceManager *manager = static_cast<DeviceManager*> (ref);
-    LogEntry *entry = manager->logStore.store(manager->currentDeviceInfo, manager->currentPersonalSettings, log_entry);
-    if (entry != NULL) {
-        //! TODO: make this optional, only used for debugging
-        manager->movesCountXML.writeLog(entry);
-
-        if (manager->syncMovescount) {
-            manager->movesCount->writeLog(entry);
+    DeviceWorker *worker = static_cast<DeviceWorker*>(sender());
+
+    if (syncPending.remove(worker)) {
+        syncSuccess = syncSuccess && success;
+        syncProgress[worker] = 100;
+        if (syncPending.isEmpty()) {
+            emit syncFinished(syncSuccess);
         }
+    }
+}
+
+void DeviceManager::workerSyncProgressInform(QString message, bool error, bool newRow, quint8 percentDone)
+{
+    DeviceWorker *worker = static_cast<DeviceWorker*>(sender());
+    int total = 0;
+
+    if (!syncPending.contains(worker)) {
+        return;
+    }
+
+    // Overall progress is the mean over all devices in the sync
+    syncProgress[worker] = percentDone;
+    foreach (quint8 percent, syncProgress) {
+        total += percent;
+    }
 
-        delete entry;
+    if (syncProgress.size() > 1) {
+        message = worker->deviceInfo().serial + ": " + message;
     }
+
+    emit syncProgressInform(message, error, newRow, total / syncProgress.size());
 }
 
-void DeviceManager::log_progress_cb(void *ref, uint16_t log_count, uint16_t log_current, uint8_t progress_percent)
+void DeviceManager::removeWorker(const QString& path)
 {
-    DeviceManager *manager = static_cast<DeviceManager*> (ref);
-    progress_percent = 100*manager->currentSyncPart/manager->syncParts + progress_percent*1/manager->syncParts;
-    emit manager->syncProgressInform(QString(tr("Downloading log %1 of %2")).arg(log_current).arg(log_count), false, false, progress_percent);
+    DeviceWorker *worker = workers.take(path);
+
+    if (worker != NULL) {
+        syncProgress.remove(worker);
+        if (syncPending.remove(worker)) {
+            syncSuccess = false;
+            if (syncPending.isEmpty()) {
+                emit syncFinished(syncSuccess);
+            }
+        }
+        delete worker;
+    }
 }
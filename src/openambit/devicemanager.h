@@ -24,18 +24,17 @@
 
 #include <QObject>
 #include <QThread>
-#include <QMutex>
+#include <QMap>
+#include <QSet>
 #include <QTimer>
 #include <QMetaType>
-#include <QSocketNotifier>
 
-#include "settings.h"
 #include <movescount/logstore.h>
 #include <movescount/movescount.h>
-#include <movescount/movescountxml.h>
-#include "udevlistener.h"
+#include "asyncqueue.h"
+#include "deviceworker.h"
+#include "hotpluglistener.h"
 #include <libambit.h>
-#include <libudev.h>
 
 class DeviceManager : public QObject
 {
@@ -50,34 +49,34 @@ signals:
     void deviceCharge(quint8 percent);
     void syncFinished(bool success);
     void syncProgressInform(QString message, bool error, bool newRow, quint8 percentDone);
+    void logStored(QString device, QDateTime time);
 public slots:
     void detect(void);
     void startSync(bool readAllLogs);
+    void cancelSync(void);
 
 private slots:
     void chargeTimerHit();
     void logMovescountID(QString device, QDateTime time, QString moveID);
+    void workerFailed();
+    void workerSyncFinished(bool success);
+    void workerSyncProgressInform(QString message, bool error, bool newRow, quint8 percentDone);
 
 private:
-    static int log_skip_cb(void *ref, ambit_log_header_t *log_header);
-    static void log_push_cb(void *ref, ambit_log_entry_t *log_entry);
-    static void log_progress_cb(void *ref, uint16_t log_count, uint16_t log_current, uint8_t progress_percent);
+    void removeWorker(const QString& path);
 
-    ambit_object_t *deviceObject;
-    UdevListener *udevListener;
+    // Keyed by device path
+    QMap<QString, DeviceWorker*> workers;
+    HotplugListener *hotplugListener;
+    AsyncQueue *queue;
 
-    DeviceInfo currentDeviceInfo;
-    ambit_personal_settings_t *currentPersonalSettings;
+    // Progress of the workers in the running sync
+    QMap<DeviceWorker*, quint8> syncProgress;
+    QSet<DeviceWorker*> syncPending;
+    bool syncSuccess;
 
-    int syncParts;
-    int currentSyncPart;
-    bool syncMovescount;
-
-    QMutex mutex;
     QTimer chargeTimer;
     MovesCount *movesCount;
-    MovesCountXML movesCountXML;
-    Settings settings;
     LogStore logStore;
 };
 
@@ -0,0 +1,513 @@
+/*
+ * (C) Copyright 2013 Emil Ljungdahl
+ *
+ * This file is part of Openambit.
+ *
+ * Openambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "deviceworker.h"
+
+#include <QDebug>
+#include <QtConcurrent/QtConcurrentRun>
+#include <libambit.h>
+
+DeviceSyncData::DeviceSyncData() :
+    apps(NULL), sportModes(NULL), orbitData(NULL)
+{
+    personalSettings = libambit_personal_settings_alloc();
+    movescountPersonalSettings = libambit_personal_settings_alloc();
+}
+
+DeviceSyncData::~DeviceSyncData()
+{
+    libambit_personal_settings_free(personalSettings);
+    libambit_personal_settings_free(movescountPersonalSettings);
+    if (apps != NULL) {
+        libambit_app_rules_free(apps);
+    }
+    if (sportModes != NULL) {
+        libambit_sport_mode_device_settings_free(sportModes);
+    }
+    free(orbitData);
+}
+
+DeviceWorker::DeviceWorker(const ambit_device_info_t *devinfo, LogStore *logStore, AsyncQueue *queue, QObject *parent) :
+    QObject(parent), statusFailures(0), statusPending(false), queue(queue),
+    syncStep(SyncIdle), syncOperation(0), syncCancelled(false), logStore(logStore)
+{
+    movesCount = MovesCount::instance();
+    syncData = new DeviceSyncData();
+    fetchWatcher = new QFutureWatcher<int>();
+    connect(fetchWatcher, SIGNAL(finished()), this, SLOT(fetchFinished()));
+
+    currentDeviceInfo = *devinfo;
+    deviceObject = libambit_new(devinfo);
+    if (deviceObject != NULL) {
+        // Pick up interrupted log downloads where they stopped
+        QString resumePath = QString(getenv("HOME")) + "/.openambit/resume_" + QString(devinfo->serial) + ".bin";
+        libambit_log_resume_set(deviceObject, resumePath.toLocal8Bit().constData());
+    }
+}
+
+DeviceWorker::~DeviceWorker()
+{
+    if (deviceObject != NULL) {
+        // Drops the sync and charge read operations at once, without
+        // calling back
+        libambit_async_abandon(queue->handle(), deviceObject);
+        if (syncStep == SyncLogRead && !logStore->commitBatch()) {
+            qDebug() << "Failed to flush stored logs";
+        }
+        libambit_close(deviceObject);
+    }
+
+    if (fetchWatcher->isRunning()) {
+        // The fetch goes on writing to the sync data, both go once it
+        // is done
+        fetchWatcher->disconnect(this);
+        connect(fetchWatcher, SIGNAL(finished()), fetchWatcher, SLOT(deleteLater()));
+        syncData->setParent(fetchWatcher);
+    }
+    else {
+        delete fetchWatcher;
+        delete syncData;
+    }
+}
+
+bool DeviceWorker::isOpen() const
+{
+    return deviceObject != NULL;
+}
+
+const DeviceInfo& DeviceWorker::deviceInfo() const
+{
+    return currentDeviceInfo;
+}
+
+void DeviceWorker::startSync(bool readAllLogs = false)
+{
+    Settings settings;
+
+    if (syncStep != SyncIdle) {
+        // Already running
+        return;
+    }
+
+    syncTime = settings.value("syncSettings/syncTime", true).toBool();
+    syncOrbit = settings.value("syncSettings/syncOrbit", true).toBool();
+    syncSportMode = settings.value("syncSettings/syncSportMode", false).toBool();
+    syncNavigation = settings.value("syncSettings/syncNavigation", false).toBool();
+    syncMovescount = settings.value("movescountSettings/movescountEnable", false).toBool();
+    this->readAllLogs = readAllLogs;
+
+    currentSyncPart = 0;
+    syncParts = 2;
+    if (syncTime) syncParts++;
+    if (syncOrbit) syncParts+=2;
+    if (syncSportMode) syncParts++;
+    if (syncMovescount) syncParts++;
+
+    syncResult = -1;
+    waypointResult = -1;
+
+    if (this->deviceObject == NULL) {
+        finishSync();
+        return;
+    }
+
+    emit this->syncProgressInform(QString(tr("Reading personal settings")), false, true, 0);
+    syncStep = SyncPersonalSettings;
+    runSync();
+}
+
+bool DeviceWorker::pollCharge()
+{
+    // No need to wait for a running sync, libambit schedules the status
+    // command in between the log read commands. A read still running
+    // from the last poll counts as a failure.
+    if (this->deviceObject != NULL) {
+        if (statusPending) {
+            statusFailures++;
+        }
+        else if (libambit_async_device_status_get(queue->handle(), this->deviceObject, &status_cb, this) > 0) {
+            statusPending = true;
+        }
+        else {
+            statusFailures++;
+        }
+    }
+
+    // Single failures may be a slow reply, give up after a few in a row
+    return this->deviceObject != NULL && statusFailures < 3;
+}
+
+void DeviceWorker::setSyncCancelled(bool cancelled)
+{
+    syncCancelled = cancelled;
+
+    // Clearing the sync display still goes, the clock would keep showing
+    // it otherwise
+    if (cancelled && syncOperation > 0 && syncStep != SyncDisplayClear) {
+        libambit_async_cancel(queue->handle(), syncOperation);
+    }
+}
+
+void DeviceWorker::fetchFinished()
+{
+    syncStepDone(fetchWatcher->result());
+    runSync();
+}
+
+void DeviceWorker::runSync()
+{
+    time_t current_time;
+    struct tm *local_time;
+    int id = 0;
+
+    // Submit the operation of the current step, or start its fetch, and
+    // return to wait for it. Steps that do not apply are passed over.
+    while (id == 0) {
+        switch (syncStep) {
+        case SyncPersonalSettings:
+            // Reading personal settings + waypoints
+            id = libambit_async_personal_settings_get(queue->handle(), this->deviceObject, syncData->personalSettings, &sync_cb, this);
+            break;
+
+        case SyncNavigationRead:
+            id = libambit_async_navigation_read(queue->handle(), this->deviceObject, syncData->personalSettings, &sync_cb, this);
+            break;
+
+        case SyncDisplayShow:
+            id = libambit_async_sync_display_show(queue->handle(), this->deviceObject, &sync_cb, this);
+            break;
+
+        case SyncDateTime:
+            if (!syncTime || syncResult == -1) {
+                syncStep = SyncLogRead;
+                continue;
+            }
+            emit this->syncProgressInform(QString(tr("Setting date/time")), false, true, 100*currentSyncPart/syncParts);
+            current_time = time(NULL);
+            local_time = localtime(&current_time);
+            id = libambit_async_date_time_set(queue->handle(), this->deviceObject, local_time, &sync_cb, this);
+            break;
+
+        case SyncLogRead:
+            if (syncResult == -1) {
+                syncStep = SyncNavigationFetch;
+                continue;
+            }
+            qDebug() << "Start reading log...";
+            emit this->syncProgressInform(QString(tr("Reading log files")), false, true, 100*currentSyncPart/syncParts);
+            // Stored logs are flushed to disk together once all are read
+            logStore->beginBatch();
+            id = libambit_async_log_read(queue->handle(), this->deviceObject, readAllLogs ? NULL : &log_skip_cb, &log_push_cb, &log_progress_cb, &sync_cb, this);
+            break;
+
+        case SyncNavigationFetch:
+            if (waypointResult == -1 || !syncNavigation || syncCancelled) {
+                syncStep = SyncSportModeFetch;
+                continue;
+            }
+            qDebug() << "Start reading navigation...";
+            emit this->syncProgressInform(QString(tr("Synchronizing navigation")), false, true, 100*currentSyncPart/syncParts);
+            currentSyncPart++;
+            fetch(QtConcurrent::run(&DeviceWorker::fetchNavigation, syncData));
+            return;
+
+        case SyncNavigationWrite:
+            id = libambit_async_navigation_write(queue->handle(), this->deviceObject, syncData->movescountPersonalSettings, &sync_cb, this);
+            break;
+
+        case SyncSportModeFetch:
+            if (!syncSportMode || syncResult == -1) {
+                syncStep = SyncOrbitFetch;
+                continue;
+            }
+            qDebug() << "Start sport mode";
+            emit this->syncProgressInform(QString(tr("Fetching sport modes")), false, true, 100*currentSyncPart/syncParts);
+            syncData->apps = liblibambit_malloc_app_rules();
+            syncData->sportModes = libambit_malloc_sport_mode_device_settings();
+            fetch(QtConcurrent::run(&DeviceWorker::fetchSportModes, syncData));
+            return;
+
+        case SyncSportModeWrite:
+            emit this->syncProgressInform(QString(tr("Write sport modes")), false, false, 100*currentSyncPart/syncParts);
+            id = libambit_async_sport_mode_write(queue->handle(), this->deviceObject, syncData->sportModes, &sync_cb, this);
+            break;
+
+        case SyncAppDataWrite:
+            emit this->syncProgressInform(QString(tr("Write apps")), false, true, 100*currentSyncPart/syncParts);
+            id = libambit_async_app_data_write(queue->handle(), this->deviceObject, syncData->sportModes, syncData->apps, &sync_cb, this);
+            break;
+
+        case SyncOrbitFetch:
+            qDebug() << "Outer space debug message";
+            if (!syncOrbit || syncResult == -1) {
+                syncStep = SyncDisplayClear;
+                continue;
+            }
+            qDebug() << "Start sync Orbit";
+            emit this->syncProgressInform(QString(tr("Fetching orbital data")), false, true, 100*currentSyncPart/syncParts);
+            fetch(QtConcurrent::run(&DeviceWorker::fetchOrbit, syncData));
+            return;
+
+        case SyncOrbitWrite:
+            emit this->syncProgressInform(QString(tr("Writing orbital data")), false, false, 100*currentSyncPart/syncParts);
+            id = libambit_async_gps_orbit_write(queue->handle(), this->deviceObject, syncData->orbitData, orbitDataLen, &sync_cb, this);
+            break;
+
+        case SyncDisplayClear:
+            // Also when cancelled, the clock would keep showing it otherwise
+            id = libambit_async_sync_display_clear(queue->handle(), this->deviceObject, &sync_cb, this);
+            break;
+
+        default:
+            finishSync();
+            return;
+        }
+
+        if (id < 0) {
+            // Not even submitted, counts as failed
+            syncStepDone(-1);
+            id = 0;
+        }
+    }
+
+    syncOperation = id;
+    if (syncCancelled && syncStep != SyncDisplayClear) {
+        libambit_async_cancel(queue->handle(), id);
+    }
+}
+
+void DeviceWorker::syncStepDone(int result)
+{
+    syncOperation = 0;
+
+    switch (syncStep) {
+    case SyncPersonalSettings:
+        syncResult = result;
+        syncStep = SyncNavigationRead;
+        break;
+
+    case SyncNavigationRead:
+        waypointResult = result;
+        currentSyncPart++;
+        syncStep = SyncDisplayShow;
+        break;
+
+    case SyncDisplayShow:
+        syncStep = SyncDateTime;
+        break;
+
+    case SyncDateTime:
+        syncResult = result;
+        currentSyncPart++;
+        syncStep = SyncLogRead;
+        break;
+
+    case SyncLogRead:
+        syncResult = result;
+        if (!logStore->commitBatch()) {
+            qDebug() << "Failed to flush stored logs";
+        }
+        currentSyncPart++;
+        qDebug() << "End reading log...";
+        syncStep = SyncNavigationFetch;
+        break;
+
+    case SyncNavigationFetch:
+        if (result != -1) {
+            emit this->syncProgressInform(QString(tr("Write navigation")), false, false, 100*currentSyncPart/syncParts);
+            syncStep = SyncNavigationWrite;
+        }
+        else {
+            qDebug() << "End reading navigation...";
+            syncStep = SyncSportModeFetch;
+        }
+        break;
+
+    case SyncNavigationWrite:
+        emit this->syncProgressInform(QString(tr("Synchronized navigation")), false, false, 100*currentSyncPart/syncParts);
+        qDebug() << "End reading navigation...";
+        syncStep = SyncSportModeFetch;
+        break;
+
+    case SyncSportModeFetch:
+        if (result != -1) {
+            syncStep = SyncSportModeWrite;
+            break;
+        }
+        // Nothing to write, fall through
+    case SyncAppDataWrite:
+        if (syncStep == SyncAppDataWrite) {
+            syncResult = result;
+        }
+        libambit_sport_mode_device_settings_free(syncData->sportModes);
+        libambit_app_rules_free(syncData->apps);
+        syncData->sportModes = NULL;
+        syncData->apps = NULL;
+        currentSyncPart++;
+        qDebug() << "End reading sport mode";
+        syncStep = SyncOrbitFetch;
+        break;
+
+    case SyncSportModeWrite:
+        syncResult = result;
+        syncStep = SyncAppDataWrite;
+        break;
+
+    case SyncOrbitFetch:
+        currentSyncPart++;
+        if (result != -1) {
+            orbitDataLen = result;
+            syncStep = SyncOrbitWrite;
+        }
+        else {
+            emit this->syncProgressInform(QString(tr("Failed to get orbital data")), true, false, 100*currentSyncPart/syncParts);
+            syncResult = -1;
+            qDebug() << "End Orbit sync";
+            currentSyncPart++;
+            syncStep = SyncDisplayClear;
+        }
+        break;
+
+    case SyncOrbitWrite:
+        syncResult = result;
+        free(syncData->orbitData);
+        syncData->orbitData = NULL;
+        qDebug() << "End Orbit sync";
+        currentSyncPart++;
+        syncStep = SyncDisplayClear;
+        break;
+
+    default:
+        syncStep = SyncIdle;
+        break;
+    }
+}
+
+void DeviceWorker::finishSync()
+{
+    bool cancelled = syncCancelled;
+
+    syncStep = SyncIdle;
+
+    if (cancelled) {
+        emit syncProgressInform(QString(tr("Synchronization cancelled")), true, true, 100);
+    }
+
+    emit syncFinished(syncResult >= 0 && !cancelled);
+
+    if (syncResult == -1 && !cancelled) {
+        // Failed to read! Let the manager redo detect
+        emit deviceFailed();
+    }
+}
+
+void DeviceWorker::fetch(const QFuture<int>& future)
+{
+    // Movescount requests block, so they run in the thread pool and the
+    // sync goes on from fetchFinished()
+    fetchWatcher->setFuture(future);
+}
+
+int DeviceWorker::fetchNavigation(DeviceSyncData *data)
+{
+    MovesCount *movesCount = MovesCount::instance();
+
+    if (movesCount->getPersonalSettings(data->movescountPersonalSettings, true) == -1) {
+        return -1;
+    }
+    movesCount->applyPersonalSettingsFromDevice(data->movescountPersonalSettings, data->personalSettings);
+    movesCount->writePersonalSettings(data->movescountPersonalSettings);
+
+    return 0;
+}
+
+int DeviceWorker::fetchSportModes(DeviceSyncData *data)
+{
+    MovesCount *movesCount = MovesCount::instance();
+
+    movesCount->getAppsData(data->apps);
+
+    return movesCount->getCustomModeData(data->sportModes);
+}
+
+int DeviceWorker::fetchOrbit(DeviceSyncData *data)
+{
+    return MovesCount::instance()->getOrbitalData(&data->orbitData);
+}
+
+void DeviceWorker::status_cb(void *ref, const ambit_async_completion_t *completion)
+{
+    DeviceWorker *worker = static_cast<DeviceWorker*> (ref);
+
+    worker->statusPending = false;
+    if (completion->result == 0) {
+        worker->statusFailures = 0;
+        emit worker->deviceCharge(completion->status.charge);
+    }
+    else {
+        worker->statusFailures++;
+    }
+}
+
+void DeviceWorker::sync_cb(void *ref, const ambit_async_completion_t *completion)
+{
+    DeviceWorker *worker = static_cast<DeviceWorker*> (ref);
+
+    worker->syncStepDone(completion->cancelled ? -1 : completion->result);
+    worker->runSync();
+}
+
+int DeviceWorker::log_skip_cb(void *ref, ambit_log_header_t *log_header)
+{
+    DeviceWorker *worker = static_cast<DeviceWorker*> (ref);
+    if (worker->logStore->logExists(worker->currentDeviceInfo.serial, log_header)) {
+        return 0;
+    }
+    return 1;
+}
+
+void DeviceWorker::log_push_cb(void *ref, ambit_log_entry_t *log_entry)
+{
+    DeviceWorker *worker = static_cast<DeviceWorker*> (ref);
+    // The store takes over log_entry, no copy is made
+    LogEntry *entry = worker->logStore->store(worker->currentDeviceInfo, worker->syncData->personalSettings, log_entry);
+    if (entry != NULL) {
+        emit worker->logStored(entry->device, entry->time);
+
+        //! TODO: make this optional, only used for debugging
+        worker->movesCountXML.writeLog(entry);
+
+        if (worker->syncMovescount) {
+            // Upload queue takes ownership, the sync continues meanwhile
+            worker->movesCount->queueLog(entry);
+        }
+        else {
+            delete entry;
+        }
+    }
+}
+
+void DeviceWorker::log_progress_cb(void *ref, uint16_t log_count, uint16_t log_current, uint8_t progress_percent)
+{
+    DeviceWorker *worker = static_cast<DeviceWorker*> (ref);
+    progress_percent = 100*worker->currentSyncPart/worker->syncParts + progress_percent*1/worker->syncParts;
+    emit worker->syncProgressInform(QString(tr("Downloading log %1 of %2")).arg(log_current).arg(log_count), false, false, progress_percent);
+}
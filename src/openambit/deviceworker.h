@@ -0,0 +1,148 @@
+/*
+ * (C) Copyright 2013 Emil Ljungdahl
+ *
+ * This file is part of Openambit.
+ *
+ * Openambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#ifndef DEVICEWORKER_H
+#define DEVICEWORKER_H
+
+#include <QObject>
+#include <QFutureWatcher>
+
+#include "asyncqueue.h"
+#include "settings.h"
+#include <movescount/logstore.h>
+#include <movescount/movescount.h>
+#include <movescount/movescountxml.h>
+#include <libambit.h>
+
+// Buffers a sync reads into and fetches from Movescount. The fetches run
+// off this thread, so these stay until a running one is done, even if
+// the worker goes away meanwhile.
+class DeviceSyncData : public QObject
+{
+public:
+    DeviceSyncData();
+    ~DeviceSyncData();
+
+    ambit_personal_settings_t *personalSettings;
+    ambit_personal_settings_t *movescountPersonalSettings;
+    ambit_app_rules_t *apps;
+    ambit_sport_mode_device_settings_t *sportModes;
+    uint8_t *orbitData;
+};
+
+// Talks to one connected device. All its operations go through the
+// queue of the device manager and complete in the same thread, so that
+// several devices can be synced at the same time without threads.
+class DeviceWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DeviceWorker(const ambit_device_info_t *devinfo, LogStore *logStore, AsyncQueue *queue, QObject *parent = 0);
+    ~DeviceWorker();
+
+    bool isOpen() const;
+    const DeviceInfo& deviceInfo() const;
+
+    // Start a charge read, which goes in between the commands of a
+    // running sync. Returns false once the device has stopped answering.
+    bool pollCharge();
+
+    // Stop a running sync at its next command to the clock
+    void setSyncCancelled(bool cancelled);
+
+signals:
+    void deviceCharge(quint8 percent);
+    void deviceFailed();
+    void syncFinished(bool success);
+    void syncProgressInform(QString message, bool error, bool newRow, quint8 percentDone);
+    void logStored(QString device, QDateTime time);
+
+public slots:
+    void startSync(bool readAllLogs);
+
+private slots:
+    void fetchFinished();
+
+private:
+    enum SyncStep {
+        SyncIdle,
+        SyncPersonalSettings,
+        SyncNavigationRead,
+        SyncDisplayShow,
+        SyncDateTime,
+        SyncLogRead,
+        SyncNavigationFetch,
+        SyncNavigationWrite,
+        SyncSportModeFetch,
+        SyncSportModeWrite,
+        SyncAppDataWrite,
+        SyncOrbitFetch,
+        SyncOrbitWrite,
+        SyncDisplayClear
+    };
+
+    void runSync();
+    void syncStepDone(int result);
+    void finishSync();
+    void fetch(const QFuture<int>& future);
+
+    static int fetchNavigation(DeviceSyncData *data);
+    static int fetchSportModes(DeviceSyncData *data);
+    static int fetchOrbit(DeviceSyncData *data);
+
+    static void status_cb(void *ref, const ambit_async_completion_t *completion);
+    static void sync_cb(void *ref, const ambit_async_completion_t *completion);
+    static int log_skip_cb(void *ref, ambit_log_header_t *log_header);
+    static void log_push_cb(void *ref, ambit_log_entry_t *log_entry);
+    static void log_progress_cb(void *ref, uint16_t log_count, uint16_t log_current, uint8_t progress_percent);
+
+    ambit_object_t *deviceObject;
+
+    DeviceInfo currentDeviceInfo;
+    DeviceSyncData *syncData;
+
+    int syncParts;
+    int currentSyncPart;
+    bool syncTime;
+    bool syncOrbit;
+    bool syncSportMode;
+    bool syncNavigation;
+    bool syncMovescount;
+    bool readAllLogs;
+    int statusFailures;
+    bool statusPending;
+    AsyncQueue *queue;
+
+    // Running sync, the step waits for syncOperation or for the fetch
+    SyncStep syncStep;
+    int syncOperation;
+    bool syncCancelled;
+    int syncResult;
+    int waypointResult;
+    int orbitDataLen;
+    QFutureWatcher<int> *fetchWatcher;
+
+    MovesCount *movesCount;
+    MovesCountXML movesCountXML;
+    LogStore *logStore;
+};
+
+#endif // DEVICEWORKER_H
@@ -0,0 +1,61 @@
+#include "hotpluglistener.h"
+
+HotplugListener::HotplugListener(QObject *parent) :
+    QObject(parent), socketNotifier(NULL)
+{
+    int fd;
+
+    hotplug = libambit_hotplug_new(&hotplug_cb, this);
+
+    if (!hotplug) {
+        return;
+    }
+
+    fd = libambit_hotplug_get_fd(hotplug);
+
+    if (fd >= 0) {
+        socketNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+        connect(socketNotifier, SIGNAL(activated(int)), this, SLOT(fdActivated(int)));
+    }
+    else {
+        // No hotplug events on this platform, rescan periodically instead
+        connect(&pollTimer, SIGNAL(timeout()), this, SLOT(poll()));
+        pollTimer.setInterval(10000);
+        pollTimer.start();
+    }
+}
+
+HotplugListener::~HotplugListener()
+{
+    pollTimer.stop();
+    delete socketNotifier;
+
+    libambit_hotplug_free(hotplug);
+}
+
+ambit_device_info_t *HotplugListener::enumerate()
+{
+    return libambit_hotplug_enumerate(hotplug);
+}
+
+void HotplugListener::fdActivated(int fd)
+{
+    if (fd == libambit_hotplug_get_fd(hotplug)) {
+        libambit_hotplug_process(hotplug);
+    }
+}
+
+void HotplugListener::poll()
+{
+    libambit_hotplug_process(hotplug);
+}
+
+void HotplugListener::hotplug_cb(void *ref, ambit_hotplug_event_t event, const ambit_device_info_t *device)
+{
+    HotplugListener *listener = static_cast<HotplugListener*> (ref);
+
+    Q_UNUSED(event);
+    Q_UNUSED(device);
+
+    emit listener->deviceEvent();
+}
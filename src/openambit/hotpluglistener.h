@@ -0,0 +1,36 @@
+#ifndef HOTPLUGLISTENER_H
+#define HOTPLUGLISTENER_H
+
+#include <QObject>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#include <libambit.h>
+
+class HotplugListener : public QObject
+{
+    Q_OBJECT
+public:
+    explicit HotplugListener(QObject *parent = 0);
+    ~HotplugListener();
+
+    // Cached list of connected clocks, safe to call from any thread.
+    // Release with libambit_free_enumeration()
+    ambit_device_info_t *enumerate();
+
+signals:
+    void deviceEvent();
+
+private slots:
+    void fdActivated(int fd);
+    void poll();
+
+private:
+    static void hotplug_cb(void *ref, ambit_hotplug_event_t event, const ambit_device_info_t *device);
+
+    ambit_hotplug_t *hotplug;
+    QSocketNotifier *socketNotifier;
+    QTimer pollTimer;
+};
+
+#endif // HOTPLUGLISTENER_H
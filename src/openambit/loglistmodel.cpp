@@ -0,0 +1,221 @@
+/*
+ * (C) Copyright 2013 Emil Ljungdahl
+ *
+ * This file is part of Openambit.
+ *
+ * Openambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#include "loglistmodel.h"
+
+#include <QtAlgorithms>
+
+// Rows handed to the view per fetchMore()
+#define FETCH_BATCH_SIZE 200
+
+static bool newerFirst(const LogStore::LogDirEntry& a, const LogStore::LogDirEntry& b)
+{
+    return a.time > b.time;
+}
+
+LogListModel::LogListModel(LogStore *logStore, QObject *parent) :
+    QAbstractListModel(parent), logStore(logStore), fetched(0)
+{
+}
+
+int LogListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : fetched;
+}
+
+QVariant LogListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= fetched) {
+        return QVariant();
+    }
+
+    const LogStore::LogDirEntry& entry = entries.at(index.row());
+    switch (role) {
+    case Qt::DisplayRole:
+        return entry.time.toString();
+    case Qt::ToolTipRole:
+        return entry.activityName;
+    case FilenameRole:
+        return entry.filename;
+    case DeviceRole:
+        return entry.device;
+    case ActivityRole:
+        return entry.activityName;
+    case TimeRole:
+        return entry.time;
+    }
+
+    return QVariant();
+}
+
+bool LogListModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && fetched < entries.count();
+}
+
+void LogListModel::fetchMore(const QModelIndex &parent)
+{
+    int count = qMin(FETCH_BATCH_SIZE, entries.count() - fetched);
+
+    if (parent.isValid() || count <= 0) {
+        return;
+    }
+
+    beginInsertRows(QModelIndex(), fetched, fetched + count - 1);
+    fetched += count;
+    endInsertRows();
+}
+
+void LogListModel::reload()
+{
+    beginResetModel();
+    entries = logStore->dir();
+    qStableSort(entries.begin(), entries.end(), newerFirst);
+    fetched = 0;
+    endResetModel();
+    emit entriesChanged();
+}
+
+void LogListModel::logStored(QString device, QDateTime time)
+{
+    LogStore::LogDirEntry dirEntry;
+    int row;
+
+    if (!logStore->dirEntry(device, time, &dirEntry)) {
+        return;
+    }
+
+    // Stored again, e.g. on a resync of all logs
+    for (row = insertPosition(time) - 1; row >= 0 && entries.at(row).time == time; row--) {
+        if (entries.at(row).filename == dirEntry.filename) {
+            entries[row] = dirEntry;
+            if (row < fetched) {
+                emit dataChanged(index(row), index(row));
+            }
+            emit entriesChanged();
+            return;
+        }
+    }
+
+    row = insertPosition(time);
+    if (row < fetched || fetched == entries.count()) {
+        beginInsertRows(QModelIndex(), row, row);
+        entries.insert(row, dirEntry);
+        fetched++;
+        endInsertRows();
+    }
+    else {
+        entries.insert(row, dirEntry);
+    }
+    emit entriesChanged();
+}
+
+// Of all logs, not just the fetched rows, for the filters
+QStringList LogListModel::devices() const
+{
+    QStringList devices;
+
+    foreach (const LogStore::LogDirEntry& entry, entries) {
+        if (!devices.contains(entry.device)) {
+            devices.append(entry.device);
+        }
+    }
+    devices.sort();
+
+    return devices;
+}
+
+QStringList LogListModel::activities() const
+{
+    QStringList activities;
+
+    foreach (const LogStore::LogDirEntry& entry, entries) {
+        if (entry.activityName != "" && !activities.contains(entry.activityName)) {
+            activities.append(entry.activityName);
+        }
+    }
+    activities.sort();
+
+    return activities;
+}
+
+// First row older than time
+int LogListModel::insertPosition(const QDateTime& time) const
+{
+    int low = 0, high = entries.count();
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (entries.at(mid).time >= time) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+
+// Filters only, the source is already newest first
+LogFilterProxyModel::LogFilterProxyModel(QObject *parent) :
+    QSortFilterProxyModel(parent)
+{
+}
+
+void LogFilterProxyModel::setDeviceFilter(QString device)
+{
+    this->device = device;
+    invalidateFilter();
+}
+
+void LogFilterProxyModel::setActivityFilter(QString activity)
+{
+    this->activity = activity;
+    invalidateFilter();
+}
+
+// Either end may be a null QDate to leave it open
+void LogFilterProxyModel::setDateRange(QDate from, QDate to)
+{
+    this->from = from;
+    this->to = to;
+    invalidateFilter();
+}
+
+bool LogFilterProxyModel::filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const
+{
+    QModelIndex index = sourceModel()->index(sourceRow, 0, sourceParent);
+    QDate date = index.data(LogListModel::TimeRole).toDateTime().date();
+
+    if (device != "" && index.data(LogListModel::DeviceRole).toString() != device) {
+        return false;
+    }
+    if (activity != "" && index.data(LogListModel::ActivityRole).toString() != activity) {
+        return false;
+    }
+    if ((from.isValid() && date < from) || (to.isValid() && date > to)) {
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,92 @@
+/*
+ * (C) Copyright 2013 Emil Ljungdahl
+ *
+ * This file is part of Openambit.
+ *
+ * Openambit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#ifndef LOGLISTMODEL_H
+#define LOGLISTMODEL_H
+
+#include <QAbstractListModel>
+#include <QSortFilterProxyModel>
+#include <QDate>
+#include <QList>
+#include <QStringList>
+
+#include <movescount/logstore.h>
+
+// Logs in the store, newest first, backed by the LogStore index. Rows are
+// handed to the view in batches as it scrolls, and stored logs are added
+// one at a time instead of rebuilding the list.
+class LogListModel : public QAbstractListModel
+{
+    Q_OBJECT
+public:
+    enum Roles {
+        FilenameRole = Qt::UserRole,
+        DeviceRole,
+        ActivityRole,
+        TimeRole
+    };
+
+    explicit LogListModel(LogStore *logStore, QObject *parent = 0);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    bool canFetchMore(const QModelIndex &parent) const;
+    void fetchMore(const QModelIndex &parent);
+    QStringList devices() const;
+    QStringList activities() const;
+
+signals:
+    // Stored logs were added or changed, fetched or not
+    void entriesChanged();
+
+public slots:
+    void reload();
+    void logStored(QString device, QDateTime time);
+
+private:
+    int insertPosition(const QDateTime& time) const;
+
+    LogStore *logStore;
+    QList<LogStore::LogDirEntry> entries;
+    int fetched;
+};
+
+class LogFilterProxyModel : public QSortFilterProxyModel
+{
+    Q_OBJECT
+public:
+    explicit LogFilterProxyModel(QObject *parent = 0);
+
+    void setDeviceFilter(QString device);
+    void setActivityFilter(QString activity);
+    void setDateRange(QDate from, QDate to);
+
+protected:
+    bool filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const;
+
+private:
+    QString device;
+    QString activity;
+    QDate from;
+    QDate to;
+};
+
+#endif // LOGLISTMODEL_H
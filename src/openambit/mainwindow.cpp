@@ -24,9 +24,11 @@
 
 #include <QCloseEvent>
 #include <QDebug>
-#include <QListWidgetItem>
 #include <QMessageBox>
 #include <QDesktopServices>
+#include <QDir>
+#include <QFileDialog>
+#include <QFileInfo>
 
 #define APPKEY                 "HpF9f1qV5qrDJ1hY1QK1diThyPsX10Mh4JvCw9xVQSglJNLdcwr3540zFyLzIC3e"
 #define MOVESCOUNT_DEFAULT_URL "https://uiservices.movescount.com/"
@@ -35,6 +37,7 @@ MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
     forceClose(false),
+    syncRunning(false),
     movesCount(NULL),
     currentLogMessageRow(NULL)
 {
@@ -90,9 +93,9 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(trayIcon, SIGNAL(activated(QSystemTrayIcon::ActivationReason)), this, SLOT(trayIconClicked(QSystemTrayIcon::ActivationReason)));
     trayIcon->setVisible(true);
 
-    // Setup device manager
+    // Setup device manager, it lives in this thread as it never waits on
+    // the clocks itself
     deviceManager = new DeviceManager();
-    deviceManager->moveToThread(&deviceWorkerThread);
     qRegisterMetaType<DeviceInfo>("DeviceInfo");
     connect(deviceManager, SIGNAL(deviceDetected(const DeviceInfo&)), this, SLOT(deviceDetected(const DeviceInfo&)), Qt::QueuedConnection);
     connect(deviceManager, SIGNAL(deviceRemoved()), this, SLOT(deviceRemoved()), Qt::QueuedConnection);
@@ -102,16 +105,35 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->buttonDeviceReload, SIGNAL(clicked()), deviceManager, SLOT(detect()));
     connect(ui->buttonSyncNow, SIGNAL(clicked()), this, SLOT(syncNowClicked()));
     connect(this, SIGNAL(syncNow(bool)), deviceManager, SLOT(startSync(bool)));
-    deviceWorkerThread.start();
+    connect(this, SIGNAL(syncCancel()), deviceManager, SLOT(cancelSync()));
     deviceManager->start();
     deviceManager->detect();
 
     // Setup log list
-    connect(ui->logsList, SIGNAL(currentItemChanged(QListWidgetItem*,QListWidgetItem*)), this, SLOT(logItemSelected(QListWidgetItem*,QListWidgetItem*)));
+    logListModel = new LogListModel(&logStore, this);
+    logFilterModel = new LogFilterProxyModel(this);
+    logFilterModel->setSourceModel(logListModel);
+    ui->logsList->setModel(logFilterModel);
+    ui->logsList->setUniformItemSizes(true);
+    connect(ui->logsList->selectionModel(), SIGNAL(currentChanged(QModelIndex,QModelIndex)), this, SLOT(logItemSelected(QModelIndex,QModelIndex)));
     ui->logsList->setContextMenuPolicy(Qt::CustomContextMenu);
     connect(ui->logsList, SIGNAL(customContextMenuRequested(QPoint)), this, SLOT(showContextMenuForLogItem(QPoint)));
-
-    updateLogList();
+    connect(deviceManager, SIGNAL(logStored(QString,QDateTime)), logListModel, SLOT(logStored(QString,QDateTime)), Qt::QueuedConnection);
+    connect(&logStore, SIGNAL(indexProgress(int,int)), this, SLOT(logIndexProgress(int,int)));
+    connect(&logStore, SIGNAL(indexRebuilt()), this, SLOT(logIndexRebuilt()));
+
+    // Log filters, the date one counts days back from today
+    ui->comboBoxFilterDate->addItem(tr("All dates"), 0);
+    ui->comboBoxFilterDate->addItem(tr("Last 7 days"), 7);
+    ui->comboBoxFilterDate->addItem(tr("Last 30 days"), 30);
+    ui->comboBoxFilterDate->addItem(tr("Last year"), 365);
+    connect(logListModel, SIGNAL(entriesChanged()), this, SLOT(updateLogFilters()));
+    connect(ui->comboBoxFilterDevice, SIGNAL(currentIndexChanged(int)), this, SLOT(logFilterChanged()));
+    connect(ui->comboBoxFilterActivity, SIGNAL(currentIndexChanged(int)), this, SLOT(logFilterChanged()));
+    connect(ui->comboBoxFilterDate, SIGNAL(currentIndexChanged(int)), this, SLOT(logFilterChanged()));
+
+    // Lists the logs by name only if the index has to be rebuilt first
+    logListModel->reload();
 
     // Setup Movescount
     movesCountSetup();
@@ -119,8 +141,6 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
-    deviceWorkerThread.quit();
-    deviceWorkerThread.wait();
     delete deviceManager;
 
     if (movesCount != NULL) {
@@ -239,7 +259,14 @@ void MainWindow::settingsSaved()
 
 void MainWindow::syncNowClicked()
 {
-    startSync();
+    if (syncRunning) {
+        // Doubles as cancel button while syncing
+        ui->buttonSyncNow->setEnabled(false);
+        emit syncCancel();
+    }
+    else {
+        startSync();
+    }
 }
 
 void MainWindow::deviceDetected(const DeviceInfo& deviceInfo)
@@ -356,12 +383,12 @@ void MainWindow::syncFinished(bool success)
     ui->checkBoxResyncAll->setChecked(false);
     ui->checkBoxResyncAll->setEnabled(true);
     ui->buttonSyncNow->setEnabled(true);
+    ui->buttonSyncNow->setText(tr("Sync now"));
     trayIconSyncAction->setEnabled(true);
     ui->syncProgressBar->setHidden(true);
+    syncRunning = false;
 
     trayIcon->setIcon(QIcon(":/icon_connected"));
-
-    updateLogList();
 }
 
 void MainWindow::syncProgressInform(QString message, bool error, bool newRow, quint8 percentDone)
@@ -400,14 +427,62 @@ void MainWindow::movesCountAuth(bool authorized)
     ui->labelMovescountAuthIcon->setHidden(authorized);
 }
 
-void MainWindow::logItemSelected(QListWidgetItem *current,QListWidgetItem *previous)
+void MainWindow::logIndexProgress(int done, int total)
+{
+    ui->statusBar->showMessage(QString(tr("Indexing logs %1/%2")).arg(done).arg(total));
+}
+
+void MainWindow::logIndexRebuilt()
+{
+    ui->statusBar->clearMessage();
+    logListModel->reload();
+}
+
+// Lists the clocks and sports of the stored logs, keeping the selection
+void MainWindow::updateLogFilters()
+{
+    QString device = ui->comboBoxFilterDevice->itemData(ui->comboBoxFilterDevice->currentIndex()).toString();
+    QString activity = ui->comboBoxFilterActivity->itemData(ui->comboBoxFilterActivity->currentIndex()).toString();
+
+    ui->comboBoxFilterDevice->blockSignals(true);
+    ui->comboBoxFilterDevice->clear();
+    ui->comboBoxFilterDevice->addItem(tr("All clocks"), QString());
+    foreach (QString current, logListModel->devices()) {
+        ui->comboBoxFilterDevice->addItem(current, current);
+    }
+    ui->comboBoxFilterDevice->setCurrentIndex(qMax(0, ui->comboBoxFilterDevice->findData(device)));
+    ui->comboBoxFilterDevice->blockSignals(false);
+
+    ui->comboBoxFilterActivity->blockSignals(true);
+    ui->comboBoxFilterActivity->clear();
+    ui->comboBoxFilterActivity->addItem(tr("All sports"), QString());
+    foreach (QString current, logListModel->activities()) {
+        ui->comboBoxFilterActivity->addItem(current, current);
+    }
+    ui->comboBoxFilterActivity->setCurrentIndex(qMax(0, ui->comboBoxFilterActivity->findData(activity)));
+    ui->comboBoxFilterActivity->blockSignals(false);
+
+    logFilterChanged();
+}
+
+void MainWindow::logFilterChanged()
+{
+    int days = ui->comboBoxFilterDate->itemData(ui->comboBoxFilterDate->currentIndex()).toInt();
+
+    logFilterModel->setDeviceFilter(ui->comboBoxFilterDevice->itemData(ui->comboBoxFilterDevice->currentIndex()).toString());
+    logFilterModel->setActivityFilter(ui->comboBoxFilterActivity->itemData(ui->comboBoxFilterActivity->currentIndex()).toString());
+    logFilterModel->setDateRange(days > 0 ? QDate::currentDate().addDays(-days) : QDate(), QDate());
+}
+
+void MainWindow::logItemSelected(const QModelIndex &current, const QModelIndex &previous)
 {
     LogEntry *logEntry = NULL;
 
     Q_UNUSED(previous);
 
-    if (current != NULL) {
-        logEntry = logStore.read(current->data(Qt::UserRole).toString());
+    if (current.isValid()) {
+        // The detail view shows header fields only, leave the samples on disk
+        logEntry = logStore.read(current.data(LogListModel::FilenameRole).toString(), true);
         if (logEntry != NULL) {
             ui->logDetail->showLog(logEntry);
         }
@@ -422,6 +497,9 @@ void MainWindow::showContextMenuForLogItem(const QPoint &pos)
     QAction *action = new QAction(tr("Write Movescount file"), this);
     connect(action, SIGNAL(triggered()), this, SLOT(logItemWriteMovescount()));
     contextMenu.addAction(action);
+    action = new QAction(tr("Export as XML..."), this);
+    connect(action, SIGNAL(triggered()), this, SLOT(logItemExportXML()));
+    contextMenu.addAction(action);
     contextMenu.exec(mapToGlobal(pos));
 }
 
@@ -429,9 +507,14 @@ void MainWindow::logItemWriteMovescount()
 {
     bool movescountEnable = settings.value("movescountSettings/movescountEnable", false).toBool();
     bool movescountInfoEnable = settings.value("generalSettings/movescountInfoEnable", true).toBool();
+    QModelIndex current = ui->logsList->currentIndex();
     LogEntry *logEntry = NULL;
 
-    logEntry = logStore.read(ui->logsList->selectedItems().at(0)->data(Qt::UserRole).toString());
+    if (!current.isValid()) {
+        return;
+    }
+
+    logEntry = logStore.read(current.data(LogListModel::FilenameRole).toString());
     if (logEntry != NULL) {
         if(!movescountEnable && movescountInfoEnable) {
             QMessageBox msgBox(QMessageBox::Information,
@@ -457,22 +540,36 @@ void MainWindow::logItemWriteMovescount()
     }
 }
 
-void MainWindow::updateLogList()
+void MainWindow::logItemExportXML()
 {
-    QList<LogStore::LogDirEntry> entries = logStore.dir();
-    ui->logsList->clear();
-    foreach (LogStore::LogDirEntry entry, entries) {
-        QListWidgetItem *item = new QListWidgetItem(entry.time.toString());
-        item->setText(entry.time.toString());
-        item->setData(Qt::UserRole, QVariant(entry.filename));
-        ui->logsList->insertItem(0, item);
+    QModelIndex current = ui->logsList->currentIndex();
+    LogEntry *logEntry = NULL;
+    QString filename;
+
+    if (!current.isValid()) {
+        return;
+    }
+
+    filename = current.data(LogListModel::FilenameRole).toString();
+
+    logEntry = logStore.read(filename);
+    if (logEntry != NULL) {
+        QString path = QFileDialog::getSaveFileName(this, tr("Export log"),
+                                                    QDir::homePath() + "/" + QFileInfo(filename).completeBaseName() + ".xml",
+                                                    tr("Openambit XML log (*.xml)"));
+        if (path != "" && !logStore.exportXML(logEntry, path)) {
+            QMessageBox::warning(this, QCoreApplication::applicationName(),
+                                 tr("Failed to write %1").arg(path));
+        }
+        delete logEntry;
     }
 }
 
 void MainWindow::startSync()
 {
+    syncRunning = true;
     ui->checkBoxResyncAll->setEnabled(false);
-    ui->buttonSyncNow->setEnabled(false);
+    ui->buttonSyncNow->setText(tr("Cancel"));
     trayIconSyncAction->setEnabled(false);
     currentLogMessageRow = NULL;
     QLayoutItem *tmpItem;
@@ -25,6 +25,7 @@
 #include "devicemanager.h"
 #include "settingsdialog.h"
 #include "confirmbetadialog.h"
+#include "loglistmodel.h"
 #include <movescount/deviceinfo.h>
 #include <movescount/movescount.h>
 #include <QMainWindow>
@@ -48,6 +49,7 @@ public:
 
 signals:
     void syncNow(bool readAll);
+    void syncCancel();
 
 public slots:
     void singleApplicationMsgRecv(QString msg);
@@ -79,10 +81,15 @@ private slots:
     void newerFirmwareExists(QByteArray fw_version);
     void movesCountAuth(bool authorized);
 
-    void logItemSelected(QListWidgetItem *current,QListWidgetItem *previous);
+    void logItemSelected(const QModelIndex &current, const QModelIndex &previous);
     void showContextMenuForLogItem(const QPoint &pos);
     void logItemWriteMovescount();
-    void updateLogList();
+    void logItemExportXML();
+
+    void logIndexProgress(int done, int total);
+    void logIndexRebuilt();
+    void updateLogFilters();
+    void logFilterChanged();
     
 private:
     void startSync();
@@ -93,6 +100,7 @@ private:
 
     Ui::MainWindow *ui;
     bool forceClose;
+    bool syncRunning;
 
     QSystemTrayIcon *trayIcon;
     QMenu *trayIconMenu;
@@ -104,9 +112,10 @@ private:
     ConfirmBetaDialog *confirmBetaDialog;
     DeviceManager *deviceManager;
     LogStore logStore;
+    LogListModel *logListModel;
+    LogFilterProxyModel *logFilterModel;
     MovesCountXML movesCountXML;
     MovesCount *movesCount;
-    QThread deviceWorkerThread;
 
     class LogMessageRow : public QHBoxLayout
     {
@@ -1,6 +1,6 @@
 #!/usr/bin/python
 
-""" converts the *.log files produced by openambit in ~/.openambit/ to standard gpx format.
+""" converts openambit XML logs (see "Export as XML..." in the log list) to standard gpx format.
 usage: ./openambit2gpx.py inputfile outputFile
 """
 
@@ -18,10 +18,11 @@ if len(sys.argv) == 3:
     fileOut=sys.argv[2]
 else:
     sys.stderr.write("""\
-Convert Openambit *.log files to standard GPX format
+Convert Openambit XML logs to standard GPX format
 usage: {} inputfile outputfile 
 
-Openambit *.log files can normally be found in ~/.openambit/
+Openambit stores logs in a binary format in ~/.openambit/, use
+"Export as XML..." in the log list to get a file this script reads
 """.format(sys.argv[0]))
     sys.exit(1)
 